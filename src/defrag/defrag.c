@@ -0,0 +1,118 @@
+/*
+  fatx-defrag: FATX filesystem defragmenter
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fatx.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+static void report(const char *path, uint32_t clusters, uint32_t extents, uint32_t target, void *user)
+{
+	int *verbose = user;
+	if (!*verbose) return;
+	if (target != 0) printf("%s: %u clusters in %u extents, to cluster %u\n", path, clusters, extents, target);
+	else printf("%s: %u clusters in %u extents, no room to move\n", path, clusters, extents);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-b MiB] [-v] /dev/sdcX\n"
+			"  -n: only report the fragmentation and what would be moved\n"
+			"  -b: MiB of files copied between FAT updates, 64 by default\n"
+			"  -v: list every file and directory to be moved\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	fatx_defrag_options defrag_opts;
+	fatx_defrag_result result;
+	fatx_fs_options opts;
+	fatx_fs_info *info;
+	uint64_t low = 1;
+	int c, i, verbose = 0, ret;
+
+	memset(&defrag_opts, 0, sizeof(defrag_opts));
+	fatx_fs_options_init(&opts);
+	while ((c = getopt(argc, argv, "nb:v")) != -1) {
+		switch (c) {
+		case 'n':
+			defrag_opts.dry_run = 1;
+			break;
+		case 'b':
+			defrag_opts.batch_size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) usage(argv[0]);
+	opts.read_only = defrag_opts.dry_run;
+	// every chain is walked once and every directory read once or twice
+	opts.extent_cache_size = 0;
+	opts.dentry_cache_size = 0;
+	opts.dir_index_cache_size = 0;
+	info = fatx_fs_init_opts(argv[optind], &opts);
+	if (info == NULL) return 1;
+	defrag_opts.report = report;
+	defrag_opts.user = &verbose;
+	ret = fatx_defrag(info, &defrag_opts, &result);
+	if (ret < 0 && ret != -EUCLEAN) {
+		fprintf(stderr, "fatx-defrag: Error defragmenting %s: %s\n", argv[optind], strerror(-ret));
+		fatx_fs_end(info);
+		return 1;
+	}
+	printf("%s: %llu directories, %llu files, %llu clusters in %llu extents, %llu fragmented\n",
+			argv[optind], (unsigned long long)result.directories, (unsigned long long)result.files,
+			(unsigned long long)result.clusters, (unsigned long long)result.extents,
+			(unsigned long long)result.fragmented);
+	printf("  extents by length in clusters:\n");
+	for (i = 0; i < FATX_DEFRAG_RUN_BUCKETS; i++, low <<= 1) {
+		if (result.runs[i] == 0) continue;
+		if (i == FATX_DEFRAG_RUN_BUCKETS - 1) printf("    %llu+: %llu\n", (unsigned long long)low,
+				(unsigned long long)result.runs[i]);
+		else printf("    %llu-%llu: %llu\n", (unsigned long long)low, (unsigned long long)(low * 2 - 1),
+				(unsigned long long)result.runs[i]);
+	}
+	printf("  %llu clusters free, the longest run %llu\n", (unsigned long long)result.free_clusters,
+			(unsigned long long)result.largest_free_run);
+	if (ret == -EUCLEAN) {
+		printf("%s: %llu damaged chains or directories, run fsck.fatx -r first\n", argv[optind],
+				(unsigned long long)result.problems);
+		fatx_fs_end(info);
+		return 1;
+	}
+	printf("%s: %s %llu chains (%llu clusters), %llu directory clusters compacted away, "
+			"%llu left for lack of room\n", argv[optind], defrag_opts.dry_run ? "would move" : "moved",
+			(unsigned long long)result.moved, (unsigned long long)result.moved_clusters,
+			(unsigned long long)result.compacted_clusters, (unsigned long long)result.unplaced);
+	printf("%s: %llu extents %s\n", argv[optind], (unsigned long long)result.extents_after,
+			defrag_opts.dry_run ? "afterwards" : "now");
+	if (result.problems > 0) {
+		printf("%s: %llu damaged chains or directories, run fsck.fatx -r\n", argv[optind],
+				(unsigned long long)result.problems);
+	}
+	fatx_fs_end(info);
+	return 0;
+}
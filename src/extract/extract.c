@@ -0,0 +1,763 @@
+/*
+  fatx-extract: copies a FATX tree out in disk order
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Copying a tree file by file in name order makes the drive seek back and
+ * forth between files. Instead, the whole tree is listed first and every
+ * file mapped onto the device with fatx_map_file. The data is then cut
+ * into pieces of at most one chunk, the pieces are sorted by where they
+ * lie on the device, and a pool of threads takes them in that order, so
+ * the device is read more or less once from front to back with several
+ * requests in flight.
+ *
+ * A tar stream has to hold each file in one piece, so with -t the files
+ * are ordered by where they start instead, and the threads read ahead into
+ * a window of chunks that one writer empties in order.
+ */
+
+#include <fatx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define EXTRACT_EXTENTS 64 // extents mapped per call before a larger array is needed
+#define EXTRACT_WINDOW 4 // chunks per thread read ahead of the tar writer
+
+struct entry {
+	char *path; // relative to the directory being extracted, "" for itself
+	fatx_dirent dirent;
+	off_t start; // device offset of the file's first byte
+	size_t pieces; // not yet written, for files extracted into a directory
+	int out;
+	pthread_mutex_t lock;
+};
+
+struct piece {
+	off_t disk;
+	off_t offset; // within the file
+	size_t length;
+	size_t entry;
+	int fd;
+	const void *mem;
+};
+
+struct slot {
+	uint8_t *buffer;
+	ssize_t length; // -1 until the piece has been read
+};
+
+struct extract {
+	fatx_fs_info *info;
+	const char *dest;
+	int tar;
+	int quiet;
+	size_t chunk;
+	unsigned int threads;
+	struct entry *entries;
+	size_t entry_count, entry_alloc;
+	struct piece *pieces;
+	size_t piece_count, piece_alloc;
+	size_t next; // next piece to hand out
+	uint64_t total, done; // bytes
+	size_t files, dirs;
+	uint32_t *listed; // first clusters of the directories listed, sorted
+	size_t listed_count, listed_alloc;
+	int failed;
+	int skipped; // something on the device couldn't be extracted, but the rest was
+	double started;
+	/* with -t */
+	struct slot *window;
+	size_t window_size, written;
+	pthread_mutex_t lock;
+	pthread_cond_t read_cond, write_cond;
+	/* progress */
+	int finished;
+	pthread_mutex_t progress_lock;
+	pthread_cond_t progress_cond;
+};
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void fail(struct extract *x, const char *what, const char *path, int error) {
+	fprintf(stderr, "fatx-extract: %s %s: %s\n", what, path, strerror(error));
+	__atomic_store_n(&x->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void skip(struct extract *x, const char *path, const char *why) {
+	fprintf(stderr, "fatx-extract: Skipping /%s: %s\n", path, why);
+	x->skipped = 1;
+}
+
+/**
+ * Names that would land outside their directory once extracted.
+ */
+static int bad_name(const char *name) {
+	return *name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL;
+}
+
+static int add_entry(struct extract *x, const char *path, const fatx_dirent *dirent) {
+	struct entry *e;
+	if (x->entry_count == x->entry_alloc) {
+		size_t alloc = x->entry_alloc ? x->entry_alloc * 2 : 1024;
+		e = realloc(x->entries, alloc * sizeof(struct entry));
+		if (e == NULL) return -ENOMEM;
+		x->entries = e;
+		x->entry_alloc = alloc;
+	}
+	e = &x->entries[x->entry_count];
+	memset(e, 0, sizeof(*e));
+	e->path = strdup(path);
+	if (e->path == NULL) return -ENOMEM;
+	e->dirent = *dirent;
+	e->out = -1;
+	pthread_mutex_init(&e->lock, NULL);
+	if (dirent->attributes & 0x10) x->dirs++;
+	else {
+		x->files++;
+		x->total += dirent->record.size;
+	}
+	x->entry_count++;
+	return 0;
+}
+
+struct listing {
+	struct extract *x;
+	const char *parent;
+	int ret;
+};
+
+static int list_entry(const fatx_dirent *dirent, off_t next, void *user) {
+	struct listing *l = user;
+	char path[1024];
+	(void) next;
+	if (snprintf(path, sizeof(path), "%s%s%s", l->parent, *l->parent ? "/" : "", dirent->record.name) >=
+			(int)sizeof(path)) {
+		skip(l->x, path, "Path too long");
+		return 0;
+	}
+	if (bad_name(dirent->record.name)) {
+		skip(l->x, path, "Bad name");
+		return 0;
+	}
+	l->ret = add_entry(l->x, path, dirent);
+	return l->ret < 0;
+}
+
+/**
+ * Remembers that the directory starting at cluster has been listed.
+ * Returns 1 if it already was, so a damaged tree that links back to a
+ * directory above isn't listed forever, 0, or -ENOMEM.
+ */
+static int list_once(struct extract *x, uint32_t cluster) {
+	size_t low = 0, high = x->listed_count, middle;
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (x->listed[middle] == cluster) return 1;
+		if (x->listed[middle] < cluster) low = middle + 1;
+		else high = middle;
+	}
+	if (x->listed_count == x->listed_alloc) {
+		size_t alloc = x->listed_alloc ? x->listed_alloc * 2 : 256;
+		uint32_t *listed = realloc(x->listed, alloc * sizeof(uint32_t));
+		if (listed == NULL) return -ENOMEM;
+		x->listed = listed;
+		x->listed_alloc = alloc;
+	}
+	memmove(x->listed + low + 1, x->listed + low, (x->listed_count - low) * sizeof(uint32_t));
+	x->listed[low] = cluster;
+	x->listed_count++;
+	return 0;
+}
+
+/**
+ * Adds everything below the directory at index dir, parents before their
+ * children.
+ */
+static int list_tree(struct extract *x, size_t dir) {
+	struct listing l = { x, NULL, 0 };
+	fatx_dirent dirent = x->entries[dir].dirent;
+	size_t first = x->entry_count, last, i;
+	int ret;
+	l.parent = x->entries[dir].path;
+	ret = list_once(x, dirent.first_cluster);
+	if (ret != 0) {
+		if (ret > 0) skip(x, l.parent, "Directory already listed elsewhere");
+		return ret < 0 ? ret : 0;
+	}
+	ret = fatx_read_dir(x->info, &dirent, 0, list_entry, &l);
+	if (l.ret < 0) return l.ret;
+	if (ret < 0) {
+		fprintf(stderr, "fatx-extract: Error reading directory /%s\n", l.parent);
+		return -EIO;
+	}
+	// only the children, as the grandchildren come after them
+	last = x->entry_count;
+	for (i = first, ret = 0; i < last && ret == 0; i++) {
+		if (x->entries[i].dirent.attributes & 0x10) ret = list_tree(x, i);
+	}
+	return ret;
+}
+
+static int add_piece(struct extract *x, const struct piece *p) {
+	if (x->piece_count == x->piece_alloc) {
+		size_t alloc = x->piece_alloc ? x->piece_alloc * 2 : 4096;
+		struct piece *pieces = realloc(x->pieces, alloc * sizeof(struct piece));
+		if (pieces == NULL) return -ENOMEM;
+		x->pieces = pieces;
+		x->piece_alloc = alloc;
+	}
+	x->pieces[x->piece_count++] = *p;
+	return 0;
+}
+
+/**
+ * Maps the file at index i onto the device and cuts its data into pieces
+ * of at most one chunk.
+ */
+static int map_entry(struct extract *x, size_t i) {
+	fatx_io_extent stack[EXTRACT_EXTENTS], *extents = stack;
+	struct entry *e = &x->entries[i];
+	struct piece p;
+	off_t offset = 0;
+	fatx_file *file;
+	int count, k, ret = 0;
+	if (e->dirent.record.size == 0) return 0;
+	file = fatx_open_dirent(x->info, &e->dirent);
+	if (file == NULL) return -errno;
+	count = fatx_map_file(file, 0, e->dirent.record.size, extents, EXTRACT_EXTENTS);
+	if (count > EXTRACT_EXTENTS) {
+		extents = malloc(count * sizeof(fatx_io_extent));
+		if (extents == NULL) count = -ENOMEM;
+		else count = fatx_map_file(file, 0, e->dirent.record.size, extents, count);
+	}
+	fatx_close(file);
+	if (count < 0) ret = count;
+	p.entry = i;
+	for (k = 0; k < count && ret == 0; k++) {
+		size_t done;
+		if (k == 0) e->start = extents[k].offset;
+		for (done = 0; done < extents[k].length && ret == 0; done += p.length) {
+			p.disk = extents[k].offset + done;
+			p.offset = offset + done;
+			p.length = extents[k].length - done < x->chunk ? extents[k].length - done : x->chunk;
+			p.fd = extents[k].fd;
+			p.mem = extents[k].mem ? (const uint8_t *)extents[k].mem + done : NULL;
+			ret = add_piece(x, &p);
+			e->pieces++;
+		}
+		offset += extents[k].length;
+	}
+	if (extents != stack) free(extents);
+	return ret;
+}
+
+static struct extract *sort_extract;
+
+static int by_disk(const void *a, const void *b) {
+	const struct piece *pa = a, *pb = b;
+	return (pa->disk > pb->disk) - (pa->disk < pb->disk);
+}
+
+static int by_file_start(const void *a, const void *b) {
+	const struct piece *pa = a, *pb = b;
+	off_t sa = sort_extract->entries[pa->entry].start, sb = sort_extract->entries[pb->entry].start;
+	if (sa != sb) return (sa > sb) - (sa < sb);
+	if (pa->entry != pb->entry) return (pa->entry > pb->entry) - (pa->entry < pb->entry);
+	return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
+
+/**
+ * Reads a piece into buffer, or points data straight at the mapped image.
+ */
+static ssize_t read_piece(const struct piece *p, uint8_t *buffer, const void **data) {
+	size_t done = 0;
+	if (p->mem != NULL) {
+		*data = p->mem;
+		return p->length;
+	}
+	while (done < p->length) {
+		ssize_t n = pread(p->fd, buffer + done, p->length - done, p->disk + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -errno;
+		if (n == 0) return -EIO;
+		done += n;
+	}
+	*data = buffer;
+	return done;
+}
+
+static int write_full(int fd, const void *data, size_t length, off_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t n = offset < 0 ? write(fd, (const uint8_t *)data + done, length - done) :
+				pwrite(fd, (const uint8_t *)data + done, length - done, offset + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -errno;
+		done += n;
+	}
+	return 0;
+}
+
+static void output_path(struct extract *x, const struct entry *e, char *path, size_t size) {
+	snprintf(path, size, "%s%s%s", x->dest, *e->path ? "/" : "", e->path);
+}
+
+static void entry_times(const struct entry *e, struct timespec times[2]) {
+	times[0].tv_sec = e->dirent.record.accessed;
+	times[0].tv_nsec = 0;
+	times[1].tv_sec = e->dirent.record.modified;
+	times[1].tv_nsec = 0;
+}
+
+/**
+ * Called once the last piece of a file has been written.
+ */
+static void finish_file(struct extract *x, struct entry *e) {
+	struct timespec times[2];
+	char path[1200];
+	entry_times(e, times);
+	if (futimens(e->out, times) < 0 || close(e->out) < 0) {
+		output_path(x, e, path, sizeof(path));
+		fail(x, "Error writing", path, errno);
+	}
+	e->out = -1;
+}
+
+static void *copy_worker(void *arg) {
+	struct extract *x = arg;
+	uint8_t *buffer = malloc(x->chunk);
+	char path[1200];
+	if (buffer == NULL) {
+		fail(x, "Error allocating", "buffer", ENOMEM);
+		return NULL;
+	}
+	while (!__atomic_load_n(&x->failed, __ATOMIC_RELAXED)) {
+		size_t i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED);
+		struct piece *p;
+		struct entry *e;
+		const void *data;
+		ssize_t n;
+		int out, ret;
+		if (i >= x->piece_count) break;
+		p = &x->pieces[i];
+		e = &x->entries[p->entry];
+		n = read_piece(p, buffer, &data);
+		if (n < 0) {
+			fail(x, "Error reading", e->path, -n);
+			break;
+		}
+		pthread_mutex_lock(&e->lock);
+		if (e->out < 0) {
+			output_path(x, e, path, sizeof(path));
+			e->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (e->out < 0) fail(x, "Error creating", path, errno);
+		}
+		out = e->out;
+		pthread_mutex_unlock(&e->lock);
+		if (out < 0) break;
+		ret = write_full(out, data, n, p->offset);
+		if (ret < 0) {
+			output_path(x, e, path, sizeof(path));
+			fail(x, "Error writing", path, -ret);
+			break;
+		}
+		__atomic_add_fetch(&x->done, n, __ATOMIC_RELAXED);
+		if (__atomic_sub_fetch(&e->pieces, 1, __ATOMIC_ACQ_REL) == 0) finish_file(x, e);
+	}
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Creates the directories and empty files, which have no pieces.
+ */
+static int make_tree(struct extract *x) {
+	char path[1200];
+	size_t i;
+	for (i = 0; i < x->entry_count; i++) {
+		struct entry *e = &x->entries[i];
+		output_path(x, e, path, sizeof(path));
+		if (e->dirent.attributes & 0x10) {
+			if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+				fail(x, "Error creating", path, errno);
+				return -1;
+			}
+		} else if (e->pieces == 0) {
+			e->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (e->out < 0) {
+				fail(x, "Error creating", path, errno);
+				return -1;
+			}
+			finish_file(x, e);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Sets the directories' times, deepest first, once nothing more will be
+ * created in them.
+ */
+static void set_dir_times(struct extract *x) {
+	struct timespec times[2];
+	char path[1200];
+	size_t i;
+	for (i = x->entry_count; i-- > 0;) {
+		struct entry *e = &x->entries[i];
+		// the root directory has no record and so no times
+		if (!(e->dirent.attributes & 0x10) || e->dirent.record_offset == -1) continue;
+		output_path(x, e, path, sizeof(path));
+		entry_times(e, times);
+		if (utimensat(AT_FDCWD, path, times, 0) < 0) fail(x, "Error setting times of", path, errno);
+	}
+}
+
+static void tar_octal(char *field, size_t size, uint64_t value) {
+	size_t i;
+	field[size - 1] = '\0';
+	for (i = size - 1; i-- > 0; value >>= 3) field[i] = '0' + (value & 7);
+}
+
+static int tar_block(const char *name, char type, uint64_t size, time_t mtime,
+		const char *prefix, char *block) {
+	unsigned int sum = 0;
+	size_t i;
+	memset(block, 0, 512);
+	strncpy(block, name, 100);
+	tar_octal(block + 100, 8, type == '5' ? 0755 : 0644);
+	tar_octal(block + 108, 8, 0);
+	tar_octal(block + 116, 8, 0);
+	tar_octal(block + 124, 12, size);
+	tar_octal(block + 136, 12, mtime < 0 ? 0 : mtime);
+	memset(block + 148, ' ', 8);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	if (prefix != NULL) strncpy(block + 345, prefix, 155);
+	for (i = 0; i < 512; i++) sum += (unsigned char)block[i];
+	snprintf(block + 148, 8, "%06o", sum);
+	return write_full(STDOUT_FILENO, block, 512, -1);
+}
+
+static int tar_pad(uint64_t size) {
+	static const char zero[512];
+	if (size % 512 == 0) return 0;
+	return write_full(STDOUT_FILENO, zero, 512 - size % 512, -1);
+}
+
+/**
+ * Writes the header for an entry. Names that don't fit in ustar's name
+ * and prefix fields get a GNU long name record first.
+ */
+static int tar_header(const struct entry *e) {
+	const fatx_file_record *r = &e->dirent.record;
+	char block[512], name[1100], *slash;
+	char type = (e->dirent.attributes & 0x10) ? '5' : '0';
+	uint64_t size = type == '5' ? 0 : r->size;
+	size_t length;
+	int ret;
+	snprintf(name, sizeof(name), "%s%s", e->path, type == '5' ? "/" : "");
+	length = strlen(name);
+	if (length <= 100) return tar_block(name, type, size, r->modified, NULL, block);
+	slash = strchr(name + length - 101, '/');
+	if (slash != NULL && slash - name <= 155 && slash[1] != '\0') {
+		*slash = '\0';
+		return tar_block(slash + 1, type, size, r->modified, name, block);
+	}
+	ret = tar_block("././@LongLink", 'L', length + 1, 0, NULL, block);
+	if (ret == 0) ret = write_full(STDOUT_FILENO, name, length + 1, -1);
+	if (ret == 0) ret = tar_pad(length + 1);
+	if (ret == 0) ret = tar_block(name, type, size, r->modified, NULL, block);
+	return ret;
+}
+
+static void *tar_worker(void *arg) {
+	struct extract *x = arg;
+	for (;;) {
+		struct slot *slot;
+		const void *data;
+		ssize_t n;
+		size_t i;
+		pthread_mutex_lock(&x->lock);
+		while (x->next < x->piece_count && x->next >= x->written + x->window_size && !x->failed) {
+			pthread_cond_wait(&x->read_cond, &x->lock);
+		}
+		if (x->next >= x->piece_count || x->failed) {
+			pthread_mutex_unlock(&x->lock);
+			break;
+		}
+		i = x->next++;
+		pthread_mutex_unlock(&x->lock);
+		slot = &x->window[i % x->window_size];
+		n = read_piece(&x->pieces[i], slot->buffer, &data);
+		if (n < 0) fail(x, "Error reading", x->entries[x->pieces[i].entry].path, -n);
+		else if (data != slot->buffer) memcpy(slot->buffer, data, n);
+		pthread_mutex_lock(&x->lock);
+		slot->length = n < 0 ? 0 : n;
+		pthread_cond_broadcast(&x->write_cond);
+		pthread_mutex_unlock(&x->lock);
+	}
+	pthread_mutex_lock(&x->lock);
+	pthread_cond_broadcast(&x->write_cond);
+	pthread_mutex_unlock(&x->lock);
+	return NULL;
+}
+
+/**
+ * Writes the pieces to stdout in order as the workers fill them in.
+ */
+static int tar_writer(struct extract *x) {
+	static const char end[1024];
+	size_t i;
+	int ret = 0;
+	for (i = 0; i < x->entry_count && ret == 0; i++) {
+		if (!(x->entries[i].dirent.attributes & 0x10) && x->entries[i].pieces == 0) {
+			ret = tar_header(&x->entries[i]);
+		}
+	}
+	for (i = 0; i < x->piece_count && ret == 0; i++) {
+		struct piece *p = &x->pieces[i];
+		struct entry *e = &x->entries[p->entry];
+		struct slot *slot = &x->window[i % x->window_size];
+		pthread_mutex_lock(&x->lock);
+		while (slot->length < 0 && !x->failed) pthread_cond_wait(&x->write_cond, &x->lock);
+		pthread_mutex_unlock(&x->lock);
+		if (__atomic_load_n(&x->failed, __ATOMIC_RELAXED)) {
+			ret = -1;
+			break;
+		}
+		if (p->offset == 0) ret = tar_header(e);
+		if (ret == 0) ret = write_full(STDOUT_FILENO, slot->buffer, slot->length, -1);
+		if (ret == 0 && p->offset + p->length == e->dirent.record.size) ret = tar_pad(e->dirent.record.size);
+		__atomic_add_fetch(&x->done, slot->length, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&x->lock);
+		slot->length = -1;
+		x->written++;
+		pthread_cond_broadcast(&x->read_cond);
+		pthread_mutex_unlock(&x->lock);
+	}
+	// directories go last, or tar would set their times before the files
+	// landed in them
+	for (i = 0; i < x->entry_count && ret == 0; i++) {
+		if (*x->entries[i].path != '\0' && (x->entries[i].dirent.attributes & 0x10)) {
+			ret = tar_header(&x->entries[i]);
+		}
+	}
+	if (ret == 0) ret = write_full(STDOUT_FILENO, end, sizeof(end), -1);
+	if (ret < 0 && !x->failed) fail(x, "Error writing", "to stdout", -ret);
+	// wake the workers in case they're waiting for room that won't come
+	pthread_mutex_lock(&x->lock);
+	pthread_cond_broadcast(&x->read_cond);
+	pthread_mutex_unlock(&x->lock);
+	return ret;
+}
+
+static int tar_setup(struct extract *x) {
+	size_t i;
+	x->window_size = x->threads * EXTRACT_WINDOW;
+	x->window = calloc(x->window_size, sizeof(struct slot));
+	if (x->window == NULL) return -1;
+	for (i = 0; i < x->window_size; i++) {
+		x->window[i].length = -1;
+		x->window[i].buffer = malloc(x->chunk);
+		if (x->window[i].buffer == NULL) return -1;
+	}
+	return 0;
+}
+
+static void print_progress(struct extract *x, int last) {
+	double seconds = now() - x->started;
+	uint64_t done = __atomic_load_n(&x->done, __ATOMIC_RELAXED);
+	fprintf(stderr, "\r%3d%%  %llu of %llu MiB  %.1f MiB/s ", x->total ? (int)(done * 100 / x->total) : 100,
+			(unsigned long long)(done >> 20), (unsigned long long)(x->total >> 20),
+			seconds > 0 ? done / seconds / 1048576 : 0.0);
+	if (last) fprintf(stderr, "\n");
+}
+
+static void *progress(void *arg) {
+	struct extract *x = arg;
+	struct timespec wake;
+	pthread_mutex_lock(&x->progress_lock);
+	while (!x->finished) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec++;
+		pthread_cond_timedwait(&x->progress_cond, &x->progress_lock, &wake);
+		if (!x->finished) print_progress(x, 0);
+	}
+	pthread_mutex_unlock(&x->progress_lock);
+	return NULL;
+}
+
+/**
+ * Lets the process keep a file open for each fragmented file in flight.
+ */
+static void raise_file_limit(void) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-b chunk] [-m] [-q] /dev/sdcX destdir [path]\n"
+			"       %s -t [-j threads] [-b chunk] [-m] [-q] /dev/sdcX [path] > out.tar\n"
+			"  -t: write a tar stream to stdout instead of into a directory\n"
+			"  -j: reading threads, one per CPU by default\n"
+			"  -b: largest read in bytes, 1 MiB by default\n"
+			"  -m: map the image into memory instead of reading it with pread\n"
+			"  -q: don't report progress\n", name, name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct extract x;
+	fatx_fs_options opts;
+	fatx_dirent root;
+	pthread_t *threads, reporter;
+	const char *image, *source = "/";
+	unsigned int t, started;
+	size_t i;
+	int c, ret;
+
+	memset(&x, 0, sizeof(x));
+	x.chunk = 1024 * 1024;
+	fatx_fs_options_init(&opts);
+	opts.read_only = 1;
+	opts.extent_cache_size = 0;
+	opts.dentry_cache_size = 0;
+	opts.dir_index_cache_size = 0;
+	while ((c = getopt(argc, argv, "tj:b:mq")) != -1) {
+		switch (c) {
+		case 't':
+			x.tar = 1;
+			break;
+		case 'j':
+			x.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			x.chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			opts.io_engine = FATX_IO_MMAP;
+			break;
+		case 'q':
+			x.quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < (x.tar ? 1 : 2) || argc - optind > (x.tar ? 2 : 3) || x.chunk < 512) usage(argv[0]);
+	image = argv[optind++];
+	if (!x.tar) x.dest = argv[optind++];
+	if (optind < argc) source = argv[optind];
+	if (x.threads == 0) x.threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (x.tar && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "fatx-extract: Not writing a tar stream to a terminal\n");
+		return 2;
+	}
+
+	x.info = fatx_fs_init_opts(image, &opts);
+	if (x.info == NULL) return 1;
+	ret = fatx_lookup_path(x.info, source, &root);
+	if (ret < 0) {
+		fprintf(stderr, "fatx-extract: %s: %s\n", source, strerror(ret == -1 ? EIO : -ret));
+		fatx_fs_end(x.info);
+		return 1;
+	}
+	// a single file is extracted under its own name
+	if (!(root.attributes & 0x10) && bad_name(root.record.name)) {
+		fprintf(stderr, "fatx-extract: %s: Bad name\n", source);
+		fatx_fs_end(x.info);
+		return 1;
+	}
+	ret = add_entry(&x, (root.attributes & 0x10) ? "" : root.record.name, &root);
+	if (ret == 0 && (root.attributes & 0x10)) ret = list_tree(&x, 0);
+	for (i = 0; i < x.entry_count && ret == 0; i++) {
+		if (!(x.entries[i].dirent.attributes & 0x10)) ret = map_entry(&x, i);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "fatx-extract: Error listing %s: %s\n", source, strerror(-ret));
+		fatx_fs_end(x.info);
+		return 1;
+	}
+	sort_extract = &x;
+	qsort(x.pieces, x.piece_count, sizeof(struct piece), x.tar ? by_file_start : by_disk);
+
+	if (x.tar) ret = tar_setup(&x);
+	else if ((root.attributes & 0x10) == 0 && mkdir(x.dest, 0755) < 0 && errno != EEXIST) ret = -1;
+	if (ret == 0 && !x.tar) ret = make_tree(&x);
+	threads = calloc(x.threads, sizeof(pthread_t));
+	if (ret < 0 || threads == NULL) {
+		if (!x.failed) fprintf(stderr, "fatx-extract: Error setting up: %s\n", strerror(errno));
+		fatx_fs_end(x.info);
+		return 1;
+	}
+	raise_file_limit();
+	pthread_mutex_init(&x.lock, NULL);
+	pthread_cond_init(&x.read_cond, NULL);
+	pthread_cond_init(&x.write_cond, NULL);
+	pthread_mutex_init(&x.progress_lock, NULL);
+	pthread_cond_init(&x.progress_cond, NULL);
+	x.started = now();
+	// progress is only a nicety, so go on without it
+	if (!x.quiet && pthread_create(&reporter, NULL, progress, &x) != 0) x.quiet = 1;
+	for (started = 0; started < x.threads; started++) {
+		if (pthread_create(&threads[started], NULL, x.tar ? tar_worker : copy_worker, &x) != 0) break;
+	}
+	if (started == 0) fail(&x, "Error starting", "threads", EAGAIN);
+	else if (x.tar) tar_writer(&x);
+	for (t = 0; t < started; t++) pthread_join(threads[t], NULL);
+	if (!x.tar && !x.failed) set_dir_times(&x);
+	pthread_mutex_lock(&x.progress_lock);
+	x.finished = 1;
+	pthread_cond_signal(&x.progress_cond);
+	pthread_mutex_unlock(&x.progress_lock);
+	if (!x.quiet) {
+		pthread_join(reporter, NULL);
+		print_progress(&x, 1);
+		fprintf(stderr, "%zu files, %zu directories, %zu reads in %.1f seconds\n", x.files,
+				x.dirs - ((root.attributes & 0x10) ? 1 : 0), x.piece_count, now() - x.started);
+	}
+
+	for (i = 0; i < x.entry_count; i++) free(x.entries[i].path);
+	free(x.entries);
+	free(x.listed);
+	free(x.pieces);
+	if (x.window != NULL) {
+		for (i = 0; i < x.window_size; i++) free(x.window[i].buffer);
+		free(x.window);
+	}
+	free(threads);
+	fatx_fs_end(x.info);
+	return x.failed || x.skipped ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/*
+  fsck.fatx: FATX filesystem checker
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fatx.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* exit codes, as fsck(8) expects them */
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+#define FSCK_USAGE 16
+
+static const char *problem_names[FATX_CHECK_PROBLEMS] = {
+	[FATX_CHECK_BAD_LINK] = "bad link",
+	[FATX_CHECK_CYCLE] = "cycle",
+	[FATX_CHECK_CROSS_LINK] = "cross link",
+	[FATX_CHECK_LOST_CHAIN] = "lost chain",
+	[FATX_CHECK_SIZE] = "size mismatch",
+	[FATX_CHECK_NAME] = "bad name",
+	[FATX_CHECK_IO] = "read error"
+};
+
+static void report(int problem, const char *path, const char *detail, void *user)
+{
+	int *quiet = user;
+	if (*quiet) return;
+	if (*path) printf("%s: %s: %s\n", problem_names[problem], path, detail);
+	else printf("%s: %s\n", problem_names[problem], detail);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n | -r] [-j threads] [-q] /dev/sdcX\n"
+			"  -n: only check, never change anything (the default)\n"
+			"  -r: repair what can be repaired\n"
+			"  -j: worker threads, one per CPU by default\n"
+			"  -q: print only the summary\n", name);
+	exit(FSCK_USAGE);
+}
+
+int main(int argc, char *argv[])
+{
+	fatx_check_options check_opts;
+	fatx_check_result result;
+	fatx_fs_options opts;
+	fatx_fs_info *info;
+	uint64_t problems = 0;
+	int c, i, quiet = 0, ret;
+
+	memset(&check_opts, 0, sizeof(check_opts));
+	fatx_fs_options_init(&opts);
+	opts.read_only = 1;
+	while ((c = getopt(argc, argv, "nrj:q")) != -1) {
+		switch (c) {
+		case 'n':
+			check_opts.repair = 0;
+			break;
+		case 'r':
+			check_opts.repair = 1;
+			break;
+		case 'j':
+			check_opts.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) usage(argv[0]);
+	opts.read_only = !check_opts.repair;
+	// checking only needs the directories; no point caching anything else
+	opts.extent_cache_size = 0;
+	opts.dentry_cache_size = 0;
+	opts.dir_index_cache_size = 0;
+	info = fatx_fs_init_opts(argv[optind], &opts);
+	if (info == NULL) return FSCK_ERROR;
+	check_opts.report = report;
+	check_opts.user = &quiet;
+	ret = fatx_check(info, &check_opts, &result);
+	if (ret < 0) {
+		fprintf(stderr, "fsck.fatx: Error checking %s: %s\n", argv[optind], strerror(-ret));
+		fatx_fs_end(info);
+		return FSCK_ERROR;
+	}
+	printf("%s: %llu directories, %llu files, %llu clusters in use\n", argv[optind],
+			(unsigned long long)result.directories, (unsigned long long)result.files,
+			(unsigned long long)result.clusters_used);
+	for (i = 0; i < FATX_CHECK_PROBLEMS; i++) {
+		if (result.problems[i] == 0) continue;
+		printf("  %s: %llu\n", problem_names[i], (unsigned long long)result.problems[i]);
+		problems += result.problems[i];
+	}
+	if (result.lost_clusters > 0) {
+		printf("  %llu lost clusters\n", (unsigned long long)result.lost_clusters);
+	}
+	fatx_fs_end(info);
+	if (problems == 0) {
+		printf("%s: clean\n", argv[optind]);
+		return FSCK_OK;
+	}
+	if (check_opts.repair) {
+		printf("%s: %llu problems, %llu repaired\n", argv[optind], (unsigned long long)problems,
+				(unsigned long long)result.repaired);
+		return result.repaired < problems ? FSCK_UNCORRECTED : FSCK_CORRECTED;
+	}
+	printf("%s: %llu problems, run with -r to repair\n", argv[optind], (unsigned long long)problems);
+	return FSCK_UNCORRECTED;
+}
@@ -10,9 +10,31 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
 
+/*
+ * Concurrency: once fatx_fs_init returns, a fatx_fs_info may be shared by
+ * any number of threads. Its geometry never changes, and the FAT, extent,
+ * dentry and directory index caches lock internally, so every function
+ * below may be called concurrently on the same fatx_fs_info. Changes to
+ * the namespace and to the FAT are serialized; reads and writes of file
+ * data go on in parallel, except on the same file.
+ * A fatx_file may be read and written from several threads at once but
+ * must not be used after (or while) it is passed to fatx_close.
+ * fatx_fs_end must only be called once no other call is in progress.
+ */
 typedef struct fatx_fs_info fatx_fs_info;
+typedef struct fatx_file fatx_file;
+typedef struct fatx_aio fatx_aio;
+
+/* backends for reading file data, see fatx_fs_options.io_engine */
+#define FATX_IO_SYNC 0 // preadv in the calling thread
+#define FATX_IO_URING 1 // io_uring, if libfatx was built with liburing
+#define FATX_IO_MMAP 2 // map the whole image; regular files only
 
 typedef struct fatx_file_record {
 	char name[43];
@@ -23,17 +45,320 @@ typedef struct fatx_file_record {
 	int isdir;
 } fatx_file_record;
 
+/**
+ * A directory entry as it was found on disk. record_offset is where the
+ * entry's 64 byte record lives (-1 for the root directory); it only
+ * changes when fatx_rename moves the entry to another directory, so it can
+ * stand in for an inode number.
+ */
+typedef struct fatx_dirent {
+	off_t record_offset;
+	uint32_t first_cluster;
+	uint8_t attributes;
+	fatx_file_record record;
+} fatx_dirent;
+
+/**
+ * A piece of a file's data as it lies on the device: length bytes of fd
+ * starting at offset. With the mmap backend, mem points at the same bytes
+ * in the mapped image; otherwise it is NULL.
+ */
+typedef struct fatx_io_extent {
+	int fd;
+	off_t offset;
+	size_t length;
+	const void *mem;
+} fatx_io_extent;
+
 typedef struct fatx_file_offsets {
 	off_t record_offset;
 	off_t data_offset;
 } fatx_file_offsets;
 
+typedef struct fatx_fs_options {
+	size_t fat_memory_limit; // bytes of FAT kept in memory, 0 for no limit
+	size_t extent_cache_size; // files whose extent maps are kept, 0 to disable
+	size_t dentry_cache_size; // path components remembered, 0 to disable
+	size_t dir_index_cache_size; // directories whose hashed index is kept, 0 to disable
+	int io_engine; // FATX_IO_SYNC or FATX_IO_URING
+	unsigned int io_depth; // reads the io_uring backend keeps in flight
+	int mmap_populate; // with FATX_IO_MMAP, fault the whole image in at mount
+	int read_only; // open the device read only even if it could be written
+	off_t offset; // where the partition starts on the device
+	off_t length; // bytes the partition takes from offset, 0 for the rest of the device
+	fatx_fs_info *share; // an open partition of the same device whose fd and I/O backend to use
+	size_t block_cache_size; // bytes of clusters libfatx caches itself, read with O_DIRECT; 0 to leave it to the kernel
+	const char *sidecar; // file to keep the partition's metadata in between mounts, see fatx_sidecar_build
+} fatx_fs_options;
+
+/**
+ * Counters of the block cache, see fatx_get_block_cache_stats. Metadata
+ * is directory clusters; data is the contents of files.
+ */
+typedef struct fatx_block_cache_stats {
+	uint64_t metadata_hits;
+	uint64_t metadata_misses;
+	uint64_t data_hits;
+	uint64_t data_misses;
+	size_t metadata_blocks; // clusters each pool holds
+	size_t data_blocks;
+	int direct; // whether misses are read with O_DIRECT
+} fatx_block_cache_stats;
+
+/*
+ * Counters of the work a fatx_fs_info has done, see fatx_get_stats. They
+ * count from fatx_fs_init and are cheap enough to be always on.
+ */
+#define FATX_STAT_LOOKUPS 0 // names looked up in a directory
+#define FATX_STAT_DIR_CLUSTERS 1 // directory clusters read to index a directory
+#define FATX_STAT_FAT_HOPS 2 // links of cluster chains followed
+#define FATX_STAT_READS 3 // reads of the device, counting extents handed out by fatx_map_file
+#define FATX_STAT_BYTES_READ 4
+#define FATX_STAT_WRITES 5
+#define FATX_STAT_BYTES_WRITTEN 6
+#define FATX_STAT_DENTRY_HITS 7
+#define FATX_STAT_DENTRY_MISSES 8
+#define FATX_STAT_DIR_INDEX_HITS 9
+#define FATX_STAT_DIR_INDEX_MISSES 10
+#define FATX_STAT_EXTENT_HITS 11
+#define FATX_STAT_EXTENT_MISSES 12
+#define FATX_STAT_FAT_PAGE_HITS 13 // only when the FAT is paged, see fat_memory_limit
+#define FATX_STAT_FAT_PAGE_MISSES 14
+#define FATX_STAT_BLOCK_HITS 15 // block cache, both pools
+#define FATX_STAT_BLOCK_MISSES 16
+#define FATX_STATS 17
+
+/*
+ * States of the metadata sidecar, see fatx_sidecar_status. A sidecar holds
+ * the FAT, every directory's records and every file's extents, so that
+ * the next mount of the same partition lists them without reading the
+ * disk. One that is missing or out of date is written in the background
+ * once fatx_sidecar_build is called.
+ */
+#define FATX_SIDECAR_NONE 0 // no sidecar was asked for
+#define FATX_SIDECAR_LOADED 1 // valid, and used
+#define FATX_SIDECAR_MISSING 2 // missing or out of date, and fatx_sidecar_build wasn't called
+#define FATX_SIDECAR_BUILDING 3
+#define FATX_SIDECAR_BUILT 4 // written, for the next mount
+#define FATX_SIDECAR_FAILED 5
+#define FATX_SIDECAR_STALE 6 // the filesystem was changed, so the sidecar was dropped
+
+/**
+ * A FATX partition on a whole drive, as found by fatx_find_partitions.
+ */
+typedef struct fatx_partition {
+	char name[24];
+	off_t offset;
+	off_t length;
+} fatx_partition;
+
+#define FATX_MAX_PARTITIONS 8
+
+void fatx_fs_options_init(fatx_fs_options *opts);
 fatx_fs_info *fatx_fs_init(const char *filename);
+fatx_fs_info *fatx_fs_init_opts(const char *filename, const fatx_fs_options *opts);
 void fatx_fs_end(fatx_fs_info *info);
+int fatx_find_partitions(const char *filename, fatx_partition *partitions, size_t max);
+int fatx_fs_read_only(fatx_fs_info *info);
+int fatx_statfs(fatx_fs_info *info, struct statvfs *st);
+const char *fatx_io_engine_name(fatx_fs_info *info);
+int fatx_get_block_cache_stats(fatx_fs_info *info, fatx_block_cache_stats *stats);
+void fatx_get_stats(fatx_fs_info *info, uint64_t stats[FATX_STATS]);
+const char *fatx_stat_name(int stat);
+int fatx_sidecar_build(fatx_fs_info *info);
+int fatx_sidecar_write(fatx_fs_info *info, const char *path);
+int fatx_sidecar_status(fatx_fs_info *info);
 int fatx_find_file_offsets(struct fatx_file_offsets *offsets,
 		fatx_fs_info *info, const char *path);
 int fatx_read_file_record(fatx_file_record *file_record,
 		fatx_fs_info *info, const char *path);
-int fatx_list_dir(fatx_fs_info *info, const char *path, void (*func)(const char *, void *), void *user);
+int fatx_list_dir(fatx_fs_info *info, const char *path, off_t cookie,
+		int (*func)(const fatx_file_record *record, off_t next, void *user), void *user);
+ssize_t fatx_read_file(fatx_fs_info *info, const char *path, void *buffer, size_t size, off_t offset);
+fatx_file *fatx_open(fatx_fs_info *info, const char *path);
+ssize_t fatx_pread(fatx_file *file, void *buffer, size_t size, off_t offset);
+ssize_t fatx_preadv(fatx_file *file, const struct iovec *iov, int iovcnt, off_t offset);
+fatx_aio *fatx_aio_submit(fatx_file *file, void *buffer, size_t size, off_t offset);
+int fatx_aio_poll(fatx_aio *aio);
+ssize_t fatx_aio_wait(fatx_aio *aio);
+int fatx_map_file(fatx_file *file, off_t offset, size_t size, fatx_io_extent *extents, int max);
+void fatx_close(fatx_file *file);
+
+/*
+ * Access by directory entry instead of by path. These never parse a path
+ * or walk down from the root, which suits callers (like a FUSE low-level
+ * driver) that already know which entry they want.
+ */
+void fatx_dirent_root(fatx_fs_info *info, fatx_dirent *entry);
+int fatx_read_dirent(fatx_fs_info *info, off_t record_offset, fatx_dirent *entry);
+int fatx_lookup(fatx_fs_info *info, const fatx_dirent *dir, const char *name, fatx_dirent *entry);
+int fatx_read_dir(fatx_fs_info *info, const fatx_dirent *dir, off_t cookie,
+		int (*func)(const fatx_dirent *entry, off_t next, void *user), void *user);
+fatx_file *fatx_open_dirent(fatx_fs_info *info, const fatx_dirent *entry);
+int fatx_lookup_path(fatx_fs_info *info, const char *path, fatx_dirent *entry);
+
+/*
+ * Walking a tree. fatx_walk calls opts->visit for everything below the
+ * directory path, with its full path, its entry and its depth (1 for what
+ * is directly in path), from a pool of threads that share out the
+ * directories, so visit is called concurrently and in no set order.
+ * Entries are only visited if their name matches opts->pattern (fnmatch,
+ * ignoring case) and, with opts->dirs_only, if they are directories; the
+ * directories that aren't visited are still walked. Subdirectories past
+ * opts->max_depth, or that visit returns FATX_WALK_PRUNE for, are never
+ * read. visit returns 0 to go on, or -errno to stop the walk, which then
+ * returns that. A directory linked to from more than one place is only
+ * walked once. Returns 0, or -errno (-EIO if some directory was damaged or
+ * linked to twice, after walking everything else).
+ */
+#define FATX_WALK_PRUNE 1
+
+typedef struct fatx_walk_options {
+	unsigned int threads; // 0 for one per CPU
+	int max_depth; // 0 for no limit
+	const char *pattern; // NULL to visit every name
+	int dirs_only;
+	int (*visit)(const char *path, const fatx_dirent *entry, int depth, void *user);
+	void *user;
+} fatx_walk_options;
+
+int fatx_walk(fatx_fs_info *info, const char *path, const fatx_walk_options *opts);
+
+/*
+ * Writing. These fail with -EROFS if the filesystem is read only, and
+ * otherwise return 0 (or a byte count) or -errno. Changes to the FAT and
+ * to directories stay in memory until fatx_sync or fatx_fs_end; file data
+ * is written straight away.
+ */
+int fatx_create(fatx_fs_info *info, const fatx_dirent *dir, const char *name, int isdir,
+		fatx_dirent *entry);
+int fatx_unlink(fatx_fs_info *info, const fatx_dirent *dir, const char *name);
+int fatx_rmdir(fatx_fs_info *info, const fatx_dirent *dir, const char *name);
+int fatx_rename(fatx_fs_info *info, const fatx_dirent *dir, const char *name,
+		const fatx_dirent *newdir, const char *newname, fatx_dirent *entry);
+int fatx_set_times(fatx_fs_info *info, const fatx_dirent *entry, time_t accessed, time_t modified);
+ssize_t fatx_pwrite(fatx_file *file, const void *buffer, size_t size, off_t offset);
+int fatx_truncate(fatx_file *file, off_t length);
+int fatx_sync(fatx_fs_info *info);
+
+/*
+ * Consistency checking. fatx_check walks every directory and cluster
+ * chain with a pool of threads and reports each problem it finds through
+ * opts->report (if set) as well as counting it in result->problems. With
+ * opts->repair, which needs a writable filesystem, broken chains are cut
+ * where they break, sizes are fixed to match their chains, bad records are
+ * deleted and lost chains are freed. If a directory can't be read
+ * (FATX_CHECK_IO), what it holds can't be told from lost chains, so lost
+ * chains are neither reported nor freed. Nothing else may use info
+ * meanwhile. Returns 0 once the whole filesystem has been checked, or
+ * -errno.
+ */
+#define FATX_CHECK_BAD_LINK 0 // a chain leaves the FAT or runs into a free cluster
+#define FATX_CHECK_CYCLE 1 // a chain loops back on itself
+#define FATX_CHECK_CROSS_LINK 2 // a cluster is in more than one chain
+#define FATX_CHECK_LOST_CHAIN 3 // clusters in use that no entry leads to
+#define FATX_CHECK_SIZE 4 // a file's size doesn't match the length of its chain
+#define FATX_CHECK_NAME 5 // a record with an invalid name length
+#define FATX_CHECK_IO 6 // a directory couldn't be read
+#define FATX_CHECK_PROBLEMS 7
+
+typedef struct fatx_check_options {
+	unsigned int threads; // 0 for one per CPU
+	int repair;
+	void (*report)(int problem, const char *path, const char *detail, void *user);
+	void *user;
+} fatx_check_options;
+
+typedef struct fatx_check_result {
+	uint64_t problems[FATX_CHECK_PROBLEMS];
+	uint64_t repaired; // problems fixed, with opts->repair
+	uint64_t directories;
+	uint64_t files;
+	uint64_t clusters_used;
+	uint64_t lost_clusters;
+} fatx_check_result;
+
+int fatx_check(fatx_fs_info *info, const fatx_check_options *opts, fatx_check_result *result);
+
+/*
+ * Defragmenting. fatx_defrag measures how fragmented every file and
+ * directory is, then moves each fragmented one to a single run of free
+ * clusters, compacting directories as it goes. Moves are planned up front
+ * from the clusters free at the start, largest first, and each planned
+ * chain is reported through opts->report with the cluster it moves to, or
+ * 0 if no free run is long enough. A filesystem with damaged chains is
+ * only measured, and -EUCLEAN is returned; fatx_check repairs it. With
+ * opts->dry_run nothing is written. The FAT is updated so that stopping
+ * at any point loses no data, at worst leaving lost chains for fatx_check
+ * to free. Nothing else may use info meanwhile.
+ */
+#define FATX_DEFRAG_RUN_BUCKETS 16 // runs of 1, 2-3, 4-7, ... clusters; the last holds all longer ones
+
+typedef struct fatx_defrag_options {
+	int dry_run;
+	size_t batch_size; // bytes of files copied between FAT updates, 0 for the default
+	void (*report)(const char *path, uint32_t clusters, uint32_t extents, uint32_t target, void *user);
+	void *user;
+} fatx_defrag_options;
+
+typedef struct fatx_defrag_result {
+	uint64_t files;
+	uint64_t directories; // not counting the root
+	uint64_t clusters; // in the chains of files and directories
+	uint64_t extents; // runs of contiguous clusters those chains are in
+	uint64_t fragmented; // chains in more than one run
+	uint64_t runs[FATX_DEFRAG_RUN_BUCKETS]; // runs by length
+	uint64_t problems; // damaged chains and directories
+	uint64_t free_clusters;
+	uint64_t largest_free_run;
+	uint64_t moved; // chains moved, or that would be with dry_run
+	uint64_t moved_clusters;
+	uint64_t compacted_clusters; // directory clusters freed by dropping deleted records
+	uint64_t unplaced; // chains left as they are for lack of a long enough free run
+	uint64_t extents_after;
+} fatx_defrag_result;
+
+int fatx_defrag(fatx_fs_info *info, const fatx_defrag_options *opts, fatx_defrag_result *result);
+
+/*
+ * Xbox 360 packages (STFS: CON, LIVE and PIRS files), which is what most
+ * of the content partition holds. fatx_package_open reads a package's
+ * hash tables and file table into memory, so looking up and listing its
+ * entries needs no I/O, and reads go straight to the package's clusters
+ * without extracting anything. Entries are named by their index in the
+ * file table, and FATX_PACKAGE_ROOT is the package's top directory. A
+ * package is read only and may be used by several threads at once; it
+ * has to be closed and opened again if the package file changes.
+ */
+#define FATX_PACKAGE_ROOT -1
+
+typedef struct fatx_package fatx_package;
+
+typedef struct fatx_package_entry {
+	int index;
+	int parent;
+	fatx_file_record record;
+} fatx_package_entry;
+
+typedef struct fatx_package_info {
+	char magic[5]; // "CON ", "LIVE" or "PIRS"
+	uint32_t content_type;
+	uint32_t title_id;
+	uint32_t blocks; // 4 KiB blocks allocated
+	char display_name[193]; // UTF-8
+} fatx_package_info;
+
+int fatx_package_probe(fatx_fs_info *info, const fatx_dirent *entry);
+fatx_package *fatx_package_open(fatx_fs_info *info, const fatx_dirent *entry);
+void fatx_package_close(fatx_package *package);
+void fatx_package_get_info(fatx_package *package, fatx_package_info *info);
+int fatx_package_entry_get(fatx_package *package, int index, fatx_package_entry *entry);
+int fatx_package_lookup(fatx_package *package, int dir, const char *name, fatx_package_entry *entry);
+int fatx_package_read_dir(fatx_package *package, int dir, off_t cookie,
+		int (*func)(const fatx_package_entry *entry, off_t next, void *user), void *user);
+ssize_t fatx_package_pread(fatx_package *package, int index, void *buffer, size_t size, off_t offset);
+int fatx_package_map(fatx_package *package, int index, off_t offset, size_t size,
+		fatx_io_extent *extents, int max);
+int fatx_package_verify(fatx_package *package, unsigned int threads, uint64_t *bad_blocks);
 
 #endif /* FATX_H_ */
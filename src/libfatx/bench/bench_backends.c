@@ -0,0 +1,163 @@
+/*
+  bench-backends: libfatx I/O backends on metadata and streaming workloads
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Mounts an image once per backend and runs two workloads on it:
+ * "metadata" looks up every path with the dentry and directory index
+ * caches turned off, so each lookup reads directory clusters again, and
+ * "stream" reads every file from start to end. "cache" is the sync
+ * backend behind a 64 MiB block cache.
+ */
+
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+
+static const struct {
+	const char *name;
+	int engine;
+	size_t block_cache; // bytes
+} engines[] = {
+	{ "sync", FATX_IO_SYNC, 0 },
+	{ "mmap", FATX_IO_MMAP, 0 },
+	{ "io_uring", FATX_IO_URING, 0 },
+	{ "cache", FATX_IO_SYNC, 64 << 20 }
+};
+
+static int metadata(fatx_fs_info *info, struct bench_tree *tree, int rounds, size_t *ops) {
+	fatx_file_record record;
+	size_t i;
+	int round;
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < tree->count; i++) {
+			if (fatx_read_file_record(&record, info, tree->files[i].path) < 0) return -1;
+			(*ops)++;
+		}
+	}
+	return 0;
+}
+
+static int stream(fatx_fs_info *info, struct bench_tree *tree, size_t chunk, size_t *ops,
+		size_t *bytes) {
+	uint8_t *buf = malloc(chunk);
+	size_t i;
+	if (buf == NULL) return -1;
+	for (i = 0; i < tree->count; i++) {
+		fatx_file *file;
+		off_t offset = 0;
+		if (tree->files[i].isdir) continue;
+		file = fatx_open(info, tree->files[i].path);
+		if (file == NULL) break;
+		while ((size_t)offset < tree->files[i].size) {
+			ssize_t n = fatx_pread(file, buf, chunk, offset);
+			if (n <= 0) break;
+			offset += n;
+			(*ops)++;
+		}
+		*bytes += offset;
+		fatx_close(file);
+		if ((size_t)offset < tree->files[i].size) break;
+	}
+	free(buf);
+	return i == tree->count ? 0 : -1;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-P] [-r rounds] [-s chunk_size] image\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_tree tree = { 0 };
+	fatx_block_cache_stats stats;
+	fatx_fs_options opts;
+	fatx_fs_info *info;
+	size_t chunk = 1024 * 1024;
+	int c, e, rounds = 10, populate = 0;
+	while ((c = getopt(argc, argv, "Pr:s:")) != -1) {
+		switch (c) {
+		case 'P':
+			populate = 1;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || chunk == 0 || rounds < 1) usage(argv[0]);
+	info = fatx_fs_init(argv[optind]);
+	if (info == NULL) return 1;
+	if (bench_collect(info, "/", &tree) < 0) {
+		fprintf(stderr, "bench-backends: Error walking %s\n", argv[optind]);
+		return 1;
+	}
+	fatx_fs_end(info);
+	printf("# %zu entries, %zu bytes in files\n", tree.count, tree.bytes);
+	printf("# backend\tworkload\tops\tseconds\tops/s\tMB/s\n");
+	for (e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+		size_t ops = 0, bytes = 0;
+		double start, elapsed;
+		fatx_fs_options_init(&opts);
+		opts.io_engine = engines[e].engine;
+		opts.block_cache_size = engines[e].block_cache;
+		opts.mmap_populate = populate;
+		opts.dentry_cache_size = 0;
+		opts.dir_index_cache_size = 0;
+		info = fatx_fs_init_opts(argv[optind], &opts);
+		if (info == NULL) return 1;
+		if (strcmp(fatx_io_engine_name(info), engines[e].name) != 0) {
+			printf("# %s not available\n", engines[e].name);
+			fatx_fs_end(info);
+			continue;
+		}
+		start = bench_now();
+		if (metadata(info, &tree, rounds, &ops) < 0) {
+			fprintf(stderr, "bench-backends: Lookup failed with %s\n", engines[e].name);
+			return 1;
+		}
+		elapsed = bench_now() - start;
+		printf("%s\tmetadata\t%zu\t%.3f\t%.0f\t-\n", engines[e].name, ops, elapsed, ops / elapsed);
+		ops = 0;
+		start = bench_now();
+		if (stream(info, &tree, chunk, &ops, &bytes) < 0) {
+			fprintf(stderr, "bench-backends: Read failed with %s\n", engines[e].name);
+			return 1;
+		}
+		elapsed = bench_now() - start;
+		printf("%s\tstream\t%zu\t%.3f\t%.0f\t%.1f\n", engines[e].name, ops, elapsed,
+				ops / elapsed, bytes / elapsed / 1e6);
+		if (fatx_get_block_cache_stats(info, &stats) == 0) {
+			printf("# %s: metadata %" PRIu64 "/%" PRIu64 " hits, data %" PRIu64 "/%" PRIu64 " hits%s\n",
+					engines[e].name, stats.metadata_hits, stats.metadata_hits + stats.metadata_misses,
+					stats.data_hits, stats.data_hits + stats.data_misses,
+					stats.direct ? "" : ", without O_DIRECT");
+		}
+		fatx_fs_end(info);
+	}
+	bench_tree_free(&tree);
+	return 0;
+}
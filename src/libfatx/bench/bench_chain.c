@@ -0,0 +1,206 @@
+/*
+  bench-chain: speed of walking cluster chains through the FAT
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Walks one long chain through a synthetic FAT, made of runs of -l
+ * contiguous clusters in random order, with the chain_run kernel of each
+ * of the four layouts and with a lookup call per hop the way a generic
+ * walk does it, and reports clusters per second. Also times each
+ * layout's fat_to_host over the table, which for the host's own byte
+ * order compiles to nothing. A 16 bit FAT can't hold more than 0xFFF0
+ * clusters, so its walks are repeated to cover as many hops as the 32
+ * bit ones.
+ */
+
+#include "bench_common.h"
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <getopt.h>
+
+/**
+ * Fills a table of count entries of the given width with a single chain
+ * starting at cluster 2, in runs of run clusters placed in random order.
+ */
+static void *make_fat(size_t width, size_t count, uint32_t run) {
+	size_t slots = (count - 2) / run, i, j;
+	uint32_t *order = malloc(slots * sizeof(uint32_t)), seed = 12345, t, last = 0, cluster;
+	uint8_t *fat = calloc(count, width);
+	if (fat == NULL || order == NULL || slots == 0) {
+		free(order);
+		free(fat);
+		return NULL;
+	}
+	for (i = 0; i < slots; i++) order[i] = i;
+	for (i = slots - 1; i > 1; i--) { // the first run stays first, so the chain starts at 2
+		seed = seed * 1103515245 + 12345;
+		j = 1 + (seed >> 8) % i;
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < slots; i++) {
+		for (j = 0; j < run; j++) {
+			cluster = 2 + order[i] * run + j;
+			if (last != 0) {
+				if (width == sizeof(uint32_t)) ((uint32_t *)fat)[last] = cluster;
+				else ((uint16_t *)fat)[last] = (uint16_t)cluster;
+			}
+			last = cluster;
+		}
+	}
+	if (width == sizeof(uint32_t)) ((uint32_t *)fat)[last] = 0xFFFFFFFF;
+	else ((uint16_t *)fat)[last] = 0xFFFF;
+	free(order);
+	return fat;
+}
+
+static uint64_t generic_hops;
+
+/**
+ * Looks up one entry the way fatx_fat_entry does for a FAT in memory: a
+ * call per hop that checks the bounds, counts the hop and tests the width.
+ */
+__attribute__((noinline))
+static int entry_generic(const void *fat, size_t width, size_t count, uint32_t cluster, uint32_t *entry) {
+	if (cluster >= count) return -1;
+	__atomic_add_fetch(&generic_hops, 1, __ATOMIC_RELAXED);
+	if (width == sizeof(uint32_t)) *entry = __atomic_load_n(&((const uint32_t *)fat)[cluster], __ATOMIC_RELAXED);
+	else *entry = __atomic_load_n(&((const uint16_t *)fat)[cluster], __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Follows the chain one hop at a time and counts its clusters and runs.
+ */
+static uint64_t walk_generic(const void *fat, size_t width, size_t count, uint64_t *extents) {
+	uint32_t cluster = 2, entry;
+	uint64_t n = 0;
+	*extents = 1;
+	for (;;) {
+		n++;
+		if (entry_generic(fat, width, count, cluster, &entry) < 0) return 0;
+		if (width == sizeof(uint32_t) ? (entry & 0xFFFFFFF) > 0xFFFFFF5 : entry > 0xFFF5) break;
+		if (entry != cluster + 1) (*extents)++;
+		cluster = entry;
+	}
+	return n;
+}
+
+/**
+ * Follows the chain a run at a time with a layout's kernel.
+ */
+static uint64_t walk_kernel(const struct fatx_geometry_ops *ops, const void *fat, size_t count,
+		uint64_t *extents) {
+	uint32_t cluster = 2, next;
+	uint64_t n = 0;
+	*extents = 0;
+	for (;;) {
+		n += ops->chain_run(fat, count, cluster, UINT32_MAX, &next);
+		(*extents)++;
+		if (ops->width == sizeof(uint32_t) ? (next & 0xFFFFFFF) > 0xFFFFFF5 : next > 0xFFF5) break;
+		if (next >= count) return 0;
+		cluster = next;
+	}
+	return n;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n entries] [-l run] [-r rounds]\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	static const int orders[] = { LITTLE_ENDIAN, BIG_ENDIAN };
+	static const size_t widths[] = { sizeof(uint16_t), sizeof(uint32_t) };
+	size_t count = 16 * 1024 * 1024, entries;
+	uint32_t run = 8;
+	int rounds = 5, c, w, o, r, repeat, k;
+	while ((c = getopt(argc, argv, "n:l:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			run = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || count < 16 || run == 0 || rounds <= 0) usage(argv[0]);
+	printf("# %zu entries in runs of %u, best of %d\n", count, run, rounds);
+	printf("# layout\twalk\tclusters\textents\tseconds\tMclusters/s\n");
+	for (w = 0; w < 2; w++) {
+		void *fat, *copy;
+		uint64_t expected, expected_extents;
+		entries = widths[w] == sizeof(uint16_t) ? min(count, (size_t)0xFFF0) : count;
+		repeat = count / entries;
+		fat = make_fat(widths[w], entries, run);
+		copy = malloc(entries * widths[w]);
+		if (fat == NULL || copy == NULL) return 1;
+		expected = walk_generic(fat, widths[w], entries, &expected_extents);
+		for (k = -1; k < 2; k++) {
+			const struct fatx_geometry_ops *ops = k < 0 ? NULL : fatx_geometry_find(orders[k], widths[w]);
+			double best = 0;
+			uint64_t n = 0, extents = 0;
+			for (r = 0; r < rounds; r++) {
+				double start = bench_now(), seconds;
+				for (c = 0; c < repeat; c++) {
+					n = ops == NULL ? walk_generic(fat, widths[w], entries, &extents) :
+							walk_kernel(ops, fat, entries, &extents);
+				}
+				seconds = bench_now() - start;
+				if (r == 0 || seconds < best) best = seconds;
+			}
+			if (n != expected || extents != expected_extents) {
+				fprintf(stderr, "bench-chain: %s walked %llu clusters in %llu extents, not %llu in %llu\n",
+						ops ? ops->name : "generic", (unsigned long long)n, (unsigned long long)extents,
+						(unsigned long long)expected, (unsigned long long)expected_extents);
+				return 1;
+			}
+			printf("%s\t%s\t%llu\t%llu\t%.4f\t%.1f\n", ops ? ops->name : (w ? "32" : "16"),
+					ops ? "chain_run" : "generic", (unsigned long long)n, (unsigned long long)extents,
+					best, (double)n * repeat / best / 1e6);
+		}
+		for (o = 0; o < 2; o++) {
+			const struct fatx_geometry_ops *ops = fatx_geometry_find(orders[o], widths[w]);
+			double best = 0;
+			for (r = 0; r < rounds; r++) {
+				double start, seconds;
+				memcpy(copy, fat, entries * widths[w]);
+				start = bench_now();
+				for (c = 0; c < repeat; c++) ops->fat_to_host(copy, entries);
+				seconds = bench_now() - start;
+				if (r == 0 || seconds < best) best = seconds;
+			}
+			if (best < 1e-6) printf("%s\tfat_to_host\t%zu\t-\t%.4f\t-\n", ops->name, entries, best);
+			else printf("%s\tfat_to_host\t%zu\t-\t%.4f\t%.1f\n", ops->name, entries, best,
+					(double)entries * repeat / best / 1e6);
+		}
+		free(copy);
+		free(fat);
+	}
+	return 0;
+}
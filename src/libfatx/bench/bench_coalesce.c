@@ -0,0 +1,152 @@
+/*
+  bench-coalesce: syscalls needed to read files cluster by cluster and run by run
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads every file on a FATX filesystem twice: once with one pread per
+ * 16KB cluster, the way libfatx used to, and once through fatx_pread,
+ * which issues one read per run of contiguous clusters. Reports the
+ * syscalls per MB and the throughput of each.
+ */
+
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define CLUSTER_SIZE 0x4000
+#define MAX_EXTENTS 4096
+
+struct result {
+	size_t syscalls;
+	size_t bytes;
+	double seconds;
+};
+
+/**
+ * Reads size bytes at offset with one pread per cluster. Returns the
+ * number of syscalls, or -1 on error.
+ */
+static ssize_t read_by_cluster(fatx_file *file, uint8_t *buf, size_t size, off_t offset,
+		fatx_io_extent *extents) {
+	ssize_t calls = 0;
+	int count = fatx_map_file(file, offset, size, extents, MAX_EXTENTS), i;
+	if (count < 0 || count > MAX_EXTENTS) return -1;
+	for (i = 0; i < count; i++) {
+		size_t done = 0;
+		while (done < extents[i].length) {
+			off_t pos = extents[i].offset + done;
+			size_t n = CLUSTER_SIZE - (pos % CLUSTER_SIZE);
+			if (n > extents[i].length - done) n = extents[i].length - done;
+			if (pread(extents[i].fd, buf, n, pos) != (ssize_t)n) return -1;
+			buf += n;
+			done += n;
+			calls++;
+		}
+	}
+	return calls;
+}
+
+static int run(fatx_fs_info *info, struct bench_tree *tree, size_t chunk, int by_cluster,
+		struct result *result) {
+	fatx_io_extent *extents = malloc(MAX_EXTENTS * sizeof(fatx_io_extent));
+	uint8_t *buf = malloc(chunk);
+	double start = bench_now();
+	size_t i;
+	memset(result, 0, sizeof(struct result));
+	if (buf == NULL || extents == NULL) return -1;
+	for (i = 0; i < tree->count; i++) {
+		fatx_file *file;
+		off_t offset = 0;
+		if (tree->files[i].isdir) continue;
+		file = fatx_open(info, tree->files[i].path);
+		if (file == NULL) return -1;
+		while ((size_t)offset < tree->files[i].size) {
+			size_t n = tree->files[i].size - offset;
+			ssize_t calls;
+			if (n > chunk) n = chunk;
+			if (by_cluster) {
+				calls = read_by_cluster(file, buf, n, offset, extents);
+			} else {
+				// fatx_pread reads each extent with one syscall
+				calls = fatx_map_file(file, offset, n, extents, 0);
+				if (fatx_pread(file, buf, n, offset) != (ssize_t)n) calls = -1;
+			}
+			if (calls < 0) {
+				fatx_close(file);
+				return -1;
+			}
+			result->syscalls += calls;
+			offset += n;
+		}
+		result->bytes += offset;
+		fatx_close(file);
+	}
+	result->seconds = bench_now() - start;
+	free(buf);
+	free(extents);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-s chunk_size] image\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_tree tree = { 0 };
+	struct result results[2];
+	fatx_fs_info *info;
+	size_t chunk = 1024 * 1024;
+	int c, mode;
+	while ((c = getopt(argc, argv, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || chunk == 0) usage(argv[0]);
+	info = fatx_fs_init(argv[optind]);
+	if (info == NULL) return 1;
+	if (bench_collect(info, "/", &tree) < 0) {
+		fprintf(stderr, "bench-coalesce: Error walking %s\n", argv[optind]);
+		return 1;
+	}
+	printf("# %zu bytes in files, %zu byte reads\n", tree.bytes, chunk);
+	printf("# mode\tsyscalls\tsyscalls/MB\tseconds\tMB/s\n");
+	for (mode = 1; mode >= 0; mode--) {
+		struct result *r = &results[mode];
+		if (run(info, &tree, chunk, mode, r) < 0) {
+			fprintf(stderr, "bench-coalesce: Read error\n");
+			return 1;
+		}
+		printf("%s\t%zu\t%.2f\t%.3f\t%.1f\n", mode ? "cluster" : "run", r->syscalls,
+				r->syscalls / (r->bytes / 1e6), r->seconds, r->bytes / r->seconds / 1e6);
+	}
+	if (results[0].syscalls > 0) {
+		printf("# %.1fx fewer syscalls\n", (double)results[1].syscalls / results[0].syscalls);
+	}
+	bench_tree_free(&tree);
+	fatx_fs_end(info);
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+  libfatx benchmarks
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Helpers shared by the benchmark programs.
+ */
+
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns how many read and write syscalls the process has made so far,
+ * from /proc/self/io, or 0 if that can't be read. Reads made by io_uring
+ * or by faulting in mapped pages don't count.
+ */
+size_t bench_syscalls(void) {
+	FILE *f = fopen("/proc/self/io", "r");
+	char line[128];
+	size_t total = 0, value;
+	if (f == NULL) return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "syscr: %zu", &value) == 1 || sscanf(line, "syscw: %zu", &value) == 1) {
+			total += value;
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+int bench_latency_add(struct bench_latency *latency, double seconds) {
+	if (latency->count == latency->allocated) {
+		size_t allocated = latency->allocated ? latency->allocated * 2 : 1024;
+		double *p = realloc(latency->samples, allocated * sizeof(double));
+		if (p == NULL) return -1;
+		latency->samples = p;
+		latency->allocated = allocated;
+	}
+	latency->samples[latency->count++] = seconds;
+	return 0;
+}
+
+static int bench_compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Returns the latency below which percent of the samples fall, sorting
+ * the samples first.
+ */
+double bench_latency_percentile(struct bench_latency *latency, double percent) {
+	size_t i;
+	if (latency->count == 0) return 0;
+	qsort(latency->samples, latency->count, sizeof(double), bench_compare_double);
+	i = (size_t)(percent / 100 * latency->count);
+	return latency->samples[i < latency->count ? i : latency->count - 1];
+}
+
+void bench_latency_free(struct bench_latency *latency) {
+	free(latency->samples);
+	memset(latency, 0, sizeof(struct bench_latency));
+}
+
+struct bench_names {
+	char **names;
+	size_t count;
+};
+
+static int bench_add_name(const fatx_file_record *record, off_t next, void *user) {
+	struct bench_names *names = user;
+	char **p = realloc(names->names, (names->count + 1) * sizeof(char *));
+	(void) next;
+	if (p == NULL) return 1;
+	names->names = p;
+	names->names[names->count++] = strdup(record->name);
+	return 0;
+}
+
+static int bench_add(struct bench_tree *tree, const char *path, fatx_file_record *record) {
+	if (tree->count == tree->allocated) {
+		size_t allocated = tree->allocated ? tree->allocated * 2 : 256;
+		struct bench_file *p = realloc(tree->files, allocated * sizeof(struct bench_file));
+		if (p == NULL) return -1;
+		tree->files = p;
+		tree->allocated = allocated;
+	}
+	tree->files[tree->count].path = strdup(path);
+	tree->files[tree->count].size = record->size;
+	tree->files[tree->count].isdir = record->isdir;
+	tree->count++;
+	if (!record->isdir) tree->bytes += record->size;
+	return 0;
+}
+
+/**
+ * Appends path and everything below it to tree.
+ */
+int bench_collect(fatx_fs_info *info, const char *path, struct bench_tree *tree) {
+	struct bench_names names = { NULL, 0 };
+	fatx_file_record record;
+	char child[1024];
+	size_t i;
+	int ret;
+	ret = fatx_read_file_record(&record, info, path);
+	if (ret < 0) return ret;
+	if (bench_add(tree, path, &record) < 0) return -1;
+	if (!record.isdir) return 0;
+	ret = fatx_list_dir(info, path, 0, bench_add_name, &names);
+	for (i = 0; i < names.count; i++) {
+		snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", names.names[i]);
+		if (ret >= 0 && bench_collect(info, child, tree) < 0) ret = -1;
+		free(names.names[i]);
+	}
+	free(names.names);
+	return ret;
+}
+
+void bench_tree_free(struct bench_tree *tree) {
+	size_t i;
+	for (i = 0; i < tree->count; i++) free(tree->files[i].path);
+	free(tree->files);
+	memset(tree, 0, sizeof(struct bench_tree));
+}
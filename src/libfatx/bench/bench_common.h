@@ -0,0 +1,55 @@
+/*
+  libfatx benchmarks
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_COMMON_H_
+#define BENCH_COMMON_H_
+
+#include "fatx.h"
+#include <stddef.h>
+
+struct bench_file {
+	char *path;
+	size_t size;
+	int isdir;
+};
+
+struct bench_tree {
+	struct bench_file *files;
+	size_t count;
+	size_t allocated;
+	size_t bytes; // sum of the sizes of regular files
+};
+
+/**
+ * Per-operation latencies of one run, for percentiles.
+ */
+struct bench_latency {
+	double *samples;
+	size_t count;
+	size_t allocated;
+};
+
+double bench_now(void);
+size_t bench_syscalls(void);
+int bench_latency_add(struct bench_latency *latency, double seconds);
+double bench_latency_percentile(struct bench_latency *latency, double percent);
+void bench_latency_free(struct bench_latency *latency);
+int bench_collect(fatx_fs_info *info, const char *path, struct bench_tree *tree);
+void bench_tree_free(struct bench_tree *tree);
+
+#endif /* BENCH_COMMON_H_ */
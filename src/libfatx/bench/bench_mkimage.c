@@ -0,0 +1,380 @@
+/*
+  bench-mkimage: writes synthetic FATX images to benchmark against
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Creates a FATX image of any size holding a generated tree: every
+ * directory down to the given depth has the same number of files and
+ * subdirectories, file sizes follow a fixed, uniform or log-uniform
+ * distribution, and a fragmentation percentage makes the allocator jump
+ * to a random cluster that often instead of taking the next free one.
+ * As with libfatx, images under 0x3FFF4000 bytes get a 16 bit FAT and
+ * larger ones a 32 bit FAT. The image is sparse: only the header, the
+ * FAT, directories and (unless -x is given) file data are written.
+ */
+
+#include "bench_common.h"
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_LOG 2
+#define DATA_CHUNK 0x100000
+
+struct image {
+	int fd;
+	int big_endian;
+	size_t width;
+	off_t end;
+	off_t root_dir;
+	uint32_t cluster_limit; // one past the last usable cluster
+	uint8_t *fat; // in disk order
+	uint8_t *used;
+	uint32_t used_count;
+	uint32_t cursor;
+	uint64_t rng;
+	/* tree shape */
+	unsigned int fanout, depth, files, frag;
+	int dist, write_data;
+	uint64_t min_size, max_size;
+	uint32_t timestamp;
+	/* totals for the summary */
+	size_t dir_count, file_count, extents;
+	uint64_t bytes;
+	uint8_t *data;
+};
+
+static uint64_t next_random(struct image *img) {
+	img->rng ^= img->rng << 13;
+	img->rng ^= img->rng >> 7;
+	img->rng ^= img->rng << 17;
+	return img->rng;
+}
+
+static uint32_t to_disk32(struct image *img, uint32_t value) {
+	return img->big_endian ? htobe32(value) : htole32(value);
+}
+
+static void fat_set(struct image *img, uint32_t cluster, uint32_t value) {
+	if (img->width == sizeof(uint32_t)) {
+		((uint32_t *)img->fat)[cluster] = to_disk32(img, value);
+	} else {
+		((uint16_t *)img->fat)[cluster] = img->big_endian ? htobe16(value) : htole16(value);
+	}
+}
+
+static uint32_t fat_last(struct image *img) {
+	return (img->width == sizeof(uint32_t)) ? 0xFFFFFFFF : 0xFFFF;
+}
+
+/**
+ * Works out where everything goes, the same way libfatx does on mount.
+ */
+static void image_geometry(struct image *img) {
+	size_t fat_size, fat_entries;
+	img->width = (img->end < 0x3FFF4000) ? sizeof(uint16_t) : sizeof(uint32_t);
+	img->root_dir = -(-((img->end >> (img->width == sizeof(uint32_t) ? 12 : 13)) + 1) &
+			INT64_C(-0x1000)) + 0x1000;
+	fat_size = (img->end - img->root_dir) >> 14;
+	fat_entries = min(fat_size + 1, (size_t)(img->root_dir - 0x1000) / img->width);
+	img->cluster_limit = min(fat_entries,
+			(size_t)((img->width == sizeof(uint32_t)) ? 0xFFFFFF0 : 0xFFF0));
+}
+
+static off_t cluster_offset(struct image *img, uint32_t cluster) {
+	return img->root_dir + ((off_t)(cluster - 1) << 14);
+}
+
+/**
+ * Takes the next free cluster after the cursor, first moving the cursor
+ * somewhere random frag percent of the time. Returns 0 when full.
+ */
+static uint32_t alloc_cluster(struct image *img) {
+	uint32_t cluster;
+	if (img->used_count >= img->cluster_limit - 2) return 0;
+	if (img->frag > 0 && next_random(img) % 100 < img->frag) {
+		img->cursor = 2 + next_random(img) % (img->cluster_limit - 2);
+	}
+	cluster = img->cursor;
+	while (img->used[cluster]) {
+		if (++cluster >= img->cluster_limit) cluster = 2;
+	}
+	img->used[cluster] = 1;
+	img->used_count++;
+	img->cursor = (cluster + 1 < img->cluster_limit) ? cluster + 1 : 2;
+	return cluster;
+}
+
+/**
+ * Allocates and links a chain of count clusters into chain. Returns 0, or
+ * -1 if the image is full.
+ */
+static int alloc_chain(struct image *img, uint32_t *chain, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		chain[i] = alloc_cluster(img);
+		if (chain[i] == 0) return -1;
+		if (i > 0) fat_set(img, chain[i - 1], chain[i]);
+	}
+	if (count > 0) fat_set(img, chain[count - 1], fat_last(img));
+	return 0;
+}
+
+static int write_full(int fd, const void *buffer, size_t size, off_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t ret = pwrite(fd, (const uint8_t *)buffer + done, size - done, offset + done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+/**
+ * Writes filler to a file's clusters, one write per contiguous run.
+ */
+static int write_data(struct image *img, const uint32_t *chain, size_t count) {
+	size_t i = 0;
+	while (i < count) {
+		size_t run = 1, done;
+		while (i + run < count && chain[i + run] == chain[i] + run) run++;
+		for (done = 0; done < run * FATX_CLUSTER_SIZE; done += DATA_CHUNK) {
+			size_t n = min((size_t)DATA_CHUNK, run * FATX_CLUSTER_SIZE - done);
+			if (write_full(img->fd, img->data, n, cluster_offset(img, chain[i]) + done) < 0) return -1;
+		}
+		i += run;
+	}
+	return 0;
+}
+
+static uint64_t file_size(struct image *img) {
+	uint64_t span = img->max_size - img->min_size;
+	double lo, hi;
+	switch (img->dist) {
+	case DIST_FIXED:
+		return img->max_size;
+	case DIST_UNIFORM:
+		return img->min_size + (span ? next_random(img) % (span + 1) : 0);
+	default:
+		// as many files between 1KB and 2KB as between 1MB and 2MB
+		lo = log((double)max(img->min_size, (uint64_t)1));
+		hi = log((double)img->max_size + 1);
+		return min((uint64_t)exp(lo + (hi - lo) * (next_random(img) >> 11) / (double)(UINT64_C(1) << 53)),
+				img->max_size);
+	}
+}
+
+static void make_record(struct image *img, struct fatx_internal_file_record *record,
+		const char *name, int isdir, uint32_t first_cluster, uint32_t size) {
+	int length;
+	memset(record, 0, sizeof(struct fatx_internal_file_record));
+	fatx_name_ansi2fatx(record->name, name, &length);
+	record->name_length = length;
+	record->attributes = isdir ? 0x10 : 0;
+	record->first_cluster = to_disk32(img, first_cluster);
+	record->size = to_disk32(img, size);
+	record->modified_time = to_disk32(img, img->timestamp);
+	record->created_time = record->modified_time;
+	record->accessed_time = record->modified_time;
+}
+
+static size_t dir_clusters(struct image *img, unsigned int level) {
+	size_t entries = img->files + (level < img->depth ? img->fanout : 0);
+	return entries ? (entries + 255) / 256 : 1;
+}
+
+/**
+ * Fills in the directory at level whose clusters are chain: creates its
+ * files and subdirectories, then writes its records out.
+ */
+static int make_dir(struct image *img, const uint32_t *chain, size_t count, unsigned int level) {
+	size_t entries = count * 256, n = 0, i, j;
+	struct fatx_internal_file_record *records = malloc(entries * sizeof(*records));
+	char name[43];
+	int ret = -1;
+	if (records == NULL) return -1;
+	memset(records, 0xFF, entries * sizeof(*records));
+	img->dir_count++;
+	for (i = 0; i < img->files; i++) {
+		uint64_t size = file_size(img);
+		size_t clusters = (size + FATX_CLUSTER_SIZE - 1) / FATX_CLUSTER_SIZE;
+		uint32_t *file_chain = malloc(max(clusters, (size_t)1) * sizeof(uint32_t));
+		if (file_chain == NULL || alloc_chain(img, file_chain, clusters) < 0 ||
+				(img->write_data && write_data(img, file_chain, clusters) < 0)) {
+			free(file_chain);
+			goto out;
+		}
+		for (j = 0; j < clusters; j++) {
+			if (j == 0 || file_chain[j] != file_chain[j - 1] + 1) img->extents++;
+		}
+		snprintf(name, sizeof(name), "file%05zu.bin", i);
+		make_record(img, &records[n++], name, 0, clusters ? file_chain[0] : 0, size);
+		img->file_count++;
+		img->bytes += size;
+		free(file_chain);
+	}
+	for (i = 0; level < img->depth && i < img->fanout; i++) {
+		size_t sub_count = dir_clusters(img, level + 1);
+		uint32_t *sub = malloc(sub_count * sizeof(uint32_t));
+		if (sub == NULL || alloc_chain(img, sub, sub_count) < 0 ||
+				make_dir(img, sub, sub_count, level + 1) < 0) {
+			free(sub);
+			goto out;
+		}
+		snprintf(name, sizeof(name), "dir%03zu", i);
+		make_record(img, &records[n++], name, 1, sub[0], 0);
+		free(sub);
+	}
+	for (i = 0; i < count; i++) {
+		if (write_full(img->fd, records + i * 256, FATX_CLUSTER_SIZE, cluster_offset(img, chain[i])) < 0) goto out;
+	}
+	ret = 0;
+out:
+	free(records);
+	return ret;
+}
+
+static int write_header(struct image *img) {
+	uint8_t header[0x1000];
+	uint32_t value;
+	memset(header, 0, sizeof(header));
+	memcpy(header, img->big_endian ? "XTAF" : "FATX", 4);
+	value = to_disk32(img, (uint32_t)next_random(img)); // volume id
+	memcpy(header + 4, &value, 4);
+	value = to_disk32(img, 32); // sectors per cluster
+	memcpy(header + 8, &value, 4);
+	value = to_disk32(img, 1); // first cluster of the root directory
+	memcpy(header + 12, &value, 4);
+	return write_full(img->fd, header, sizeof(header), 0);
+}
+
+static uint64_t parse_size(const char *arg) {
+	char *end;
+	uint64_t size = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'T': case 't': size <<= 10; /* fall through */
+	case 'G': case 'g': size <<= 10; /* fall through */
+	case 'M': case 'm': size <<= 10; /* fall through */
+	case 'K': case 'k': size <<= 10;
+	}
+	return size;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s -s size[KMGT] [-e little|big] [-f fanout] [-d depth] [-n files]\n"
+			"       [-D fixed|uniform|log] [-m min_size] [-M max_size] [-F frag_percent]\n"
+			"       [-r seed] [-x] image\n"
+			"Images under 1GB get a 16 bit FAT, larger ones a 32 bit FAT. -x leaves file\n"
+			"data unwritten (sparse).\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct image img;
+	uint32_t root = 1;
+	double start = bench_now();
+	int c;
+	memset(&img, 0, sizeof(img));
+	img.fanout = 4;
+	img.depth = 3;
+	img.files = 16;
+	img.dist = DIST_LOG;
+	img.min_size = 1024;
+	img.max_size = 4 * 1024 * 1024;
+	img.write_data = 1;
+	img.rng = 88172645463325252ULL;
+	while ((c = getopt(argc, argv, "s:e:f:d:n:D:m:M:F:r:x")) != -1) {
+		switch (c) {
+		case 's': img.end = parse_size(optarg); break;
+		case 'e': img.big_endian = (strcmp(optarg, "big") == 0); break;
+		case 'f': img.fanout = strtoul(optarg, NULL, 0); break;
+		case 'd': img.depth = strtoul(optarg, NULL, 0); break;
+		case 'n': img.files = strtoul(optarg, NULL, 0); break;
+		case 'D':
+			if (strcmp(optarg, "fixed") == 0) img.dist = DIST_FIXED;
+			else if (strcmp(optarg, "uniform") == 0) img.dist = DIST_UNIFORM;
+			else if (strcmp(optarg, "log") == 0) img.dist = DIST_LOG;
+			else usage(argv[0]);
+			break;
+		case 'm': img.min_size = parse_size(optarg); break;
+		case 'M': img.max_size = parse_size(optarg); break;
+		case 'F': img.frag = strtoul(optarg, NULL, 0); break;
+		case 'r': img.rng = strtoull(optarg, NULL, 0) * 2654435761ULL + 1; break;
+		case 'x': img.write_data = 0; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || img.end < 0x100000 || img.frag > 100 || img.min_size > img.max_size ||
+			img.max_size > UINT32_MAX) {
+		usage(argv[0]);
+	}
+	if (img.files + img.fanout > 256) {
+		fputs("bench-mkimage: The root directory holds at most 256 entries\n", stderr);
+		return 1;
+	}
+	image_geometry(&img);
+	img.fat = calloc(img.cluster_limit, img.width);
+	img.used = calloc(img.cluster_limit, 1);
+	img.data = malloc(DATA_CHUNK);
+	if (img.fat == NULL || img.used == NULL || img.data == NULL) {
+		fputs("bench-mkimage: Out of memory\n", stderr);
+		return 1;
+	}
+	for (c = 0; c < DATA_CHUNK; c++) img.data[c] = next_random(&img);
+	img.cursor = 2;
+	img.timestamp = fatx_time_unix2fatx(1300000000);
+	fat_set(&img, 0, (img.width == sizeof(uint32_t)) ? 0xFFFFFFF8 : 0xFFF8);
+	fat_set(&img, 1, fat_last(&img));
+	img.fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (img.fd < 0 || ftruncate(img.fd, img.end) < 0) {
+		fprintf(stderr, "bench-mkimage: Error creating %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (make_dir(&img, &root, 1, 0) < 0) {
+		fprintf(stderr, "bench-mkimage: %s\n", img.used_count >= img.cluster_limit - 2 ?
+				"The tree doesn't fit in the image" : strerror(errno));
+		unlink(argv[optind]);
+		return 1;
+	}
+	if (write_header(&img) < 0 || write_full(img.fd, img.fat, img.cluster_limit * img.width, 0x1000) < 0 ||
+			fsync(img.fd) < 0) {
+		fprintf(stderr, "bench-mkimage: Error writing %s: %s\n", argv[optind], strerror(errno));
+		unlink(argv[optind]);
+		return 1;
+	}
+	close(img.fd);
+	printf("# %s: %s endian, %zu bit FAT, %u clusters, %u used\n", argv[optind],
+			img.big_endian ? "big" : "little", img.width * 8, img.cluster_limit - 2, img.used_count);
+	printf("# %zu directories, %zu files, %llu bytes, %.2f extents per file, %.1fs\n",
+			img.dir_count, img.file_count, (unsigned long long)img.bytes,
+			img.file_count ? (double)img.extents / img.file_count : 0.0,
+			bench_now() - start);
+	free(img.fat);
+	free(img.used);
+	free(img.data);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+  bench-readers: libfatx read throughput against concurrent readers
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads every file on a FATX filesystem through one shared fatx_fs_info
+ * with 1, 2, 4, ... threads and reports the throughput of each run.
+ */
+
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <getopt.h>
+
+struct run {
+	fatx_fs_info *info;
+	struct bench_tree *tree;
+	size_t chunk;
+	size_t next; // next file to read, shared by all threads
+	size_t bytes;
+	int errors;
+};
+
+static void *reader(void *arg) {
+	struct run *run = arg;
+	uint8_t *buf = malloc(run->chunk);
+	size_t i, bytes = 0;
+	int errors = 0;
+	if (buf == NULL) return NULL;
+	while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->tree->count) {
+		struct bench_file *f = &run->tree->files[i];
+		fatx_file *file;
+		off_t offset = 0;
+		if (f->isdir) continue;
+		file = fatx_open(run->info, f->path);
+		if (file == NULL) {
+			errors++;
+			continue;
+		}
+		while ((size_t)offset < f->size) {
+			ssize_t n = fatx_pread(file, buf, run->chunk, offset);
+			if (n <= 0) {
+				errors++;
+				break;
+			}
+			offset += n;
+		}
+		bytes += offset;
+		fatx_close(file);
+	}
+	free(buf);
+	__atomic_add_fetch(&run->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&run->errors, errors, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-u] [-t max_threads] [-s chunk_size] [-r rounds] image\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_tree tree = { 0 };
+	fatx_fs_info *info;
+	fatx_fs_options opts;
+	int c, max_threads = 8, rounds = 1, threads, round, i;
+	size_t chunk = 128 * 1024;
+	fatx_fs_options_init(&opts);
+	while ((c = getopt(argc, argv, "t:s:r:u")) != -1) {
+		switch (c) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			opts.io_engine = FATX_IO_URING;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || max_threads < 1 || chunk == 0) usage(argv[0]);
+	info = fatx_fs_init_opts(argv[optind], &opts);
+	if (info == NULL) return 1;
+	if (bench_collect(info, "/", &tree) < 0) {
+		fprintf(stderr, "bench-readers: Error walking %s\n", argv[optind]);
+		return 1;
+	}
+	printf("# %zu entries, %zu bytes in files, %zu byte reads, %s\n", tree.count, tree.bytes, chunk,
+			fatx_io_engine_name(info));
+	printf("# readers\tseconds\tMB/s\n");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		for (round = 0; round < rounds; round++) {
+			struct run run = { info, &tree, chunk, 0, 0, 0 };
+			pthread_t *workers = calloc(threads, sizeof(pthread_t));
+			double start, elapsed;
+			if (workers == NULL) return 1;
+			start = bench_now();
+			for (i = 0; i < threads; i++) pthread_create(&workers[i], NULL, reader, &run);
+			for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+			elapsed = bench_now() - start;
+			free(workers);
+			printf("%d\t%.3f\t%.1f%s\n", threads, elapsed, run.bytes / elapsed / 1e6,
+					run.errors ? "\t(read errors)" : "");
+		}
+	}
+	bench_tree_free(&tree);
+	fatx_fs_end(info);
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+  bench-scan: speed of the free cluster count over the FAT
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs each count_free kernel the CPU supports over a synthetic FAT of
+ * 16 and 32 bit entries, counting only and building the free bitmap, and
+ * reports entries and bytes per second. Given an image, it also times
+ * counting its FAT with one pread per entry against mounting it, which
+ * counts with the fastest kernel.
+ */
+
+#include "bench_common.h"
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+/**
+ * Fills a table of count entries of the given width, free_percent of
+ * them zero, the rest looking like chains of consecutive clusters.
+ */
+static void *make_fat(size_t width, size_t count, unsigned int free_percent) {
+	uint8_t *fat = malloc(count * width);
+	uint32_t seed = 12345;
+	size_t i;
+	if (fat == NULL) return NULL;
+	for (i = 0; i < count; i++) {
+		uint32_t value;
+		seed = seed * 1103515245 + 12345;
+		value = ((seed >> 16) % 100 < free_percent) ? 0 : (uint32_t)(i + 1) | 1;
+		if (width == sizeof(uint32_t)) ((uint32_t *)fat)[i] = value;
+		else ((uint16_t *)fat)[i] = (uint16_t)value;
+	}
+	return fat;
+}
+
+static double run_kernel(const struct fatx_scan_ops *ops, const void *fat, size_t width,
+		size_t count, uint64_t *mask, int rounds, size_t *found) {
+	double best = 0;
+	int r;
+	for (r = 0; r < rounds; r++) {
+		double start = bench_now(), seconds;
+		*found = ops->count_free(fat, width, count, mask);
+		seconds = bench_now() - start;
+		if (r == 0 || seconds < best) best = seconds;
+	}
+	return best;
+}
+
+/**
+ * Counts the zero entries of an image's FAT the slow way, one pread each.
+ */
+static int count_by_pread(fatx_fs_info *info, const char *path, double *seconds, size_t *found) {
+	int fd = open(path, O_RDONLY);
+	uint32_t entry;
+	size_t i;
+	double start;
+	if (fd < 0) return -1;
+	*found = 0;
+	start = bench_now();
+	for (i = 2; i < info->cluster_limit; i++) {
+		entry = 0;
+		if (pread(fd, &entry, info->width, info->fat_offset + i * info->width) != (ssize_t)info->width) {
+			close(fd);
+			return -1;
+		}
+		if (entry == 0) (*found)++;
+	}
+	*seconds = bench_now() - start;
+	close(fd);
+	return 0;
+}
+
+static int bench_image(const char *path) {
+	fatx_fs_options opts;
+	fatx_fs_info *info;
+	struct statvfs st;
+	double start, mount, slow;
+	size_t found;
+	fatx_fs_options_init(&opts);
+	opts.read_only = 1;
+	start = bench_now();
+	info = fatx_fs_init_opts(path, &opts);
+	mount = bench_now() - start;
+	if (info == NULL) return -1;
+	fatx_statfs(info, &st);
+	if (count_by_pread(info, path, &slow, &found) < 0) {
+		fatx_fs_end(info);
+		return -1;
+	}
+	printf("# %s: %u entries, %zu free\n", path, info->cluster_limit, (size_t)st.f_bfree);
+	printf("pread\t%zu\t%.4f\t%.1f\n", found, slow, info->cluster_limit / slow / 1e6);
+	printf("mount\t%zu\t%.4f\t%.1f\n", (size_t)st.f_bfree, mount, info->cluster_limit / mount / 1e6);
+	if (found != st.f_bfree) {
+		fprintf(stderr, "bench-scan: pread found %zu free clusters, statfs %zu\n",
+				found, (size_t)st.f_bfree);
+		fatx_fs_end(info);
+		return -1;
+	}
+	fatx_fs_end(info);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n entries] [-f free_percent] [-r rounds] [image]\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	size_t count = 32 * 1024 * 1024, widths[] = { sizeof(uint16_t), sizeof(uint32_t) };
+	unsigned int free_percent = 50;
+	int rounds = 5, c, w, k, m;
+	uint64_t *mask, *expected_mask;
+	size_t words;
+	while ((c = getopt(argc, argv, "n:f:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			free_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1 || count == 0 || rounds <= 0 || free_percent > 100) usage(argv[0]);
+	words = (count + 63) / 64;
+	mask = malloc(words * sizeof(uint64_t));
+	expected_mask = malloc(words * sizeof(uint64_t));
+	if (mask == NULL || expected_mask == NULL) return 1;
+	printf("# %zu entries, %u%% free, best of %d\n", count, free_percent, rounds);
+	printf("# kernel\twidth\tmask\tfree\tseconds\tMentries/s\tGB/s\n");
+	for (w = 0; w < 2; w++) {
+		void *fat = make_fat(widths[w], count, free_percent);
+		size_t expected = 0;
+		if (fat == NULL) return 1;
+		for (k = 0; k < 3; k++) {
+			const struct fatx_scan_ops *ops = fatx_scan_find(kernels[k]);
+			if (ops == NULL) continue;
+			for (m = 0; m < 2; m++) {
+				size_t found;
+				double seconds = run_kernel(ops, fat, widths[w], count, m ? mask : NULL, rounds, &found);
+				if (k == 0 && m == 0) expected = found;
+				if (k == 0 && m == 1) memcpy(expected_mask, mask, words * sizeof(uint64_t));
+				if (found != expected || (m == 1 && memcmp(mask, expected_mask, words * sizeof(uint64_t)))) {
+					fprintf(stderr, "bench-scan: %s disagrees with scalar\n", ops->name);
+					return 1;
+				}
+				printf("%s\t%zu\t%s\t%zu\t%.4f\t%.1f\t%.2f\n", ops->name, widths[w] * 8,
+						m ? "yes" : "no", found, seconds, count / seconds / 1e6,
+						count * widths[w] / seconds / 1e9);
+			}
+		}
+		free(fat);
+	}
+	free(mask);
+	free(expected_mask);
+	if (optind == argc - 1) {
+		printf("# method\tfree\tseconds\tMentries/s\n");
+		if (bench_image(argv[optind]) < 0) {
+			fprintf(stderr, "bench-scan: Error reading %s\n", argv[optind]);
+			return 1;
+		}
+	}
+	return 0;
+}
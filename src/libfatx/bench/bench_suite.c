@@ -0,0 +1,306 @@
+/*
+  bench-suite: times the main libfatx calls against an image
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs five workloads on each image given and prints one JSON object per
+ * workload and image, so results can be collected and compared run to run:
+ *   lookup     fatx_find_file_offsets on every path
+ *   list       fatx_list_dir on every directory
+ *   read_seq   fatx_read_file through every file from start to end
+ *   read_rand  fatx_read_file at random offsets of random files
+ *   crawl      a walk of the whole tree with fatx_list_dir and
+ *              fatx_read_file_record, the way a backup tool would
+ * Every call is timed for the p50 and p99 latencies. syscalls counts the
+ * read and write syscalls the workload made (see bench_syscalls).
+ */
+
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+struct suite {
+	fatx_fs_info *info;
+	struct bench_tree *tree;
+	const char *image;
+	const char *engine;
+	size_t chunk;
+	size_t random_reads;
+	size_t syscall_overhead; // made by bench_syscalls itself
+	int rounds;
+	uint64_t rng;
+	uint8_t *buffer;
+	/* the workload being run */
+	size_t ops;
+	size_t bytes;
+	struct bench_latency latency;
+};
+
+static uint64_t next_random(struct suite *s) {
+	s->rng ^= s->rng << 13;
+	s->rng ^= s->rng >> 7;
+	s->rng ^= s->rng << 17;
+	return s->rng;
+}
+
+/**
+ * Counts one call that started at start and moved bytes bytes.
+ */
+static int record_op(struct suite *s, double start, size_t bytes) {
+	s->ops++;
+	s->bytes += bytes;
+	return bench_latency_add(&s->latency, bench_now() - start);
+}
+
+static int lookup(struct suite *s) {
+	fatx_file_offsets offsets;
+	size_t i;
+	int round;
+	for (round = 0; round < s->rounds; round++) {
+		for (i = 0; i < s->tree->count; i++) {
+			double start = bench_now();
+			if (fatx_find_file_offsets(&offsets, s->info, s->tree->files[i].path) < 0) return -1;
+			if (record_op(s, start, 0) < 0) return -1;
+		}
+	}
+	return 0;
+}
+
+static int count_name(const fatx_file_record *record, off_t next, void *user) {
+	(void) record;
+	(void) next;
+	(*(size_t *)user)++;
+	return 0;
+}
+
+static int list(struct suite *s) {
+	size_t i, names;
+	int round;
+	for (round = 0; round < s->rounds; round++) {
+		for (i = 0; i < s->tree->count; i++) {
+			double start;
+			if (!s->tree->files[i].isdir) continue;
+			names = 0;
+			start = bench_now();
+			if (fatx_list_dir(s->info, s->tree->files[i].path, 0, count_name, &names) < 0) return -1;
+			if (record_op(s, start, 0) < 0) return -1;
+		}
+	}
+	return 0;
+}
+
+static int read_seq(struct suite *s) {
+	size_t i;
+	for (i = 0; i < s->tree->count; i++) {
+		struct bench_file *f = &s->tree->files[i];
+		off_t offset = 0;
+		if (f->isdir) continue;
+		while ((size_t)offset < f->size) {
+			double start = bench_now();
+			ssize_t n = fatx_read_file(s->info, f->path, s->buffer, s->chunk, offset);
+			if (n <= 0 || record_op(s, start, n) < 0) return -1;
+			offset += n;
+		}
+	}
+	return 0;
+}
+
+static int read_rand(struct suite *s) {
+	size_t *files = malloc(s->tree->count * sizeof(size_t)), count = 0, i;
+	int ret = 0;
+	if (files == NULL) return -1;
+	for (i = 0; i < s->tree->count; i++) {
+		if (!s->tree->files[i].isdir && s->tree->files[i].size > 0) files[count++] = i;
+	}
+	for (i = 0; count > 0 && i < s->random_reads; i++) {
+		struct bench_file *f = &s->tree->files[files[next_random(s) % count]];
+		off_t offset = next_random(s) % f->size;
+		double start = bench_now();
+		ssize_t n = fatx_read_file(s->info, f->path, s->buffer, s->chunk, offset);
+		if (n <= 0 || record_op(s, start, n) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	free(files);
+	return ret;
+}
+
+struct crawl_names {
+	char **names;
+	size_t count;
+};
+
+static int crawl_add(const fatx_file_record *record, off_t next, void *user) {
+	struct crawl_names *names = user;
+	char **p = realloc(names->names, (names->count + 1) * sizeof(char *));
+	(void) next;
+	if (p == NULL) return 1;
+	names->names = p;
+	names->names[names->count++] = strdup(record->name);
+	return 0;
+}
+
+static int crawl_dir(struct suite *s, const char *path) {
+	struct crawl_names names = { NULL, 0 };
+	fatx_file_record record;
+	char child[1024];
+	double start = bench_now();
+	size_t i;
+	int ret = fatx_list_dir(s->info, path, 0, crawl_add, &names);
+	if (ret >= 0) ret = record_op(s, start, 0);
+	for (i = 0; i < names.count; i++) {
+		snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", names.names[i]);
+		if (ret >= 0) {
+			start = bench_now();
+			ret = fatx_read_file_record(&record, s->info, child);
+			if (ret >= 0) ret = record_op(s, start, 0);
+			if (ret >= 0 && record.isdir) ret = crawl_dir(s, child);
+		}
+		free(names.names[i]);
+	}
+	free(names.names);
+	return ret < 0 ? -1 : 0;
+}
+
+static int crawl(struct suite *s) {
+	int round;
+	for (round = 0; round < s->rounds; round++) {
+		if (crawl_dir(s, "/") < 0) return -1;
+	}
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct suite *s);
+} workloads[] = {
+	{ "lookup", lookup },
+	{ "list", list },
+	{ "read_seq", read_seq },
+	{ "read_rand", read_rand },
+	{ "crawl", crawl }
+};
+
+static int run_workload(struct suite *s, size_t w) {
+	size_t syscalls = bench_syscalls();
+	double start = bench_now(), seconds;
+	s->ops = 0;
+	s->bytes = 0;
+	if (workloads[w].run(s) < 0) {
+		fprintf(stderr, "bench-suite: %s failed on %s\n", workloads[w].name, s->image);
+		bench_latency_free(&s->latency);
+		return -1;
+	}
+	seconds = bench_now() - start;
+	syscalls = bench_syscalls() - syscalls - s->syscall_overhead;
+	printf("{\"image\": \"%s\", \"engine\": \"%s\", \"workload\": \"%s\", \"ops\": %zu, "
+			"\"bytes\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"syscalls\": %zu, \"syscalls_per_op\": %.3f, \"p50_us\": %.2f, \"p99_us\": %.2f}\n",
+			s->image, s->engine, workloads[w].name, s->ops, s->bytes, seconds,
+			s->ops / seconds, s->bytes / seconds / 1e6, syscalls,
+			s->ops ? (double)syscalls / s->ops : 0.0,
+			bench_latency_percentile(&s->latency, 50) * 1e6,
+			bench_latency_percentile(&s->latency, 99) * 1e6);
+	fflush(stdout);
+	bench_latency_free(&s->latency);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-e sync|mmap|io_uring] [-C] [-b read_size] [-n random_reads]\n"
+			"       [-r rounds] [-s seed] [-w workload] image...\n"
+			"-C turns the extent, dentry and directory index caches off.\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct suite s;
+	fatx_fs_options opts;
+	const char *only = NULL;
+	size_t w;
+	int c, ret = 0;
+	memset(&s, 0, sizeof(s));
+	fatx_fs_options_init(&opts);
+	opts.read_only = 1;
+	s.engine = "sync";
+	s.chunk = 64 * 1024;
+	s.random_reads = 10000;
+	s.rounds = 3;
+	s.rng = 88172645463325252ULL;
+	while ((c = getopt(argc, argv, "e:Cb:n:r:s:w:")) != -1) {
+		switch (c) {
+		case 'e':
+			s.engine = optarg;
+			if (strcmp(optarg, "sync") == 0) opts.io_engine = FATX_IO_SYNC;
+			else if (strcmp(optarg, "mmap") == 0) opts.io_engine = FATX_IO_MMAP;
+			else if (strcmp(optarg, "io_uring") == 0) opts.io_engine = FATX_IO_URING;
+			else usage(argv[0]);
+			break;
+		case 'C':
+			opts.extent_cache_size = 0;
+			opts.dentry_cache_size = 0;
+			opts.dir_index_cache_size = 0;
+			break;
+		case 'b':
+			s.chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			s.random_reads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			s.rounds = atoi(optarg);
+			break;
+		case 's':
+			s.rng = strtoull(optarg, NULL, 0) * 2654435761ULL + 1;
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || s.chunk == 0 || s.rounds <= 0) usage(argv[0]);
+	s.buffer = malloc(s.chunk);
+	if (s.buffer == NULL) return 1;
+	s.syscall_overhead = bench_syscalls();
+	s.syscall_overhead = bench_syscalls() - s.syscall_overhead;
+	for (; optind < argc && ret == 0; optind++) {
+		struct bench_tree tree = { 0 };
+		s.image = argv[optind];
+		s.info = fatx_fs_init_opts(s.image, &opts);
+		if (s.info == NULL) return 1;
+		s.engine = fatx_io_engine_name(s.info);
+		if (bench_collect(s.info, "/", &tree) < 0) {
+			fprintf(stderr, "bench-suite: Error walking %s\n", s.image);
+			return 1;
+		}
+		s.tree = &tree;
+		for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]) && ret == 0; w++) {
+			if (only != NULL && strcmp(only, workloads[w].name) != 0) continue;
+			ret = run_workload(&s, w);
+		}
+		bench_tree_free(&tree);
+		fatx_fs_end(s.info);
+	}
+	free(s.buffer);
+	return ret < 0 ? 1 : 0;
+}
@@ -17,6 +17,7 @@
  */
 
 #include <fatx.h>
+#include "fatx_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -26,61 +27,23 @@
 #include <libgen.h>
 #include <endian.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
-
-#define FATX_MAGIC 0x46415458
-#define max(a, b) (((a) > (b)) ? (a) : (b))
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
 
 const char *delimiter = "/";
 
-struct fatx_fs_info {
-	int fd;
-	int endianness;
-	size_t width;
-	int mode;
-	off_t fat_offset;
-	size_t fat_size;
-	off_t end;
-	size_t size;
-	off_t root_dir;
-};
-
-struct fatx_internal_file_record {
-	uint8_t name_length;
-	uint8_t attributes;
-	uint8_t name[42];
-	uint32_t first_cluster;
-	uint32_t size;
-	uint32_t modified_time;
-	uint32_t created_time;
-	uint32_t accessed_time;
-}__attribute__((packed));
-
-#define fatx_warn_corruption(fmt, ...) fprintf(stderr, "libfatx: Warning: Possible filesystem corruption:\n" fmt "\n(file: %s, line: %d)\n", __VA_ARGS__, __FILE__, __LINE__)
-
-/**
- * Converts a name from a FATX record into ansi format (null-terminated).
- * A FATX name cannot be more than 42 characters, which means an ansi_name
- * allocated to 43 characters will fit any FATX name.
- */
-static void fatx_name_fatx2ansi(char *ansi_name, uint8_t *fatx_name, int length) {
-	int i;
-	if (length > 42) length = 42;
-	for (i = 0; i < length; i++) {
-		ansi_name[i] = fatx_name[i];
-	}
-	ansi_name[length] = 0;
-}
-
 /**
  * Converts a name from ansi format into a FATX record (followed by 42-len FF bytes)
  * A FATX name cannot be more than 42 characters, which means that excess characters
  * in ansi_name will be dropped. The length field in a FATX file record will need to
  * be updated.
  */
-static void fatx_name_ansi2fatx(uint8_t *fatx_name, char *ansi_name, int *length) {
+void fatx_name_ansi2fatx(uint8_t *fatx_name, const char *ansi_name, int *length) {
 	int i;
 	*length = strlen(ansi_name);
 	if ((unsigned int)(*length) > 42) *length = 42;
@@ -92,18 +55,82 @@ static void fatx_name_ansi2fatx(uint8_t *fatx_name, char *ansi_name, int *length
 	}
 }
 
-static time_t fatx_time_fatx2unix(uint32_t time) {
-	struct tm t;
-	t.tm_year = (time >> 25) + 80;
-	t.tm_mon = ((time >> 21) & 0xF) - 1;
-	t.tm_mday = (time >> 16) & 0x1F;
-	t.tm_hour = (time >> 11) & 0x1F;
-	t.tm_min = (time >> 5) & 0x3F;
-	t.tm_sec = time & 0x1F;
-	return mktime(&t);
+/**
+ * Days of local time already converted by fatx_time_fatx2unix. Each slot
+ * packs a key (the TZ generation and the FATX date, time >> 16, plus one)
+ * into the top 46 bits and that day's offset from UTC, biased to be
+ * positive, into the rest, so it can be read and written atomically
+ * without a lock. A day whose offset isn't the same at both ends has a
+ * DST change in it and is never cached.
+ */
+#define FATX_TIME_DAYS 1024
+#define FATX_TIME_OFFSET_BITS 18
+#define FATX_TIME_OFFSET_BIAS (1L << (FATX_TIME_OFFSET_BITS - 1))
+static uint64_t fatx_time_days[FATX_TIME_DAYS];
+static uint32_t fatx_time_generation;
+static const char *fatx_time_tz; // the TZ fatx_time_generation is for
+static pthread_mutex_t fatx_time_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns the generation of the cached days, starting a new one whenever
+ * TZ has been changed since the last call.
+ */
+static uint32_t fatx_time_zone(void) {
+	const char *tz = getenv("TZ");
+	if (tz != __atomic_load_n(&fatx_time_tz, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&fatx_time_lock);
+		if (tz != fatx_time_tz) {
+			__atomic_add_fetch(&fatx_time_generation, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&fatx_time_tz, tz, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&fatx_time_lock);
+	}
+	return __atomic_load_n(&fatx_time_generation, __ATOMIC_RELAXED);
+}
+
+static void fatx_time_tm(uint32_t time, int hour, int min, int sec, struct tm *t) {
+	memset(t, 0, sizeof(struct tm));
+	t->tm_year = (time >> 25) + 80;
+	t->tm_mon = ((time >> 21) & 0xF) - 1;
+	t->tm_mday = (time >> 16) & 0x1F;
+	t->tm_hour = hour;
+	t->tm_min = min;
+	t->tm_sec = sec;
+	t->tm_isdst = -1;
+}
+
+/**
+ * Converts a FATX timestamp (local time) to unix time. mktime takes the
+ * timezone lock and does a lot of work, and every record has three of
+ * these, so it is only called the first time a day is seen; after that
+ * the local time is taken as UTC and the day's offset subtracted.
+ */
+time_t fatx_time_fatx2unix(uint32_t time) {
+	uint32_t day = time >> 16;
+	uint64_t key = ((uint64_t)(fatx_time_zone() & 0x1FFFFFFF) << 16 | day) + 1;
+	uint64_t *slot = &fatx_time_days[(day * 2654435761u) >> 22];
+	uint64_t cached = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	long offset;
+	time_t ret;
+	struct tm t, start, end;
+	fatx_time_tm(time, (time >> 11) & 0x1F, (time >> 5) & 0x3F, time & 0x1F, &t);
+	if (cached >> FATX_TIME_OFFSET_BITS == key) {
+		offset = (long)(cached & ((UINT64_C(1) << FATX_TIME_OFFSET_BITS) - 1)) - FATX_TIME_OFFSET_BIAS;
+		return timegm(&t) - offset;
+	}
+	ret = mktime(&t);
+	if (ret == (time_t)-1) return ret;
+	fatx_time_tm(time, 0, 0, 0, &start);
+	fatx_time_tm(time, 23, 59, 59, &end);
+	if (mktime(&start) != (time_t)-1 && mktime(&end) != (time_t)-1 && start.tm_gmtoff == end.tm_gmtoff &&
+			start.tm_gmtoff > -FATX_TIME_OFFSET_BIAS && start.tm_gmtoff < FATX_TIME_OFFSET_BIAS) {
+		__atomic_store_n(slot, key << FATX_TIME_OFFSET_BITS | (uint64_t)(start.tm_gmtoff + FATX_TIME_OFFSET_BIAS),
+				__ATOMIC_RELAXED);
+	}
+	return ret;
 }
 
-static uint32_t fatx_time_unix2fatx(time_t time) {
+uint32_t fatx_time_unix2fatx(time_t time) {
 	uint32_t ret;
 	struct tm t;
 	ret = 0;
@@ -120,159 +147,607 @@ static uint32_t fatx_time_unix2fatx(time_t time) {
 	return ret;
 }
 
-static inline uint32_t fatx_read_int(fatx_fs_info *info, off_t offset);
-static inline uint16_t fatx_read_short(fatx_fs_info *info, off_t offset);
-
 static inline off_t fatx_next_cluster_offset(fatx_fs_info *info, off_t offset);
 
-int fatx_find_file_offsets(fatx_file_offsets *offsets,
-		fatx_fs_info *info, const char *path) {
-	char *d_path, *save_ptr, *token, name[43];
-	int i;
-	off_t record_offset, data_offset;
-	struct fatx_internal_file_record records[256];
-	if (!strcmp(delimiter, path)) { // root directory, has no record
-		offsets->record_offset = -1;
-		offsets->data_offset = info->root_dir;
-		return 0;
+static int fatx_pread_full(int fd, void *buffer, size_t size, off_t offset);
+static int fatx_extent_cache_init(fatx_fs_info *info, size_t limit);
+static void fatx_extent_cache_free(struct fatx_extent_cache *cache);
+
+/**
+ * Fills file_record from an on-disk record.
+ */
+int fatx_decode_record(fatx_fs_info *info, struct fatx_internal_file_record *ifr,
+		fatx_file_record *file_record) {
+	info->geometry->decode_record(ifr, file_record);
+	return 0;
+}
+
+/**
+ * Fills entry with the root directory, which has no record of its own.
+ */
+void fatx_dirent_root(fatx_fs_info *info, struct fatx_dirent *entry) {
+	(void) info; // the root is the same on every partition
+	memset(entry, 0, sizeof(struct fatx_dirent));
+	entry->record_offset = -1;
+	entry->first_cluster = 1;
+	entry->attributes = 0x10;
+	entry->record.name[0] = '/';
+	entry->record.isdir = 1;
+}
+
+static inline uint32_t fatx_dentry_hash(uint32_t parent, const char *folded, size_t length) {
+	uint32_t hash = 2166136261u ^ parent;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= (uint8_t)folded[i];
+		hash *= 16777619u;
 	}
-	d_path = strdupa(path);
-	data_offset = info->root_dir;
-	token = strtok_r(d_path, delimiter, &save_ptr);
-	if (token == NULL) return -1;
-	do {
-		while (1) {
-			size_t read = pread(info->fd, records, sizeof(records), data_offset);
-			for (i = 0; i < 256; i++) {
-				if (records[i].name_length == 0xFF) {
-					return -1;
-				} else if (records[i].name_length == 0xE5) { // deleted file, skip
-					continue;
-				} else if (records[i].name_length > 42) {
-					fatx_warn_corruption("Filename length is an invalid value (possible that we stepped into a file somehow)\nname_length: %d", records[i].name_length);
-					return -1;
-				}
-				fatx_name_fatx2ansi(name, records[i].name, records[i].name_length);
-				if ((strlen(token) == records[i].name_length) && (!strcasecmp(token, name))) {
-					record_offset = (off_t) (sizeof(struct fatx_internal_file_record) * i) + data_offset;
-					if (info->endianness == BIG_ENDIAN) data_offset = be32toh(records[i].first_cluster) - 1;
-					if (info->endianness == LITTLE_ENDIAN) data_offset = le32toh(records[i].first_cluster) - 1;
-					data_offset <<= 14;
-					data_offset += info->root_dir;
-					break;
-				}
-			}
-			if ((strlen(token) == records[i].name_length) && (!strcasecmp(token, name))) {
-				break;
+	return hash;
+}
+
+static int fatx_dentry_cache_init(fatx_fs_info *info, size_t limit) {
+	struct fatx_dentry_cache *cache;
+	if (limit == 0) return 0;
+	cache = calloc(1, sizeof(struct fatx_dentry_cache));
+	if (cache == NULL) return -1;
+	cache->limit = limit;
+	cache->bucket_count = 1;
+	while (cache->bucket_count < limit) cache->bucket_count <<= 1;
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct fatx_dentry *));
+	if (cache->buckets == NULL) {
+		free(cache);
+		return -1;
+	}
+	pthread_rwlock_init(&cache->lock, NULL);
+	info->dentry_cache = cache;
+	return 0;
+}
+
+/**
+ * Removes dentry from the cache and frees it. Called with the lock held
+ * for writing.
+ */
+static void fatx_dentry_cache_unlink(struct fatx_dentry_cache *cache, struct fatx_dentry *dentry) {
+	struct fatx_dentry **p = &cache->buckets[dentry->hash & (cache->bucket_count - 1)];
+	while (*p != dentry) p = &(*p)->hash_next;
+	*p = dentry->hash_next;
+	fatx_lru_remove(&cache->lru, &dentry->lru);
+	free(dentry);
+}
+
+static void fatx_dentry_cache_free(struct fatx_dentry_cache *cache) {
+	if (cache == NULL) return;
+	while (cache->lru.head) {
+		fatx_dentry_cache_unlink(cache, fatx_lru_entry(cache->lru.head, struct fatx_dentry, lru));
+	}
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+static struct fatx_dentry *fatx_dentry_cache_find(struct fatx_dentry_cache *cache, uint32_t parent,
+		const char *folded, size_t length, uint32_t hash) {
+	struct fatx_dentry *dentry = cache->buckets[hash & (cache->bucket_count - 1)];
+	while (dentry != NULL && (dentry->parent != parent || dentry->name_length != length ||
+			memcmp(dentry->name, folded, length))) {
+		dentry = dentry->hash_next;
+	}
+	return dentry;
+}
+
+/**
+ * Looks up a cached name in the directory starting at parent.
+ * Returns 1 and fills entry on a hit, 0 on a negative hit (the name is
+ * known not to exist) and -1 if nothing is cached.
+ */
+static int fatx_dentry_cache_get(fatx_fs_info *info, uint32_t parent,
+		const char *folded, size_t length, uint32_t hash, struct fatx_dirent *entry) {
+	struct fatx_dentry_cache *cache = info->dentry_cache;
+	struct fatx_dentry *dentry;
+	int ret = -1;
+	if (cache == NULL) return -1;
+	pthread_rwlock_rdlock(&cache->lock);
+	dentry = fatx_dentry_cache_find(cache, parent, folded, length, hash);
+	if (dentry != NULL) {
+		fatx_lru_touch(&dentry->lru);
+		if (dentry->negative) {
+			ret = 0;
+		} else {
+			*entry = dentry->entry;
+			ret = 1;
+		}
+	}
+	pthread_rwlock_unlock(&cache->lock);
+	return ret;
+}
+
+/**
+ * Remembers the result of a lookup. entry is NULL for names that don't
+ * exist. Nothing is added if entries have been dropped since the lookup
+ * started (generation was read before it), as the result may be stale.
+ */
+static void fatx_dentry_cache_add(fatx_fs_info *info, uint32_t parent,
+		const char *folded, size_t length, uint32_t hash, struct fatx_dirent *entry,
+		uint64_t generation) {
+	struct fatx_dentry_cache *cache = info->dentry_cache;
+	struct fatx_dentry *dentry, **bucket;
+	if (cache == NULL) return;
+	dentry = malloc(sizeof(struct fatx_dentry));
+	if (dentry == NULL) return;
+	dentry->parent = parent;
+	dentry->hash = hash;
+	dentry->name_length = length;
+	memcpy(dentry->name, folded, length);
+	dentry->negative = (entry == NULL);
+	if (entry != NULL) dentry->entry = *entry;
+	pthread_rwlock_wrlock(&cache->lock);
+	if (cache->generation != generation ||
+			fatx_dentry_cache_find(cache, parent, folded, length, hash) != NULL) { // another thread beat us to it
+		pthread_rwlock_unlock(&cache->lock);
+		free(dentry);
+		return;
+	}
+	if (cache->lru.count >= cache->limit) {
+		fatx_dentry_cache_unlink(cache, fatx_lru_entry(fatx_lru_victim(&cache->lru), struct fatx_dentry, lru));
+	}
+	bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+	dentry->hash_next = *bucket;
+	*bucket = dentry;
+	fatx_lru_push(&cache->lru, &dentry->lru);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Drops what the dentry cache knows about name in the directory starting
+ * at parent, after the directory has been changed.
+ */
+void fatx_dentry_forget(fatx_fs_info *info, uint32_t parent, const char *name) {
+	struct fatx_dentry_cache *cache = info->dentry_cache;
+	struct fatx_dentry *dentry;
+	char folded[FATX_FOLDED_NAME_SIZE] = { 0 };
+	size_t i, length = strlen(name);
+	uint32_t hash;
+	if (cache == NULL || length > 42) return;
+	for (i = 0; i < length; i++) folded[i] = tolower((unsigned char)name[i]);
+	hash = fatx_dentry_hash(parent, folded, length);
+	pthread_rwlock_wrlock(&cache->lock);
+	__atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+	dentry = fatx_dentry_cache_find(cache, parent, folded, length, hash);
+	if (dentry != NULL) fatx_dentry_cache_unlink(cache, dentry);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Drops every name cached under the directory starting at parent, which
+ * has been removed (so its cluster may come back as another directory).
+ */
+void fatx_dentry_forget_parent(fatx_fs_info *info, uint32_t parent) {
+	struct fatx_dentry_cache *cache = info->dentry_cache;
+	struct fatx_lru_node *node, *next;
+	if (cache == NULL) return;
+	pthread_rwlock_wrlock(&cache->lock);
+	__atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+	for (node = cache->lru.head; node != NULL; node = next) {
+		struct fatx_dentry *dentry = fatx_lru_entry(node, struct fatx_dentry, lru);
+		next = node->next;
+		if (dentry->parent == parent) fatx_dentry_cache_unlink(cache, dentry);
+	}
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+static inline uint32_t fatx_name_hash(const uint8_t *name, size_t length) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= (uint8_t)tolower(name[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void fatx_dir_index_put(struct fatx_dir_index *index) {
+	if (index == NULL || __atomic_sub_fetch(&index->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	free(index->records);
+	free(index->classes);
+	free(index->cluster_offsets);
+	free(index->slots);
+	free(index);
+}
+
+/**
+ * Reads every cluster of the directory index is for up to its end marker
+ * and classifies the records. Returns 0 or -1.
+ */
+static int fatx_dir_index_read(fatx_fs_info *info, struct fatx_dir_index *index) {
+	size_t allocated = 0, clusters = 0, stop;
+	off_t data_offset = fatx_cluster_offset(info, index->cluster);
+	while (1) {
+		struct fatx_internal_file_record *records;
+		if (clusters == allocated) {
+			void *p;
+			allocated = allocated ? allocated * 2 : 1;
+			p = realloc(index->records, allocated * FATX_CLUSTER_SIZE);
+			if (p == NULL) return -1;
+			index->records = p;
+			p = realloc(index->classes, allocated * FATX_RECORDS_PER_CLUSTER);
+			if (p == NULL) return -1;
+			index->classes = p;
+			p = realloc(index->cluster_offsets, allocated * sizeof(off_t));
+			if (p == NULL) return -1;
+			index->cluster_offsets = p;
+		}
+		records = index->records + clusters * FATX_RECORDS_PER_CLUSTER;
+		if (fatx_read_meta(info, records, FATX_CLUSTER_SIZE, data_offset) < 0) return -1;
+		index->cluster_offsets[clusters++] = data_offset;
+		index->clusters = clusters;
+		fatx_count(info, FATX_STAT_DIR_CLUSTERS, 1);
+		stop = fatx_scan->classify(records, FATX_RECORDS_PER_CLUSTER,
+				index->classes + index->count);
+		index->count += stop;
+		if (stop < FATX_RECORDS_PER_CLUSTER) {
+			if (records[stop].name_length != 0xFF) {
+				fatx_warn_corruption("Filename length is an invalid value (possible that we stepped into a file somehow)\nname_length: %d", records[stop].name_length);
+				index->corrupt = 1;
 			}
-			data_offset = fatx_next_cluster_offset(info, data_offset);
-			if (data_offset < 0) return -1;
+			return 0;
 		}
-	} while ((token = strtok_r(NULL, delimiter, &save_ptr)) != NULL);
-	offsets->record_offset = record_offset;
-	offsets->data_offset = data_offset; // you can see that there's problems if sizeof(off_t) < 64 bits
-	return 0;
+		if (clusters > info->fat_size) {
+			fatx_warn_corruption("Directory cluster chain loops\ncluster: %u", index->cluster);
+			return -1;
+		}
+		data_offset = fatx_next_cluster_offset(info, data_offset);
+		if (data_offset == -2) return 0;
+		if (data_offset < 0) return -1;
+	}
 }
 
-int fatx_read_file_record(fatx_file_record *file_record,
-		fatx_fs_info *info, const char *path) {
-	fatx_file_offsets offsets;
-	memset(file_record, 0, sizeof(fatx_file_record));
-	int ret = fatx_find_file_offsets(&offsets, info, path);
-	if (ret < 0) return ret;
-	struct fatx_internal_file_record internal_file_record;
-	if (offsets.record_offset == -1 && offsets.data_offset == info->root_dir) {
-		file_record->name[0] = '/';
-		file_record->name[1] = 0;
-		file_record->isdir = 1;
-		return 0;
+/**
+ * Reads the directory starting at cluster, from the sidecar if there is
+ * one, and hashes the live names.
+ */
+struct fatx_dir_index *fatx_dir_index_build(fatx_fs_info *info, uint32_t cluster) {
+	struct fatx_dir_index *index;
+	size_t live = 0, i;
+	index = calloc(1, sizeof(struct fatx_dir_index));
+	if (index == NULL) return NULL;
+	index->cluster = cluster;
+	index->refs = 1;
+	if (fatx_sidecar_dir(info, cluster, index) < 0 && fatx_dir_index_read(info, index) < 0) goto fail;
+	for (i = 0; i < index->count; i++) {
+		if (index->classes[i] == FATX_RECORD_LIVE) live++;
 	}
-	size_t read = pread(info->fd, &internal_file_record,
-			sizeof(struct fatx_internal_file_record), offsets.record_offset);
-	if (read != sizeof(struct fatx_internal_file_record)) { return -1; }
-	fatx_name_fatx2ansi(file_record->name, internal_file_record.name,
-			internal_file_record.name_length);
-	if (internal_file_record.attributes & 0x10) {
-		file_record->isdir = 1;
-	} else {
-		file_record->isdir = 0;
-	}
-	if (info->endianness == LITTLE_ENDIAN) {
-		file_record->size = (size_t) le32toh(internal_file_record.size);
-		file_record->modified = fatx_time_fatx2unix(le32toh(internal_file_record.modified_time));
-		file_record->created = fatx_time_fatx2unix(le32toh(internal_file_record.created_time));
-		file_record->accessed = fatx_time_fatx2unix(le32toh(internal_file_record.accessed_time));
-	} else if (info->endianness == BIG_ENDIAN) {
-		file_record->size = (size_t) be32toh(internal_file_record.size);
-		file_record->modified = fatx_time_fatx2unix(be32toh(internal_file_record.modified_time));
-		file_record->created = fatx_time_fatx2unix(be32toh(internal_file_record.created_time));
-		file_record->accessed = fatx_time_fatx2unix(be32toh(internal_file_record.accessed_time));
-	} else {
+	index->mask = 15;
+	while (index->mask + 1 < live * 2) index->mask = (index->mask << 1) | 1;
+	index->slots = calloc(index->mask + 1, sizeof(struct fatx_dir_index_slot));
+	if (index->slots == NULL) goto fail;
+	for (i = 0; i < index->count; i++) {
+		uint32_t hash, slot;
+		if (index->classes[i] != FATX_RECORD_LIVE) continue;
+		hash = fatx_name_hash(index->records[i].name, index->records[i].name_length);
+		slot = hash & index->mask;
+		while (index->slots[slot].record != 0) slot = (slot + 1) & index->mask;
+		index->slots[slot].hash = hash;
+		index->slots[slot].record = i + 1;
+	}
+	return index;
+fail:
+	fatx_dir_index_put(index);
+	return NULL;
+}
+
+/**
+ * Returns the index of the record named folded (lowercased and zero
+ * padded to FATX_FOLDED_NAME_SIZE), or -1 if there is none. Names that
+ * appear twice resolve to the first record, like a linear scan would.
+ */
+static ssize_t fatx_dir_index_find(struct fatx_dir_index *index, const uint8_t *folded,
+		size_t length) {
+	uint32_t hash = fatx_name_hash(folded, length);
+	uint32_t slot = hash & index->mask;
+	while (index->slots[slot].record != 0) {
+		if (index->slots[slot].hash == hash &&
+				fatx_scan->name_equal(&index->records[index->slots[slot].record - 1], folded, length)) {
+			return index->slots[slot].record - 1;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+	return -1;
+}
+
+static int fatx_dir_index_cache_init(fatx_fs_info *info, size_t limit) {
+	struct fatx_dir_index_cache *cache;
+	if (limit == 0) return 0;
+	cache = calloc(1, sizeof(struct fatx_dir_index_cache));
+	if (cache == NULL) return -1;
+	cache->limit = limit;
+	cache->bucket_count = 1;
+	while (cache->bucket_count < limit) cache->bucket_count <<= 1;
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct fatx_dir_index *));
+	if (cache->buckets == NULL) {
+		free(cache);
 		return -1;
 	}
+	pthread_rwlock_init(&cache->lock, NULL);
+	info->dir_index_cache = cache;
 	return 0;
 }
 
 /**
- * Reads a short from a given offset without moving the file marker.
+ * Removes index from the cache and drops the cache's reference to it.
+ * Called with the lock held for writing.
  */
-static inline uint16_t fatx_read_short_fd(int fd, off_t offset) {
-	uint16_t ret;
-	size_t read = pread(fd, &ret, sizeof(uint16_t), offset);
-	return ret;
+static void fatx_dir_index_cache_unlink(struct fatx_dir_index_cache *cache, struct fatx_dir_index *index) {
+	struct fatx_dir_index **p = &cache->buckets[index->cluster & (cache->bucket_count - 1)];
+	while (*p != index) p = &(*p)->hash_next;
+	*p = index->hash_next;
+	fatx_lru_remove(&cache->lru, &index->lru);
+	fatx_dir_index_put(index);
+}
+
+static void fatx_dir_index_cache_free(struct fatx_dir_index_cache *cache) {
+	if (cache == NULL) return;
+	while (cache->lru.head) {
+		fatx_dir_index_cache_unlink(cache, fatx_lru_entry(cache->lru.head, struct fatx_dir_index, lru));
+	}
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+static struct fatx_dir_index *fatx_dir_index_cache_find(struct fatx_dir_index_cache *cache, uint32_t cluster) {
+	struct fatx_dir_index *index = cache->buckets[cluster & (cache->bucket_count - 1)];
+	while (index != NULL && index->cluster != cluster) index = index->hash_next;
+	return index;
+}
+
+/**
+ * Returns a reference to the index of the directory starting at cluster,
+ * building it on first use. Drop it with fatx_dir_index_put.
+ */
+struct fatx_dir_index *fatx_dir_index_get(fatx_fs_info *info, uint32_t cluster) {
+	struct fatx_dir_index_cache *cache = info->dir_index_cache;
+	struct fatx_dir_index *index, *existing, **bucket;
+	uint64_t generation = 0;
+	if (cache != NULL) {
+		pthread_rwlock_rdlock(&cache->lock);
+		index = fatx_dir_index_cache_find(cache, cluster);
+		if (index != NULL) {
+			__atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+			fatx_lru_touch(&index->lru);
+		}
+		generation = cache->generation;
+		pthread_rwlock_unlock(&cache->lock);
+		fatx_count(info, index != NULL ? FATX_STAT_DIR_INDEX_HITS : FATX_STAT_DIR_INDEX_MISSES, 1);
+		if (index != NULL) return index;
+	}
+	index = fatx_dir_index_build(info, cluster);
+	if (index == NULL || cache == NULL) return index;
+	pthread_rwlock_wrlock(&cache->lock);
+	if (cache->generation != generation) { // the directory may have changed while it was read
+		pthread_rwlock_unlock(&cache->lock);
+		return index;
+	}
+	existing = fatx_dir_index_cache_find(cache, cluster);
+	if (existing != NULL) { // built by another thread in the meantime
+		__atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&cache->lock);
+		fatx_dir_index_put(index);
+		return existing;
+	}
+	if (cache->lru.count >= cache->limit) {
+		fatx_dir_index_cache_unlink(cache, fatx_lru_entry(fatx_lru_victim(&cache->lru), struct fatx_dir_index, lru));
+	}
+	bucket = &cache->buckets[cluster & (cache->bucket_count - 1)];
+	index->hash_next = *bucket;
+	*bucket = index;
+	fatx_lru_push(&cache->lru, &index->lru);
+	index->refs++;
+	pthread_rwlock_unlock(&cache->lock);
+	return index;
 }
 
 /**
- * Reads a short from a given offset without moving the file marker.
- * Takes into account the endianness of the filesystem.
+ * Drops the cached index of the directory starting at cluster, after the
+ * directory has been changed.
  */
-static inline uint16_t fatx_read_short(fatx_fs_info *info, off_t offset) {
-	uint16_t ret;
-	size_t read = pread(info->fd, &ret, sizeof(uint16_t), offset);
-	if (info->endianness == BIG_ENDIAN) ret = be32toh(ret);
-	if (info->endianness == LITTLE_ENDIAN) ret = le32toh(ret);
+void fatx_dir_index_forget(fatx_fs_info *info, uint32_t cluster) {
+	struct fatx_dir_index_cache *cache = info->dir_index_cache;
+	struct fatx_dir_index *index;
+	if (cache == NULL) return;
+	pthread_rwlock_wrlock(&cache->lock);
+	cache->generation++;
+	index = fatx_dir_index_cache_find(cache, cluster);
+	if (index != NULL) fatx_dir_index_cache_unlink(cache, index);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Fills entry from the record at index i of index, taking a newer copy of
+ * the record if it has been changed since the index was built. Returns
+ * -ENOENT if that copy is no longer a live record.
+ */
+int fatx_dir_index_entry(fatx_fs_info *info, struct fatx_dir_index *index, size_t i,
+		struct fatx_dirent *entry) {
+	struct fatx_internal_file_record *ifr = &index->records[i], fresh;
+	entry->record_offset = fatx_dir_index_record_offset(index, i);
+	if (fatx_record_refresh(info, entry->record_offset, &fresh)) {
+		if (fresh.name_length == 0 || fresh.name_length > 42) return -ENOENT;
+		ifr = &fresh;
+	}
+	entry->first_cluster = fatx_to_host32(info, ifr->first_cluster);
+	entry->attributes = ifr->attributes;
+	return fatx_decode_record(info, ifr, &entry->record);
+}
+
+/**
+ * Looks for name (lowercased into folded) in the directory starting at
+ * cluster. Returns 0 and fills entry if found, -ENOENT if the name isn't
+ * in the directory, or -1 on a read error or corruption.
+ */
+static int fatx_dir_index_lookup(fatx_fs_info *info, uint32_t cluster, const uint8_t *folded,
+		size_t length, struct fatx_dirent *entry) {
+	struct fatx_dir_index *index;
+	ssize_t i;
+	int ret;
+	index = fatx_dir_index_get(info, cluster);
+	if (index == NULL) return -1;
+	i = fatx_dir_index_find(index, folded, length);
+	if (i < 0) {
+		ret = index->corrupt ? -1 : -ENOENT;
+	} else {
+		ret = fatx_dir_index_entry(info, index, i, entry);
+	}
+	fatx_dir_index_put(index);
 	return ret;
 }
 
 /**
- * Reads an integer from a given offset without moving the file marker.
+ * Finds name in the directory starting at cluster, going through the
+ * dentry cache first. Same return values as fatx_dir_index_lookup.
  */
-static inline uint32_t fatx_read_int_fd(int fd, off_t offset) {
-	uint32_t ret;
-	size_t read = pread(fd, &ret, sizeof(uint32_t), offset);
+int fatx_dir_lookup(fatx_fs_info *info, uint32_t cluster, const char *name,
+		struct fatx_dirent *entry) {
+	char folded[FATX_FOLDED_NAME_SIZE] = { 0 };
+	struct fatx_internal_file_record fresh;
+	size_t i, length = strlen(name);
+	uint64_t generation = 0;
+	uint32_t hash;
+	int ret;
+	fatx_count(info, FATX_STAT_LOOKUPS, 1);
+	if (length > 42) return -ENOENT;
+	for (i = 0; i < length; i++) folded[i] = tolower((unsigned char)name[i]);
+	hash = fatx_dentry_hash(cluster, folded, length);
+	if (info->dentry_cache != NULL) {
+		generation = __atomic_load_n(&info->dentry_cache->generation, __ATOMIC_ACQUIRE);
+	}
+	ret = fatx_dentry_cache_get(info, cluster, folded, length, hash, entry);
+	if (info->dentry_cache != NULL) {
+		fatx_count(info, ret >= 0 ? FATX_STAT_DENTRY_HITS : FATX_STAT_DENTRY_MISSES, 1);
+	}
+	if (ret == 1) {
+		// the record's size or clusters may have changed since it was cached
+		if (!fatx_record_refresh(info, entry->record_offset, &fresh)) return 0;
+		if (fresh.name_length == 0 || fresh.name_length > 42) return -ENOENT;
+		entry->first_cluster = fatx_to_host32(info, fresh.first_cluster);
+		entry->attributes = fresh.attributes;
+		return fatx_decode_record(info, &fresh, &entry->record);
+	}
+	if (ret == 0) return -ENOENT;
+	ret = fatx_dir_index_lookup(info, cluster, (uint8_t *)folded, length, entry);
+	if (ret == 0) fatx_dentry_cache_add(info, cluster, folded, length, hash, entry, generation);
+	else if (ret == -ENOENT) fatx_dentry_cache_add(info, cluster, folded, length, hash, NULL, generation);
 	return ret;
 }
 
+/**
+ * Resolves path one component at a time from the root directory.
+ */
+static int fatx_resolve(fatx_fs_info *info, const char *path, struct fatx_dirent *entry) {
+	char *d_path, *save_ptr, *token;
+	int ret;
+	fatx_dirent_root(info, entry);
+	d_path = strdupa(path);
+	token = strtok_r(d_path, delimiter, &save_ptr);
+	while (token != NULL) {
+		if (!(entry->attributes & 0x10)) return -ENOTDIR;
+		ret = fatx_dir_lookup(info, entry->first_cluster, token, entry);
+		if (ret < 0) return ret;
+		token = strtok_r(NULL, delimiter, &save_ptr);
+	}
+	return 0;
+}
+
+int fatx_find_file_offsets(fatx_file_offsets *offsets,
+		fatx_fs_info *info, const char *path) {
+	struct fatx_dirent entry;
+	if (fatx_resolve(info, path, &entry) < 0) return -1;
+	offsets->record_offset = entry.record_offset;
+	offsets->data_offset = fatx_cluster_offset(info, entry.first_cluster); // you can see that there's problems if sizeof(off_t) < 64 bits
+	return 0;
+}
+
+int fatx_read_file_record(fatx_file_record *file_record,
+		fatx_fs_info *info, const char *path) {
+	struct fatx_dirent entry;
+	int ret;
+	memset(file_record, 0, sizeof(fatx_file_record));
+	ret = fatx_resolve(info, path, &entry);
+	if (ret < 0) return ret;
+	*file_record = entry.record;
+	return 0;
+}
+
+/**
+ * Reads the record at record_offset (as found in a fatx_dirent) straight
+ * from disk; -1 gives the root directory. Returns -ENOENT if the record
+ * has been deleted or isn't a record, or -1 on a read error.
+ */
+int fatx_read_dirent(fatx_fs_info *info, off_t record_offset, struct fatx_dirent *entry) {
+	struct fatx_internal_file_record ifr;
+	if (record_offset == -1) {
+		fatx_dirent_root(info, entry);
+		return 0;
+	}
+	if (record_offset < info->root_dir || record_offset >= info->end ||
+			(record_offset - info->root_dir) % sizeof(ifr) != 0) {
+		return -ENOENT;
+	}
+	if (fatx_read_meta(info, &ifr, sizeof(ifr), record_offset) < 0) return -1;
+	if (ifr.name_length == 0 || ifr.name_length > 42) return -ENOENT;
+	entry->record_offset = record_offset;
+	entry->first_cluster = fatx_to_host32(info, ifr.first_cluster);
+	entry->attributes = ifr.attributes;
+	return fatx_decode_record(info, &ifr, &entry->record);
+}
+
+/**
+ * Finds name in the directory dir. Returns 0 and fills entry if found,
+ * -ENOENT if it isn't there, -ENOTDIR if dir isn't a directory, or -1 on a
+ * read error or corruption.
+ */
+int fatx_lookup(fatx_fs_info *info, const struct fatx_dirent *dir, const char *name,
+		struct fatx_dirent *entry) {
+	if (!(dir->attributes & 0x10)) return -ENOTDIR;
+	return fatx_dir_lookup(info, dir->first_cluster, name, entry);
+}
+
+/**
+ * Finds the entry at path. Same return values as fatx_lookup.
+ */
+int fatx_lookup_path(fatx_fs_info *info, const char *path, struct fatx_dirent *entry) {
+	return fatx_resolve(info, path, entry);
+}
+
 /**
  * Reads an integer from a given offset without moving the file marker.
- * Takes into account the endianness of the filesystem.
  */
-static inline uint32_t fatx_read_int(fatx_fs_info *info, off_t offset) {
-	uint32_t ret;
-	size_t read = pread(info->fd, &ret, sizeof(uint32_t), offset);
-	if (info->endianness == BIG_ENDIAN) ret = be32toh(ret);
-	if (info->endianness == LITTLE_ENDIAN) ret = le32toh(ret);
+static inline uint32_t fatx_read_int_fd(int fd, off_t offset) {
+	uint32_t ret = 0;
+	size_t read = pread(fd, &ret, sizeof(uint32_t), offset);
 	return ret;
 }
 
 /**
  * FATX doesn't have any information in the header realating to the size of the
  * filesystem or the location of the root directory. Instead, this information is
- * calculated based off of the size of the partition/drive.
+ * calculated based off of the size of the partition/drive. All offsets kept in
+ * info are from the start of the device, not of the partition.
  */
-static inline void fatx_calc_size_and_table_offset(fatx_fs_info *info) {
-	off_t here = lseek(info->fd, 0, SEEK_CUR);
-	info->fat_offset = (off_t) 0x1000;
-	info->end = lseek(info->fd, 0, SEEK_END);
-	info->width = (info->end < 0x3FFF4000) ? sizeof(uint16_t) : sizeof(uint32_t);
+static inline void fatx_calc_size_and_table_offset(fatx_fs_info *info, off_t offset, off_t length) {
+	info->fat_offset = offset + (off_t) 0x1000;
+	info->end = offset + length;
+	info->width = (length < 0x3FFF4000) ? sizeof(uint16_t) : sizeof(uint32_t);
 	if (info->width == sizeof(uint32_t)) {
-		info->root_dir = -(-((info->end >> 12) + 1) & INT64_C(-0x1000)) + info->fat_offset;
+		info->root_dir = -(-((length >> 12) + 1) & INT64_C(-0x1000)) + info->fat_offset;
 	} else if (info->width == sizeof(uint16_t)) {
-		info->root_dir = -(-((info->end >> 13) + 1) & INT64_C(-0x1000)) + info->fat_offset;
+		info->root_dir = -(-((length >> 13) + 1) & INT64_C(-0x1000)) + info->fat_offset;
 	}
 	info->size = info->end - info->root_dir;
 	info->fat_size = info->size >> 14;
-	lseek(info->fd, here, SEEK_SET);
+	info->fat_entries = min((size_t)(info->fat_size + 1),
+			(size_t)(info->root_dir - info->fat_offset) / info->width);
+	info->cluster_limit = min(info->fat_entries,
+			(size_t)((info->width == sizeof(uint32_t)) ? 0xFFFFFF0 : 0xFFF0));
 }
 
 /**
@@ -281,8 +756,8 @@ static inline void fatx_calc_size_and_table_offset(fatx_fs_info *info) {
  * or -1 if it is not a fatx partition. (BIG_ENDIAN and LITTLE_ENDIAN
  * are defined in endian.h)
  */
-static inline int fatx_find_endianness(int fd) {
-	uint32_t magic = fatx_read_int_fd(fd, 0);
+static inline int fatx_find_endianness(int fd, off_t offset) {
+	uint32_t magic = fatx_read_int_fd(fd, offset);
 	/*
 	 * Little endian partitions have FATX as their magic identifier.
 	 * Since the code was never changed, big endian partitions have XTAF.
@@ -296,187 +771,1540 @@ static inline int fatx_find_endianness(int fd) {
 	return -1;
 }
 
-static uint32_t fatx_next_cluster(fatx_fs_info *info, uint32_t cluster);
-
-static inline off_t fatx_next_cluster_offset(fatx_fs_info *info, off_t offset) {
-	off_t ret;
-	ret = (off_t)(fatx_next_cluster(info, ((offset - info->root_dir) >> 14) + 1));
-	if (ret == 0xFFFFFFFF) return -1;
-	if (ret == 0xFFFFFFFE) return -2;
-	return ((off_t)(ret - 1) << 14) + info->root_dir;
+/**
+ * Converts count FAT entries from the filesystem's byte order to host order.
+ */
+void fatx_fat_to_host(fatx_fs_info *info, void *entries, size_t count) {
+	info->geometry->fat_to_host(entries, count);
 }
 
-static uint32_t fatx_next_cluster(fatx_fs_info *info, uint32_t cluster) {
-	if (cluster == 1) return -1; // root directory can only be one cluster
-	switch(info->width) {
-	case sizeof(uint32_t):
-		if ((cluster & 0xFFFFFFF) > info->fat_size && (cluster & 0xFFFFFFF) <  0xFFFFFF5) {
-			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", cluster);
-			return -1;
-		}
-		if ((cluster & 0xFFFFFFF) > 0xFFFFFF5) {
-			fprintf(stderr, "libfatx: Warning: fatx_next_cluster was given an invalid cluster.\n");
-			return -1;
-		}
-		cluster = fatx_read_int(info, info->fat_offset + cluster * sizeof(uint32_t));
-		if ((cluster & 0xFFFFFFF) > info->fat_size && (cluster & 0xFFFFFFF) <  0xFFFFFF5) {
-			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", cluster);
-			return -1;
-		}
-		if ((cluster & 0xFFFFFFF) > 0xFFFFFF5) { // last cluster
-			return -2;
-		}
-		return cluster;
-	case sizeof(uint16_t):
-		if (cluster > info->fat_size && cluster <  0xFFF5) {
-			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", cluster);
-			return -1;
-		}
-		if (cluster > 0xFFF5) {
-			fprintf(stderr, "libfatx: Warning: fatx_next_cluster was given an invalid cluster.\n");
-			return -1;
-		}
-		cluster = fatx_read_int(info, info->fat_offset + cluster * sizeof(uint32_t));
-		if (cluster > info->fat_size && cluster <  0xFFF5) {
-			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", cluster);
-			return -1;
-		}
-		if (cluster > 0xFFF5) { // last cluster
-			return -1;
-		}
-		return cluster;
+/**
+ * Reads size bytes at offset, retrying short reads.
+ * Returns 0 on success, -1 if the whole range couldn't be read.
+ */
+static int fatx_pread_full(int fd, void *buffer, size_t size, off_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t ret = pread(fd, (uint8_t *)buffer + done, size - done, offset + done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return -1;
+		done += ret;
 	}
+	return 0;
 }
 
 /**
- * Opens the file pointed to by filename. Returns a pointer to data
- * for the other fatx functions to use.
+ * Reads size bytes at offset from the image, through the mapping if it
+ * is mapped. Directory clusters go through the metadata pool of the block
+ * cache if there is one. Same return values as fatx_pread_full.
  */
-fatx_fs_info *fatx_fs_init(const char *filename) {
-	int fd, endianness;
-	fatx_fs_info *info;
-	info = malloc(sizeof(fatx_fs_info));
-	if (info == NULL) {
-		fputs("libfatx: fatal: Out of memory\n", stderr);
-		return NULL;
+int fatx_read_at(fatx_fs_info *info, void *buffer, size_t size, off_t offset) {
+	if (info->block_cache != NULL && offset >= info->root_dir) {
+		struct iovec iov = { buffer, size };
+		return fatx_cache_readv(info, &iov, 1, offset, FATX_CACHE_META);
 	}
-	fd = open(filename, O_RDWR);
-	info->mode = O_RDWR;
-	if (fd < 0) {
-		if (errno == EACCES) { // permission denied; let's try read only
-			fd = open(filename, O_RDONLY);
-			if (fd < 0) {
-				fprintf(stderr, "libfatx: Error opening file %s: [%d] %s\n",
-						filename, errno, strerror(errno));
-				return NULL;
-			} else {
-				fprintf(stderr, "libfatx: Warning: Opened file %s in read-only mode\n",
-						filename);
-				info->mode = O_RDONLY;
-			}
-		} else {
-			fprintf(stderr, "libfatx: Error opening file %s: [%d] %s\n", filename,
-					errno, strerror(errno));
-			return NULL;
-		}
+	fatx_count(info, FATX_STAT_READS, 1);
+	fatx_count(info, FATX_STAT_BYTES_READ, size);
+	if (info->map == NULL) return fatx_pread_full(info->fd, buffer, size, offset);
+	if (offset < 0 || offset + size > info->map_size) {
+		errno = EIO;
+		return -1;
 	}
-	info->fd = fd;
-	endianness = fatx_find_endianness(fd);
+	memcpy(buffer, info->map + offset, size);
+	return 0;
+}
+
+/**
+ * Whether the FAT can be used straight out of the mapped image, which is
+ * the case when its byte order is the host's and it will never be written.
+ */
+static int fatx_fat_can_map(fatx_fs_info *info) {
+	return info->map != NULL && info->read_only && info->endianness == __BYTE_ORDER &&
+			info->fat_offset + info->fat_entries * info->width <= info->map_size;
+}
+
+/**
+ * Reads the whole FAT into memory. The table is stored in host byte order
+ * so that walking a cluster chain never touches the disk.
+ */
+static int fatx_fat_load(fatx_fs_info *info) {
+	size_t bytes = info->fat_entries * info->width;
+	if (fatx_fat_can_map(info)) {
+		info->fat = info->map + info->fat_offset;
+		info->fat_mapped = 1;
+		return 0;
+	}
+	info->fat = malloc(bytes);
+	if (info->fat == NULL) return -1;
+	if (fatx_read_at(info, info->fat, bytes, info->fat_offset) < 0) {
+		fprintf(stderr, "libfatx: Error reading the FAT: [%d] %s\n", errno, strerror(errno));
+		free(info->fat);
+		info->fat = NULL;
+		return -1;
+	}
+	fatx_fat_to_host(info, info->fat, info->fat_entries);
+	return 0;
+}
+
+/**
+ * Counts the free clusters into info->free_clusters and, if mask isn't
+ * NULL, sets a bit in it for each one. A loaded or mapped FAT is scanned
+ * where it is; a paged one is read through in FATX_FLUSH_CHUNK pieces that
+ * bypass the page cache, so mounting doesn't evict what is already cached.
+ * Returns 0, or -1 if the FAT couldn't be read.
+ */
+int fatx_fat_count_free(fatx_fs_info *info, uint64_t *mask) {
+	size_t entries = info->cluster_limit, per_chunk = FATX_FLUSH_CHUNK / info->width, i;
+	size_t count, found = 0, reserved = 0;
+	uint8_t *buffer;
+	if (info->fat != NULL) {
+		// entries 0 and 1 hold the media byte and an end marker, not clusters
+		reserved = fatx_scan->count_free(info->fat, info->width, min(entries, (size_t)2), NULL);
+		found = fatx_scan->count_free(info->fat, info->width, entries, mask);
+	} else {
+		buffer = malloc(FATX_FLUSH_CHUNK);
+		if (buffer == NULL) return -1;
+		for (i = 0; i < entries; i += per_chunk) {
+			count = min(per_chunk, entries - i);
+			if (fatx_read_at(info, buffer, count * info->width, info->fat_offset + i * info->width) < 0) {
+				fprintf(stderr, "libfatx: Error reading the FAT: [%d] %s\n", errno, strerror(errno));
+				free(buffer);
+				return -1;
+			}
+			if (i == 0) reserved = fatx_scan->count_free(buffer, info->width, min(count, (size_t)2), NULL);
+			found += fatx_scan->count_free(buffer, info->width, count, mask != NULL ? mask + i / 64 : NULL);
+		}
+		free(buffer);
+	}
+	if (mask != NULL && entries > 0) mask[0] &= ~UINT64_C(3);
+	__atomic_store_n(&info->free_clusters, found - reserved, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Sets up a paged FAT cache holding at most limit bytes of the table.
+ */
+static int fatx_fat_cache_init(fatx_fs_info *info, size_t limit) {
+	struct fatx_fat_cache *cache;
+	size_t i, bytes = info->fat_entries * info->width;
+	cache = calloc(1, sizeof(struct fatx_fat_cache));
+	if (cache == NULL) return -1;
+	cache->page_count = (bytes + FATX_FAT_PAGE_SIZE - 1) / FATX_FAT_PAGE_SIZE;
+	cache->slot_count = max(limit / FATX_FAT_PAGE_SIZE, FATX_FAT_MIN_PAGES);
+	cache->slot_count = min(cache->slot_count, cache->page_count);
+	cache->page_slot = malloc(cache->page_count * sizeof(int32_t));
+	cache->slot_page = malloc(cache->slot_count * sizeof(uint32_t));
+	cache->slot_referenced = calloc(cache->slot_count, 1);
+	cache->slot_dirty = calloc(cache->slot_count, 1);
+	cache->data = malloc(cache->slot_count * FATX_FAT_PAGE_SIZE);
+	if (cache->page_slot == NULL || cache->slot_page == NULL || cache->slot_referenced == NULL ||
+			cache->slot_dirty == NULL || cache->data == NULL) {
+		free(cache->page_slot);
+		free(cache->slot_page);
+		free(cache->slot_referenced);
+		free(cache->slot_dirty);
+		free(cache->data);
+		free(cache);
+		return -1;
+	}
+	for (i = 0; i < cache->page_count; i++) cache->page_slot[i] = -1;
+	for (i = 0; i < cache->slot_count; i++) cache->slot_page[i] = UINT32_MAX;
+	pthread_mutex_init(&cache->lock, NULL);
+	info->fat_cache = cache;
+	return 0;
+}
+
+static void fatx_fat_cache_free(struct fatx_fat_cache *cache) {
+	if (cache == NULL) return;
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->page_slot);
+	free(cache->slot_page);
+	free(cache->slot_referenced);
+	free(cache->slot_dirty);
+	free(cache->data);
+	free(cache);
+}
+
+/**
+ * Writes the page of the FAT in slot back to disk, in the filesystem's
+ * byte order. Called with the cache's lock held.
+ */
+static int fatx_fat_cache_writeback(fatx_fs_info *info, size_t slot) {
+	struct fatx_fat_cache *cache = info->fat_cache;
+	uint8_t buffer[FATX_FAT_PAGE_SIZE];
+	off_t offset = (off_t)cache->slot_page[slot] * FATX_FAT_PAGE_SIZE;
+	size_t bytes = min((size_t)FATX_FAT_PAGE_SIZE, info->fat_entries * info->width - offset);
+	struct iovec iov = { buffer, bytes };
+	memcpy(buffer, cache->data + slot * FATX_FAT_PAGE_SIZE, bytes);
+	fatx_fat_to_host(info, buffer, bytes / info->width); // the same swap converts back
+	if (fatx_write_at(info, &iov, 1, info->fat_offset + offset) < 0) {
+		fprintf(stderr, "libfatx: Error writing the FAT: [%d] %s\n", errno, strerror(errno));
+		return -1;
+	}
+	cache->slot_dirty[slot] = 0;
+	return 0;
+}
+
+/**
+ * Returns the slot holding the given page of the FAT, reading it from
+ * disk (and evicting the first unreferenced slot) if it isn't loaded.
+ * Called with the cache's lock held.
+ */
+static int fatx_fat_cache_page(fatx_fs_info *info, uint32_t page) {
+	struct fatx_fat_cache *cache = info->fat_cache;
+	size_t bytes, slot;
+	off_t offset;
+	if (cache->page_slot[page] >= 0) {
+		slot = cache->page_slot[page];
+		cache->slot_referenced[slot] = 1;
+		fatx_count(info, FATX_STAT_FAT_PAGE_HITS, 1);
+		return slot;
+	}
+	fatx_count(info, FATX_STAT_FAT_PAGE_MISSES, 1);
+	while (cache->slot_referenced[cache->hand]) {
+		cache->slot_referenced[cache->hand] = 0;
+		cache->hand = (cache->hand + 1) % cache->slot_count;
+	}
+	slot = cache->hand;
+	cache->hand = (cache->hand + 1) % cache->slot_count;
+	if (cache->slot_dirty[slot] && fatx_fat_cache_writeback(info, slot) < 0) return -1;
+	if (cache->slot_page[slot] != UINT32_MAX) cache->page_slot[cache->slot_page[slot]] = -1;
+	cache->slot_page[slot] = UINT32_MAX;
+	offset = (off_t)page * FATX_FAT_PAGE_SIZE;
+	bytes = min((size_t)FATX_FAT_PAGE_SIZE, info->fat_entries * info->width - offset);
+	if (fatx_read_at(info, cache->data + slot * FATX_FAT_PAGE_SIZE, bytes,
+			info->fat_offset + offset) < 0) {
+		fprintf(stderr, "libfatx: Error reading the FAT: [%d] %s\n", errno, strerror(errno));
+		return -1;
+	}
+	fatx_fat_to_host(info, cache->data + slot * FATX_FAT_PAGE_SIZE, bytes / info->width);
+	cache->slot_page[slot] = page;
+	cache->page_slot[page] = slot;
+	cache->slot_referenced[slot] = 1;
+	return slot;
+}
+
+/**
+ * Looks up the FAT entry for cluster in host byte order.
+ * Returns 0 on success, or -1 if cluster is outside of the table.
+ */
+int fatx_fat_entry(fatx_fs_info *info, uint32_t cluster, uint32_t *entry) {
+	uint32_t per_page;
+	uint8_t *page;
+	int slot;
+	if (cluster >= info->fat_entries) {
+		fatx_warn_corruption("Cluster is outside of the FAT\ncluster: %u", cluster);
+		return -1;
+	}
+	fatx_count(info, FATX_STAT_FAT_HOPS, 1);
+	if (info->fat != NULL) { // entries may be changed by a writer at the same time
+		*entry = info->geometry->load(info->fat, cluster);
+		return 0;
+	}
+	per_page = FATX_FAT_PAGE_SIZE / info->width;
+	pthread_mutex_lock(&info->fat_cache->lock);
+	slot = fatx_fat_cache_page(info, cluster / per_page);
+	if (slot < 0) {
+		pthread_mutex_unlock(&info->fat_cache->lock);
+		return -1;
+	}
+	page = info->fat_cache->data + (size_t)slot * FATX_FAT_PAGE_SIZE;
+	*entry = info->geometry->load(page, cluster % per_page);
+	pthread_mutex_unlock(&info->fat_cache->lock);
+	return 0;
+}
+
+/**
+ * Changes the FAT entry for cluster (in host byte order). The change stays
+ * in memory until fatx_fat_flush. Called with write_lock held.
+ */
+int fatx_fat_set(fatx_fs_info *info, uint32_t cluster, uint32_t value) {
+	uint32_t per_page = FATX_FAT_PAGE_SIZE / info->width;
+	uint8_t *page;
+	int slot;
+	if (cluster >= info->fat_entries) return -1;
+	fatx_sidecar_changed(info);
+	if (info->fat != NULL) {
+		info->geometry->store(info->fat, cluster, value);
+		info->fat_dirty[cluster / per_page] = 1;
+		return 0;
+	}
+	pthread_mutex_lock(&info->fat_cache->lock);
+	slot = fatx_fat_cache_page(info, cluster / per_page);
+	if (slot < 0) {
+		pthread_mutex_unlock(&info->fat_cache->lock);
+		return -1;
+	}
+	page = info->fat_cache->data + (size_t)slot * FATX_FAT_PAGE_SIZE;
+	info->geometry->store(page, cluster % per_page, value);
+	info->fat_cache->slot_dirty[slot] = 1;
+	pthread_mutex_unlock(&info->fat_cache->lock);
+	return 0;
+}
+
+/**
+ * Returns the host order entries of page if they have changed since the
+ * last flush, or NULL. A paged FAT must have its lock held.
+ */
+static const uint8_t *fatx_fat_dirty_page(fatx_fs_info *info, size_t page) {
+	int32_t slot;
+	if (info->fat != NULL) {
+		return info->fat_dirty[page] ? (uint8_t *)info->fat + page * FATX_FAT_PAGE_SIZE : NULL;
+	}
+	slot = info->fat_cache->page_slot[page];
+	if (slot < 0 || !info->fat_cache->slot_dirty[slot]) return NULL;
+	return info->fat_cache->data + (size_t)slot * FATX_FAT_PAGE_SIZE;
+}
+
+static void fatx_fat_clean_page(fatx_fs_info *info, size_t page) {
+	if (info->fat != NULL) info->fat_dirty[page] = 0;
+	else info->fat_cache->slot_dirty[info->fat_cache->page_slot[page]] = 0;
+}
+
+/**
+ * Writes out every page of the FAT changed since the last flush, in disk
+ * order, merging neighbouring pages into writes of up to FATX_FLUSH_CHUNK
+ * bytes. Called with write_lock held.
+ */
+int fatx_fat_flush(fatx_fs_info *info) {
+	size_t bytes = info->fat_entries * info->width;
+	size_t pages = (bytes + FATX_FAT_PAGE_SIZE - 1) / FATX_FAT_PAGE_SIZE;
+	size_t page = 0, first, used, i;
+	const uint8_t *data;
+	uint8_t *buffer;
+	int ret = 0;
+	buffer = malloc(FATX_FLUSH_CHUNK);
+	if (buffer == NULL) return -1;
+	if (info->fat == NULL) pthread_mutex_lock(&info->fat_cache->lock);
+	while (page < pages) {
+		struct iovec iov;
+		if (fatx_fat_dirty_page(info, page) == NULL) {
+			page++;
+			continue;
+		}
+		first = page;
+		used = 0;
+		while (page < pages && used < FATX_FLUSH_CHUNK && (data = fatx_fat_dirty_page(info, page)) != NULL) {
+			size_t n = min((size_t)FATX_FAT_PAGE_SIZE, bytes - page * FATX_FAT_PAGE_SIZE);
+			memcpy(buffer + used, data, n);
+			used += n;
+			page++;
+		}
+		fatx_fat_to_host(info, buffer, used / info->width); // the same swap converts back
+		iov.iov_base = buffer;
+		iov.iov_len = used;
+		if (fatx_write_at(info, &iov, 1, info->fat_offset + (off_t)first * FATX_FAT_PAGE_SIZE) < 0) {
+			fprintf(stderr, "libfatx: Error writing the FAT: [%d] %s\n", errno, strerror(errno));
+			ret = -1;
+			break;
+		}
+		for (i = first; i < page; i++) fatx_fat_clean_page(info, i);
+	}
+	if (info->fat == NULL) pthread_mutex_unlock(&info->fat_cache->lock);
+	free(buffer);
+	return ret;
+}
+
+static uint32_t fatx_next_cluster(fatx_fs_info *info, uint32_t cluster);
+
+static inline off_t fatx_next_cluster_offset(fatx_fs_info *info, off_t offset) {
+	off_t ret;
+	ret = (off_t)(fatx_next_cluster(info, ((offset - info->root_dir) >> 14) + 1));
+	if (ret == 0xFFFFFFFF) return -1;
+	if (ret == 0xFFFFFFFE) return -2;
+	return ((off_t)(ret - 1) << 14) + info->root_dir;
+}
+
+static uint32_t fatx_next_cluster(fatx_fs_info *info, uint32_t cluster) {
+	uint32_t mask = info->geometry->entry_mask, last_above = info->geometry->last_above, next;
+	if (cluster == 1) return -1; // root directory can only be one cluster
+	if ((cluster & mask) > info->fat_size && (cluster & mask) < last_above) {
+		fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", cluster);
+		return -1;
+	}
+	if ((cluster & mask) > last_above) {
+		fprintf(stderr, "libfatx: Warning: fatx_next_cluster was given an invalid cluster.\n");
+		return -1;
+	}
+	if (fatx_fat_entry(info, cluster, &next) < 0) return -1;
+	if ((next & mask) > info->fat_size && (next & mask) < last_above) {
+		fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %d", next);
+		return -1;
+	}
+	if (fatx_fat_is_last(info, next)) return -2;
+	return next;
+}
+
+/**
+ * Fills opts with the defaults used by fatx_fs_init.
+ */
+void fatx_fs_options_init(fatx_fs_options *opts) {
+	memset(opts, 0, sizeof(fatx_fs_options));
+	opts->extent_cache_size = FATX_DEFAULT_EXTENT_CACHE_SIZE;
+	opts->dentry_cache_size = FATX_DEFAULT_DENTRY_CACHE_SIZE;
+	opts->dir_index_cache_size = FATX_DEFAULT_DIR_INDEX_CACHE_SIZE;
+	opts->io_engine = FATX_IO_SYNC;
+	opts->io_depth = FATX_DEFAULT_IO_DEPTH;
+}
+
+/**
+ * Returns 1 if info can't be changed, either because it was opened read
+ * only or because the device couldn't be opened for writing.
+ */
+int fatx_fs_read_only(fatx_fs_info *info) {
+	return info->read_only;
+}
+
+/**
+ * Fills st with the size of the filesystem and how much of it is free, in
+ * 16KB clusters. The free count is kept as clusters are allocated and
+ * freed, so this never reads the FAT.
+ */
+int fatx_statfs(fatx_fs_info *info, struct statvfs *st) {
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize = 0x4000;
+	st->f_frsize = 0x4000;
+	st->f_blocks = info->cluster_limit > 2 ? info->cluster_limit - 2 : 0;
+	st->f_bfree = __atomic_load_n(&info->free_clusters, __ATOMIC_RELAXED);
+	st->f_bavail = st->f_bfree;
+	st->f_namemax = 42;
+	if (info->read_only) st->f_flag |= ST_RDONLY;
+	return 0;
+}
+
+static const char *fatx_stat_names[FATX_STATS] = {
+	"lookups", "dir_clusters", "fat_hops", "reads", "bytes_read", "writes", "bytes_written",
+	"dentry_hits", "dentry_misses", "dir_index_hits", "dir_index_misses",
+	"extent_hits", "extent_misses", "fat_page_hits", "fat_page_misses",
+	"block_hits", "block_misses"
+};
+
+__thread unsigned int fatx_stat_shard; // shard + 1, 0 until the thread first counts
+static unsigned int fatx_stat_next;
+
+/**
+ * Gives the calling thread the next shard of the counters.
+ */
+unsigned int fatx_stat_shard_pick(void) {
+	fatx_stat_shard = __atomic_fetch_add(&fatx_stat_next, 1, __ATOMIC_RELAXED) % FATX_STAT_SHARDS + 1;
+	return fatx_stat_shard;
+}
+
+/**
+ * Fills stats, indexed by the FATX_STAT_* ids, with what info has counted
+ * so far. Counters are read one at a time while other threads go on
+ * counting, so they needn't add up with each other exactly.
+ */
+void fatx_get_stats(fatx_fs_info *info, uint64_t stats[FATX_STATS]) {
+	struct fatx_block_cache *cache = info->block_cache;
+	int i, j;
+	for (i = 0; i < FATX_STATS; i++) {
+		stats[i] = 0;
+		for (j = 0; j < FATX_STAT_SHARDS; j++) {
+			stats[i] += __atomic_load_n(&info->stats[j].counters[i], __ATOMIC_RELAXED);
+		}
+	}
+	if (cache != NULL) {
+		pthread_mutex_lock(&cache->lock);
+		stats[FATX_STAT_BLOCK_HITS] = cache->hits[FATX_CACHE_META] + cache->hits[FATX_CACHE_DATA];
+		stats[FATX_STAT_BLOCK_MISSES] = cache->misses[FATX_CACHE_META] + cache->misses[FATX_CACHE_DATA];
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+/**
+ * Returns the name of a counter, in lower case with underscores, or NULL
+ * if stat isn't one.
+ */
+const char *fatx_stat_name(int stat) {
+	if (stat < 0 || stat >= FATX_STATS) return NULL;
+	return fatx_stat_names[stat];
+}
+
+/**
+ * Sets up the backend reads go through, falling back to plain preadv if
+ * the one asked for can't be used. The block cache takes the place of
+ * any other backend.
+ */
+static void fatx_io_init(fatx_fs_info *info, const fatx_fs_options *opts) {
+	const struct fatx_io_ops *io = NULL;
+	int ret;
+	info->io = &fatx_io_sync;
+	if (opts->block_cache_size > 0) {
+		io = &fatx_io_cache;
+	} else if (opts->io_engine == FATX_IO_MMAP) {
+		io = &fatx_io_mmap;
+	} else if (opts->io_engine == FATX_IO_URING) {
+#ifdef HAVE_LIBURING
+		io = &fatx_io_uring;
+#else
+		fputs("libfatx: Warning: Built without io_uring support\n", stderr);
+#endif
+	}
+	if (io != NULL) {
+		ret = io->init(info, opts);
+		if (ret == 0) {
+			info->io = io;
+			return;
+		}
+		fprintf(stderr, "libfatx: Warning: Could not set up %s, using pread: [%d] %s\n",
+				io->name, -ret, strerror(-ret));
+	}
+	info->io->init(info, opts);
+}
+
+/**
+ * Returns the name of the backend reads of file data go through.
+ */
+const char *fatx_io_engine_name(fatx_fs_info *info) {
+	return info->io->name;
+}
+
+/**
+ * Opens the file pointed to by filename. Returns a pointer to data
+ * for the other fatx functions to use.
+ */
+fatx_fs_info *fatx_fs_init(const char *filename) {
+	return fatx_fs_init_opts(filename, NULL);
+}
+
+/**
+ * Where partitions lie on an Xbox 360 drive. Every retail drive has the
+ * same layout, with the content partition taking whatever is left; only
+ * some of the partitions are formatted. Development kit drives start with
+ * a table giving the place and size of their two partitions instead.
+ */
+static const fatx_partition fatx_retail_partitions[] = {
+	{ "SystemCache", INT64_C(0x80000), INT64_C(0x80000000) },
+	{ "GameCache", INT64_C(0x80080000), INT64_C(0xA0E30000) },
+	{ "SystemExtended", INT64_C(0x10C080000), INT64_C(0xCE30000) },
+	{ "SystemExtended2", INT64_C(0x118EB0000), INT64_C(0x8000000) },
+	{ "Compatibility", INT64_C(0x120EB0000), INT64_C(0x10000000) },
+	{ "Content", INT64_C(0x130EB0000), 0 }
+};
+
+#define FATX_DEVKIT_MAGIC 0x00020000 // first word of a development kit drive
+static const char *fatx_devkit_partitions[] = { "Content", "Dashboard" };
+
+/**
+ * Adds the partition at offset to partitions if it holds a FATX
+ * filesystem and fits on a device of size bytes. A length of 0 takes
+ * the rest of the device.
+ */
+static void fatx_add_partition(int fd, off_t size, const char *name, off_t offset, off_t length,
+		fatx_partition *partitions, size_t max, int *count) {
+	if ((size_t)*count >= max || offset <= 0 || offset >= size) return;
+	if (length != 0 && offset + length > size) return;
+	if (fatx_find_endianness(fd, offset) < 0) return;
+	memset(partitions[*count].name, 0, sizeof(partitions[*count].name));
+	strncpy(partitions[*count].name, name, sizeof(partitions[*count].name) - 1);
+	partitions[*count].offset = offset;
+	partitions[*count].length = length != 0 ? length : size - offset;
+	(*count)++;
+}
+
+/**
+ * Finds the FATX partitions on the drive or image filename, and fills in
+ * up to max of them. A file that is a FATX partition by itself gives one
+ * partition at offset 0. Returns how many were found, or -1 with errno
+ * set if filename couldn't be read.
+ */
+int fatx_find_partitions(const char *filename, fatx_partition *partitions, size_t max) {
+	uint32_t table[6];
+	off_t size;
+	int fd, count = 0;
+	size_t i;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		close(fd);
+		return -1;
+	}
+	if (fatx_find_endianness(fd, 0) >= 0) {
+		if (max > 0) {
+			strcpy(partitions[0].name, "Partition");
+			partitions[0].offset = 0;
+			partitions[0].length = size;
+			count = 1;
+		}
+	} else if (fatx_pread_full(fd, table, sizeof(table), 0) == 0 &&
+			be32toh(table[0]) == FATX_DEVKIT_MAGIC) {
+		// sector and sector count of each partition, from the third word on
+		for (i = 0; i < sizeof(fatx_devkit_partitions) / sizeof(fatx_devkit_partitions[0]); i++) {
+			if (table[3 + 2 * i] == 0) continue;
+			fatx_add_partition(fd, size, fatx_devkit_partitions[i],
+					(off_t)be32toh(table[2 + 2 * i]) << 9, (off_t)be32toh(table[3 + 2 * i]) << 9,
+					partitions, max, &count);
+		}
+	} else {
+		for (i = 0; i < sizeof(fatx_retail_partitions) / sizeof(fatx_retail_partitions[0]); i++) {
+			fatx_add_partition(fd, size, fatx_retail_partitions[i].name,
+					fatx_retail_partitions[i].offset, fatx_retail_partitions[i].length,
+					partitions, max, &count);
+		}
+	}
+	close(fd);
+	return count;
+}
+
+/**
+ * Opens filename for a new fatx_fs_info that doesn't share its device.
+ * Returns the fd, or -1.
+ */
+static int fatx_open_device(fatx_fs_info *info, const char *filename, const fatx_fs_options *opts) {
+	int fd;
+	info->device_refs = malloc(sizeof(unsigned int));
+	if (info->device_refs == NULL) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		return -1;
+	}
+	*info->device_refs = 1;
+	info->mode = opts->read_only ? O_RDONLY : O_RDWR;
+	fd = open(filename, info->mode);
+	if (fd < 0) {
+		if (errno == EACCES) { // permission denied; let's try read only
+			fd = open(filename, O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "libfatx: Error opening file %s: [%d] %s\n",
+						filename, errno, strerror(errno));
+				return -1;
+			} else {
+				fprintf(stderr, "libfatx: Warning: Opened file %s in read-only mode\n",
+						filename);
+				info->mode = O_RDONLY;
+			}
+		} else {
+			fprintf(stderr, "libfatx: Error opening file %s: [%d] %s\n", filename,
+					errno, strerror(errno));
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/**
+ * Like fatx_fs_init, but takes options controlling how the filesystem
+ * is accessed. opts may be NULL to use the defaults.
+ *
+ * With opts->offset and opts->length, the filesystem is the partition
+ * that range of the device holds. With opts->share, filename is only
+ * used in messages: the partition is read through the fd and I/O backend
+ * of that already open partition of the same device, and those stay open
+ * until the last partition using them is ended.
+ */
+fatx_fs_info *fatx_fs_init_opts(const char *filename, const fatx_fs_options *opts) {
+	int fd, endianness;
+	off_t device_end, length;
+	fatx_fs_info *info;
+	fatx_fs_options defaults;
+	if (opts == NULL) {
+		fatx_fs_options_init(&defaults);
+		opts = &defaults;
+	}
+	fatx_scan_init();
+	info = calloc(1, sizeof(fatx_fs_info));
+	if (info == NULL || posix_memalign((void **)&info->stats, __alignof__(struct fatx_stat_shard),
+			FATX_STAT_SHARDS * sizeof(struct fatx_stat_shard)) != 0) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		free(info);
+		return NULL;
+	}
+	memset(info->stats, 0, FATX_STAT_SHARDS * sizeof(struct fatx_stat_shard));
+	if (opts->share != NULL) {
+		fd = opts->share->fd;
+		info->mode = opts->share->mode;
+		info->device_refs = opts->share->device_refs;
+		__atomic_add_fetch(info->device_refs, 1, __ATOMIC_RELAXED);
+	} else {
+		fd = fatx_open_device(info, filename, opts);
+		if (fd < 0) {
+			free(info->device_refs);
+			free(info->stats);
+			free(info);
+			return NULL;
+		}
+	}
+	info->fd = fd;
+	info->read_only = (info->mode == O_RDONLY || opts->read_only);
+	device_end = lseek(fd, 0, SEEK_END);
+	length = opts->length ? opts->length : device_end - opts->offset;
+	if (opts->offset < 0 || length <= 0 || opts->offset + length > device_end) {
+		fprintf(stderr, "libfatx: Error: %s has no partition at %lld\n", filename,
+				(long long)opts->offset);
+		fatx_fs_end(info);
+		return NULL;
+	}
+	endianness = fatx_find_endianness(fd, opts->offset);
 	if (endianness < 0) {
 		fprintf(stderr, "libfatx: Error: %s is not a FATX filesystem\n",
 				filename);
+		fatx_fs_end(info);
 		return NULL;
 	}
 	info->endianness = endianness;
-	fatx_calc_size_and_table_offset(info);
+	fatx_calc_size_and_table_offset(info, opts->offset, length);
+	info->geometry = fatx_geometry_find(info->endianness, info->width);
+	if (opts->share != NULL) {
+		info->io = opts->share->io;
+		info->io_state = opts->share->io_state;
+		info->map = opts->share->map;
+		info->map_size = opts->share->map_size;
+	} else {
+		fatx_io_init(info, opts);
+	}
+	if (opts->block_cache_size > 0 && fatx_block_cache_init(info, opts->block_cache_size) < 0) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		fatx_fs_end(info);
+		return NULL;
+	}
+	if (opts->fat_memory_limit == 0 || info->fat_entries * info->width <= opts->fat_memory_limit ||
+			fatx_fat_can_map(info)) {
+		if (fatx_fat_load(info) < 0) {
+			fputs("libfatx: fatal: Could not load the FAT\n", stderr);
+			fatx_fs_end(info);
+			return NULL;
+		}
+	} else if (fatx_fat_cache_init(info, opts->fat_memory_limit) < 0) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		fatx_fs_end(info);
+		return NULL;
+	}
+	if (opts->sidecar != NULL) {
+		if (fatx_sidecar_open(info, opts->sidecar) < 0) {
+			fputs("libfatx: fatal: Out of memory\n", stderr);
+			fatx_fs_end(info);
+			return NULL;
+		}
+		if (info->fat == NULL && info->read_only && fatx_sidecar_fat_table(info) != NULL) {
+			// the sidecar holds the whole table in host order, and it will never be written
+			info->fat = fatx_sidecar_fat_table(info);
+			info->fat_mapped = 1;
+			fatx_fat_cache_free(info->fat_cache);
+			info->fat_cache = NULL;
+		}
+	}
+	if (fatx_extent_cache_init(info, opts->extent_cache_size) < 0 ||
+			fatx_dentry_cache_init(info, opts->dentry_cache_size) < 0 ||
+			fatx_dir_index_cache_init(info, opts->dir_index_cache_size) < 0) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		fatx_fs_end(info);
+		return NULL;
+	}
+	info->nodes = calloc(1, sizeof(struct fatx_node_table));
+	if (info->nodes == NULL) {
+		fputs("libfatx: fatal: Out of memory\n", stderr);
+		fatx_fs_end(info);
+		return NULL;
+	}
+	pthread_mutex_init(&info->nodes->lock, NULL);
+	if (!info->read_only && fatx_write_init(info) < 0) {
+		fprintf(stderr, "libfatx: Warning: Could not set up writing to %s, opened it read only\n",
+				filename);
+		info->read_only = 1;
+	}
+	if (info->free_map == NULL && fatx_fat_count_free(info, NULL) < 0) {
+		fputs("libfatx: fatal: Could not count the free clusters\n", stderr);
+		fatx_fs_end(info);
+		return NULL;
+	}
 	return info;
 }
 
+struct fatx_list_dir_user {
+	int (*func)(const fatx_file_record *, off_t, void *);
+	void *user;
+};
+
+static int fatx_list_dir_entry(const struct fatx_dirent *entry, off_t next, void *user) {
+	struct fatx_list_dir_user *list = user;
+	return list->func(&entry->record, next, list->user);
+}
+
 /**
- * Calls func on each file in the (sub)directory
- * Think of it as an "ls" type function
+ * Calls func on each file in the (sub)directory, with its decoded record,
+ * so nothing has to be looked up again to stat it. Think of it as an
+ * "ls -l" type function. Like fatx_read_dir, the listing starts from
+ * cookie (0 for the beginning), func is given the cookie that resumes
+ * after its entry, and returning nonzero from func stops the listing.
  */
-int fatx_list_dir(fatx_fs_info *info, const char *path, void (*func)(const char *, void *), void *user) {
-	off_t data_offset;
-	fatx_file_offsets offsets;
-	struct fatx_internal_file_record ifr;
-	int ret = fatx_find_file_offsets(&offsets, info, path);
+int fatx_list_dir(fatx_fs_info *info, const char *path, off_t cookie,
+		int (*func)(const fatx_file_record *, off_t, void *), void *user) {
+	struct fatx_list_dir_user list = { func, user };
+	struct fatx_dirent entry;
+	int ret = fatx_resolve(info, path, &entry);
 	if (ret < 0) return ret;
-	if (offsets.record_offset > 0 || offsets.data_offset != info->root_dir) { // to avoid ENOTDIR on root directory
-		pread(info->fd, &ifr, sizeof(ifr), offsets.record_offset);
-		if ((ifr.attributes & 0x10) != 0x10) return -ENOTDIR;
+	return fatx_read_dir(info, &entry, cookie, fatx_list_dir_entry, &list);
+}
+
+/**
+ * Calls func on each file in the directory dir, starting from cookie (0
+ * for the beginning). func is also given the cookie that resumes after
+ * its entry, and stops the listing by returning nonzero.
+ */
+int fatx_read_dir(fatx_fs_info *info, const struct fatx_dirent *dir, off_t cookie,
+		int (*func)(const struct fatx_dirent *, off_t, void *), void *user) {
+	struct fatx_dirent entry;
+	struct fatx_dir_index *index;
+	size_t i;
+	int ret = 0;
+	if (!(dir->attributes & 0x10)) return -ENOTDIR;
+	if (cookie < 0) return -EINVAL;
+	index = fatx_dir_index_get(info, dir->first_cluster);
+	if (index == NULL) return -1;
+	for (i = cookie; i < index->count; i++) {
+		if (index->classes[i] != FATX_RECORD_LIVE) continue;
+		if (fatx_dir_index_entry(info, index, i, &entry) < 0) continue;
+		if (func(&entry, i + 1, user)) break;
 	}
-	data_offset = offsets.data_offset;
-	while (1) {
-		struct fatx_internal_file_record records[256];
-		size_t read = pread(info->fd, records, sizeof(records), data_offset);
-		int i;
-		for (i = 0; i < 256; i++) {
-			if (records[i].name_length == 0xFF) {
-				return 0;
-			} else if (records[i].name_length == 0xE5) { // deleted file, skip
-				continue;
-			} else if (records[i].name_length > 42) {
-				fatx_warn_corruption("Filename length is an invalid value (possible that we stepped into a file somehow)\nname_length: %d", records[i].name_length);
-				return -1;
+	if (i >= index->count && index->corrupt) ret = -1;
+	fatx_dir_index_put(index);
+	return ret;
+}
+
+static int fatx_extent_cache_init(fatx_fs_info *info, size_t limit) {
+	struct fatx_extent_cache *cache;
+	if (limit == 0) return 0;
+	cache = calloc(1, sizeof(struct fatx_extent_cache));
+	if (cache == NULL) return -1;
+	cache->limit = limit;
+	cache->bucket_count = 1;
+	while (cache->bucket_count < limit) cache->bucket_count <<= 1;
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct fatx_extent_map *));
+	if (cache->buckets == NULL) {
+		free(cache);
+		return -1;
+	}
+	pthread_rwlock_init(&cache->lock, NULL);
+	info->extent_cache = cache;
+	return 0;
+}
+
+void fatx_extent_map_put(struct fatx_extent_map *map) {
+	if (map == NULL || __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	free(map->extents);
+	free(map);
+}
+
+/**
+ * Removes map from the cache and drops the cache's reference to it.
+ * Called with the lock held for writing.
+ */
+static void fatx_extent_cache_unlink(struct fatx_extent_cache *cache, struct fatx_extent_map *map) {
+	struct fatx_extent_map **p = &cache->buckets[map->first_cluster & (cache->bucket_count - 1)];
+	while (*p != map) p = &(*p)->hash_next;
+	*p = map->hash_next;
+	fatx_lru_remove(&cache->lru, &map->lru);
+	fatx_extent_map_put(map);
+}
+
+static void fatx_extent_cache_free(struct fatx_extent_cache *cache) {
+	if (cache == NULL) return;
+	while (cache->lru.head) {
+		fatx_extent_cache_unlink(cache, fatx_lru_entry(cache->lru.head, struct fatx_extent_map, lru));
+	}
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+static struct fatx_extent_map *fatx_extent_cache_find(struct fatx_extent_cache *cache, uint32_t first_cluster) {
+	struct fatx_extent_map *map = cache->buckets[first_cluster & (cache->bucket_count - 1)];
+	while (map != NULL && map->first_cluster != first_cluster) map = map->hash_next;
+	return map;
+}
+
+/**
+ * Finds the cached map for the chain starting at first_cluster.
+ * Returns a new reference, or NULL. generation is set for a later
+ * fatx_extent_cache_add of a map built because there was none.
+ */
+static struct fatx_extent_map *fatx_extent_cache_get(fatx_fs_info *info, uint32_t first_cluster,
+		uint64_t *generation) {
+	struct fatx_extent_cache *cache = info->extent_cache;
+	struct fatx_extent_map *map;
+	if (cache == NULL) return NULL;
+	pthread_rwlock_rdlock(&cache->lock);
+	map = fatx_extent_cache_find(cache, first_cluster);
+	if (map != NULL) {
+		__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+		fatx_lru_touch(&map->lru);
+	}
+	*generation = cache->generation;
+	pthread_rwlock_unlock(&cache->lock);
+	fatx_count(info, map != NULL ? FATX_STAT_EXTENT_HITS : FATX_STAT_EXTENT_MISSES, 1);
+	return map;
+}
+
+/**
+ * Adds a newly built map to the cache. If another thread cached a map for
+ * the same chain first, map is dropped and a reference to that one is
+ * returned instead. A map of a chain that may have changed while it was
+ * walked isn't cached.
+ */
+static struct fatx_extent_map *fatx_extent_cache_add(fatx_fs_info *info, struct fatx_extent_map *map,
+		uint64_t generation) {
+	struct fatx_extent_cache *cache = info->extent_cache;
+	struct fatx_extent_map *existing, **bucket;
+	if (cache == NULL) return map;
+	pthread_rwlock_wrlock(&cache->lock);
+	if (cache->generation != generation) {
+		pthread_rwlock_unlock(&cache->lock);
+		return map;
+	}
+	existing = fatx_extent_cache_find(cache, map->first_cluster);
+	if (existing != NULL) {
+		__atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&cache->lock);
+		fatx_extent_map_put(map);
+		return existing;
+	}
+	if (cache->lru.count >= cache->limit) {
+		fatx_extent_cache_unlink(cache, fatx_lru_entry(fatx_lru_victim(&cache->lru), struct fatx_extent_map, lru));
+	}
+	bucket = &cache->buckets[map->first_cluster & (cache->bucket_count - 1)];
+	map->hash_next = *bucket;
+	*bucket = map;
+	fatx_lru_push(&cache->lru, &map->lru);
+	map->refs++;
+	pthread_rwlock_unlock(&cache->lock);
+	return map;
+}
+
+/**
+ * Drops the cached map of the chain starting at first_cluster, after the
+ * chain has been changed or freed.
+ */
+void fatx_extent_forget(fatx_fs_info *info, uint32_t first_cluster) {
+	struct fatx_extent_cache *cache = info->extent_cache;
+	struct fatx_extent_map *map;
+	if (cache == NULL) return;
+	pthread_rwlock_wrlock(&cache->lock);
+	cache->generation++;
+	map = fatx_extent_cache_find(cache, first_cluster);
+	if (map != NULL) fatx_extent_cache_unlink(cache, map);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Drops the cached directory indexes and names, whose records may be
+ * older than the disk once changed records have been written out.
+ */
+void fatx_caches_forget(fatx_fs_info *info) {
+	if (info->dentry_cache != NULL) {
+		pthread_rwlock_wrlock(&info->dentry_cache->lock);
+		__atomic_add_fetch(&info->dentry_cache->generation, 1, __ATOMIC_RELEASE);
+		while (info->dentry_cache->lru.head) {
+			fatx_dentry_cache_unlink(info->dentry_cache,
+					fatx_lru_entry(info->dentry_cache->lru.head, struct fatx_dentry, lru));
+		}
+		pthread_rwlock_unlock(&info->dentry_cache->lock);
+	}
+	if (info->dir_index_cache != NULL) {
+		pthread_rwlock_wrlock(&info->dir_index_cache->lock);
+		info->dir_index_cache->generation++;
+		while (info->dir_index_cache->lru.head) {
+			fatx_dir_index_cache_unlink(info->dir_index_cache,
+					fatx_lru_entry(info->dir_index_cache->lru.head, struct fatx_dir_index, lru));
+		}
+		pthread_rwlock_unlock(&info->dir_index_cache->lock);
+	}
+}
+
+/**
+ * Returns an empty map for a chain starting at first_cluster.
+ */
+struct fatx_extent_map *fatx_extent_map_new(uint32_t first_cluster) {
+	struct fatx_extent_map *map = calloc(1, sizeof(struct fatx_extent_map));
+	if (map == NULL) return NULL;
+	map->first_cluster = first_cluster;
+	map->refs = 1;
+	map->allocated = 4;
+	map->extents = malloc(map->allocated * sizeof(struct fatx_extent));
+	if (map->extents == NULL) {
+		free(map);
+		return NULL;
+	}
+	return map;
+}
+
+/**
+ * Appends an extent of length clusters starting at cluster, which holds
+ * cluster file_cluster of the file. Returns 0, or -1 if out of memory.
+ */
+static int fatx_extent_map_add(fatx_fs_info *info, struct fatx_extent_map *map, uint32_t file_cluster,
+		uint32_t cluster, uint32_t length) {
+	struct fatx_extent *extent;
+	if (map->count == map->allocated) {
+		extent = realloc(map->extents, map->allocated * 2 * sizeof(struct fatx_extent));
+		if (extent == NULL) return -1;
+		map->extents = extent;
+		map->allocated *= 2;
+	}
+	extent = &map->extents[map->count++];
+	extent->file_cluster = file_cluster;
+	extent->length = length;
+	extent->disk_offset = fatx_cluster_offset(info, cluster);
+	return 0;
+}
+
+/**
+ * Fills map from the FAT in memory, a contiguous run at a time with the
+ * partition's chain_run kernel. Returns the number of clusters found (up
+ * to clusters), or -1.
+ */
+static int64_t fatx_extent_map_runs(fatx_fs_info *info, struct fatx_extent_map *map,
+		uint32_t cluster, uint32_t clusters) {
+	uint32_t i = 0, run, next = 0;
+	while (i < clusters) {
+		// the first cluster and every link are checked, even for a run of one
+		if (cluster < 2 || cluster >= info->fat_entries) {
+			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %u", cluster);
+			return -1;
+		}
+		if (clusters - i == 1) {
+			run = 1;
+		} else {
+			run = info->geometry->chain_run(info->fat, info->fat_entries, cluster, clusters - i, &next);
+			fatx_count(info, FATX_STAT_FAT_HOPS, run);
+		}
+		if (fatx_extent_map_add(info, map, i, cluster, run) < 0) return -1;
+		i += run;
+		if (i == clusters) break;
+		if (fatx_fat_is_last(info, next)) {
+			fatx_warn_corruption("Cluster chain is shorter than the file size\nfirst_cluster: %u", map->first_cluster);
+			break;
+		}
+		cluster = next;
+	}
+	return i;
+}
+
+/**
+ * Walks the chain starting at first_cluster (at most clusters long) and
+ * collapses it into runs of physically contiguous clusters.
+ */
+struct fatx_extent_map *fatx_extent_map_build(fatx_fs_info *info,
+		uint32_t first_cluster, uint32_t clusters) {
+	struct fatx_extent_map *map;
+	uint32_t cluster, prev, i;
+	int64_t found;
+	map = fatx_extent_map_new(first_cluster);
+	if (map == NULL) return NULL;
+	if (info->fat != NULL) {
+		found = fatx_extent_map_runs(info, map, first_cluster, clusters);
+		if (found < 0) goto fail;
+		map->clusters = found;
+		return map;
+	}
+	cluster = first_cluster;
+	prev = 0;
+	for (i = 0; i < clusters; i++) {
+		if (i > 0) {
+			cluster = fatx_next_cluster(info, prev);
+			if (cluster == (uint32_t)-2) {
+				fatx_warn_corruption("Cluster chain is shorter than the file size\nfirst_cluster: %u", first_cluster);
+				break;
 			}
-			char name[43];
-			fatx_name_fatx2ansi(name, records[i].name, records[i].name_length);
-			func(name, user);
+			if (cluster == (uint32_t)-1) goto fail;
 		}
-		data_offset = fatx_next_cluster_offset(info, data_offset);
-		if (data_offset == -2) return 0;
-		else if (data_offset < 0) return -1;
+		// as in fatx_extent_map_runs, the first cluster and every link are checked
+		if (cluster < 2 || cluster >= info->fat_entries) {
+			fatx_warn_corruption("Current cluster is out of bounds\ncurrent_cluster: %u", cluster);
+			goto fail;
+		}
+		if (i > 0 && cluster == prev + 1) {
+			map->extents[map->count - 1].length++;
+		} else if (fatx_extent_map_add(info, map, i, cluster, 1) < 0) {
+			goto fail;
+		}
+		prev = cluster;
+	}
+	map->clusters = i;
+	return map;
+fail:
+	free(map->extents);
+	free(map);
+	return NULL;
+}
+
+/**
+ * Tells the kernel that a big file in the mapped image is going to be
+ * read front to back, undoing the MADV_RANDOM the mapping starts with.
+ */
+static void fatx_extent_map_advise(fatx_fs_info *info, struct fatx_extent_map *map) {
+	size_t i;
+	for (i = 0; i < map->count; i++) {
+		madvise(info->map + map->extents[i].disk_offset,
+				(size_t)map->extents[i].length << 14, MADV_SEQUENTIAL);
+	}
+}
+
+/**
+ * Returns the index of the extent holding the given cluster of the file.
+ */
+size_t fatx_extent_find(struct fatx_extent_map *map, uint32_t file_cluster) {
+	size_t low = 0, high = map->count;
+	while (high - low > 1) {
+		size_t mid = (low + high) / 2;
+		if (map->extents[mid].file_cluster <= file_cluster) low = mid;
+		else high = mid;
+	}
+	return low;
+}
+
+/**
+ * Opens the file at path for reading with fatx_pread. The file's cluster
+ * chain is resolved once, so reads at any offset don't walk the FAT.
+ * Returns NULL and sets errno on failure.
+ */
+fatx_file *fatx_open(fatx_fs_info *info, const char *path) {
+	struct fatx_dirent entry;
+	int ret = fatx_resolve(info, path, &entry);
+	if (ret < 0) {
+		errno = (ret == -1) ? EIO : -ret;
+		return NULL;
+	}
+	return fatx_open_dirent(info, &entry);
+}
+
+static inline struct fatx_node **fatx_node_slot(fatx_fs_info *info, off_t record_offset) {
+	struct fatx_node **slot = &info->nodes->buckets[(record_offset >> 6) % FATX_NODE_BUCKETS];
+	while (*slot != NULL && (*slot)->record_offset != record_offset) slot = &(*slot)->hash_next;
+	return slot;
+}
+
+/**
+ * Returns 1 if a file whose record is at record_offset is open (or was
+ * unlinked while open and still is), so the record can't be reused.
+ */
+int fatx_node_busy(fatx_fs_info *info, off_t record_offset) {
+	int busy;
+	pthread_mutex_lock(&info->nodes->lock);
+	busy = (*fatx_node_slot(info, record_offset) != NULL);
+	pthread_mutex_unlock(&info->nodes->lock);
+	return busy;
+}
+
+/**
+ * Marks the open file whose record is at record_offset as unlinked.
+ * Returns 1 if it was open, or 0 if there is no such file. Called with
+ * write_lock held.
+ */
+int fatx_node_unlink(fatx_fs_info *info, off_t record_offset) {
+	struct fatx_node *node;
+	pthread_mutex_lock(&info->nodes->lock);
+	node = *fatx_node_slot(info, record_offset);
+	if (node != NULL) node->unlinked = 1;
+	pthread_mutex_unlock(&info->nodes->lock);
+	return node != NULL;
+}
+
+/**
+ * Follows a file's record to its new place after a move to another
+ * directory. Called with write_lock held.
+ */
+void fatx_node_move(fatx_fs_info *info, off_t from, off_t to) {
+	struct fatx_node **slot, *node;
+	pthread_mutex_lock(&info->nodes->lock);
+	slot = fatx_node_slot(info, from);
+	node = *slot;
+	if (node != NULL) {
+		*slot = node->hash_next;
+		node->record_offset = to;
+		slot = fatx_node_slot(info, to);
+		node->hash_next = *slot;
+		*slot = node;
 	}
+	pthread_mutex_unlock(&info->nodes->lock);
+}
+
+/**
+ * Sets up a node for a file that isn't open yet, resolving its chain once
+ * so reads at any offset don't walk the FAT.
+ */
+static struct fatx_node *fatx_node_new(fatx_fs_info *info, const struct fatx_dirent *entry) {
+	struct fatx_node *node;
+	struct fatx_extent_map *map;
+	uint64_t generation = 0;
+	uint32_t clusters;
+	node = calloc(1, sizeof(struct fatx_node));
+	if (node == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->record_offset = entry->record_offset;
+	node->refs = 1;
+	node->first_cluster = entry->first_cluster;
+	node->size = entry->record.size;
+	pthread_rwlock_init(&node->lock, NULL);
+	clusters = (node->size + FATX_CLUSTER_SIZE - 1) >> 14;
+	if (clusters == 0) return node;
+	map = fatx_extent_cache_get(info, entry->first_cluster, &generation);
+	if (map == NULL) {
+		map = fatx_sidecar_extents(info, entry->first_cluster, clusters);
+		if (map == NULL) map = fatx_extent_map_build(info, entry->first_cluster, clusters);
+		if (map == NULL) {
+			pthread_rwlock_destroy(&node->lock);
+			free(node);
+			errno = EIO;
+			return NULL;
+		}
+		if (info->map != NULL && node->size >= FATX_MMAP_SEQUENTIAL_SIZE) {
+			fatx_extent_map_advise(info, map);
+		}
+		map = fatx_extent_cache_add(info, map, generation);
+	}
+	node->map = map;
+	if (((off_t)map->clusters << 14) < (off_t)node->size) node->size = (size_t)map->clusters << 14;
+	return node;
+}
+
+static void fatx_node_free(struct fatx_node *node) {
+	fatx_extent_map_put(node->map);
+	pthread_rwlock_destroy(&node->lock);
+	free(node);
+}
+
+/**
+ * Like fatx_open, for an entry that has already been looked up. Handles
+ * of the same file share its size and clusters, so a write through one is
+ * seen through the others.
+ */
+fatx_file *fatx_open_dirent(fatx_fs_info *info, const struct fatx_dirent *entry) {
+	struct fatx_node **slot, *node;
+	fatx_file *file;
+	if (entry->attributes & 0x10) {
+		errno = EISDIR;
+		return NULL;
+	}
+	file = malloc(sizeof(fatx_file));
+	if (file == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->info = info;
+	pthread_mutex_lock(&info->nodes->lock);
+	node = *fatx_node_slot(info, entry->record_offset);
+	if (node != NULL) node->refs++;
+	pthread_mutex_unlock(&info->nodes->lock);
+	if (node == NULL) {
+		node = fatx_node_new(info, entry);
+		if (node == NULL) {
+			free(file);
+			return NULL;
+		}
+		pthread_mutex_lock(&info->nodes->lock);
+		slot = fatx_node_slot(info, entry->record_offset);
+		if (*slot != NULL) { // opened by another thread in the meantime
+			fatx_node_free(node);
+			node = *slot;
+			node->refs++;
+		} else {
+			node->hash_next = NULL;
+			*slot = node;
+		}
+		pthread_mutex_unlock(&info->nodes->lock);
+	}
+	file->node = node;
+	return file;
+}
+
+/**
+ * Reads up to size bytes from an open file starting at offset. Returns
+ * the number of bytes read (short at the end of the file), or -errno.
+ */
+ssize_t fatx_pread(fatx_file *file, void *buffer, size_t size, off_t offset) {
+	struct iovec iov = { buffer, size };
+	return fatx_preadv(file, &iov, 1, offset);
+}
+
+/**
+ * Adds a device read of the buffers in batch to aio.
+ */
+static int fatx_aio_add(struct fatx_aio *aio, off_t offset, const struct iovec *batch, int n) {
+	struct fatx_io_read *read;
+	if (aio->count == aio->reads_allocated) {
+		int allocated = aio->reads_allocated * 2;
+		void *p = malloc(allocated * sizeof(struct fatx_io_read));
+		if (p == NULL) return -1;
+		memcpy(p, aio->reads, aio->count * sizeof(struct fatx_io_read));
+		if (aio->reads != aio->local_reads) free(aio->reads);
+		aio->reads = p;
+		aio->reads_allocated = allocated;
+	}
+	if (aio->iov_count + n > aio->iovs_allocated) {
+		int allocated = max(aio->iovs_allocated * 2, aio->iov_count + n);
+		void *p = malloc(allocated * sizeof(struct iovec));
+		if (p == NULL) return -1;
+		memcpy(p, aio->iovs, aio->iov_count * sizeof(struct iovec));
+		if (aio->iovs != aio->local_iovs) free(aio->iovs);
+		aio->iovs = p;
+		aio->iovs_allocated = allocated;
+	}
+	read = &aio->reads[aio->count++];
+	read->aio = aio;
+	read->offset = offset;
+	read->iov = NULL;
+	read->iovcnt = n;
+	memcpy(aio->iovs + aio->iov_count, batch, n * sizeof(struct iovec));
+	aio->iov_count += n;
 	return 0;
 }
 
+static void fatx_aio_release(struct fatx_aio *aio) {
+	if (aio->reads != aio->local_reads) free(aio->reads);
+	if (aio->iovs != aio->local_iovs) free(aio->iovs);
+}
+
 /**
- * Reads size bytes from a file starting at offset. Expects buffer to be allocated for at least size bytes.
+ * Splits a read of node into one device read per run of physically
+ * contiguous clusters, each filling its part of the caller's buffers.
+ * Called with the node's lock held. Returns 0, or -errno.
  */
-size_t fatx_read_file(fatx_fs_info *info, const char *path, void *buffer, size_t size, off_t offset) {
-	int i;
-	uint32_t cluster;
-	off_t data_offset;
-	size_t read;
-	fatx_file_offsets offsets;
-	struct fatx_internal_file_record ifr;
-	int ret = fatx_find_file_offsets(&offsets, info, path);
+static int fatx_aio_prepare_locked(struct fatx_aio *aio, fatx_fs_info *info,
+		struct fatx_node *node, const struct iovec *iov, int iovcnt, off_t offset) {
+	struct iovec batch[FATX_IOV_BATCH];
+	size_t size = 0, done = 0, used = 0, i;
+	int v = 0, n;
+	memset(aio, 0, offsetof(struct fatx_aio, local_reads));
+	aio->info = info;
+	aio->reads = aio->local_reads;
+	aio->reads_allocated = FATX_AIO_LOCAL_READS;
+	aio->iovs = aio->local_iovs;
+	aio->iovs_allocated = FATX_AIO_LOCAL_IOVS;
+	if (offset < 0 || iovcnt < 0) return -EINVAL;
+	for (n = 0; n < iovcnt; n++) size += iov[n].iov_len;
+	if ((size_t)offset >= node->size) return 0;
+	size = min(size, node->size - offset);
+	i = fatx_extent_find(node->map, offset >> 14);
+	while (done < size) {
+		struct fatx_extent *extent = &node->map->extents[i++];
+		off_t within = offset - ((off_t)extent->file_cluster << 14);
+		size_t run = min(size - done, ((size_t)extent->length << 14) - within);
+		size_t gathered = 0;
+		while (gathered < run) {
+			size_t bytes = 0;
+			// the part of the caller's buffers this run (or batch) lands in
+			for (n = 0; n < FATX_IOV_BATCH && gathered + bytes < run; ) {
+				size_t take;
+				if (used == iov[v].iov_len) {
+					v++;
+					used = 0;
+					continue;
+				}
+				take = min(iov[v].iov_len - used, run - gathered - bytes);
+				batch[n].iov_base = (uint8_t *)iov[v].iov_base + used;
+				batch[n].iov_len = take;
+				n++;
+				used += take;
+				bytes += take;
+			}
+			if (fatx_aio_add(aio, extent->disk_offset + within + gathered, batch, n) < 0) {
+				fatx_aio_release(aio);
+				return -ENOMEM;
+			}
+			gathered += bytes;
+		}
+		done += run;
+		offset += run;
+	}
+	// the iovec array has stopped moving, so the reads can point into it
+	for (n = 0, v = 0; n < aio->count; n++) {
+		aio->reads[n].iov = aio->iovs + v;
+		v += aio->reads[n].iovcnt;
+	}
+	aio->size = size;
+	aio->pending = aio->count;
+	return 0;
+}
+
+static int fatx_aio_prepare(struct fatx_aio *aio, fatx_file *file, const struct iovec *iov,
+		int iovcnt, off_t offset) {
+	int ret;
+	pthread_rwlock_rdlock(&file->node->lock);
+	ret = fatx_aio_prepare_locked(aio, file->info, file->node, iov, iovcnt, offset);
+	pthread_rwlock_unlock(&file->node->lock);
+	return ret;
+}
+
+/**
+ * Counts the device reads of aio as it is submitted. The block cache
+ * counts its own, as only its misses reach the device.
+ */
+static void fatx_aio_count(fatx_fs_info *info, struct fatx_aio *aio) {
+	if (info->block_cache != NULL) return;
+	fatx_count(info, FATX_STAT_READS, aio->count);
+	fatx_count(info, FATX_STAT_BYTES_READ, aio->size);
+}
+
+static ssize_t fatx_aio_result(struct fatx_aio *aio) {
+	return aio->error ? -aio->error : (ssize_t)aio->size;
+}
+
+/**
+ * Like fatx_pread, filling the buffers in iov in turn. Every run of
+ * physically contiguous clusters is one device read, whatever the size
+ * of the run and however it lines up with the caller's buffers; with the
+ * io_uring backend the reads for all runs are in flight together.
+ */
+ssize_t fatx_preadv(fatx_file *file, const struct iovec *iov, int iovcnt, off_t offset) {
+	fatx_fs_info *info = file->info;
+	struct fatx_aio aio;
+	ssize_t ret = fatx_aio_prepare(&aio, file, iov, iovcnt, offset);
 	if (ret < 0) return ret;
-	if (offsets.record_offset < 0 && offsets.data_offset == info->root_dir) { // to avoid ENOTDIR on root directory
-		return EISDIR;
-	}
-	pread(info->fd, &ifr, sizeof(struct fatx_internal_file_record), offsets.record_offset);
-	if (ifr.attributes & 0x10) return EISDIR;
-	switch(info->endianness) {
-	case BIG_ENDIAN:
-		cluster = be32toh(ifr.first_cluster);
-		break;
-	case LITTLE_ENDIAN:
-		cluster = le32toh(ifr.first_cluster);
-		break;
-	default:
-		return -1;
+	if (aio.count > 0) {
+		fatx_aio_count(info, &aio);
+		info->io->submit(info, &aio);
+		info->io->wait(info, &aio);
 	}
-	data_offset = offsets.data_offset;
-	for (i = 0; i < (offset >> 14); i++) {
-		data_offset = fatx_next_cluster_offset(info, data_offset);
-		if (data_offset < 0) return -1;
+	ret = fatx_aio_result(&aio);
+	fatx_aio_release(&aio);
+	return ret;
+}
+
+/**
+ * Starts reading up to size bytes of file at offset into buffer and
+ * returns without waiting for the data. buffer must stay valid until
+ * the read is passed to fatx_aio_wait; the file may be closed earlier.
+ * Returns NULL and sets errno on failure.
+ */
+fatx_aio *fatx_aio_submit(fatx_file *file, void *buffer, size_t size, off_t offset) {
+	struct iovec iov = { buffer, size };
+	fatx_aio *aio = malloc(sizeof(fatx_aio));
+	int ret;
+	if (aio == NULL) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	offset -= (off_t)(i) << 14;
-	read = 0;
-	for (i = 0; i < ((offset + size) >> 14); i++) {
-		read += pread(info->fd, (uint8_t *)(buffer) + read, 0x4000 - offset, data_offset + offset);
-		offset = 0;
-		data_offset = fatx_next_cluster_offset(info, data_offset);
-		if (data_offset < 0) return -1;
+	ret = fatx_aio_prepare(aio, file, &iov, 1, offset);
+	if (ret < 0) {
+		free(aio);
+		errno = -ret;
+		return NULL;
+	}
+	if (aio->count > 0) {
+		fatx_aio_count(file->info, aio);
+		file->info->io->submit(file->info, aio);
 	}
-	size -= (off_t)(i) << 14;
-	read += pread(info->fd, (uint8_t *)(buffer) + read, size, data_offset + offset);
+	return aio;
+}
+
+/**
+ * Returns 1 if the read has completed, without blocking.
+ */
+int fatx_aio_poll(fatx_aio *aio) {
+	return aio->count == 0 || aio->info->io->poll(aio->info, aio);
+}
+
+/**
+ * Waits for the read to complete and frees it. Returns the number of
+ * bytes read, as fatx_pread would, or -errno.
+ */
+ssize_t fatx_aio_wait(fatx_aio *aio) {
+	ssize_t ret;
+	if (aio->count > 0) aio->info->io->wait(aio->info, aio);
+	ret = fatx_aio_result(aio);
+	fatx_aio_release(aio);
+	free(aio);
+	return ret;
+}
+
+/**
+ * Maps size bytes of an open file starting at offset onto the device,
+ * one fatx_io_extent per contiguous run of clusters, so the caller can do
+ * the I/O itself (for example by splicing from the device). Fills at most
+ * max extents and returns how many the request needs, which is more than
+ * max if the array was too small; the request is clamped to the end of
+ * the file first. Returns -errno on error, and -EOPNOTSUPP if info has
+ * a block cache, as reads from the device would go around it.
+ */
+int fatx_map_file(fatx_file *file, off_t offset, size_t size, fatx_io_extent *extents, int max) {
+	struct fatx_node *node = file->node;
+	size_t done = 0, i;
+	int count = 0;
+	if (offset < 0) return -EINVAL;
+	if (file->info->block_cache != NULL) return -EOPNOTSUPP;
+	pthread_rwlock_rdlock(&node->lock);
+	if ((size_t)offset >= node->size) {
+		pthread_rwlock_unlock(&node->lock);
+		return 0;
+	}
+	size = min(size, node->size - offset);
+	i = fatx_extent_find(node->map, offset >> 14);
+	while (done < size) {
+		struct fatx_extent *extent = &node->map->extents[i++];
+		off_t within = offset - ((off_t)extent->file_cluster << 14);
+		size_t run = min(size - done, ((size_t)extent->length << 14) - within);
+		if (count < max) {
+			extents[count].fd = file->info->fd;
+			extents[count].offset = extent->disk_offset + within;
+			extents[count].length = run;
+			extents[count].mem = file->info->map ? file->info->map + extents[count].offset : NULL;
+		}
+		count++;
+		done += run;
+		offset += run;
+	}
+	pthread_rwlock_unlock(&node->lock);
+	if (count <= max) { // the caller reads the extents now, rather than asking again
+		fatx_count(file->info, FATX_STAT_READS, count);
+		fatx_count(file->info, FATX_STAT_BYTES_READ, size);
+	}
+	return count;
+}
+
+void fatx_close(fatx_file *file) {
+	fatx_fs_info *info;
+	struct fatx_node *node, **slot;
+	int last;
+	if (file == NULL) return;
+	info = file->info;
+	node = file->node;
+	free(file);
+	pthread_mutex_lock(&info->nodes->lock);
+	last = (--node->refs == 0);
+	if (last) {
+		slot = &info->nodes->buckets[(node->record_offset >> 6) % FATX_NODE_BUCKETS];
+		while (*slot != node) slot = &(*slot)->hash_next;
+		*slot = node->hash_next;
+	}
+	pthread_mutex_unlock(&info->nodes->lock);
+	if (!last) return;
+	if (node->unlinked) fatx_node_release(info, node);
+	fatx_node_free(node);
+}
+
+/**
+ * Reads size bytes from a file starting at offset. Expects buffer to be allocated for at least size bytes.
+ */
+ssize_t fatx_read_file(fatx_fs_info *info, const char *path, void *buffer, size_t size, off_t offset) {
+	ssize_t read;
+	fatx_file *file = fatx_open(info, path);
+	if (file == NULL) return -errno;
+	read = fatx_pread(file, buffer, size, offset);
+	fatx_close(file);
 	return read;
 }
 
 void fatx_fs_end(fatx_fs_info *info) {
-	close(info->fd);
+	fatx_sidecar_stop(info);
+	fatx_write_end(info);
+	// the last partition on the device closes it
+	if (__atomic_sub_fetch(info->device_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (info->io != NULL) info->io->end(info);
+		close(info->fd);
+		free(info->device_refs);
+	}
+	if (!info->fat_mapped) free(info->fat);
+	fatx_block_cache_free(info->block_cache);
+	fatx_fat_cache_free(info->fat_cache);
+	fatx_extent_cache_free(info->extent_cache);
+	fatx_dentry_cache_free(info->dentry_cache);
+	fatx_dir_index_cache_free(info->dir_index_cache);
+	if (info->nodes != NULL) pthread_mutex_destroy(&info->nodes->lock);
+	free(info->nodes);
+	free(info->stats);
+	fatx_sidecar_free(info->sidecar);
 	free(info);
 }
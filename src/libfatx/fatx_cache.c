@@ -0,0 +1,594 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The block cache: clusters of the data area kept in our own memory and
+ * read from a second descriptor of the device opened with O_DIRECT, so
+ * the kernel doesn't hold a copy as well. It has two pools. Directory
+ * clusters, read through fatx_read_at, go to the metadata pool, a clock
+ * whose blocks bank up to FATX_CACHE_WEIGHT hits against eviction. File
+ * data goes to the data pool, managed with 2Q: clusters seen once wait in
+ * a FIFO (A1in) and only move to the clock (Am) if they are asked for
+ * again soon after leaving it, which their offsets in the A1out ring
+ * remember. Streaming a large file therefore only ever cycles A1in, and
+ * never pushes directory clusters out at all.
+ *
+ * Writes go to the device first and then to any cached copy, so the
+ * cache never holds anything the disk doesn't. The FAT isn't cached here:
+ * it lies below the data area and has its own cache.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * A walk through a caller's buffers, which are filled (or, for writes,
+ * read) in order.
+ */
+struct fatx_iov_cursor {
+	const struct iovec *iov;
+	int iovcnt;
+	size_t within;
+};
+
+static void fatx_cursor_copy_out(struct fatx_iov_cursor *cursor, const uint8_t *data, size_t size) {
+	while (size > 0 && cursor->iovcnt > 0) {
+		size_t n = min(size, cursor->iov->iov_len - cursor->within);
+		memcpy((uint8_t *)cursor->iov->iov_base + cursor->within, data, n);
+		data += n;
+		size -= n;
+		cursor->within += n;
+		if (cursor->within == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->iovcnt--;
+			cursor->within = 0;
+		}
+	}
+}
+
+static void fatx_cursor_copy_in(struct fatx_iov_cursor *cursor, uint8_t *data, size_t size) {
+	while (size > 0 && cursor->iovcnt > 0) {
+		size_t n = min(size, cursor->iov->iov_len - cursor->within);
+		memcpy(data, (const uint8_t *)cursor->iov->iov_base + cursor->within, n);
+		data += n;
+		size -= n;
+		cursor->within += n;
+		if (cursor->within == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->iovcnt--;
+			cursor->within = 0;
+		}
+	}
+}
+
+static void fatx_cursor_skip(struct fatx_iov_cursor *cursor, size_t size) {
+	while (size > 0 && cursor->iovcnt > 0) {
+		size_t n = min(size, cursor->iov->iov_len - cursor->within);
+		size -= n;
+		cursor->within += n;
+		if (cursor->within == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->iovcnt--;
+			cursor->within = 0;
+		}
+	}
+}
+
+/**
+ * Reads size bytes at offset straight into the caller's buffers.
+ */
+static int fatx_cursor_pread(int fd, struct fatx_iov_cursor *cursor, size_t size, off_t offset) {
+	struct iovec iov[FATX_IOV_BATCH];
+	while (size > 0) {
+		struct fatx_iov_cursor start = *cursor;
+		size_t bytes = 0;
+		int n = 0;
+		for (; n < FATX_IOV_BATCH && bytes < size && start.iovcnt > 0; n++) {
+			iov[n].iov_base = (uint8_t *)start.iov->iov_base + start.within;
+			iov[n].iov_len = min(size - bytes, start.iov->iov_len - start.within);
+			bytes += iov[n].iov_len;
+			fatx_cursor_skip(&start, iov[n].iov_len);
+		}
+		if (n == 0) break;
+		if (fatx_preadv_full(fd, iov, n, offset) < 0) return -1;
+		*cursor = start;
+		size -= bytes;
+		offset += bytes;
+	}
+	return 0;
+}
+
+static inline size_t fatx_cache_bucket(struct fatx_block_cache *cache, off_t offset) {
+	return (size_t)(offset >> 14) & (cache->bucket_count - 1);
+}
+
+static struct fatx_cache_block *fatx_cache_lookup(struct fatx_block_cache *cache, off_t offset) {
+	struct fatx_cache_block *block = cache->buckets[fatx_cache_bucket(cache, offset)];
+	while (block != NULL && block->offset != offset) block = block->hash_next;
+	return block;
+}
+
+static void fatx_cache_unhash(struct fatx_block_cache *cache, struct fatx_cache_block *block) {
+	struct fatx_cache_block **slot = &cache->buckets[fatx_cache_bucket(cache, block->offset)];
+	while (*slot != block) slot = &(*slot)->hash_next;
+	*slot = block->hash_next;
+}
+
+static struct fatx_lru *fatx_cache_queue(struct fatx_block_cache *cache, struct fatx_cache_block *block) {
+	if (block->queue == FATX_BLOCK_A1IN) return &cache->a1in;
+	if (block->queue == FATX_BLOCK_AM) return &cache->am;
+	return &cache->meta;
+}
+
+/**
+ * Takes block out of the cache and puts its slot back on its pool's free
+ * list.
+ */
+static void fatx_cache_drop(struct fatx_block_cache *cache, struct fatx_cache_block *block) {
+	int pool = block->queue == FATX_BLOCK_META ? FATX_CACHE_META : FATX_CACHE_DATA;
+	fatx_cache_unhash(cache, block);
+	fatx_lru_remove(fatx_cache_queue(cache, block), &block->lru);
+	block->state = FATX_BLOCK_FREE;
+	block->hash_next = cache->free[pool];
+	cache->free[pool] = block;
+}
+
+/**
+ * Remembers that the data block at offset left A1in, forgetting the
+ * oldest such block if the ring is full.
+ */
+static void fatx_ghost_add(struct fatx_block_cache *cache, off_t offset) {
+	size_t slot = cache->ghost_head, bucket;
+	int32_t *link;
+	if (cache->ghosts[slot] >= 0) {
+		bucket = fatx_cache_bucket(cache, cache->ghosts[slot]) & (cache->ghost_bucket_count - 1);
+		link = &cache->ghost_buckets[bucket];
+		while (*link != (int32_t)slot) link = &cache->ghost_next[*link];
+		*link = cache->ghost_next[slot];
+	}
+	bucket = fatx_cache_bucket(cache, offset) & (cache->ghost_bucket_count - 1);
+	cache->ghosts[slot] = offset;
+	cache->ghost_next[slot] = cache->ghost_buckets[bucket];
+	cache->ghost_buckets[bucket] = slot;
+	cache->ghost_head = (slot + 1) % cache->ghost_limit;
+}
+
+/**
+ * Returns 1 and forgets offset if it is in A1out.
+ */
+static int fatx_ghost_take(struct fatx_block_cache *cache, off_t offset) {
+	size_t bucket = fatx_cache_bucket(cache, offset) & (cache->ghost_bucket_count - 1);
+	int32_t *link = &cache->ghost_buckets[bucket];
+	while (*link >= 0) {
+		int32_t slot = *link;
+		if (cache->ghosts[slot] == offset) {
+			*link = cache->ghost_next[slot];
+			cache->ghosts[slot] = -1;
+			return 1;
+		}
+		link = &cache->ghost_next[slot];
+	}
+	return 0;
+}
+
+/**
+ * Runs the clock over lru: blocks with weight left lose one and go round
+ * again, blocks still being read are passed over. Returns NULL if every
+ * block is being read.
+ */
+static struct fatx_cache_block *fatx_cache_clock(struct fatx_lru *lru) {
+	size_t scanned, limit = lru->count * (FATX_CACHE_WEIGHT + 1);
+	for (scanned = 0; scanned < limit; scanned++) {
+		struct fatx_cache_block *block = fatx_lru_entry(lru->tail, struct fatx_cache_block, lru);
+		if (block->state != FATX_BLOCK_LOADING && block->weight == 0) return block;
+		if (block->weight > 0) block->weight--;
+		fatx_lru_remove(lru, &block->lru);
+		fatx_lru_push(lru, &block->lru);
+	}
+	return NULL;
+}
+
+/**
+ * The oldest block of A1in that isn't being read, or NULL.
+ */
+static struct fatx_cache_block *fatx_cache_fifo(struct fatx_lru *lru) {
+	struct fatx_lru_node *node;
+	for (node = lru->tail; node != NULL; node = node->prev) {
+		struct fatx_cache_block *block = fatx_lru_entry(node, struct fatx_cache_block, lru);
+		if (block->state != FATX_BLOCK_LOADING) return block;
+	}
+	return NULL;
+}
+
+/**
+ * Frees a slot of pool by evicting a block, or returns NULL if none can
+ * go. Data blocks leave A1in while it is over its share, remembered in
+ * A1out, and Am otherwise.
+ */
+static struct fatx_cache_block *fatx_cache_evict(struct fatx_block_cache *cache, int pool) {
+	struct fatx_cache_block *block = NULL;
+	int fifo;
+	if (pool == FATX_CACHE_META) {
+		block = fatx_cache_clock(&cache->meta);
+	} else {
+		fifo = cache->a1in.count > cache->a1in_limit || cache->am.count == 0;
+		if (fifo) block = fatx_cache_fifo(&cache->a1in);
+		if (block == NULL) block = fatx_cache_clock(&cache->am);
+		if (block == NULL && !fifo) block = fatx_cache_fifo(&cache->a1in);
+		if (block != NULL && block->queue == FATX_BLOCK_A1IN) fatx_ghost_add(cache, block->offset);
+	}
+	if (block == NULL) return NULL;
+	fatx_cache_unhash(cache, block);
+	fatx_lru_remove(fatx_cache_queue(cache, block), &block->lru);
+	return block;
+}
+
+/**
+ * Gives the block at offset a slot in pool and marks it as being read.
+ * Returns NULL if every slot of the pool is busy.
+ */
+static struct fatx_cache_block *fatx_cache_claim(struct fatx_block_cache *cache, int pool,
+		off_t offset, uint32_t length) {
+	struct fatx_cache_block *block = cache->free[pool];
+	size_t bucket;
+	if (block != NULL) cache->free[pool] = block->hash_next;
+	else block = fatx_cache_evict(cache, pool);
+	if (block == NULL) return NULL;
+	block->offset = offset;
+	block->length = length;
+	block->state = FATX_BLOCK_LOADING;
+	block->weight = 0;
+	if (pool == FATX_CACHE_META) block->queue = FATX_BLOCK_META;
+	else block->queue = fatx_ghost_take(cache, offset) ? FATX_BLOCK_AM : FATX_BLOCK_A1IN;
+	fatx_lru_push(fatx_cache_queue(cache, block), &block->lru);
+	bucket = fatx_cache_bucket(cache, offset);
+	block->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = block;
+	return block;
+}
+
+static void fatx_cache_hit(struct fatx_cache_block *block) {
+	if (block->queue == FATX_BLOCK_META) {
+		if (block->weight < FATX_CACHE_WEIGHT) block->weight++;
+	} else if (block->queue == FATX_BLOCK_AM) {
+		block->weight = 1;
+	} // A1in is a FIFO: a second hit there doesn't make a block hot yet
+}
+
+/**
+ * Where the block holding offset starts: the data area is cut into
+ * clusters, and the last one may be short.
+ */
+static inline off_t fatx_cache_base(fatx_fs_info *info, off_t offset) {
+	return info->root_dir + ((offset - info->root_dir) & ~(off_t)(FATX_CLUSTER_SIZE - 1));
+}
+
+static inline uint32_t fatx_cache_length(fatx_fs_info *info, off_t base) {
+	return min((off_t)FATX_CLUSTER_SIZE, info->end - base);
+}
+
+/**
+ * Reads count claimed blocks, which follow each other on the device. The
+ * O_DIRECT descriptor is used when the run is aligned for it.
+ */
+static int fatx_cache_fill(fatx_fs_info *info, struct fatx_cache_block **run, int count) {
+	struct fatx_block_cache *cache = info->block_cache;
+	struct iovec iov[FATX_CACHE_BATCH];
+	int i, fd = __atomic_load_n(&cache->direct_fd, __ATOMIC_RELAXED);
+	fatx_count(info, FATX_STAT_READS, 1);
+	fatx_count(info, FATX_STAT_BYTES_READ, run[count - 1]->offset + run[count - 1]->length - run[0]->offset);
+	if (run[0]->offset % FATX_CACHE_ALIGN != 0 || run[count - 1]->length % FATX_CACHE_ALIGN != 0) {
+		fd = -1;
+	}
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = run[i]->data;
+		iov[i].iov_len = run[i]->length;
+	}
+	if (fd >= 0) {
+		if (fatx_preadv_full(fd, iov, count, run[0]->offset) == 0) return 0;
+		if (errno != EINVAL) return -1;
+		// the device wants a bigger alignment than we give it
+		if (__atomic_exchange_n(&cache->direct_fd, -1, __ATOMIC_RELAXED) >= 0) {
+			fputs("libfatx: Warning: O_DIRECT reads were refused, using buffered reads\n", stderr);
+		}
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = run[i]->data;
+			iov[i].iov_len = run[i]->length;
+		}
+	}
+	return fatx_preadv_full(info->fd, iov, count, run[0]->offset);
+}
+
+/**
+ * Reads iov from offset in the data area through the cache, as data of
+ * the given pool. Misses in a row are read from the device together.
+ * When every slot of the pool is being read the block is read around the
+ * cache. Returns 0, or -1 with errno set.
+ */
+int fatx_cache_readv(fatx_fs_info *info, const struct iovec *iov, int iovcnt, off_t offset, int pool) {
+	struct fatx_block_cache *cache = info->block_cache;
+	struct fatx_cache_block *block, *run[FATX_CACHE_BATCH];
+	struct fatx_iov_cursor cursor = { iov, iovcnt, 0 };
+	off_t pos = offset, end = offset, base;
+	int i, count, ret = 0, error = 0;
+	for (i = 0; i < iovcnt; i++) end += iov[i].iov_len;
+	if (end > info->end) {
+		errno = EIO;
+		return -1;
+	}
+	pthread_mutex_lock(&cache->lock);
+	while (pos < end) {
+		base = fatx_cache_base(info, pos);
+		block = fatx_cache_lookup(cache, base);
+		if (block != NULL && block->state == FATX_BLOCK_LOADING) {
+			pthread_cond_wait(&cache->loaded, &cache->lock);
+			continue;
+		}
+		if (block != NULL) {
+			size_t n = min(end, base + (off_t)block->length) - pos;
+			cache->hits[pool]++;
+			fatx_cache_hit(block);
+			fatx_cursor_copy_out(&cursor, block->data + (pos - base), n);
+			pos += n;
+			continue;
+		}
+		for (count = 0; count < FATX_CACHE_BATCH && base < end; count++) {
+			if (count > 0 && fatx_cache_lookup(cache, base) != NULL) break;
+			run[count] = fatx_cache_claim(cache, pool, base, fatx_cache_length(info, base));
+			if (run[count] == NULL) break;
+			base += run[count]->length;
+		}
+		if (count == 0) {
+			size_t n = min(end, base + (off_t)fatx_cache_length(info, base)) - pos;
+			cache->misses[pool]++;
+			pthread_mutex_unlock(&cache->lock);
+			fatx_count(info, FATX_STAT_READS, 1);
+			fatx_count(info, FATX_STAT_BYTES_READ, n);
+			ret = fatx_cursor_pread(info->fd, &cursor, n, pos);
+			error = errno;
+			pthread_mutex_lock(&cache->lock);
+			if (ret < 0) break;
+			pos += n;
+			continue;
+		}
+		cache->misses[pool] += count;
+		pthread_mutex_unlock(&cache->lock);
+		ret = fatx_cache_fill(info, run, count);
+		error = errno;
+		pthread_mutex_lock(&cache->lock);
+		for (i = 0; i < count; i++) {
+			if (ret < 0) {
+				fatx_cache_drop(cache, run[i]);
+				continue;
+			}
+			run[i]->state = FATX_BLOCK_VALID;
+			if (pos < run[i]->offset + (off_t)run[i]->length) {
+				size_t n = min(end, run[i]->offset + (off_t)run[i]->length) - pos;
+				fatx_cursor_copy_out(&cursor, run[i]->data + (pos - run[i]->offset), n);
+				pos += n;
+			}
+		}
+		pthread_cond_broadcast(&cache->loaded);
+		if (ret < 0) break;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (ret < 0) errno = error;
+	return ret;
+}
+
+/**
+ * Brings the cached copies of blocks overlapping a write of iov at offset
+ * up to date, or drops them if the write failed. Blocks still being read
+ * are waited for, as they may hold what was on the disk before.
+ */
+static void fatx_cache_written(fatx_fs_info *info, const struct iovec *iov, int iovcnt,
+		off_t offset, int failed) {
+	struct fatx_block_cache *cache = info->block_cache;
+	struct fatx_cache_block *block;
+	struct fatx_iov_cursor cursor = { iov, iovcnt, 0 };
+	off_t pos = max(offset, info->root_dir), end = offset, base;
+	int i;
+	for (i = 0; i < iovcnt; i++) end += iov[i].iov_len;
+	end = min(end, info->end);
+	if (pos >= end) return;
+	fatx_cursor_skip(&cursor, pos - offset);
+	pthread_mutex_lock(&cache->lock);
+	while (pos < end) {
+		size_t n;
+		base = fatx_cache_base(info, pos);
+		n = min(end, base + (off_t)fatx_cache_length(info, base)) - pos;
+		block = fatx_cache_lookup(cache, base);
+		if (block != NULL && block->state == FATX_BLOCK_LOADING) {
+			pthread_cond_wait(&cache->loaded, &cache->lock);
+			continue;
+		}
+		if (block == NULL) {
+			fatx_cursor_skip(&cursor, n);
+		} else if (failed) {
+			fatx_cache_drop(cache, block);
+			fatx_cursor_skip(&cursor, n);
+		} else {
+			fatx_cursor_copy_in(&cursor, block->data + (pos - base), n);
+		}
+		pos += n;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Writes iov (at most FATX_IOV_BATCH buffers) at offset on the device, the
+ * way fatx_pwritev_full does, and keeps the block cache in step.
+ */
+int fatx_write_at(fatx_fs_info *info, struct iovec *iov, int iovcnt, off_t offset) {
+	struct iovec saved[FATX_IOV_BATCH];
+	size_t bytes = 0;
+	int ret, error, i;
+	for (i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+	fatx_count(info, FATX_STAT_WRITES, 1);
+	fatx_count(info, FATX_STAT_BYTES_WRITTEN, bytes);
+	if (info->block_cache == NULL) return fatx_pwritev_full(info->fd, iov, iovcnt, offset);
+	memcpy(saved, iov, iovcnt * sizeof(struct iovec));
+	ret = fatx_pwritev_full(info->fd, iov, iovcnt, offset);
+	error = errno;
+	fatx_cache_written(info, saved, iovcnt, offset, ret < 0);
+	errno = error;
+	return ret;
+}
+
+/**
+ * Sets up the block cache of info with size bytes, a quarter of them for
+ * metadata. Returns 0, or -1 if out of memory.
+ */
+int fatx_block_cache_init(fatx_fs_info *info, size_t size) {
+	struct fatx_block_cache *cache;
+	size_t blocks = max(size / FATX_CLUSTER_SIZE, (size_t)2), i;
+	void *data;
+	cache = calloc(1, sizeof(struct fatx_block_cache));
+	if (cache == NULL) return -1;
+	info->block_cache = cache;
+	cache->direct_fd = info->io == &fatx_io_cache ? *(int *)info->io_state : -1;
+	cache->meta_blocks = max(blocks / FATX_CACHE_META_SHARE, (size_t)1);
+	cache->data_blocks = blocks - cache->meta_blocks;
+	cache->a1in_limit = max(cache->data_blocks / 4, (size_t)1);
+	cache->ghost_limit = max(cache->data_blocks / 2, (size_t)1);
+	for (cache->bucket_count = 1; cache->bucket_count < blocks; cache->bucket_count <<= 1);
+	for (cache->ghost_bucket_count = 1; cache->ghost_bucket_count < cache->ghost_limit;
+			cache->ghost_bucket_count <<= 1);
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct fatx_cache_block *));
+	cache->blocks = calloc(blocks, sizeof(struct fatx_cache_block));
+	cache->ghosts = malloc(cache->ghost_limit * sizeof(off_t));
+	cache->ghost_next = malloc(cache->ghost_limit * sizeof(int32_t));
+	cache->ghost_buckets = malloc(cache->ghost_bucket_count * sizeof(int32_t));
+	if (posix_memalign(&data, FATX_CACHE_ALIGN, blocks * FATX_CLUSTER_SIZE) != 0) data = NULL;
+	cache->data = data;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->loaded, NULL);
+	if (cache->buckets == NULL || cache->blocks == NULL || cache->ghosts == NULL ||
+			cache->ghost_next == NULL || cache->ghost_buckets == NULL || cache->data == NULL) {
+		return -1;
+	}
+	for (i = 0; i < cache->ghost_limit; i++) cache->ghosts[i] = -1;
+	for (i = 0; i < cache->ghost_bucket_count; i++) cache->ghost_buckets[i] = -1;
+	for (i = blocks; i-- > 0;) {
+		int pool = i < cache->meta_blocks ? FATX_CACHE_META : FATX_CACHE_DATA;
+		cache->blocks[i].data = cache->data + i * FATX_CLUSTER_SIZE;
+		cache->blocks[i].hash_next = cache->free[pool];
+		cache->free[pool] = &cache->blocks[i];
+	}
+	return 0;
+}
+
+void fatx_block_cache_free(struct fatx_block_cache *cache) {
+	if (cache == NULL) return;
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->loaded);
+	free(cache->buckets);
+	free(cache->blocks);
+	free(cache->ghosts);
+	free(cache->ghost_next);
+	free(cache->ghost_buckets);
+	free(cache->data);
+	free(cache);
+}
+
+/**
+ * Fills in stats with the block cache's counters. Returns 0, or -ENOENT
+ * if info was opened without a block cache.
+ */
+int fatx_get_block_cache_stats(fatx_fs_info *info, fatx_block_cache_stats *stats) {
+	struct fatx_block_cache *cache = info->block_cache;
+	if (cache == NULL) return -ENOENT;
+	pthread_mutex_lock(&cache->lock);
+	stats->metadata_hits = cache->hits[FATX_CACHE_META];
+	stats->metadata_misses = cache->misses[FATX_CACHE_META];
+	stats->data_hits = cache->hits[FATX_CACHE_DATA];
+	stats->data_misses = cache->misses[FATX_CACHE_DATA];
+	stats->metadata_blocks = cache->meta_blocks;
+	stats->data_blocks = cache->data_blocks;
+	stats->direct = cache->direct_fd >= 0;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+/**
+ * The backend file data goes through when the block cache is on. Its
+ * state is the device opened a second time with O_DIRECT, which is left
+ * at -1 if the device or the filesystem it lives on won't allow that.
+ */
+static int fatx_io_cache_init(fatx_fs_info *info, const fatx_fs_options *opts) {
+	char path[32];
+	int *direct_fd = malloc(sizeof(int));
+	(void) opts;
+	if (direct_fd == NULL) return -ENOMEM;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", info->fd);
+	*direct_fd = open(path, O_RDONLY | O_DIRECT);
+	if (*direct_fd < 0) {
+		fprintf(stderr, "libfatx: Warning: Could not open the device with O_DIRECT, "
+				"the kernel will cache it too: [%d] %s\n", errno, strerror(errno));
+	}
+	info->io_state = direct_fd;
+	return 0;
+}
+
+static void fatx_io_cache_end(fatx_fs_info *info) {
+	int *direct_fd = info->io_state;
+	if (*direct_fd >= 0) close(*direct_fd);
+	free(direct_fd);
+	info->io_state = NULL;
+}
+
+static void fatx_io_cache_submit(fatx_fs_info *info, struct fatx_aio *aio) {
+	int i;
+	for (i = 0; i < aio->count; i++) {
+		struct fatx_io_read *read = &aio->reads[i];
+		int ret;
+		if (info->block_cache != NULL) {
+			ret = fatx_cache_readv(info, read->iov, read->iovcnt, read->offset, FATX_CACHE_DATA);
+		} else {
+			ret = fatx_preadv_full(info->fd, read->iov, read->iovcnt, read->offset);
+		}
+		fatx_aio_read_done(read, ret < 0 ? errno : 0);
+	}
+}
+
+static int fatx_io_cache_poll(fatx_fs_info *info, struct fatx_aio *aio) {
+	(void) info;
+	(void) aio;
+	return 1;
+}
+
+static void fatx_io_cache_wait(fatx_fs_info *info, struct fatx_aio *aio) {
+	(void) info;
+	(void) aio;
+}
+
+const struct fatx_io_ops fatx_io_cache = {
+	.name = "cache",
+	.init = fatx_io_cache_init,
+	.end = fatx_io_cache_end,
+	.submit = fatx_io_cache_submit,
+	.poll = fatx_io_cache_poll,
+	.wait = fatx_io_cache_wait
+};
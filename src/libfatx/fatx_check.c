@@ -0,0 +1,506 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Consistency checking. The whole FAT is in memory (a private copy is
+ * read if info only pages it), so chains are walked without any I/O; the
+ * only reads are of directory clusters. Directories are handed out to
+ * worker threads through the queues of fatx_work.c. Every cluster a chain
+ * reaches is claimed in a shared bitmap with an atomic or, so a cluster
+ * claimed twice is a cycle (if the chain already holds it) or a cross
+ * link, and one never claimed but not free belongs to a lost chain, as
+ * long as every directory could be read: the contents of one that
+ * couldn't would look lost too, so then lost chains aren't looked for.
+ * Repairs are collected while checking and made afterwards, from one
+ * thread, under write_lock.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define FATX_CHECK_RUN 64 // directory clusters read at once
+
+/**
+ * A repair to a record and its chain: the record is deleted, or its chain
+ * ends at last (dropped if last is 0), its size becomes size, and the
+ * clusters in release, which the chain held past its new end, are freed.
+ */
+struct fatx_check_fix {
+	off_t record_offset;
+	int remove;
+	uint32_t first;
+	uint32_t last;
+	uint32_t size;
+	uint32_t *release;
+	size_t release_count;
+};
+
+struct fatx_check {
+	fatx_fs_info *info;
+	const fatx_check_options *opts;
+	fatx_check_result *result;
+	const void *fat;
+	void *fat_copy;
+	uint64_t *owned; // bit per cluster, set once a chain has reached it
+	struct fatx_work work; // directories, with record_offset -1 for the root
+	int error;
+	pthread_mutex_t lock; // reports, result and fixes
+	struct fatx_check_fix *fixes;
+	size_t fix_count, fix_allocated;
+};
+
+struct fatx_check_worker {
+	struct fatx_check *check;
+	unsigned int id;
+	pthread_t thread;
+	uint32_t *chain;
+	size_t chain_allocated;
+	uint8_t *buffer;
+};
+
+static inline uint32_t fatx_check_entry(struct fatx_check *check, uint32_t cluster) {
+	return check->info->geometry->load(check->fat, cluster);
+}
+
+/**
+ * Claims cluster for the chain being walked. Returns 0 if some chain
+ * (maybe this one) already had it.
+ */
+static inline int fatx_check_claim(struct fatx_check *check, uint32_t cluster) {
+	uint64_t bit = UINT64_C(1) << (cluster % 64);
+	return !(__atomic_fetch_or(&check->owned[cluster / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static void fatx_check_fail(struct fatx_check *check, int error) {
+	int expected = 0;
+	__atomic_compare_exchange_n(&check->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+__attribute__((format(printf, 4, 5)))
+static void fatx_check_report(struct fatx_check *check, int problem, const char *path,
+		const char *fmt, ...) {
+	char detail[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(detail, sizeof(detail), fmt, ap);
+	va_end(ap);
+	pthread_mutex_lock(&check->lock);
+	check->result->problems[problem]++;
+	if (check->opts->report != NULL) check->opts->report(problem, path, detail, check->opts->user);
+	pthread_mutex_unlock(&check->lock);
+}
+
+static void fatx_check_count(uint64_t *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queues a repair if repairs were asked for. release_count clusters from
+ * release are copied.
+ */
+static void fatx_check_fix(struct fatx_check *check, const struct fatx_check_fix *fix,
+		const uint32_t *release, size_t release_count) {
+	struct fatx_check_fix *slot;
+	if (!check->opts->repair) return;
+	pthread_mutex_lock(&check->lock);
+	if (check->fix_count == check->fix_allocated) {
+		size_t allocated = check->fix_allocated ? check->fix_allocated * 2 : 64;
+		struct fatx_check_fix *p = realloc(check->fixes, allocated * sizeof(struct fatx_check_fix));
+		if (p == NULL) {
+			pthread_mutex_unlock(&check->lock);
+			fatx_check_fail(check, -ENOMEM);
+			return;
+		}
+		check->fixes = p;
+		check->fix_allocated = allocated;
+	}
+	slot = &check->fixes[check->fix_count];
+	*slot = *fix;
+	slot->release = NULL;
+	slot->release_count = 0;
+	if (release_count > 0) {
+		slot->release = malloc(release_count * sizeof(uint32_t));
+		if (slot->release == NULL) {
+			pthread_mutex_unlock(&check->lock);
+			fatx_check_fail(check, -ENOMEM);
+			return;
+		}
+		memcpy(slot->release, release, release_count * sizeof(uint32_t));
+		slot->release_count = release_count;
+	}
+	check->fix_count++;
+	pthread_mutex_unlock(&check->lock);
+}
+
+/**
+ * Walks the chain starting at first, claiming each cluster and collecting
+ * it in worker->chain. Stops, reporting the problem against path, where
+ * the chain leaves the FAT, goes through a cluster marked free, loops or
+ * runs into another chain, and sets *broken if so. Returns the number of
+ * clusters the chain soundly holds, or -ENOMEM.
+ */
+static ssize_t fatx_check_chain(struct fatx_check_worker *worker, const char *path,
+		uint32_t first, int *broken) {
+	struct fatx_check *check = worker->check;
+	fatx_fs_info *info = check->info;
+	uint32_t cluster = first, next;
+	size_t n = 0, i;
+	*broken = 1;
+	if (cluster < 2 || cluster >= info->cluster_limit) {
+		fatx_check_report(check, FATX_CHECK_BAD_LINK, path, "first cluster %u is out of range", cluster);
+		return 0;
+	}
+	for (;;) {
+		if (!fatx_check_claim(check, cluster)) {
+			for (i = 0; i < n && worker->chain[i] != cluster; i++);
+			if (i < n) {
+				fatx_check_report(check, FATX_CHECK_CYCLE, path,
+						"chain loops back to cluster %u after %zu clusters", cluster, n);
+			} else {
+				fatx_check_report(check, FATX_CHECK_CROSS_LINK, path,
+						"cluster %u is also in another chain", cluster);
+			}
+			return n;
+		}
+		if (n == worker->chain_allocated) {
+			size_t allocated = n ? n * 2 : 1024;
+			uint32_t *p = realloc(worker->chain, allocated * sizeof(uint32_t));
+			if (p == NULL) return -ENOMEM;
+			worker->chain = p;
+			worker->chain_allocated = allocated;
+		}
+		worker->chain[n++] = cluster;
+		next = fatx_check_entry(check, cluster);
+		if (fatx_fat_is_last(info, next)) break;
+		if (next == 0) {
+			fatx_check_report(check, FATX_CHECK_BAD_LINK, path,
+					"cluster %u is in the chain but marked free", cluster);
+			return n;
+		}
+		if (next < 2 || next >= info->cluster_limit) {
+			fatx_check_report(check, FATX_CHECK_BAD_LINK, path,
+					"cluster %u links to cluster %u, which is out of range", cluster, next);
+			return n;
+		}
+		cluster = next;
+	}
+	*broken = 0;
+	return n;
+}
+
+/**
+ * Checks a file's chain against its size.
+ */
+static int fatx_check_file(struct fatx_check_worker *worker, const char *path, off_t record_offset,
+		uint32_t first, uint32_t size) {
+	struct fatx_check *check = worker->check;
+	struct fatx_check_fix fix = { record_offset, 0, first, 0, size, NULL, 0 };
+	size_t expected = ((size_t)size + FATX_CLUSTER_SIZE - 1) / FATX_CLUSTER_SIZE, keep;
+	ssize_t n = 0;
+	int broken = 0;
+	fatx_check_count(&check->result->files);
+	if (first != 0) {
+		n = fatx_check_chain(worker, path, first, &broken);
+		if (n < 0) return n;
+	}
+	if (!broken && (size_t)n != expected) {
+		fatx_check_report(check, FATX_CHECK_SIZE, path, "size %u needs %zu clusters, the chain has %zd",
+				size, expected, n);
+	}
+	if (!broken && (size_t)n == expected) return 0;
+	keep = min((size_t)n, expected);
+	fix.last = keep ? worker->chain[keep - 1] : 0;
+	fix.size = min((uint64_t)size, (uint64_t)keep * FATX_CLUSTER_SIZE);
+	fatx_check_fix(check, &fix, worker->chain + keep, n - keep);
+	return 0;
+}
+
+/**
+ * Checks the records in one directory cluster. Returns 1 at the end of
+ * the directory, 0 if the next cluster has to be looked at, or -errno.
+ */
+static int fatx_check_records(struct fatx_check_worker *worker, const struct fatx_work_dir *dir,
+		const uint8_t *data, uint32_t cluster) {
+	struct fatx_check *check = worker->check;
+	fatx_fs_info *info = check->info;
+	char path[1024];
+	size_t i, length = strlen(dir->path);
+	struct fatx_work_dir subdir = { 0, 0, 0, path };
+	int ret;
+	for (i = 0; i < FATX_RECORDS_PER_CLUSTER; i++) {
+		const struct fatx_internal_file_record *ifr =
+				(const struct fatx_internal_file_record *)data + i;
+		off_t record_offset = fatx_cluster_offset(info, cluster) + i * sizeof(*ifr);
+		if (ifr->name_length == 0xFF) return 1;
+		if (ifr->name_length == 0xE5) continue;
+		if (ifr->name_length == 0 || ifr->name_length > 42) {
+			struct fatx_check_fix fix = { record_offset, 1, 0, 0, 0, NULL, 0 };
+			fatx_check_report(check, FATX_CHECK_NAME, dir->path,
+					"record %zu of cluster %u has name length %u", i, cluster, ifr->name_length);
+			fatx_check_fix(check, &fix, NULL, 0);
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%.*s", length > 1 ? dir->path : "", ifr->name_length, ifr->name);
+		if (ifr->attributes & 0x10) {
+			subdir.cluster = fatx_to_host32(info, ifr->first_cluster);
+			subdir.record_offset = record_offset;
+			ret = fatx_work_push(&check->work, worker->id, &subdir);
+		} else {
+			ret = fatx_check_file(worker, path, record_offset, fatx_to_host32(info, ifr->first_cluster),
+					fatx_to_host32(info, ifr->size));
+		}
+		if (ret < 0) return ret;
+	}
+	return 0;
+}
+
+/**
+ * Walks a directory's chain and checks everything in it, reading runs of
+ * contiguous clusters with one call.
+ */
+static int fatx_check_dir(struct fatx_check_worker *worker, const struct fatx_work_dir *dir) {
+	struct fatx_check *check = worker->check;
+	fatx_fs_info *info = check->info;
+	uint32_t *chain;
+	ssize_t n = 1;
+	size_t i, run, j;
+	int broken = 0, ret = 0;
+	fatx_check_count(&check->result->directories);
+	if (dir->cluster == 1) {
+		if (worker->chain_allocated == 0) {
+			worker->chain = malloc(1024 * sizeof(uint32_t));
+			if (worker->chain == NULL) return -ENOMEM;
+			worker->chain_allocated = 1024;
+		}
+		worker->chain[0] = 1; // the root directory is one cluster, outside the FAT
+	} else {
+		n = fatx_check_chain(worker, dir->path, dir->cluster, &broken);
+		if (n < 0) return n;
+		if (broken) {
+			struct fatx_check_fix fix = { dir->record_offset, n == 0, dir->cluster, 0, 0, NULL, 0 };
+			if (n > 0) fix.last = worker->chain[n - 1];
+			fatx_check_fix(check, &fix, NULL, 0);
+		}
+	}
+	// checking files reuses worker->chain, so keep this directory's own copy
+	chain = malloc(max(n, (ssize_t)1) * sizeof(uint32_t));
+	if (chain == NULL) return -ENOMEM;
+	memcpy(chain, worker->chain, n * sizeof(uint32_t));
+	for (i = 0; i < (size_t)n && ret == 0; i += run) {
+		for (run = 1; run < FATX_CHECK_RUN && i + run < (size_t)n && chain[i + run] == chain[i] + run; run++);
+		if (fatx_read_at(info, worker->buffer, run * FATX_CLUSTER_SIZE, fatx_cluster_offset(info, chain[i])) < 0) {
+			fatx_check_report(check, FATX_CHECK_IO, dir->path, "reading cluster %u: %s",
+					chain[i], strerror(errno));
+			break;
+		}
+		for (j = 0; j < run && ret == 0; j++) {
+			ret = fatx_check_records(worker, dir, worker->buffer + j * FATX_CLUSTER_SIZE, chain[i + j]);
+		}
+	}
+	free(chain);
+	return ret < 0 ? ret : 0;
+}
+
+static void *fatx_check_worker(void *arg) {
+	struct fatx_check_worker *worker = arg;
+	struct fatx_check *check = worker->check;
+	struct fatx_work_dir dir;
+	int ret;
+	while (fatx_work_next(&check->work, worker->id, &dir)) {
+		if (__atomic_load_n(&check->error, __ATOMIC_RELAXED) == 0) {
+			ret = fatx_check_dir(worker, &dir);
+			if (ret < 0) fatx_check_fail(check, ret);
+		}
+		fatx_work_done(&check->work, &dir);
+	}
+	return NULL;
+}
+
+/**
+ * Finds the clusters that are in use but were never reached, reporting
+ * each lost chain by the cluster it starts at. Sets bits in lost for them.
+ * Only counts the clusters in use if a directory couldn't be read.
+ */
+static void fatx_check_lost(struct fatx_check *check, uint64_t *lost) {
+	fatx_fs_info *info = check->info;
+	uint64_t *reached = check->owned;
+	size_t words = (info->cluster_limit + 63) / 64, chains = 0;
+	uint32_t cluster, next;
+	// what an unreadable directory holds would look lost, and be freed
+	int unread = check->result->problems[FATX_CHECK_IO] > 0;
+	for (cluster = 2; cluster < info->cluster_limit; cluster++) {
+		if (fatx_check_entry(check, cluster) == 0) continue;
+		check->result->clusters_used++;
+		if (!unread && !(reached[cluster / 64] >> (cluster % 64) & 1)) {
+			lost[cluster / 64] |= UINT64_C(1) << (cluster % 64);
+			check->result->lost_clusters++;
+		}
+	}
+	if (check->result->lost_clusters == 0) return;
+	// a lost chain starts at a lost cluster no other lost cluster links to
+	memset(reached, 0, words * sizeof(uint64_t));
+	for (cluster = 2; cluster < info->cluster_limit; cluster++) {
+		if (!(lost[cluster / 64] >> (cluster % 64) & 1)) continue;
+		next = fatx_check_entry(check, cluster);
+		if (next >= 2 && next < info->cluster_limit) reached[next / 64] |= UINT64_C(1) << (next % 64);
+	}
+	for (cluster = 2; cluster < info->cluster_limit; cluster++) {
+		if (!(lost[cluster / 64] >> (cluster % 64) & 1) || (reached[cluster / 64] >> (cluster % 64) & 1)) continue;
+		fatx_check_report(check, FATX_CHECK_LOST_CHAIN, "", "lost chain starting at cluster %u", cluster);
+		chains++;
+	}
+	if (chains == 0) {
+		fatx_check_report(check, FATX_CHECK_LOST_CHAIN, "", "%llu lost clusters linked in a loop",
+				(unsigned long long)check->result->lost_clusters);
+	}
+}
+
+/**
+ * Makes the repairs collected while checking and frees the lost clusters
+ * (none are set in lost if a directory couldn't be read), then writes
+ * everything out and rebuilds the free cluster bitmap.
+ */
+static int fatx_check_repair(struct fatx_check *check, const uint64_t *lost) {
+	fatx_fs_info *info = check->info;
+	struct fatx_internal_file_record ifr;
+	uint32_t cluster;
+	size_t i, j;
+	int ret = 0;
+	pthread_mutex_lock(&info->write_lock);
+	for (i = 0; i < check->fix_count && ret == 0; i++) {
+		struct fatx_check_fix *fix = &check->fixes[i];
+		if (fatx_record_read(info, fix->record_offset, &ifr) < 0) {
+			ret = -EIO;
+			break;
+		}
+		if (fix->first != 0) fatx_extent_forget(info, fix->first);
+		if (fix->remove) {
+			ifr.name_length = 0xE5;
+		} else {
+			if (fix->last != 0) ret = fatx_fat_set(info, fix->last, fatx_fat_last(info));
+			else ifr.first_cluster = 0;
+			ifr.size = fatx_to_disk32(info, fix->size);
+		}
+		for (j = 0; j < fix->release_count && ret == 0; j++) ret = fatx_fat_set(info, fix->release[j], 0);
+		if (ret == 0) ret = fatx_record_write(info, fix->record_offset, &ifr);
+		if (ret == 0) check->result->repaired++;
+	}
+	for (cluster = 2; cluster < info->cluster_limit && ret == 0; cluster++) {
+		if (lost[cluster / 64] >> (cluster % 64) & 1) ret = fatx_fat_set(info, cluster, 0);
+	}
+	if (ret == 0) check->result->repaired += check->result->problems[FATX_CHECK_LOST_CHAIN];
+	fatx_caches_forget(info);
+	pthread_mutex_unlock(&info->write_lock);
+	if (ret == 0) ret = fatx_sync(info);
+	if (ret == 0) ret = fatx_free_map_reset(info);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Points check->fat at the whole table in host order, reading a copy if
+ * info only keeps pages of it.
+ */
+static int fatx_check_load_fat(struct fatx_check *check) {
+	fatx_fs_info *info = check->info;
+	if (info->fat != NULL) {
+		check->fat = info->fat;
+		return 0;
+	}
+	check->fat_copy = malloc(info->fat_entries * info->width);
+	if (check->fat_copy == NULL) return -ENOMEM;
+	if (fatx_read_at(info, check->fat_copy, info->fat_entries * info->width, info->fat_offset) < 0) {
+		fprintf(stderr, "libfatx: Error reading the FAT: [%d] %s\n", errno, strerror(errno));
+		return -EIO;
+	}
+	fatx_fat_to_host(info, check->fat_copy, info->fat_entries);
+	check->fat = check->fat_copy;
+	return 0;
+}
+
+int fatx_check(fatx_fs_info *info, const fatx_check_options *opts, fatx_check_result *result) {
+	struct fatx_check check;
+	struct fatx_check_worker *workers = NULL;
+	struct fatx_work_dir root = { 1, 0, -1, "/" };
+	uint64_t *lost = NULL;
+	size_t words = (info->cluster_limit + 63) / 64, i;
+	unsigned int started = 0;
+	int ret;
+	memset(result, 0, sizeof(fatx_check_result));
+	if (opts->repair && info->read_only) return -EROFS;
+	ret = fatx_sync(info); // everything is checked as it is on disk
+	if (ret < 0) return ret;
+	memset(&check, 0, sizeof(check));
+	check.info = info;
+	check.opts = opts;
+	check.result = result;
+	pthread_mutex_init(&check.lock, NULL);
+	check.owned = calloc(words, sizeof(uint64_t));
+	lost = calloc(words, sizeof(uint64_t));
+	if (fatx_work_init(&check.work, opts->threads) == 0) {
+		workers = calloc(check.work.threads, sizeof(struct fatx_check_worker));
+	}
+	if (check.owned == NULL || lost == NULL || workers == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = fatx_check_load_fat(&check);
+	if (ret < 0) goto out;
+	for (i = 0; i < check.work.threads; i++) {
+		workers[i].check = &check;
+		workers[i].id = i;
+		workers[i].buffer = malloc(FATX_CHECK_RUN * FATX_CLUSTER_SIZE);
+		if (workers[i].buffer == NULL) ret = -ENOMEM;
+	}
+	if (ret == 0) ret = fatx_work_push(&check.work, 0, &root);
+	if (ret < 0) goto out;
+	for (started = 0; started < check.work.threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, fatx_check_worker, &workers[started]) != 0) break;
+	}
+	if (started == 0) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	for (i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+	ret = check.error;
+	if (ret == 0) {
+		fatx_check_lost(&check, lost);
+		if (opts->repair) ret = fatx_check_repair(&check, lost);
+	}
+out:
+	if (workers != NULL) {
+		for (i = 0; i < check.work.threads; i++) {
+			free(workers[i].chain);
+			free(workers[i].buffer);
+		}
+	}
+	fatx_work_destroy(&check.work);
+	for (i = 0; i < check.fix_count; i++) free(check.fixes[i].release);
+	free(check.fixes);
+	free(workers);
+	free(check.owned);
+	free(check.fat_copy);
+	free(lost);
+	pthread_mutex_destroy(&check.lock);
+	return ret;
+}
@@ -0,0 +1,560 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Defragmenting. Every directory is walked first, measuring each chain
+ * (how many runs of contiguous clusters it is in) and claiming its
+ * clusters in a bitmap, which also finds chains that are damaged or share
+ * clusters; a filesystem with any of those is left for fsck. Then every
+ * fragmented chain, and every directory that would fit in fewer clusters
+ * without its deleted records, is given a run of clusters that were free
+ * at the start, largest chain first. Nothing is moved twice, and a chain
+ * is never moved into clusters another move frees, so a second run can
+ * use the space the first one left.
+ *
+ * Moves are done a batch at a time, in an order that keeps the data safe
+ * if it is interrupted at any point: the chains are copied and the copies
+ * synced; the new chains are linked in the FAT and synced, so a crash
+ * leaves them as lost chains that fsck frees; the records are pointed at
+ * the new chains and synced; and only then are the old chains freed.
+ * Directories are moved one at a time, deepest first, so that the record
+ * of a directory is always updated where its parent is at that moment,
+ * and are compacted as they are copied: only their live records go to
+ * the new chain, in the same order.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define FATX_DEFRAG_COPY_SIZE 0x400000 // bytes read before they are written out to the new chain
+#define FATX_DEFRAG_BATCH_SIZE 0x4000000 // bytes of files copied between FAT updates, by default
+#define FATX_DEFRAG_SIZE_BUCKETS 32 // free runs kept by power of two length
+
+/**
+ * A file or directory, and where it is to go. need is less than clusters
+ * for a directory that compacting shrinks.
+ */
+struct fatx_defrag_chain {
+	off_t record_offset;
+	uint32_t first;
+	uint32_t clusters;
+	uint32_t need;
+	uint32_t extents;
+	uint32_t target; // first cluster of the run it moves to, 0 if it stays
+	uint32_t depth;
+	int isdir;
+	char *path;
+};
+
+struct fatx_defrag_dir {
+	uint32_t cluster;
+	uint32_t depth;
+	char *path;
+	ssize_t chain; // index in chains, -1 for the root directory
+};
+
+struct fatx_defrag_run {
+	uint32_t start;
+	uint32_t length;
+};
+
+struct fatx_defrag {
+	fatx_fs_info *info;
+	const fatx_defrag_options *opts;
+	fatx_defrag_result *result;
+	uint64_t *owned; // bit per cluster, set once a chain has reached it
+	struct fatx_defrag_chain *chains;
+	size_t chain_count, chains_allocated;
+	struct fatx_defrag_dir *stack;
+	size_t stack_count, stack_allocated;
+	struct fatx_defrag_run *runs[FATX_DEFRAG_SIZE_BUCKETS];
+	size_t run_count[FATX_DEFRAG_SIZE_BUCKETS], runs_allocated[FATX_DEFRAG_SIZE_BUCKETS];
+	uint8_t *buffer; // FATX_DEFRAG_COPY_SIZE
+};
+
+static inline int fatx_defrag_log2(uint64_t n) {
+	return 63 - __builtin_clzll(n);
+}
+
+static int fatx_defrag_grow(void *array, size_t *allocated, size_t count, size_t size) {
+	size_t want = *allocated ? *allocated * 2 : 64;
+	void *p;
+	if (count < *allocated) return 0;
+	p = realloc(*(void **)array, want * size);
+	if (p == NULL) return -ENOMEM;
+	*(void **)array = p;
+	*allocated = want;
+	return 0;
+}
+
+/**
+ * Walks the chain starting at first, claiming its clusters and counting
+ * them and the runs they are in. With expect, the chain has to be exactly
+ * that long. Returns 0, 1 if the chain is damaged or shares a cluster with
+ * one walked before, or -errno.
+ */
+static int fatx_defrag_walk(struct fatx_defrag *d, uint32_t first, uint32_t expect,
+		uint32_t *clusters, uint32_t *extents) {
+	fatx_fs_info *info = d->info;
+	uint64_t runs[FATX_DEFRAG_RUN_BUCKETS] = {0};
+	uint32_t cluster = first, prev = 0, next, n = 0, count = 0, run = 0;
+	int i;
+	for (;;) {
+		if (cluster < 2 || cluster >= info->cluster_limit) return 1;
+		if (d->owned[cluster / 64] >> (cluster % 64) & 1) return 1;
+		d->owned[cluster / 64] |= UINT64_C(1) << (cluster % 64);
+		if (n > 0 && cluster == prev + 1) {
+			run++;
+		} else {
+			if (run > 0) runs[min(fatx_defrag_log2(run), FATX_DEFRAG_RUN_BUCKETS - 1)]++;
+			run = 1;
+			count++;
+		}
+		n++;
+		if (fatx_fat_entry(info, cluster, &next) < 0) return -EIO;
+		if (fatx_fat_is_last(info, next)) break;
+		if (expect != 0 && n == expect) return 1;
+		prev = cluster;
+		cluster = next;
+	}
+	if (expect != 0 && n != expect) return 1;
+	runs[min(fatx_defrag_log2(run), FATX_DEFRAG_RUN_BUCKETS - 1)]++;
+	for (i = 0; i < FATX_DEFRAG_RUN_BUCKETS; i++) d->result->runs[i] += runs[i];
+	d->result->clusters += n;
+	d->result->extents += count;
+	if (count > 1) d->result->fragmented++;
+	*clusters = n;
+	*extents = count;
+	return 0;
+}
+
+static char *fatx_defrag_path(const char *parent, const char *name) {
+	size_t a = strlen(parent), b = strlen(name);
+	char *path = malloc(a + b + 2);
+	if (path == NULL) return NULL;
+	memcpy(path, parent, a);
+	if (a == 0 || parent[a - 1] != '/') path[a++] = '/';
+	memcpy(path + a, name, b + 1);
+	return path;
+}
+
+static int fatx_defrag_add_chain(struct fatx_defrag *d, const struct fatx_defrag_chain *chain) {
+	if (fatx_defrag_grow(&d->chains, &d->chains_allocated, d->chain_count, sizeof(*d->chains)) < 0) {
+		return -ENOMEM;
+	}
+	d->chains[d->chain_count++] = *chain;
+	return 0;
+}
+
+/**
+ * Measures the files and subdirectories of dir, queueing the
+ * subdirectories, and decides whether dir itself is worth moving.
+ */
+static int fatx_defrag_survey_dir(struct fatx_defrag *d, struct fatx_defrag_dir *dir) {
+	fatx_fs_info *info = d->info;
+	struct fatx_dir_index *index;
+	struct fatx_defrag_chain chain;
+	fatx_file_record record;
+	size_t live = 0, i;
+	int ret = 0;
+	index = fatx_dir_index_build(info, dir->cluster);
+	if (index == NULL) {
+		d->result->problems++;
+		return 0;
+	}
+	if (index->corrupt) d->result->problems++;
+	for (i = 0; i < index->count && ret >= 0; i++) {
+		struct fatx_internal_file_record *ifr = &index->records[i];
+		uint32_t first = fatx_to_host32(info, ifr->first_cluster);
+		uint32_t size = fatx_to_host32(info, ifr->size);
+		if (index->classes[i] != FATX_RECORD_LIVE) continue;
+		live++;
+		memset(&chain, 0, sizeof(chain));
+		chain.record_offset = fatx_dir_index_record_offset(index, i);
+		chain.first = first;
+		chain.isdir = (ifr->attributes & 0x10) != 0;
+		chain.depth = dir->depth + 1;
+		if (chain.isdir) {
+			d->result->directories++;
+			ret = fatx_defrag_walk(d, first, 0, &chain.clusters, &chain.extents);
+		} else {
+			d->result->files++;
+			if (first == 0 && size == 0) continue;
+			if (first == 0 || size == 0) ret = 1;
+			else ret = fatx_defrag_walk(d, first, ((uint64_t)size + FATX_CLUSTER_SIZE - 1) >> 14,
+					&chain.clusters, &chain.extents);
+		}
+		if (ret != 0) {
+			if (ret > 0) d->result->problems++;
+			continue;
+		}
+		fatx_decode_record(info, ifr, &record);
+		chain.path = fatx_defrag_path(dir->path, record.name);
+		if (chain.path == NULL || fatx_defrag_add_chain(d, &chain) < 0) {
+			free(chain.path);
+			ret = -ENOMEM;
+			break;
+		}
+		if (chain.isdir) {
+			if (fatx_defrag_grow(&d->stack, &d->stack_allocated, d->stack_count, sizeof(*d->stack)) < 0) {
+				ret = -ENOMEM;
+				break;
+			}
+			d->stack[d->stack_count].cluster = first;
+			d->stack[d->stack_count].depth = chain.depth;
+			d->stack[d->stack_count].path = chain.path;
+			d->stack[d->stack_count++].chain = d->chain_count - 1;
+		}
+	}
+	if (ret >= 0 && dir->chain >= 0 && !index->corrupt) {
+		struct fatx_defrag_chain *self = &d->chains[dir->chain];
+		self->need = max((live + FATX_RECORDS_PER_CLUSTER - 1) / FATX_RECORDS_PER_CLUSTER, (size_t)1);
+		if (self->need > self->clusters) self->need = self->clusters;
+	}
+	fatx_dir_index_put(index);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Walks every directory from the root, measuring every chain.
+ */
+static int fatx_defrag_survey(struct fatx_defrag *d) {
+	struct fatx_defrag_dir dir;
+	size_t i;
+	int ret = 0;
+	d->stack = malloc(sizeof(*d->stack));
+	if (d->stack == NULL) return -ENOMEM;
+	d->stack_allocated = 1;
+	d->stack[0].cluster = 1;
+	d->stack[0].depth = 0;
+	d->stack[0].path = "/";
+	d->stack[0].chain = -1;
+	d->stack_count = 1;
+	while (d->stack_count > 0 && ret == 0) {
+		dir = d->stack[--d->stack_count];
+		ret = fatx_defrag_survey_dir(d, &dir);
+	}
+	// files, and directories whose index couldn't be built, keep their length
+	for (i = 0; i < d->chain_count; i++) {
+		if (d->chains[i].need == 0) d->chains[i].need = d->chains[i].clusters;
+	}
+	return ret;
+}
+
+static int fatx_defrag_run_add(struct fatx_defrag *d, uint32_t start, uint32_t length) {
+	int bucket = fatx_defrag_log2(length);
+	if (fatx_defrag_grow(&d->runs[bucket], &d->runs_allocated[bucket], d->run_count[bucket],
+			sizeof(struct fatx_defrag_run)) < 0) {
+		return -ENOMEM;
+	}
+	d->runs[bucket][d->run_count[bucket]].start = start;
+	d->runs[bucket][d->run_count[bucket]++].length = length;
+	return 0;
+}
+
+/**
+ * Collects the runs of free clusters, by power of two length.
+ */
+static int fatx_defrag_free_runs(struct fatx_defrag *d) {
+	fatx_fs_info *info = d->info;
+	uint64_t *free_map = calloc((info->cluster_limit + 63) / 64, sizeof(uint64_t));
+	uint32_t cluster, start;
+	int ret = 0;
+	if (free_map == NULL) return -ENOMEM;
+	if (fatx_fat_count_free(info, free_map) < 0) {
+		free(free_map);
+		return -EIO;
+	}
+	d->result->free_clusters = info->free_clusters;
+	for (cluster = 2; cluster < info->cluster_limit && ret == 0; ) {
+		if (!(free_map[cluster / 64] >> (cluster % 64) & 1)) {
+			cluster++;
+			continue;
+		}
+		start = cluster;
+		while (cluster < info->cluster_limit && (free_map[cluster / 64] >> (cluster % 64) & 1)) cluster++;
+		ret = fatx_defrag_run_add(d, start, cluster - start);
+		if (cluster - start > d->result->largest_free_run) d->result->largest_free_run = cluster - start;
+	}
+	free(free_map);
+	return ret;
+}
+
+/**
+ * Takes a run of length free clusters: the first long enough one among
+ * the runs of its own power of two, or else any longer run. What is left
+ * of the run goes back. Returns the first cluster, or 0 if there is none.
+ */
+static uint32_t fatx_defrag_take(struct fatx_defrag *d, uint32_t length) {
+	struct fatx_defrag_run run;
+	int bucket = fatx_defrag_log2(length);
+	size_t i;
+	for (; bucket < FATX_DEFRAG_SIZE_BUCKETS; bucket++) {
+		for (i = 0; i < d->run_count[bucket] && d->runs[bucket][i].length < length; i++);
+		if (i < d->run_count[bucket]) break;
+	}
+	if (bucket == FATX_DEFRAG_SIZE_BUCKETS) return 0;
+	run = d->runs[bucket][i];
+	d->runs[bucket][i] = d->runs[bucket][--d->run_count[bucket]];
+	// never fails: it goes to a bucket no bigger than one that just lost a run
+	if (run.length > length) fatx_defrag_run_add(d, run.start + length, run.length - length);
+	return run.start;
+}
+
+static int fatx_defrag_compare_need(const void *a, const void *b) {
+	const struct fatx_defrag_chain *x = *(struct fatx_defrag_chain * const *)a;
+	const struct fatx_defrag_chain *y = *(struct fatx_defrag_chain * const *)b;
+	return (x->need < y->need) - (x->need > y->need);
+}
+
+/**
+ * Gives every chain worth moving a run of free clusters, largest first.
+ */
+static int fatx_defrag_plan(struct fatx_defrag *d) {
+	struct fatx_defrag_chain **order;
+	size_t count = 0, i;
+	int ret = fatx_defrag_free_runs(d);
+	if (ret < 0) return ret;
+	order = malloc(max(d->chain_count, (size_t)1) * sizeof(*order));
+	if (order == NULL) return -ENOMEM;
+	for (i = 0; i < d->chain_count; i++) {
+		if (d->chains[i].extents > 1 || d->chains[i].need < d->chains[i].clusters) order[count++] = &d->chains[i];
+	}
+	qsort(order, count, sizeof(*order), fatx_defrag_compare_need);
+	for (i = 0; i < count; i++) {
+		struct fatx_defrag_chain *chain = order[i];
+		chain->target = fatx_defrag_take(d, chain->need);
+		if (chain->target == 0) {
+			d->result->unplaced++;
+		} else {
+			d->result->moved++;
+			d->result->moved_clusters += chain->need;
+			d->result->compacted_clusters += chain->clusters - chain->need;
+			d->result->extents_after -= chain->extents - 1;
+		}
+		if (d->opts->report != NULL) {
+			d->opts->report(chain->path, chain->clusters, chain->extents, chain->target, d->opts->user);
+		}
+	}
+	free(order);
+	return 0;
+}
+
+static int fatx_defrag_write(fatx_fs_info *info, const void *data, size_t size, off_t offset) {
+	struct iovec iov = { (void *)data, size };
+	return fatx_write_at(info, &iov, 1, offset) < 0 ? -EIO : 0;
+}
+
+/**
+ * Copies a file's chain to its new run, FATX_DEFRAG_COPY_SIZE at a time.
+ */
+static int fatx_defrag_copy_file(struct fatx_defrag *d, struct fatx_defrag_chain *chain) {
+	fatx_fs_info *info = d->info;
+	struct fatx_extent_map *map;
+	off_t dest = fatx_cluster_offset(info, chain->target), from;
+	size_t fill = 0, left, n, i;
+	int ret = 0;
+	map = fatx_extent_map_build(info, chain->first, chain->clusters);
+	if (map == NULL) return -EIO;
+	if (map->clusters != chain->clusters) ret = -EIO;
+	for (i = 0; i < map->count && ret == 0; i++) {
+		from = map->extents[i].disk_offset;
+		left = (size_t)map->extents[i].length << 14;
+		while (left > 0 && ret == 0) {
+			n = min(left, (size_t)FATX_DEFRAG_COPY_SIZE - fill);
+			if (fatx_read_at(info, d->buffer + fill, n, from) < 0) ret = -EIO;
+			fill += n;
+			from += n;
+			left -= n;
+			if (ret == 0 && fill == FATX_DEFRAG_COPY_SIZE) {
+				ret = fatx_defrag_write(info, d->buffer, fill, dest);
+				dest += fill;
+				fill = 0;
+			}
+		}
+	}
+	if (ret == 0 && fill > 0) ret = fatx_defrag_write(info, d->buffer, fill, dest);
+	fatx_extent_map_put(map);
+	return ret;
+}
+
+/**
+ * Writes a directory's live records to its new run, in order, leaving
+ * the rest of the run as end markers.
+ */
+static int fatx_defrag_copy_dir(struct fatx_defrag *d, struct fatx_defrag_chain *chain) {
+	fatx_fs_info *info = d->info;
+	struct fatx_dir_index *index;
+	struct fatx_internal_file_record *records;
+	size_t size = (size_t)chain->need * FATX_CLUSTER_SIZE, n = 0, i;
+	int ret = 0;
+	index = fatx_dir_index_build(info, chain->first);
+	if (index == NULL) return -EIO;
+	records = malloc(size);
+	if (records == NULL) {
+		fatx_dir_index_put(index);
+		return -ENOMEM;
+	}
+	memset(records, 0xFF, size);
+	for (i = 0; i < index->count; i++) {
+		if (index->classes[i] != FATX_RECORD_LIVE) continue;
+		if (n == (size_t)chain->need * FATX_RECORDS_PER_CLUSTER) {
+			ret = -EAGAIN; // it changed since the survey
+			break;
+		}
+		records[n++] = index->records[i];
+	}
+	if (ret == 0) ret = fatx_defrag_write(info, records, size, fatx_cluster_offset(info, chain->target));
+	free(records);
+	fatx_dir_index_put(index);
+	return ret;
+}
+
+/**
+ * Moves the chains of a batch: copies them and syncs, links the new runs
+ * in the FAT and syncs, points the records at them and syncs, then frees
+ * the old chains and syncs.
+ */
+static int fatx_defrag_move(struct fatx_defrag *d, struct fatx_defrag_chain **batch, size_t count) {
+	fatx_fs_info *info = d->info;
+	struct fatx_internal_file_record ifr;
+	uint32_t cluster, next, j;
+	size_t i;
+	int ret = 0;
+	for (i = 0; i < count && ret == 0; i++) {
+		ret = batch[i]->isdir ? fatx_defrag_copy_dir(d, batch[i]) : fatx_defrag_copy_file(d, batch[i]);
+	}
+	if (ret == 0) ret = fatx_sync(info);
+	if (ret < 0) return ret;
+	pthread_mutex_lock(&info->write_lock);
+	for (i = 0; i < count && ret == 0; i++) {
+		for (j = 0; j < batch[i]->need && ret == 0; j++) {
+			cluster = batch[i]->target + j;
+			if (fatx_fat_set(info, cluster, j + 1 < batch[i]->need ? cluster + 1 : fatx_fat_last(info)) < 0) {
+				ret = -EIO;
+			}
+		}
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	if (ret == 0) ret = fatx_sync(info);
+	if (ret < 0) return ret;
+	pthread_mutex_lock(&info->write_lock);
+	for (i = 0; i < count && ret == 0; i++) {
+		ret = fatx_record_read(info, batch[i]->record_offset, &ifr);
+		if (ret < 0) break;
+		if (fatx_to_host32(info, ifr.first_cluster) != batch[i]->first) {
+			ret = -EAGAIN;
+			break;
+		}
+		ifr.first_cluster = fatx_to_disk32(info, batch[i]->target);
+		ret = fatx_record_write(info, batch[i]->record_offset, &ifr);
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	if (ret == 0) ret = fatx_sync(info);
+	if (ret < 0) return ret;
+	pthread_mutex_lock(&info->write_lock);
+	for (i = 0; i < count && ret == 0; i++) {
+		fatx_extent_forget(info, batch[i]->first);
+		cluster = batch[i]->first;
+		for (j = 0; j < batch[i]->clusters && ret == 0; j++) {
+			if (fatx_fat_entry(info, cluster, &next) < 0 || fatx_fat_set(info, cluster, 0) < 0) ret = -EIO;
+			cluster = next;
+		}
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	if (ret == 0) ret = fatx_sync(info);
+	return ret;
+}
+
+static int fatx_defrag_compare_depth(const void *a, const void *b) {
+	const struct fatx_defrag_chain *x = *(struct fatx_defrag_chain * const *)a;
+	const struct fatx_defrag_chain *y = *(struct fatx_defrag_chain * const *)b;
+	return (x->depth < y->depth) - (x->depth > y->depth);
+}
+
+/**
+ * Moves the planned files in batches of opts->batch_size bytes, then the
+ * planned directories one at a time, deepest first.
+ */
+static int fatx_defrag_execute(struct fatx_defrag *d) {
+	size_t batch_size = d->opts->batch_size ? d->opts->batch_size : FATX_DEFRAG_BATCH_SIZE;
+	struct fatx_defrag_chain **batch;
+	size_t count = 0, dirs = 0, bytes = 0, i;
+	int ret = 0;
+	batch = malloc(max(d->chain_count, (size_t)1) * sizeof(*batch));
+	d->buffer = malloc(FATX_DEFRAG_COPY_SIZE);
+	if (batch == NULL || d->buffer == NULL) {
+		free(batch);
+		return -ENOMEM;
+	}
+	for (i = 0; i < d->chain_count && ret == 0; i++) {
+		struct fatx_defrag_chain *chain = &d->chains[i];
+		if (chain->target == 0 || chain->isdir) continue;
+		batch[count++] = chain;
+		bytes += (size_t)chain->clusters << 14;
+		if (bytes >= batch_size) {
+			ret = fatx_defrag_move(d, batch, count);
+			count = bytes = 0;
+		}
+	}
+	if (ret == 0 && count > 0) ret = fatx_defrag_move(d, batch, count);
+	for (i = 0; i < d->chain_count; i++) {
+		if (d->chains[i].target != 0 && d->chains[i].isdir) batch[dirs++] = &d->chains[i];
+	}
+	qsort(batch, dirs, sizeof(*batch), fatx_defrag_compare_depth);
+	for (i = 0; i < dirs && ret == 0; i++) ret = fatx_defrag_move(d, &batch[i], 1);
+	free(batch);
+	return ret;
+}
+
+int fatx_defrag(fatx_fs_info *info, const fatx_defrag_options *opts, fatx_defrag_result *result) {
+	struct fatx_defrag d;
+	size_t i;
+	int ret, freed;
+	memset(result, 0, sizeof(fatx_defrag_result));
+	if (!opts->dry_run && info->read_only) return -EROFS;
+	ret = fatx_sync(info); // everything is measured as it is on disk
+	if (ret < 0) return ret;
+	memset(&d, 0, sizeof(d));
+	d.info = info;
+	d.opts = opts;
+	d.result = result;
+	d.owned = calloc((info->cluster_limit + 63) / 64, sizeof(uint64_t));
+	if (d.owned == NULL) return -ENOMEM;
+	ret = fatx_defrag_survey(&d);
+	result->extents_after = result->extents;
+	if (ret == 0) ret = fatx_defrag_plan(&d);
+	if (ret == 0 && !opts->dry_run) {
+		if (result->problems > 0) ret = -EUCLEAN;
+		else if (result->moved > 0) ret = fatx_defrag_execute(&d);
+		freed = result->moved > 0 && fatx_free_map_reset(info) < 0;
+		if (ret == 0 && freed) ret = -EIO;
+	}
+	for (i = 0; i < d.chain_count; i++) free(d.chains[i].path);
+	for (i = 0; i < FATX_DEFRAG_SIZE_BUCKETS; i++) free(d.runs[i]);
+	free(d.chains);
+	free(d.stack);
+	free(d.buffer);
+	free(d.owned);
+	return ret;
+}
@@ -0,0 +1,117 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kernels for each of the four layouts a partition can have: little or
+ * big endian, with a 16 or 32 bit FAT. fatx_fs_init picks one set once it
+ * knows the layout, so the kernels never test the byte order or width,
+ * and their byte swaps are settled when they are compiled (to nothing for
+ * the host's own order).
+ */
+
+#include "fatx_internal.h"
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+/**
+ * Copies a name out of a record, null terminated. name has room for 43
+ * bytes, which fits any FATX name.
+ */
+static inline void fatx_geometry_name(char *name, const uint8_t *fatx_name, int length) {
+	if (length > 42) length = 42;
+	memcpy(name, fatx_name, length);
+	name[length] = 0;
+}
+
+#define FATX_GEOMETRY(variant, type, swap, swap32, order, mask, last_above) \
+static void fatx_fat_to_host_##variant(void *entries, size_t count) { \
+	type *e = entries; \
+	size_t i; \
+	for (i = 0; i < count; i++) e[i] = swap(e[i]); \
+} \
+\
+static uint32_t fatx_load_##variant(const void *fat, uint32_t index) { \
+	return __atomic_load_n(&((const type *)fat)[index], __ATOMIC_RELAXED); \
+} \
+\
+static void fatx_store_##variant(void *fat, uint32_t index, uint32_t value) { \
+	__atomic_store_n(&((type *)fat)[index], (type)value, __ATOMIC_RELAXED); \
+} \
+\
+static uint32_t fatx_chain_run_##variant(const void *fat, uint32_t limit, uint32_t cluster, \
+		uint32_t max, uint32_t *next) { \
+	const type *entries = fat; \
+	uint32_t n = 1, entry; \
+	for (;;) { \
+		entry = __atomic_load_n(&entries[cluster], __ATOMIC_RELAXED); \
+		if (n == max || entry != cluster + 1 || entry >= limit) break; \
+		cluster = entry; \
+		n++; \
+	} \
+	*next = entry; \
+	return n; \
+} \
+\
+static void fatx_decode_record_##variant(const struct fatx_internal_file_record *ifr, \
+		fatx_file_record *record) { \
+	fatx_geometry_name(record->name, ifr->name, ifr->name_length); \
+	record->isdir = (ifr->attributes & 0x10) != 0; \
+	record->size = (size_t)swap32(ifr->size); \
+	record->modified = fatx_time_fatx2unix(swap32(ifr->modified_time)); \
+	record->created = fatx_time_fatx2unix(swap32(ifr->created_time)); \
+	record->accessed = fatx_time_fatx2unix(swap32(ifr->accessed_time)); \
+} \
+\
+static uint32_t fatx_to_host32_##variant(uint32_t value) { \
+	return swap32(value); \
+} \
+\
+static const struct fatx_geometry_ops fatx_geometry_##variant = { \
+	#variant, order, sizeof(type), mask, last_above, (type)-1, \
+	fatx_fat_to_host_##variant, \
+	fatx_load_##variant, \
+	fatx_store_##variant, \
+	fatx_chain_run_##variant, \
+	fatx_decode_record_##variant, \
+	fatx_to_host32_##variant \
+};
+
+FATX_GEOMETRY(le16, uint16_t, le16toh, le32toh, LITTLE_ENDIAN, 0xFFFF, 0xFFF5)
+FATX_GEOMETRY(be16, uint16_t, be16toh, be32toh, BIG_ENDIAN, 0xFFFF, 0xFFF5)
+FATX_GEOMETRY(le32, uint32_t, le32toh, le32toh, LITTLE_ENDIAN, 0xFFFFFFF, 0xFFFFFF5)
+FATX_GEOMETRY(be32, uint32_t, be32toh, be32toh, BIG_ENDIAN, 0xFFFFFFF, 0xFFFFFF5)
+
+static const struct fatx_geometry_ops *fatx_geometries[] = {
+	&fatx_geometry_le16, &fatx_geometry_be16, &fatx_geometry_le32, &fatx_geometry_be32
+};
+
+/**
+ * Returns the kernels for a partition of the given byte order
+ * (LITTLE_ENDIAN or BIG_ENDIAN) and FAT entry width in bytes, or NULL if
+ * there are none.
+ */
+const struct fatx_geometry_ops *fatx_geometry_find(int endianness, size_t width) {
+	size_t i;
+	for (i = 0; i < sizeof(fatx_geometries) / sizeof(fatx_geometries[0]); i++) {
+		if (fatx_geometries[i]->endianness == endianness && fatx_geometries[i]->width == width) {
+			return fatx_geometries[i];
+		}
+	}
+	return NULL;
+}
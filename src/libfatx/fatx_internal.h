@@ -0,0 +1,659 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Structures and helpers shared between the libfatx source files.
+ * Nothing in here is part of the public interface.
+ */
+
+#ifndef FATX_INTERNAL_H_
+#define FATX_INTERNAL_H_
+
+#include <fatx.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <endian.h>
+
+#define FATX_MAGIC 0x46415458
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+#define FATX_CLUSTER_SIZE 0x4000
+#define FATX_FAT_PAGE_SIZE 0x4000
+#define FATX_FAT_MIN_PAGES 4
+#define FATX_DEFAULT_EXTENT_CACHE_SIZE 256
+#define FATX_DEFAULT_DENTRY_CACHE_SIZE 4096
+#define FATX_DEFAULT_DIR_INDEX_CACHE_SIZE 64
+#define FATX_RECORDS_PER_CLUSTER 256
+#define FATX_IOV_BATCH 64 // caller buffers passed to one preadv
+#define FATX_DEFAULT_IO_DEPTH 64
+#define FATX_AIO_LOCAL_READS 8 // reads held in a fatx_aio without allocating
+#define FATX_AIO_LOCAL_IOVS 16
+#define FATX_MMAP_SEQUENTIAL_SIZE 0x100000 // files this big are advised MADV_SEQUENTIAL
+#define FATX_NODE_BUCKETS 256
+#define FATX_DIRTY_CLUSTER_LIMIT 1024 // directory clusters changed before they are written out
+#define FATX_FLUSH_CHUNK 0x100000 // largest single write of FAT entries
+#define FATX_ALLOC_LOOKAHEAD 4096 // clusters a growing file asks to have free after it
+#define FATX_CACHE_META_SHARE 4 // the block cache gives 1/4 of its blocks to directory clusters
+#define FATX_CACHE_WEIGHT 3 // hits a metadata block can bank against eviction
+#define FATX_CACHE_BATCH 16 // missing blocks read from the device in one preadv
+#define FATX_CACHE_ALIGN 4096 // buffer and offset alignment O_DIRECT reads are given
+#define FATX_STAT_SHARDS 16 // copies of the counters, so threads don't share a cache line
+
+/**
+ * Intrusive list used by the caches to pick what to evict. Hits only set
+ * referenced (so they can happen under a read lock); the eviction scan
+ * gives referenced nodes a second chance at the head of the list.
+ */
+struct fatx_lru_node {
+	struct fatx_lru_node *prev, *next;
+	uint8_t referenced;
+};
+
+struct fatx_lru {
+	struct fatx_lru_node *head, *tail;
+	size_t count;
+};
+
+#define fatx_lru_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+static inline void fatx_lru_push(struct fatx_lru *lru, struct fatx_lru_node *node) {
+	node->referenced = 0;
+	node->prev = NULL;
+	node->next = lru->head;
+	if (lru->head) lru->head->prev = node;
+	else lru->tail = node;
+	lru->head = node;
+	lru->count++;
+}
+
+static inline void fatx_lru_remove(struct fatx_lru *lru, struct fatx_lru_node *node) {
+	if (node->prev) node->prev->next = node->next;
+	else lru->head = node->next;
+	if (node->next) node->next->prev = node->prev;
+	else lru->tail = node->prev;
+	lru->count--;
+}
+
+static inline void fatx_lru_touch(struct fatx_lru_node *node) {
+	if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&node->referenced, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Returns the node to evict from a non-empty list. The caller must hold
+ * the cache's lock for writing.
+ */
+static inline struct fatx_lru_node *fatx_lru_victim(struct fatx_lru *lru) {
+	struct fatx_lru_node *node;
+	size_t scanned;
+	for (scanned = 0; scanned < lru->count; scanned++) {
+		node = lru->tail;
+		if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) return node;
+		fatx_lru_remove(lru, node);
+		fatx_lru_push(lru, node);
+	}
+	return lru->tail;
+}
+
+/**
+ * One copy of the counters of a fatx_fs_info. fatx_get_stats adds the
+ * copies up.
+ */
+struct fatx_stat_shard {
+	uint64_t counters[FATX_STATS];
+} __attribute__((aligned(64)));
+
+/**
+ * The metadata sidecar of a fatx_fs_info, see fatx_sidecar.c. changes is
+ * set by the first change to the filesystem, under lock.
+ */
+struct fatx_sidecar {
+	char *path;
+	uint8_t *map; // the sidecar in use, or NULL if it was missing or stale
+	size_t map_size;
+	int changes;
+	int state; // FATX_SIDECAR_*
+	int stop; // set to make the builder give up
+	int started; // builder has to be joined
+	pthread_t builder;
+	pthread_mutex_t lock;
+};
+
+struct fatx_fs_info {
+	int fd;
+	unsigned int *device_refs; // partitions sharing fd and the I/O backend
+	int endianness;
+	size_t width;
+	const struct fatx_geometry_ops *geometry; // kernels for endianness and width
+	int mode;
+	off_t fat_offset;
+	size_t fat_size;
+	off_t end;
+	size_t size;
+	off_t root_dir;
+	size_t fat_entries;
+	void *fat; // whole table in host order, or NULL when paged
+	int fat_mapped; // fat points into map rather than at its own copy
+	struct fatx_fat_cache *fat_cache;
+	struct fatx_extent_cache *extent_cache;
+	struct fatx_dentry_cache *dentry_cache;
+	struct fatx_dir_index_cache *dir_index_cache;
+	struct fatx_block_cache *block_cache; // NULL unless fatx_fs_options.block_cache_size was set
+	const struct fatx_io_ops *io;
+	void *io_state;
+	uint8_t *map; // the whole image, with the mmap backend
+	size_t map_size;
+	struct fatx_node_table *nodes;
+	struct fatx_stat_shard *stats; // FATX_STAT_SHARDS of them, see fatx_count
+	struct fatx_sidecar *sidecar; // NULL unless fatx_fs_options.sidecar was set
+	int read_only;
+	uint32_t cluster_limit; // one past the last cluster that can be allocated
+	uint32_t free_clusters; // counted at mount, changed atomically under write_lock
+	/* everything below is only used when writing, under write_lock */
+	pthread_mutex_t write_lock;
+	uint64_t *free_map; // bit per cluster, set while the cluster is free
+	uint32_t alloc_hint; // where the search for a free run starts
+	uint8_t *fat_dirty; // per page of a wholly loaded FAT, changed since the last flush
+	struct fatx_dirty_clusters *dirty;
+};
+
+/**
+ * Holds pages of the FAT when the whole table doesn't fit in the memory
+ * limit given to fatx_fs_init_opts. Pages are byte-swapped to host order
+ * when they are loaded and evicted with the clock algorithm.
+ */
+struct fatx_fat_cache {
+	size_t page_count; // number of pages the table is split into
+	int32_t *page_slot; // page -> slot, or -1 if not loaded
+	size_t slot_count;
+	uint32_t *slot_page;
+	uint8_t *slot_referenced;
+	uint8_t *slot_dirty; // changed since it was read, written back on eviction
+	size_t hand;
+	uint8_t *data;
+	pthread_mutex_t lock;
+};
+
+/**
+ * A run of physically contiguous clusters in a file. file_cluster is the
+ * index of the run's first cluster within the file.
+ */
+struct fatx_extent {
+	uint32_t file_cluster;
+	uint32_t length;
+	off_t disk_offset;
+};
+
+/**
+ * The extents making up a file's cluster chain, in file order. Maps are
+ * shared between the extent cache and open handles and freed when the
+ * last reference is dropped.
+ */
+struct fatx_extent_map {
+	uint32_t first_cluster;
+	uint32_t clusters;
+	size_t refs;
+	size_t count;
+	size_t allocated;
+	struct fatx_extent *extents;
+	struct fatx_extent_map *hash_next;
+	struct fatx_lru_node lru;
+};
+
+/**
+ * Extent maps of recently used files, keyed by first cluster and
+ * bounded by dropping the least recently used map.
+ */
+struct fatx_extent_cache {
+	size_t limit;
+	size_t bucket_count;
+	struct fatx_extent_map **buckets;
+	struct fatx_lru lru;
+	uint64_t generation; // bumped when entries are dropped because the disk changed
+	pthread_rwlock_t lock;
+};
+
+
+/**
+ * A cached lookup of a case-folded name in the directory starting at
+ * parent. Negative entries remember names that aren't there.
+ */
+struct fatx_dentry {
+	uint32_t parent;
+	uint32_t hash;
+	uint8_t name_length;
+	char name[42];
+	int negative;
+	struct fatx_dirent entry;
+	struct fatx_dentry *hash_next;
+	struct fatx_lru_node lru;
+};
+
+struct fatx_dentry_cache {
+	size_t limit;
+	size_t bucket_count;
+	struct fatx_dentry **buckets;
+	struct fatx_lru lru;
+	uint64_t generation;
+	pthread_rwlock_t lock;
+};
+
+/**
+ * All records of a directory, read in one go, plus an open addressed
+ * hash table of their case-folded names. slots hold a record index + 1,
+ * with 0 marking an empty slot.
+ */
+struct fatx_dir_index {
+	uint32_t cluster;
+	size_t refs;
+	size_t count; // records before the end marker
+	size_t clusters;
+	int corrupt; // the directory ends in a record with an invalid name length
+	struct fatx_internal_file_record *records;
+	uint8_t *classes;
+	off_t *cluster_offsets;
+	struct fatx_dir_index_slot {
+		uint32_t hash;
+		uint32_t record;
+	} *slots;
+	size_t mask;
+	struct fatx_dir_index *hash_next;
+	struct fatx_lru_node lru;
+};
+
+struct fatx_dir_index_cache {
+	size_t limit;
+	size_t bucket_count;
+	struct fatx_dir_index **buckets;
+	struct fatx_lru lru;
+	uint64_t generation;
+	pthread_rwlock_t lock;
+};
+
+/* the pools of the block cache, and the queues its blocks are on */
+#define FATX_CACHE_META 0
+#define FATX_CACHE_DATA 1
+#define FATX_BLOCK_META 0 // metadata clock
+#define FATX_BLOCK_A1IN 1 // data read once, FIFO
+#define FATX_BLOCK_AM 2 // data asked for again after leaving A1in, clock
+#define FATX_BLOCK_FREE 0
+#define FATX_BLOCK_LOADING 1
+#define FATX_BLOCK_VALID 2
+
+/**
+ * A cluster of the data area held by the block cache. Blocks being read
+ * from the device are in the hash table already, so other readers of the
+ * same cluster wait for them rather than reading it again.
+ */
+struct fatx_cache_block {
+	off_t offset;
+	uint32_t length;
+	uint8_t state;
+	uint8_t queue;
+	uint8_t weight; // clock passes left before it can be evicted
+	struct fatx_cache_block *hash_next; // or the next free block of its pool
+	struct fatx_lru_node lru;
+	uint8_t *data;
+};
+
+/**
+ * See fatx_cache.c. A1out is a ring of the offsets of ghost_limit data
+ * blocks that recently left A1in, chained into a hash table by index.
+ */
+struct fatx_block_cache {
+	int direct_fd; // the device opened with O_DIRECT, -1 to use fd
+	size_t meta_blocks;
+	size_t data_blocks;
+	size_t bucket_count;
+	struct fatx_cache_block **buckets;
+	struct fatx_cache_block *blocks;
+	struct fatx_cache_block *free[2];
+	struct fatx_lru meta, a1in, am;
+	size_t a1in_limit;
+	off_t *ghosts;
+	int32_t *ghost_next;
+	int32_t *ghost_buckets;
+	size_t ghost_bucket_count;
+	size_t ghost_limit;
+	size_t ghost_head;
+	uint64_t hits[2];
+	uint64_t misses[2];
+	uint8_t *data;
+	pthread_mutex_t lock;
+	pthread_cond_t loaded; // broadcast when blocks finish loading
+};
+
+/**
+ * What every open handle of a file shares: its size and cluster chain,
+ * which writes change. Nodes are keyed by the offset of the file's record
+ * and live until the last handle is closed. A file unlinked while open
+ * keeps its node (and its record slot stays unused) until then, and its
+ * clusters are only freed at that point.
+ */
+struct fatx_node {
+	off_t record_offset;
+	size_t refs;
+	uint32_t first_cluster;
+	size_t size;
+	struct fatx_extent_map *map; // NULL while the file has no clusters
+	int unlinked; // changed under both write_lock and the table's lock
+	pthread_rwlock_t lock; // held for writing while size or map change
+	struct fatx_node *hash_next;
+};
+
+struct fatx_node_table {
+	struct fatx_node *buckets[FATX_NODE_BUCKETS];
+	pthread_mutex_t lock;
+};
+
+struct fatx_file {
+	fatx_fs_info *info;
+	struct fatx_node *node;
+};
+
+/**
+ * A cluster of directory records that has been changed in memory and not
+ * written back yet. Records are read from here before the disk.
+ */
+struct fatx_dirty_cluster {
+	off_t offset;
+	struct fatx_dirty_cluster *hash_next;
+	uint8_t data[FATX_CLUSTER_SIZE];
+};
+
+struct fatx_dirty_clusters {
+	size_t count;
+	struct fatx_dirty_cluster *buckets[FATX_DIRTY_CLUSTER_LIMIT];
+	pthread_rwlock_t lock; // readers copy records under it, write_lock holders change them
+	uint32_t *freed; // clusters freed since the last flush, still in use until it
+	size_t freed_count;
+	size_t freed_alloc;
+};
+
+struct fatx_internal_file_record {
+	uint8_t name_length;
+	uint8_t attributes;
+	uint8_t name[42];
+	uint32_t first_cluster;
+	uint32_t size;
+	uint32_t modified_time;
+	uint32_t created_time;
+	uint32_t accessed_time;
+}__attribute__((packed));
+
+/**
+ * Kernels for one byte order and FAT width, see fatx_geometry.c.
+ * fat_to_host converts count FAT entries to host order, or back.
+ * load and store read and write entry index of a FAT in host order
+ * atomically, so a table that a writer changes can be read at the same
+ * time. chain_run follows the chain from cluster through an in-memory FAT
+ * in host order while it stays contiguous, for at most max clusters, and
+ * returns how many clusters it went through; next gets the FAT entry of
+ * the last one. limit is one past the last cluster in the FAT.
+ * decode_record fills record from an on-disk record, and to_host32 swaps
+ * one of its fields to host order, or back. An entry ends a chain if its
+ * cluster bits (entry_mask) are above last_above; last is what is written
+ * to end one.
+ */
+struct fatx_geometry_ops {
+	const char *name;
+	int endianness;
+	size_t width;
+	uint32_t entry_mask;
+	uint32_t last_above;
+	uint32_t last;
+	void (*fat_to_host)(void *entries, size_t count);
+	uint32_t (*load)(const void *fat, uint32_t index);
+	void (*store)(void *fat, uint32_t index, uint32_t value);
+	uint32_t (*chain_run)(const void *fat, uint32_t limit, uint32_t cluster, uint32_t max, uint32_t *next);
+	void (*decode_record)(const struct fatx_internal_file_record *ifr, fatx_file_record *record);
+	uint32_t (*to_host32)(uint32_t value);
+};
+
+const struct fatx_geometry_ops *fatx_geometry_find(int endianness, size_t width);
+
+static inline uint32_t fatx_to_host32(fatx_fs_info *info, uint32_t value) {
+	return info->geometry->to_host32(value);
+}
+
+static inline uint32_t fatx_to_disk32(fatx_fs_info *info, uint32_t value) {
+	return info->geometry->to_host32(value); // the same swap converts back
+}
+
+static inline off_t fatx_cluster_offset(fatx_fs_info *info, uint32_t cluster) {
+	return ((off_t)(cluster - 1) << 14) + info->root_dir;
+}
+
+static inline int fatx_fat_is_last(fatx_fs_info *info, uint32_t entry) {
+	return (entry & info->geometry->entry_mask) > info->geometry->last_above;
+}
+
+static inline uint32_t fatx_fat_last(fatx_fs_info *info) {
+	return info->geometry->last;
+}
+
+static inline uint32_t fatx_offset_cluster(fatx_fs_info *info, off_t offset) {
+	return ((offset - info->root_dir) >> 14) + 1;
+}
+
+extern __thread unsigned int fatx_stat_shard;
+unsigned int fatx_stat_shard_pick(void);
+
+/**
+ * Adds n to a counter of info. Every thread counts into a shard it picks
+ * the first time (round robin), so the add is almost never contended.
+ */
+static inline void fatx_count(fatx_fs_info *info, int stat, uint64_t n) {
+	unsigned int shard = fatx_stat_shard;
+	if (shard == 0) shard = fatx_stat_shard_pick();
+	__atomic_add_fetch(&info->stats[shard - 1].counters[stat], n, __ATOMIC_RELAXED);
+}
+
+#define fatx_warn_corruption(fmt, ...) fprintf(stderr, "libfatx: Warning: Possible filesystem corruption:\n" fmt "\n(file: %s, line: %d)\n", __VA_ARGS__, __FILE__, __LINE__)
+
+/* Record classes produced by fatx_scan->classify */
+#define FATX_RECORD_LIVE 0
+#define FATX_RECORD_DELETED 1
+#define FATX_RECORD_END 2
+#define FATX_RECORD_INVALID 3
+
+/* Size of the buffer holding a case-folded name for fatx_scan->name_equal */
+#define FATX_FOLDED_NAME_SIZE 48
+
+/**
+ * Directory scanning kernels, see fatx_scan.c.
+ * classify stores the class of each record in classes and returns the
+ * index of the first end marker or invalid record (count if none).
+ * name_equal compares a record's name case insensitively against a
+ * lowercased name, zero padded to FATX_FOLDED_NAME_SIZE bytes.
+ * count_free returns how many of count FAT entries of the given width are
+ * zero (free); if mask isn't NULL, bit i % 64 of mask[i / 64] is set to
+ * whether entry i is. Byte order doesn't matter to it.
+ */
+struct fatx_scan_ops {
+	const char *name;
+	size_t (*classify)(const struct fatx_internal_file_record *records,
+			size_t count, uint8_t *classes);
+	int (*name_equal)(const struct fatx_internal_file_record *record,
+			const uint8_t *folded, size_t length);
+	size_t (*count_free)(const void *entries, size_t width, size_t count, uint64_t *mask);
+};
+
+extern const struct fatx_scan_ops *fatx_scan;
+void fatx_scan_init(void);
+const struct fatx_scan_ops *fatx_scan_find(const char *name);
+
+/**
+ * One device read belonging to a fatx_aio: a run of contiguous clusters
+ * going into iovcnt of the caller's buffers.
+ */
+struct fatx_io_read {
+	struct fatx_aio *aio;
+	off_t offset;
+	struct iovec *iov;
+	int iovcnt;
+};
+
+/**
+ * A read of a file range, split into device reads that a backend may
+ * have in flight at the same time. pending counts the reads that haven't
+ * completed; error holds the first errno seen.
+ */
+struct fatx_aio {
+	fatx_fs_info *info;
+	size_t size;
+	int pending;
+	int error;
+	int count;
+	int iov_count;
+	struct fatx_io_read *reads;
+	struct iovec *iovs;
+	int reads_allocated;
+	int iovs_allocated;
+	struct fatx_io_read local_reads[FATX_AIO_LOCAL_READS];
+	struct iovec local_iovs[FATX_AIO_LOCAL_IOVS];
+};
+
+/**
+ * An I/O backend. submit starts every read of an aio (the sync backend
+ * finishes them before returning), poll returns 1 once they have all
+ * completed, and wait blocks until they have. All three may be called
+ * from any number of threads at once.
+ */
+struct fatx_io_ops {
+	const char *name;
+	int (*init)(fatx_fs_info *info, const fatx_fs_options *opts);
+	void (*end)(fatx_fs_info *info);
+	void (*submit)(fatx_fs_info *info, struct fatx_aio *aio);
+	int (*poll)(fatx_fs_info *info, struct fatx_aio *aio);
+	void (*wait)(fatx_fs_info *info, struct fatx_aio *aio);
+};
+
+extern const struct fatx_io_ops fatx_io_sync;
+extern const struct fatx_io_ops fatx_io_mmap;
+extern const struct fatx_io_ops fatx_io_cache;
+#ifdef HAVE_LIBURING
+extern const struct fatx_io_ops fatx_io_uring;
+#endif
+int fatx_preadv_full(int fd, struct iovec *iov, int iovcnt, off_t offset);
+int fatx_pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t offset);
+void fatx_aio_read_done(struct fatx_io_read *read, int error);
+
+/* directories handed out to a pool of threads, see fatx_work.c */
+struct fatx_work_dir {
+	uint32_t cluster;
+	int depth;
+	off_t record_offset;
+	char *path;
+};
+
+struct fatx_work_queue {
+	pthread_mutex_t lock;
+	struct fatx_work_dir *items;
+	size_t start, end, allocated;
+};
+
+struct fatx_work {
+	unsigned int threads;
+	struct fatx_work_queue *queues;
+	pthread_mutex_t lock; // queued and pending
+	pthread_cond_t wake; // a directory was queued, or the last one done
+	size_t queued; // directories on the queues
+	size_t pending; // directories queued or being worked on
+};
+
+/* fatx.c, shared with the write support in fatx_write.c */
+void fatx_name_ansi2fatx(uint8_t *fatx_name, const char *ansi_name, int *length);
+uint32_t fatx_time_unix2fatx(time_t time);
+time_t fatx_time_fatx2unix(uint32_t time);
+int fatx_decode_record(fatx_fs_info *info, struct fatx_internal_file_record *ifr,
+		fatx_file_record *file_record);
+int fatx_read_at(fatx_fs_info *info, void *buffer, size_t size, off_t offset);
+void fatx_fat_to_host(fatx_fs_info *info, void *entries, size_t count);
+int fatx_fat_entry(fatx_fs_info *info, uint32_t cluster, uint32_t *entry);
+int fatx_fat_set(fatx_fs_info *info, uint32_t cluster, uint32_t value);
+int fatx_fat_flush(fatx_fs_info *info);
+int fatx_fat_count_free(fatx_fs_info *info, uint64_t *mask);
+int fatx_dir_lookup(fatx_fs_info *info, uint32_t cluster, const char *name,
+		struct fatx_dirent *entry);
+struct fatx_dir_index *fatx_dir_index_build(fatx_fs_info *info, uint32_t cluster);
+struct fatx_dir_index *fatx_dir_index_get(fatx_fs_info *info, uint32_t cluster);
+int fatx_dir_index_entry(fatx_fs_info *info, struct fatx_dir_index *index, size_t i,
+		struct fatx_dirent *entry);
+void fatx_dir_index_put(struct fatx_dir_index *index);
+void fatx_dir_index_forget(fatx_fs_info *info, uint32_t cluster);
+void fatx_dentry_forget(fatx_fs_info *info, uint32_t parent, const char *name);
+void fatx_dentry_forget_parent(fatx_fs_info *info, uint32_t parent);
+void fatx_extent_forget(fatx_fs_info *info, uint32_t first_cluster);
+void fatx_caches_forget(fatx_fs_info *info);
+struct fatx_extent_map *fatx_extent_map_new(uint32_t first_cluster);
+struct fatx_extent_map *fatx_extent_map_build(fatx_fs_info *info, uint32_t first_cluster,
+		uint32_t clusters);
+void fatx_extent_map_put(struct fatx_extent_map *map);
+size_t fatx_extent_find(struct fatx_extent_map *map, uint32_t file_cluster);
+int fatx_node_busy(fatx_fs_info *info, off_t record_offset);
+int fatx_node_unlink(fatx_fs_info *info, off_t record_offset);
+void fatx_node_move(fatx_fs_info *info, off_t from, off_t to);
+
+static inline off_t fatx_dir_index_record_offset(struct fatx_dir_index *index, size_t i) {
+	return index->cluster_offsets[i / FATX_RECORDS_PER_CLUSTER] +
+			(off_t)(i % FATX_RECORDS_PER_CLUSTER) * sizeof(struct fatx_internal_file_record);
+}
+
+/* fatx_cache.c */
+int fatx_block_cache_init(fatx_fs_info *info, size_t size);
+void fatx_block_cache_free(struct fatx_block_cache *cache);
+int fatx_cache_readv(fatx_fs_info *info, const struct iovec *iov, int iovcnt, off_t offset, int pool);
+int fatx_write_at(fatx_fs_info *info, struct iovec *iov, int iovcnt, off_t offset);
+
+/* fatx_sidecar.c */
+int fatx_sidecar_open(fatx_fs_info *info, const char *path);
+void *fatx_sidecar_fat_table(fatx_fs_info *info);
+int fatx_sidecar_dir(fatx_fs_info *info, uint32_t cluster, struct fatx_dir_index *index);
+struct fatx_extent_map *fatx_sidecar_extents(fatx_fs_info *info, uint32_t first_cluster, uint32_t clusters);
+void fatx_sidecar_changed(fatx_fs_info *info);
+void fatx_sidecar_stop(fatx_fs_info *info);
+void fatx_sidecar_free(struct fatx_sidecar *sidecar);
+
+/* fatx_work.c */
+int fatx_work_init(struct fatx_work *work, unsigned int threads);
+void fatx_work_destroy(struct fatx_work *work);
+int fatx_work_push(struct fatx_work *work, unsigned int id, const struct fatx_work_dir *dir);
+int fatx_work_next(struct fatx_work *work, unsigned int id, struct fatx_work_dir *dir);
+void fatx_work_done(struct fatx_work *work, struct fatx_work_dir *dir);
+
+/* fatx_write.c */
+int fatx_write_init(fatx_fs_info *info);
+void fatx_write_end(fatx_fs_info *info);
+int fatx_read_meta(fatx_fs_info *info, void *buffer, size_t size, off_t offset);
+int fatx_record_refresh(fatx_fs_info *info, off_t record_offset,
+		struct fatx_internal_file_record *ifr);
+int fatx_record_read(fatx_fs_info *info, off_t record_offset,
+		struct fatx_internal_file_record *ifr);
+int fatx_record_write(fatx_fs_info *info, off_t record_offset,
+		const struct fatx_internal_file_record *ifr);
+int fatx_free_map_reset(fatx_fs_info *info);
+void fatx_node_release(fatx_fs_info *info, struct fatx_node *node);
+
+#endif /* FATX_INTERNAL_H_ */
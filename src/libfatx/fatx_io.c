@@ -0,0 +1,366 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I/O backends for file data. The sync backend does each read with
+ * preadv as soon as it is submitted. The io_uring backend (built when
+ * configure finds liburing) queues every read of a request on a ring
+ * shared by all threads, submits them in one go and reaps them together.
+ * The mmap backend maps an image file once and copies out of the mapping.
+ */
+
+#include "fatx_internal.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/**
+ * Reads until every buffer in iov is full, retrying short reads. iov is
+ * updated as the data arrives. Returns 0, or -1 with errno set.
+ */
+int fatx_preadv_full(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	while (iovcnt > 0) {
+		ssize_t ret = preadv(fd, iov, iovcnt, offset);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret == 0) errno = EIO;
+		if (ret <= 0) return -1;
+		offset += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Writes every buffer in iov, retrying short writes. iov is updated as the
+ * data goes out. Returns 0, or -1 with errno set.
+ */
+int fatx_pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	while (iovcnt > 0) {
+		ssize_t ret = pwritev(fd, iov, iovcnt, offset);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret == 0) errno = EIO;
+		if (ret <= 0) return -1;
+		offset += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Records that read has finished, with error 0 on success.
+ */
+void fatx_aio_read_done(struct fatx_io_read *read, int error) {
+	struct fatx_aio *aio = read->aio;
+	if (error != 0) {
+		int none = 0;
+		__atomic_compare_exchange_n(&aio->error, &none, error, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&aio->pending, 1, __ATOMIC_RELEASE);
+}
+
+static int fatx_io_sync_init(fatx_fs_info *info, const fatx_fs_options *opts) {
+	(void) info;
+	(void) opts;
+	return 0;
+}
+
+static void fatx_io_sync_end(fatx_fs_info *info) {
+	(void) info;
+}
+
+static void fatx_io_sync_submit(fatx_fs_info *info, struct fatx_aio *aio) {
+	int i;
+	for (i = 0; i < aio->count; i++) {
+		struct fatx_io_read *read = &aio->reads[i];
+		int ret = fatx_preadv_full(info->fd, read->iov, read->iovcnt, read->offset);
+		fatx_aio_read_done(read, ret < 0 ? errno : 0);
+	}
+}
+
+static int fatx_io_sync_poll(fatx_fs_info *info, struct fatx_aio *aio) {
+	(void) info;
+	(void) aio;
+	return 1;
+}
+
+static void fatx_io_sync_wait(fatx_fs_info *info, struct fatx_aio *aio) {
+	(void) info;
+	(void) aio;
+}
+
+const struct fatx_io_ops fatx_io_sync = {
+	.name = "sync",
+	.init = fatx_io_sync_init,
+	.end = fatx_io_sync_end,
+	.submit = fatx_io_sync_submit,
+	.poll = fatx_io_sync_poll,
+	.wait = fatx_io_sync_wait
+};
+
+/**
+ * Maps the image read only. Block devices are left to the fd backends:
+ * their size isn't known to fstat and mapping them gains little over the
+ * kernel's own buffer cache.
+ */
+static int fatx_io_mmap_init(fatx_fs_info *info, const fatx_fs_options *opts) {
+	struct stat st;
+	void *map;
+	if (fstat(info->fd, &st) < 0) return -errno;
+	if (!S_ISREG(st.st_mode)) return -ENODEV;
+	if ((off_t)(size_t)st.st_size != st.st_size) return -EFBIG;
+	map = mmap(NULL, st.st_size, PROT_READ,
+			MAP_SHARED | (opts->mmap_populate ? MAP_POPULATE : 0), info->fd, 0);
+	if (map == MAP_FAILED) return -errno;
+	// lookups jump around the FAT and directories; big files ask for more
+	madvise(map, st.st_size, MADV_RANDOM);
+	info->map = map;
+	info->map_size = st.st_size;
+	return 0;
+}
+
+static void fatx_io_mmap_end(fatx_fs_info *info) {
+	if (info->map != NULL) munmap(info->map, info->map_size);
+	info->map = NULL;
+}
+
+static void fatx_io_mmap_submit(fatx_fs_info *info, struct fatx_aio *aio) {
+	int i, j;
+	for (i = 0; i < aio->count; i++) {
+		struct fatx_io_read *read = &aio->reads[i];
+		off_t offset = read->offset;
+		int error = 0;
+		for (j = 0; j < read->iovcnt; j++) {
+			if (offset + read->iov[j].iov_len > info->map_size) {
+				error = EIO;
+				break;
+			}
+			memcpy(read->iov[j].iov_base, info->map + offset, read->iov[j].iov_len);
+			offset += read->iov[j].iov_len;
+		}
+		fatx_aio_read_done(read, error);
+	}
+}
+
+const struct fatx_io_ops fatx_io_mmap = {
+	.name = "mmap",
+	.init = fatx_io_mmap_init,
+	.end = fatx_io_mmap_end,
+	.submit = fatx_io_mmap_submit,
+	.poll = fatx_io_sync_poll,
+	.wait = fatx_io_sync_wait
+};
+
+#ifdef HAVE_LIBURING
+
+/**
+ * The ring and what guards it. Submitters serialize on sq_lock. One
+ * thread at a time reaps completions (reaping is set while it does);
+ * the others wait on cq_cond for it to finish a round.
+ */
+struct fatx_uring {
+	struct io_uring ring;
+	unsigned int depth;
+	unsigned int inflight;
+	pthread_mutex_t sq_lock;
+	pthread_mutex_t cq_lock;
+	pthread_cond_t cq_cond;
+	int reaping;
+};
+
+static int fatx_io_uring_init(fatx_fs_info *info, const fatx_fs_options *opts) {
+	struct fatx_uring *u = calloc(1, sizeof(struct fatx_uring));
+	unsigned int depth = opts->io_depth ? opts->io_depth : FATX_DEFAULT_IO_DEPTH;
+	int ret;
+	if (u == NULL) return -ENOMEM;
+	ret = io_uring_queue_init(depth, &u->ring, 0);
+	if (ret < 0) {
+		free(u);
+		return ret;
+	}
+	u->depth = depth;
+	pthread_mutex_init(&u->sq_lock, NULL);
+	pthread_mutex_init(&u->cq_lock, NULL);
+	pthread_cond_init(&u->cq_cond, NULL);
+	info->io_state = u;
+	return 0;
+}
+
+static void fatx_io_uring_end(fatx_fs_info *info) {
+	struct fatx_uring *u = info->io_state;
+	if (u == NULL) return;
+	io_uring_queue_exit(&u->ring);
+	pthread_mutex_destroy(&u->sq_lock);
+	pthread_mutex_destroy(&u->cq_lock);
+	pthread_cond_destroy(&u->cq_cond);
+	free(u);
+	info->io_state = NULL;
+}
+
+/**
+ * Queues read on the ring. Called with sq_lock held. Returns 0, or -1 if
+ * the ring has no free entry.
+ */
+static int fatx_io_uring_queue(struct fatx_uring *u, int fd, struct fatx_io_read *read) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&u->ring);
+		sqe = io_uring_get_sqe(&u->ring);
+		if (sqe == NULL) return -1;
+	}
+	io_uring_prep_readv(sqe, fd, read->iov, read->iovcnt, read->offset);
+	io_uring_sqe_set_data(sqe, read);
+	__atomic_add_fetch(&u->inflight, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Queues the rest of a read that came back short, or fails it.
+ */
+static void fatx_io_uring_resubmit(fatx_fs_info *info, struct fatx_io_read *read) {
+	struct fatx_uring *u = info->io_state;
+	int ret;
+	pthread_mutex_lock(&u->sq_lock);
+	ret = fatx_io_uring_queue(u, info->fd, read);
+	if (ret == 0) io_uring_submit(&u->ring);
+	pthread_mutex_unlock(&u->sq_lock);
+	if (ret < 0) fatx_aio_read_done(read, EAGAIN);
+}
+
+static void fatx_io_uring_complete(fatx_fs_info *info, struct fatx_io_read *read, int res) {
+	if (res == -EINTR || res == -EAGAIN) {
+		fatx_io_uring_resubmit(info, read);
+		return;
+	}
+	if (res <= 0) {
+		fatx_aio_read_done(read, res == 0 ? EIO : -res);
+		return;
+	}
+	read->offset += res;
+	while (read->iovcnt > 0 && (size_t)res >= read->iov->iov_len) {
+		res -= read->iov->iov_len;
+		read->iov++;
+		read->iovcnt--;
+	}
+	if (read->iovcnt == 0) {
+		fatx_aio_read_done(read, 0);
+		return;
+	}
+	read->iov->iov_base = (uint8_t *)read->iov->iov_base + res;
+	read->iov->iov_len -= res;
+	fatx_io_uring_resubmit(info, read);
+}
+
+/**
+ * Takes a turn reaping completions for every thread. With block set,
+ * waits for at least one, unless aio (or, without one, every read in
+ * flight) turns out to have completed already. If another thread is
+ * reaping, returns without doing anything (after its turn, when blocking).
+ */
+static void fatx_io_uring_reap(fatx_fs_info *info, struct fatx_aio *aio, int block) {
+	struct fatx_uring *u = info->io_state;
+	struct io_uring_cqe *cqe;
+	int ret;
+	pthread_mutex_lock(&u->cq_lock);
+	if (u->reaping) {
+		if (block) pthread_cond_wait(&u->cq_cond, &u->cq_lock);
+		pthread_mutex_unlock(&u->cq_lock);
+		return;
+	}
+	u->reaping = 1;
+	pthread_mutex_unlock(&u->cq_lock);
+	// the last reaper may have finished what we were about to wait for
+	if (block && (aio != NULL ? __atomic_load_n(&aio->pending, __ATOMIC_ACQUIRE) :
+			__atomic_load_n(&u->inflight, __ATOMIC_RELAXED)) == 0) {
+		block = 0;
+	}
+	ret = block ? io_uring_wait_cqe(&u->ring, &cqe) : io_uring_peek_cqe(&u->ring, &cqe);
+	if (ret == 0) {
+		do {
+			struct fatx_io_read *read = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			io_uring_cqe_seen(&u->ring, cqe);
+			__atomic_sub_fetch(&u->inflight, 1, __ATOMIC_RELAXED);
+			fatx_io_uring_complete(info, read, res);
+		} while (io_uring_peek_cqe(&u->ring, &cqe) == 0);
+	}
+	pthread_mutex_lock(&u->cq_lock);
+	u->reaping = 0;
+	pthread_cond_broadcast(&u->cq_cond);
+	pthread_mutex_unlock(&u->cq_lock);
+}
+
+static void fatx_io_uring_submit(fatx_fs_info *info, struct fatx_aio *aio) {
+	struct fatx_uring *u = info->io_state;
+	int i = 0;
+	while (i < aio->count) {
+		pthread_mutex_lock(&u->sq_lock);
+		for (; i < aio->count; i++) {
+			// keep completions from outrunning the completion ring
+			if (__atomic_load_n(&u->inflight, __ATOMIC_RELAXED) >= u->depth) break;
+			if (fatx_io_uring_queue(u, info->fd, &aio->reads[i]) < 0) break;
+		}
+		io_uring_submit(&u->ring);
+		pthread_mutex_unlock(&u->sq_lock);
+		if (i < aio->count) fatx_io_uring_reap(info, NULL, 1);
+	}
+}
+
+static int fatx_io_uring_poll(fatx_fs_info *info, struct fatx_aio *aio) {
+	if (__atomic_load_n(&aio->pending, __ATOMIC_ACQUIRE) > 0) fatx_io_uring_reap(info, aio, 0);
+	return __atomic_load_n(&aio->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void fatx_io_uring_wait(fatx_fs_info *info, struct fatx_aio *aio) {
+	while (__atomic_load_n(&aio->pending, __ATOMIC_ACQUIRE) > 0) fatx_io_uring_reap(info, aio, 1);
+}
+
+const struct fatx_io_ops fatx_io_uring = {
+	.name = "io_uring",
+	.init = fatx_io_uring_init,
+	.end = fatx_io_uring_end,
+	.submit = fatx_io_uring_submit,
+	.poll = fatx_io_uring_poll,
+	.wait = fatx_io_uring_wait
+};
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,747 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * STFS packages. After the header, a package is a run of 4 KiB blocks:
+ * data blocks with hash tables between them. A level 0 table holds the
+ * SHA-1 and the next block in the chain of 170 (0xAA) data blocks, a
+ * level 1 table the hashes of 170 level 0 tables and a level 2 table
+ * those of 170 level 1 tables; the top table's hash is in the header.
+ * Packages whose block separation has bit 0 clear keep two copies of each
+ * table, and a status bit in the entry one level up (or bit 1 of the
+ * block separation for the top table) says which copy is current.
+ *
+ * fatx_package_open walks the tables from the top down once, keeping
+ * where each current table lives and the next block of every data block,
+ * then reads the file table and turns each file's chain into runs of
+ * contiguous bytes within the package file. Reads after that only look up
+ * a run and go through the package's fatx_file.
+ */
+
+#include <fatx.h>
+#include "fatx_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define STFS_BLOCK 0x1000
+#define STFS_ENTRIES 0xAA // hash entries in a table
+#define STFS_ENTRY_SIZE 0x18
+#define STFS_HEADER_SIZE 0x340
+#define STFS_CONTENT_TYPE 0x344
+#define STFS_TITLE_ID 0x360
+#define STFS_VOLUME 0x379
+#define STFS_DISPLAY_NAME 0x411
+#define STFS_DISPLAY_NAME_SIZE 0x80
+#define STFS_HEADER_READ (STFS_DISPLAY_NAME + STFS_DISPLAY_NAME_SIZE)
+#define STFS_MIN_SIZE 0xA000
+
+/* one file table record */
+#define STFS_RECORD_SIZE 0x40
+#define STFS_RECORDS (STFS_BLOCK / STFS_RECORD_SIZE)
+#define STFS_CONSECUTIVE 0x40
+#define STFS_DIRECTORY 0x80
+
+struct fatx_package_table {
+	off_t offset; // of the current copy within the package file
+	uint8_t hash[20]; // expected, from the level above or the header
+};
+
+struct fatx_package_run {
+	uint64_t file_offset;
+	off_t offset; // within the package file
+	size_t length;
+};
+
+struct fatx_package_child {
+	const char *name;
+	int index;
+};
+
+struct fatx_package_file {
+	int valid;
+	fatx_package_entry entry;
+	struct fatx_package_run *runs;
+	size_t run_count;
+	struct fatx_package_child *children; // sorted by name, for directories
+	size_t child_count;
+};
+
+struct fatx_package {
+	fatx_fs_info *info;
+	fatx_file *file;
+	size_t size; // of the package file
+	fatx_package_info header;
+	uint8_t top_hash[20];
+	int shift; // 1 if every table takes two blocks
+	uint32_t step[2]; // blocks between level 0 and level 1 tables
+	off_t first_table;
+	int top_level;
+	struct fatx_package_table *tables[3];
+	size_t table_count[3];
+	uint32_t *next; // the next block of each data block's chain
+	struct fatx_package_file *files;
+	size_t count;
+	struct fatx_package_file root;
+};
+
+static inline uint32_t stfs_be24(const uint8_t *p) {
+	return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static inline uint32_t stfs_le24(const uint8_t *p) {
+	return ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static inline uint32_t stfs_be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Which block of the package (counting from the first table) holds data
+ * block block.
+ */
+static uint32_t stfs_data_block(const fatx_package *p, uint32_t block) {
+	uint32_t ret = (((block + STFS_ENTRIES) / STFS_ENTRIES) << p->shift) + block;
+	if (block < STFS_ENTRIES) return ret;
+	ret += ((block + 0x70E4) / 0x70E4) << p->shift;
+	if (block < 0x70E4) return ret;
+	return ret + (1 << p->shift);
+}
+
+/**
+ * Which block holds the first copy of the level table covering data
+ * block block.
+ */
+static uint32_t stfs_table_block(const fatx_package *p, int level, uint32_t block) {
+	uint32_t ret;
+	if (level == 2) return p->step[1];
+	if (level == 1) {
+		if (block < 0x70E4) return p->step[0];
+		return (1 << p->shift) + (block / 0x70E4) * p->step[1];
+	}
+	if (block < STFS_ENTRIES) return 0;
+	ret = (block / STFS_ENTRIES) * p->step[0] + (((block / 0x70E4) + 1) << p->shift);
+	if (block / 0x70E4 == 0) return ret;
+	return ret + (1 << p->shift);
+}
+
+static inline off_t stfs_data_offset(const fatx_package *p, uint32_t block) {
+	return p->first_table + ((off_t)stfs_data_block(p, block) << 12);
+}
+
+/**
+ * Reads size bytes of the package file at offset, failing on a short read.
+ */
+static int stfs_read(fatx_package *p, void *buffer, size_t size, off_t offset) {
+	ssize_t ret = fatx_pread(p->file, buffer, size, offset);
+	if (ret < 0) return ret;
+	return (size_t)ret == size ? 0 : -EIO;
+}
+
+/* SHA-1, for verifying blocks against their hash entries */
+struct stfs_sha1 {
+	uint32_t h[5];
+};
+
+static inline uint32_t stfs_rol(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+static void stfs_sha1_block(struct stfs_sha1 *s, const uint8_t *block) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+	for (i = 0; i < 16; i++) w[i] = stfs_be32(block + i * 4);
+	for (; i < 80; i++) w[i] = stfs_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	a = s->h[0];
+	b = s->h[1];
+	c = s->h[2];
+	d = s->h[3];
+	e = s->h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = stfs_rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = stfs_rol(b, 30);
+		b = a;
+		a = t;
+	}
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+	s->h[4] += e;
+}
+
+/**
+ * Hashes one 4 KiB block, the only size a package ever hashes.
+ */
+static void stfs_sha1(const uint8_t *data, uint8_t *digest) {
+	struct stfs_sha1 s = { { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 } };
+	uint8_t last[64];
+	int i;
+	for (i = 0; i < STFS_BLOCK; i += 64) stfs_sha1_block(&s, data + i);
+	memset(last, 0, sizeof(last));
+	last[0] = 0x80;
+	// the length in bits, 0x8000, big endian in the last 8 bytes
+	last[62] = (STFS_BLOCK * 8) >> 8;
+	stfs_sha1_block(&s, last);
+	for (i = 0; i < 20; i++) digest[i] = s.h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/**
+ * Reads the hash tables from the top level down, noting where the current
+ * copy of every table is and the next block of every data block.
+ */
+static int stfs_load_tables(fatx_package *p, const uint8_t *separation) {
+	uint8_t *table = malloc(STFS_BLOCK);
+	uint32_t per = STFS_ENTRIES, b;
+	size_t level, t, e;
+	int ret = 0;
+	if (table == NULL) return -ENOMEM;
+	for (level = 0; level <= (size_t)p->top_level; level++) {
+		p->table_count[level] = (p->header.blocks + per - 1) / per;
+		if (p->table_count[level] == 0) p->table_count[level] = 1;
+		p->tables[level] = calloc(p->table_count[level], sizeof(struct fatx_package_table));
+		if (p->tables[level] == NULL) {
+			free(table);
+			return -ENOMEM;
+		}
+		per *= STFS_ENTRIES;
+	}
+	p->tables[p->top_level][0].offset = p->first_table +
+			((off_t)stfs_table_block(p, p->top_level, 0) << 12) +
+			((p->shift && (*separation & 2)) ? STFS_BLOCK : 0);
+	memcpy(p->tables[p->top_level][0].hash, p->top_hash, 20);
+	for (level = p->top_level, per = 1; level > 0; level--) per *= STFS_ENTRIES;
+	for (level = p->top_level; level > 0 && ret == 0; level--) {
+		uint32_t child_per = per; // data blocks under each table one level down
+		for (t = 0; t < p->table_count[level] && ret == 0; t++) {
+			ret = stfs_read(p, table, STFS_BLOCK, p->tables[level][t].offset);
+			for (e = 0; e < STFS_ENTRIES && ret == 0; e++) {
+				size_t child = t * STFS_ENTRIES + e;
+				const uint8_t *entry = table + e * STFS_ENTRY_SIZE;
+				if (child >= p->table_count[level - 1]) break;
+				p->tables[level - 1][child].offset = p->first_table +
+						((off_t)stfs_table_block(p, level - 1, child * child_per) << 12) +
+						((p->shift && (entry[0x14] & 0x40)) ? STFS_BLOCK : 0);
+				memcpy(p->tables[level - 1][child].hash, entry, 20);
+			}
+		}
+		per /= STFS_ENTRIES;
+	}
+	for (t = 0; t < p->table_count[0] && ret == 0; t++) {
+		ret = stfs_read(p, table, STFS_BLOCK, p->tables[0][t].offset);
+		for (e = 0; e < STFS_ENTRIES && ret == 0; e++) {
+			b = t * STFS_ENTRIES + e;
+			if (b >= p->header.blocks) break;
+			p->next[b] = stfs_be24(table + e * STFS_ENTRY_SIZE + 0x15);
+		}
+	}
+	free(table);
+	return ret;
+}
+
+/**
+ * Turns the chain of blocks starting at first into runs that are
+ * contiguous in the package file, covering size bytes.
+ */
+static int stfs_map_chain(fatx_package *p, struct fatx_package_file *f, uint32_t first,
+		uint32_t blocks, int consecutive, size_t size) {
+	uint32_t block = first, i;
+	uint64_t done = 0;
+	size_t alloc = 0;
+	for (i = 0; i < blocks && done < size; i++) {
+		off_t offset = stfs_data_offset(p, block);
+		size_t length = size - done < STFS_BLOCK ? size - done : STFS_BLOCK;
+		struct fatx_package_run *run = f->run_count ? &f->runs[f->run_count - 1] : NULL;
+		if (block >= p->header.blocks || offset + STFS_BLOCK > (off_t)p->size) return -EIO;
+		if (run != NULL && run->offset + (off_t)run->length == offset) {
+			run->length += length;
+		} else {
+			if (f->run_count == alloc) {
+				alloc = alloc ? alloc * 2 : 4;
+				run = realloc(f->runs, alloc * sizeof(struct fatx_package_run));
+				if (run == NULL) return -ENOMEM;
+				f->runs = run;
+			}
+			run = &f->runs[f->run_count++];
+			run->file_offset = done;
+			run->offset = offset;
+			run->length = length;
+		}
+		done += length;
+		block = consecutive ? block + 1 : p->next[block];
+	}
+	return done == size ? 0 : -EIO;
+}
+
+static int stfs_child_compare(const void *a, const void *b) {
+	return strcasecmp(((const struct fatx_package_child *)a)->name,
+			((const struct fatx_package_child *)b)->name);
+}
+
+/**
+ * Gives every directory (and the root) its sorted list of children.
+ */
+static int stfs_link_children(fatx_package *p) {
+	size_t i;
+	for (i = 0; i < p->count; i++) {
+		struct fatx_package_file *f = &p->files[i], *dir;
+		int parent = f->entry.parent;
+		if (!f->valid) continue;
+		if (parent == FATX_PACKAGE_ROOT) dir = &p->root;
+		else if ((size_t)parent < p->count && p->files[parent].valid && p->files[parent].entry.record.isdir) {
+			dir = &p->files[parent];
+		} else continue; // an orphan, left out of the tree
+		if ((dir->child_count & (dir->child_count + 1)) == 0) { // a power of two less one: full
+			struct fatx_package_child *c = realloc(dir->children,
+					(dir->child_count * 2 + 1) * sizeof(struct fatx_package_child));
+			if (c == NULL) return -ENOMEM;
+			dir->children = c;
+		}
+		dir->children[dir->child_count].name = f->entry.record.name;
+		dir->children[dir->child_count++].index = i;
+	}
+	qsort(p->root.children, p->root.child_count, sizeof(struct fatx_package_child), stfs_child_compare);
+	for (i = 0; i < p->count; i++) {
+		if (p->files[i].child_count == 0) continue;
+		qsort(p->files[i].children, p->files[i].child_count, sizeof(struct fatx_package_child),
+				stfs_child_compare);
+	}
+	return 0;
+}
+
+/**
+ * Names that can't be a single path component: FUSE would fail the whole
+ * listing, and a copy would land outside its directory.
+ */
+static int stfs_bad_name(const char *name) {
+	return *name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL;
+}
+
+/**
+ * Reads the file table, which is a chain of blocks like any file. Entries
+ * with a bad name, or that are their own parent, are left out.
+ */
+static int stfs_load_files(fatx_package *p, uint32_t first, uint32_t blocks) {
+	uint8_t *table = malloc(STFS_BLOCK);
+	uint32_t block = first, i, j;
+	int ret = 0;
+	if (table == NULL) return -ENOMEM;
+	p->files = calloc((size_t)blocks * STFS_RECORDS, sizeof(struct fatx_package_file));
+	if (p->files == NULL) {
+		free(table);
+		return -ENOMEM;
+	}
+	p->count = (size_t)blocks * STFS_RECORDS;
+	for (i = 0; i < blocks && ret == 0; i++) {
+		if (block >= p->header.blocks) {
+			ret = -EIO;
+			break;
+		}
+		ret = stfs_read(p, table, STFS_BLOCK, stfs_data_offset(p, block));
+		for (j = 0; j < STFS_RECORDS && ret == 0; j++) {
+			const uint8_t *r = table + j * STFS_RECORD_SIZE;
+			struct fatx_package_file *f = &p->files[i * STFS_RECORDS + j];
+			fatx_file_record *record = &f->entry.record;
+			size_t length = r[0x28] & 0x3F;
+			uint16_t parent = (r[0x32] << 8) | r[0x33];
+			if (length == 0 || length > 40) continue;
+			memcpy(record->name, r, length);
+			record->name[length] = '\0';
+			if (stfs_bad_name(record->name) || parent == i * STFS_RECORDS + j) {
+				fatx_warn_corruption("Bad file table entry in a package\nindex: %u", i * STFS_RECORDS + j);
+				continue;
+			}
+			f->valid = 1;
+			f->entry.index = i * STFS_RECORDS + j;
+			f->entry.parent = parent == 0xFFFF ? FATX_PACKAGE_ROOT : parent;
+			record->isdir = (r[0x28] & STFS_DIRECTORY) != 0;
+			record->size = record->isdir ? 0 : stfs_be32(r + 0x34);
+			record->created = fatx_time_fatx2unix(stfs_be32(r + 0x38));
+			record->modified = record->created;
+			record->accessed = fatx_time_fatx2unix(stfs_be32(r + 0x3C));
+			if (record->size > 0 && stfs_map_chain(p, f, stfs_le24(r + 0x2F), stfs_le24(r + 0x29),
+					r[0x28] & STFS_CONSECUTIVE, record->size) < 0) {
+				// keep the entry but leave it without data, so reading it fails
+				free(f->runs);
+				f->runs = NULL;
+				f->run_count = 0;
+			}
+		}
+		block = p->next[block];
+	}
+	free(table);
+	if (ret == 0) ret = stfs_link_children(p);
+	return ret;
+}
+
+/**
+ * Converts the UTF-16 display name to UTF-8.
+ */
+static void stfs_display_name(const uint8_t *utf16, char *out, size_t size) {
+	size_t i, used = 0;
+	for (i = 0; i < STFS_DISPLAY_NAME_SIZE; i += 2) {
+		unsigned int c = (utf16[i] << 8) | utf16[i + 1];
+		if (c == 0) break;
+		if (c < 0x80 && used + 1 < size) {
+			out[used++] = c;
+		} else if (c < 0x800 && used + 2 < size) {
+			out[used++] = 0xC0 | (c >> 6);
+			out[used++] = 0x80 | (c & 0x3F);
+		} else if (c >= 0x800 && used + 3 < size) {
+			out[used++] = 0xE0 | (c >> 12);
+			out[used++] = 0x80 | ((c >> 6) & 0x3F);
+			out[used++] = 0x80 | (c & 0x3F);
+		}
+	}
+	out[used] = '\0';
+}
+
+static int stfs_magic(const uint8_t *magic) {
+	return memcmp(magic, "CON ", 4) == 0 || memcmp(magic, "LIVE", 4) == 0 ||
+			memcmp(magic, "PIRS", 4) == 0;
+}
+
+/**
+ * Returns 1 if entry is a file that starts like a package, 0 if it isn't,
+ * or -errno. Only the magic is read.
+ */
+int fatx_package_probe(fatx_fs_info *info, const fatx_dirent *entry) {
+	uint8_t magic[4];
+	fatx_file *file;
+	ssize_t ret;
+	if (entry->record.isdir || entry->record.size < STFS_MIN_SIZE) return 0;
+	file = fatx_open_dirent(info, entry);
+	if (file == NULL) return -errno;
+	ret = fatx_pread(file, magic, sizeof(magic), 0);
+	fatx_close(file);
+	if (ret < 0) return ret;
+	return ret == sizeof(magic) && stfs_magic(magic);
+}
+
+/**
+ * Opens the package in entry and reads its tables. Returns NULL and sets
+ * errno (EINVAL if entry isn't a package) on failure.
+ */
+fatx_package *fatx_package_open(fatx_fs_info *info, const fatx_dirent *entry) {
+	uint8_t header[STFS_HEADER_READ];
+	fatx_package *p;
+	uint32_t table_blocks, table_first, header_size;
+	int ret;
+	if (entry->record.isdir || entry->record.size < STFS_MIN_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p = calloc(1, sizeof(fatx_package));
+	if (p == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p->info = info;
+	p->size = entry->record.size;
+	p->root.valid = 1;
+	p->root.entry.index = FATX_PACKAGE_ROOT;
+	p->root.entry.parent = FATX_PACKAGE_ROOT;
+	p->root.entry.record = entry->record;
+	p->root.entry.record.isdir = 1;
+	p->root.entry.record.size = 0;
+	p->file = fatx_open_dirent(info, entry);
+	if (p->file == NULL) {
+		ret = -errno;
+		goto fail;
+	}
+	ret = stfs_read(p, header, sizeof(header), 0);
+	if (ret < 0) goto fail;
+	header_size = stfs_be32(header + STFS_HEADER_SIZE);
+	table_blocks = header[STFS_VOLUME + 3] | (header[STFS_VOLUME + 4] << 8);
+	table_first = stfs_le24(header + STFS_VOLUME + 5);
+	p->header.blocks = stfs_be32(header + STFS_VOLUME + 0x1C);
+	p->first_table = (header_size + 0xFFF) & ~0xFFF;
+	if (!stfs_magic(header) || header[STFS_VOLUME] != 0x24 || header_size < STFS_HEADER_READ ||
+			table_blocks == 0 || p->first_table >= (off_t)p->size ||
+			p->header.blocks > (p->size - p->first_table) / STFS_BLOCK) {
+		ret = -EINVAL;
+		goto fail;
+	}
+	memcpy(p->header.magic, header, 4);
+	p->header.magic[4] = '\0';
+	p->header.content_type = stfs_be32(header + STFS_CONTENT_TYPE);
+	p->header.title_id = stfs_be32(header + STFS_TITLE_ID);
+	stfs_display_name(header + STFS_DISPLAY_NAME, p->header.display_name, sizeof(p->header.display_name));
+	memcpy(p->top_hash, header + STFS_VOLUME + 8, 20);
+	p->shift = !(header[STFS_VOLUME + 2] & 1);
+	p->step[0] = p->shift ? 0xAC : 0xAB;
+	p->step[1] = p->shift ? 0x723A : 0x718F;
+	p->top_level = p->header.blocks > 0x70E4 ? 2 : p->header.blocks > STFS_ENTRIES ? 1 : 0;
+	p->next = calloc(p->header.blocks ? p->header.blocks : 1, sizeof(uint32_t));
+	if (p->next == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	ret = stfs_load_tables(p, header + STFS_VOLUME + 2);
+	if (ret == 0) ret = stfs_load_files(p, table_first, table_blocks);
+	if (ret == 0) return p;
+fail:
+	fatx_package_close(p);
+	errno = ret == -1 ? EIO : -ret;
+	return NULL;
+}
+
+void fatx_package_close(fatx_package *package) {
+	size_t i;
+	if (package == NULL) return;
+	for (i = 0; i < package->count; i++) {
+		free(package->files[i].runs);
+		free(package->files[i].children);
+	}
+	for (i = 0; i < 3; i++) free(package->tables[i]);
+	free(package->root.children);
+	free(package->files);
+	free(package->next);
+	fatx_close(package->file);
+	free(package);
+}
+
+void fatx_package_get_info(fatx_package *package, fatx_package_info *info) {
+	*info = package->header;
+}
+
+static struct fatx_package_file *stfs_file(fatx_package *p, int index) {
+	if (index == FATX_PACKAGE_ROOT) return &p->root;
+	if (index < 0 || (size_t)index >= p->count || !p->files[index].valid) return NULL;
+	return &p->files[index];
+}
+
+/**
+ * Fills entry with the file table entry at index (FATX_PACKAGE_ROOT for
+ * the package itself). Returns 0 or -ENOENT.
+ */
+int fatx_package_entry_get(fatx_package *package, int index, fatx_package_entry *entry) {
+	struct fatx_package_file *f = stfs_file(package, index);
+	if (f == NULL) return -ENOENT;
+	*entry = f->entry;
+	return 0;
+}
+
+/**
+ * Finds name, case insensitively, in the directory at index dir. Returns
+ * 0, -ENOENT or -ENOTDIR.
+ */
+int fatx_package_lookup(fatx_package *package, int dir, const char *name, fatx_package_entry *entry) {
+	struct fatx_package_file *f = stfs_file(package, dir);
+	struct fatx_package_child key, *found;
+	if (f == NULL) return -ENOENT;
+	if (!f->entry.record.isdir) return -ENOTDIR;
+	key.name = name;
+	found = bsearch(&key, f->children, f->child_count, sizeof(key), stfs_child_compare);
+	if (found == NULL) return -ENOENT;
+	*entry = package->files[found->index].entry;
+	return 0;
+}
+
+/**
+ * Calls func for each entry of the directory at index dir, in name order,
+ * starting at cookie (0 for the first), until it returns nonzero. next is
+ * the cookie of the entry after this one.
+ */
+int fatx_package_read_dir(fatx_package *package, int dir, off_t cookie,
+		int (*func)(const fatx_package_entry *entry, off_t next, void *user), void *user) {
+	struct fatx_package_file *f = stfs_file(package, dir);
+	size_t i;
+	if (f == NULL) return -ENOENT;
+	if (!f->entry.record.isdir) return -ENOTDIR;
+	if (cookie < 0) return -EINVAL;
+	for (i = cookie; i < f->child_count; i++) {
+		if (func(&package->files[f->children[i].index].entry, i + 1, user)) break;
+	}
+	return 0;
+}
+
+/**
+ * Finds the run holding byte offset of f, or f->run_count.
+ */
+static size_t stfs_find_run(const struct fatx_package_file *f, uint64_t offset) {
+	size_t low = 0, high = f->run_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (f->runs[mid].file_offset + f->runs[mid].length <= offset) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+/**
+ * Reads up to size bytes of the file at index from offset. Returns the
+ * number of bytes read (short only at the end of the file) or -errno.
+ */
+ssize_t fatx_package_pread(fatx_package *package, int index, void *buffer, size_t size, off_t offset) {
+	struct fatx_package_file *f = stfs_file(package, index);
+	size_t done = 0, i;
+	if (f == NULL) return -ENOENT;
+	if (f->entry.record.isdir) return -EISDIR;
+	if (offset < 0) return -EINVAL;
+	if ((size_t)offset >= f->entry.record.size) return 0;
+	if (f->run_count == 0) return -EIO;
+	if (size > f->entry.record.size - offset) size = f->entry.record.size - offset;
+	for (i = stfs_find_run(f, offset); done < size && i < f->run_count; i++) {
+		const struct fatx_package_run *run = &f->runs[i];
+		uint64_t within = offset + done - run->file_offset;
+		size_t length = run->length - within < size - done ? run->length - within : size - done;
+		int ret = stfs_read(package, (uint8_t *)buffer + done, length, run->offset + within);
+		if (ret < 0) return ret;
+		done += length;
+	}
+	return done;
+}
+
+/**
+ * Maps size bytes of the file at index from offset onto the device, the
+ * way fatx_map_file does for a FATX file, with the same return values.
+ */
+int fatx_package_map(fatx_package *package, int index, off_t offset, size_t size,
+		fatx_io_extent *extents, int max) {
+	struct fatx_package_file *f = stfs_file(package, index);
+	size_t done = 0, i;
+	int count = 0;
+	if (f == NULL) return -ENOENT;
+	if (f->entry.record.isdir) return -EISDIR;
+	if (offset < 0) return -EINVAL;
+	if ((size_t)offset >= f->entry.record.size) return 0;
+	if (f->run_count == 0) return -EIO;
+	if (size > f->entry.record.size - offset) size = f->entry.record.size - offset;
+	for (i = stfs_find_run(f, offset); done < size && i < f->run_count; i++) {
+		const struct fatx_package_run *run = &f->runs[i];
+		uint64_t within = offset + done - run->file_offset;
+		size_t length = run->length - within < size - done ? run->length - within : size - done;
+		int ret = fatx_map_file(package->file, run->offset + within, length,
+				count < max ? extents + count : NULL, count < max ? max - count : 0);
+		if (ret < 0) return ret;
+		count += ret;
+		done += length;
+	}
+	return count;
+}
+
+struct stfs_verify {
+	fatx_package *package;
+	size_t next_table; // next level 0 table to hand out
+	uint64_t bad;
+	int error;
+};
+
+/**
+ * Checks one hash table, and with level 0 every data block it covers,
+ * against the hashes expected for them.
+ */
+static int stfs_verify_table(fatx_package *p, int level, size_t t, uint8_t *table, uint8_t *block,
+		uint64_t *bad) {
+	uint8_t digest[20];
+	size_t e;
+	int ret = stfs_read(p, table, STFS_BLOCK, p->tables[level][t].offset);
+	if (ret < 0) return ret;
+	stfs_sha1(table, digest);
+	if (memcmp(digest, p->tables[level][t].hash, 20) != 0) (*bad)++;
+	if (level > 0) return 0;
+	for (e = 0; e < STFS_ENTRIES; e++) {
+		uint32_t b = t * STFS_ENTRIES + e;
+		if (b >= p->header.blocks) break;
+		ret = stfs_read(p, block, STFS_BLOCK, stfs_data_offset(p, b));
+		if (ret < 0) return ret;
+		stfs_sha1(block, digest);
+		if (memcmp(digest, table + e * STFS_ENTRY_SIZE, 20) != 0) (*bad)++;
+	}
+	return 0;
+}
+
+static void *stfs_verify_worker(void *arg) {
+	struct stfs_verify *v = arg;
+	fatx_package *p = v->package;
+	uint8_t *buffers = malloc(2 * STFS_BLOCK);
+	uint64_t bad = 0;
+	int ret = buffers == NULL ? -ENOMEM : 0;
+	while (ret == 0) {
+		size_t t = __atomic_fetch_add(&v->next_table, 1, __ATOMIC_RELAXED);
+		if (t >= p->table_count[0]) break;
+		ret = stfs_verify_table(p, 0, t, buffers, buffers + STFS_BLOCK, &bad);
+	}
+	__atomic_add_fetch(&v->bad, bad, __ATOMIC_RELAXED);
+	if (ret < 0) __atomic_store_n(&v->error, ret, __ATOMIC_RELAXED);
+	free(buffers);
+	return NULL;
+}
+
+/**
+ * Checks every hash table and data block of the package against the hash
+ * recorded for it, with threads threads (0 for one per CPU). Sets
+ * *bad_blocks to the number that don't match and returns 0, or -errno if
+ * the package couldn't be read.
+ */
+int fatx_package_verify(fatx_package *package, unsigned int threads, uint64_t *bad_blocks) {
+	struct stfs_verify v;
+	pthread_t *workers;
+	uint8_t *buffers;
+	unsigned int i, started = 0;
+	size_t t;
+	int level, ret = 0;
+	memset(&v, 0, sizeof(v));
+	v.package = package;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	// the upper levels are a handful of tables at most
+	buffers = malloc(2 * STFS_BLOCK);
+	if (buffers == NULL) return -ENOMEM;
+	for (level = package->top_level; level > 0 && ret == 0; level--) {
+		for (t = 0; t < package->table_count[level] && ret == 0; t++) {
+			ret = stfs_verify_table(package, level, t, buffers, buffers + STFS_BLOCK, &v.bad);
+		}
+	}
+	free(buffers);
+	if (ret < 0) return ret;
+	if (threads > package->table_count[0]) threads = package->table_count[0];
+	workers = malloc(threads * sizeof(pthread_t));
+	if (workers == NULL) return -ENOMEM;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, stfs_verify_worker, &v) != 0) break;
+		started++;
+	}
+	if (started == 0) stfs_verify_worker(&v);
+	for (i = 0; i < started; i++) pthread_join(workers[i], NULL);
+	free(workers);
+	*bad_blocks = v.bad;
+	return v.error;
+}
@@ -0,0 +1,314 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kernels for scanning directory records and the FAT in bulk. Each kernel has a
+ * scalar version that runs everywhere, and on x86 SSE2 and AVX2 versions
+ * picked at runtime by fatx_scan_init.
+ */
+
+#include "fatx_internal.h"
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FATX_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static inline uint8_t fatx_scan_class(uint8_t name_length) {
+	if (name_length == 0xFF) return FATX_RECORD_END;
+	if (name_length == 0xE5) return FATX_RECORD_DELETED;
+	if (name_length > 42) return FATX_RECORD_INVALID;
+	return FATX_RECORD_LIVE;
+}
+
+static size_t fatx_classify_scalar(const struct fatx_internal_file_record *records,
+		size_t count, uint8_t *classes) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		classes[i] = fatx_scan_class(records[i].name_length);
+		if (classes[i] >= FATX_RECORD_END) return i;
+	}
+	return count;
+}
+
+static int fatx_name_equal_scalar(const struct fatx_internal_file_record *record,
+		const uint8_t *folded, size_t length) {
+	size_t i;
+	if (record->name_length != length) return 0;
+	for (i = 0; i < length; i++) {
+		if (tolower(record->name[i]) != folded[i]) return 0;
+	}
+	return 1;
+}
+
+static size_t fatx_count_free_scalar(const void *entries, size_t width, size_t count,
+		uint64_t *mask) {
+	size_t i, j, n, free = 0;
+	for (i = 0; i < count; i += 64) {
+		uint64_t bits = 0;
+		n = min(count - i, (size_t)64);
+		if (width == sizeof(uint32_t)) {
+			const uint32_t *e = (const uint32_t *)entries + i;
+			for (j = 0; j < n; j++) bits |= (uint64_t)(e[j] == 0) << j;
+		} else {
+			const uint16_t *e = (const uint16_t *)entries + i;
+			for (j = 0; j < n; j++) bits |= (uint64_t)(e[j] == 0) << j;
+		}
+		free += __builtin_popcountll(bits);
+		if (mask != NULL) mask[i / 64] = bits;
+	}
+	return free;
+}
+
+#ifdef FATX_SCAN_X86
+
+__attribute__((target("sse2")))
+static inline __m128i fatx_fold_sse2(__m128i v) {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/**
+ * Classifies 16 records per step: the length bytes are gathered into one
+ * vector and compared against the end marker, the deleted marker and the
+ * largest valid length together.
+ */
+__attribute__((target("sse2")))
+static size_t fatx_classify_sse2(const struct fatx_internal_file_record *records,
+		size_t count, uint8_t *classes) {
+	uint8_t lengths[16];
+	size_t i, j;
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i v, end, deleted, invalid, cls;
+		unsigned int stop;
+		for (j = 0; j < 16; j++) lengths[j] = records[i + j].name_length;
+		v = _mm_loadu_si128((const __m128i *)lengths);
+		end = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xFF));
+		deleted = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xE5));
+		invalid = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(43)), v);
+		invalid = _mm_andnot_si128(_mm_or_si128(end, deleted), invalid);
+		cls = _mm_or_si128(_mm_and_si128(deleted, _mm_set1_epi8(FATX_RECORD_DELETED)),
+				_mm_or_si128(_mm_and_si128(end, _mm_set1_epi8(FATX_RECORD_END)),
+				_mm_and_si128(invalid, _mm_set1_epi8(FATX_RECORD_INVALID))));
+		_mm_storeu_si128((__m128i *)(classes + i), cls);
+		stop = _mm_movemask_epi8(_mm_or_si128(end, invalid));
+		if (stop) return i + __builtin_ctz(stop);
+	}
+	return i + fatx_classify_scalar(records + i, count - i, classes + i);
+}
+
+/**
+ * Compares the 42 byte name field in three 16 byte pieces. The loads stay
+ * inside the 64 byte record, so no bounds checks are needed.
+ */
+__attribute__((target("sse2")))
+static int fatx_name_equal_sse2(const struct fatx_internal_file_record *record,
+		const uint8_t *folded, size_t length) {
+	uint64_t mask = 0, want;
+	int i;
+	if (record->name_length != length) return 0;
+	for (i = 0; i < 3; i++) {
+		__m128i name = fatx_fold_sse2(_mm_loadu_si128((const __m128i *)(record->name + i * 16)));
+		__m128i needle = _mm_loadu_si128((const __m128i *)(folded + i * 16));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(name, needle)) << (i * 16);
+	}
+	want = (UINT64_C(1) << length) - 1;
+	return (mask & want) == want;
+}
+
+__attribute__((target("avx2")))
+static size_t fatx_classify_avx2(const struct fatx_internal_file_record *records,
+		size_t count, uint8_t *classes) {
+	uint8_t lengths[32];
+	size_t i, j;
+	for (i = 0; i + 32 <= count; i += 32) {
+		__m256i v, end, deleted, invalid, cls;
+		unsigned int stop;
+		for (j = 0; j < 32; j++) lengths[j] = records[i + j].name_length;
+		v = _mm256_loadu_si256((const __m256i *)lengths);
+		end = _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xFF));
+		deleted = _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xE5));
+		invalid = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(43)), v);
+		invalid = _mm256_andnot_si256(_mm256_or_si256(end, deleted), invalid);
+		cls = _mm256_or_si256(_mm256_and_si256(deleted, _mm256_set1_epi8(FATX_RECORD_DELETED)),
+				_mm256_or_si256(_mm256_and_si256(end, _mm256_set1_epi8(FATX_RECORD_END)),
+				_mm256_and_si256(invalid, _mm256_set1_epi8(FATX_RECORD_INVALID))));
+		_mm256_storeu_si256((__m256i *)(classes + i), cls);
+		stop = _mm256_movemask_epi8(_mm256_or_si256(end, invalid));
+		if (stop) return i + __builtin_ctz(stop);
+	}
+	return i + fatx_classify_sse2(records + i, count - i, classes + i);
+}
+
+__attribute__((target("avx2")))
+static int fatx_name_equal_avx2(const struct fatx_internal_file_record *record,
+		const uint8_t *folded, size_t length) {
+	__m256i name, needle, upper;
+	uint64_t mask, want;
+	if (record->name_length != length) return 0;
+	name = _mm256_loadu_si256((const __m256i *)record->name);
+	upper = _mm256_and_si256(_mm256_cmpgt_epi8(name, _mm256_set1_epi8('A' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), name));
+	name = _mm256_or_si256(name, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+	needle = _mm256_loadu_si256((const __m256i *)folded);
+	mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(name, needle));
+	mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			fatx_fold_sse2(_mm_loadu_si128((const __m128i *)(record->name + 32))),
+			_mm_loadu_si128((const __m128i *)(folded + 32)))) << 32;
+	want = (UINT64_C(1) << length) - 1;
+	return (mask & want) == want;
+}
+
+/**
+ * Finds the zero entries among 64 at a time: the comparison results are
+ * packed down to one byte per entry so that movemask yields 16 bits of the
+ * free mask per vector.
+ */
+__attribute__((target("sse2")))
+static size_t fatx_count_free_sse2(const void *entries, size_t width, size_t count,
+		uint64_t *mask) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i, free = 0;
+	int j;
+	for (i = 0; i + 64 <= count; i += 64) {
+		uint64_t bits = 0;
+		for (j = 0; j < 4; j++) {
+			__m128i packed;
+			if (width == sizeof(uint32_t)) {
+				const __m128i *e = (const __m128i *)((const uint32_t *)entries + i + j * 16);
+				packed = _mm_packs_epi16(
+						_mm_packs_epi32(_mm_cmpeq_epi32(_mm_loadu_si128(e), zero),
+								_mm_cmpeq_epi32(_mm_loadu_si128(e + 1), zero)),
+						_mm_packs_epi32(_mm_cmpeq_epi32(_mm_loadu_si128(e + 2), zero),
+								_mm_cmpeq_epi32(_mm_loadu_si128(e + 3), zero)));
+			} else {
+				const __m128i *e = (const __m128i *)((const uint16_t *)entries + i + j * 16);
+				packed = _mm_packs_epi16(_mm_cmpeq_epi16(_mm_loadu_si128(e), zero),
+						_mm_cmpeq_epi16(_mm_loadu_si128(e + 1), zero));
+			}
+			bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(packed) << (j * 16);
+		}
+		free += __builtin_popcountll(bits);
+		if (mask != NULL) mask[i / 64] = bits;
+	}
+	return free + fatx_count_free_scalar((const uint8_t *)entries + i * width, width,
+			count - i, mask != NULL ? mask + i / 64 : NULL);
+}
+
+/**
+ * As fatx_count_free_sse2, 32 entries per movemask. The packs work within
+ * each 128 bit lane, so the packed bytes are put back in order first.
+ */
+__attribute__((target("avx2")))
+static size_t fatx_count_free_avx2(const void *entries, size_t width, size_t count,
+		uint64_t *mask) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i, free = 0;
+	int j;
+	for (i = 0; i + 64 <= count; i += 64) {
+		uint64_t bits = 0;
+		for (j = 0; j < 2; j++) {
+			__m256i packed;
+			if (width == sizeof(uint32_t)) {
+				const __m256i *e = (const __m256i *)((const uint32_t *)entries + i + j * 32);
+				packed = _mm256_packs_epi16(
+						_mm256_packs_epi32(_mm256_cmpeq_epi32(_mm256_loadu_si256(e), zero),
+								_mm256_cmpeq_epi32(_mm256_loadu_si256(e + 1), zero)),
+						_mm256_packs_epi32(_mm256_cmpeq_epi32(_mm256_loadu_si256(e + 2), zero),
+								_mm256_cmpeq_epi32(_mm256_loadu_si256(e + 3), zero)));
+				packed = _mm256_permutevar8x32_epi32(packed, order);
+			} else {
+				const __m256i *e = (const __m256i *)((const uint16_t *)entries + i + j * 32);
+				packed = _mm256_packs_epi16(_mm256_cmpeq_epi16(_mm256_loadu_si256(e), zero),
+						_mm256_cmpeq_epi16(_mm256_loadu_si256(e + 1), zero));
+				packed = _mm256_permute4x64_epi64(packed, 0xD8);
+			}
+			bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << (j * 32);
+		}
+		free += __builtin_popcountll(bits);
+		if (mask != NULL) mask[i / 64] = bits;
+	}
+	return free + fatx_count_free_scalar((const uint8_t *)entries + i * width, width,
+			count - i, mask != NULL ? mask + i / 64 : NULL);
+}
+
+static const struct fatx_scan_ops fatx_scan_sse2 = {
+	.name = "sse2",
+	.classify = fatx_classify_sse2,
+	.name_equal = fatx_name_equal_sse2,
+	.count_free = fatx_count_free_sse2
+};
+
+static const struct fatx_scan_ops fatx_scan_avx2 = {
+	.name = "avx2",
+	.classify = fatx_classify_avx2,
+	.name_equal = fatx_name_equal_avx2,
+	.count_free = fatx_count_free_avx2
+};
+
+#endif /* FATX_SCAN_X86 */
+
+static const struct fatx_scan_ops fatx_scan_scalar = {
+	.name = "scalar",
+	.classify = fatx_classify_scalar,
+	.name_equal = fatx_name_equal_scalar,
+	.count_free = fatx_count_free_scalar
+};
+
+const struct fatx_scan_ops *fatx_scan = &fatx_scan_scalar;
+
+static pthread_once_t fatx_scan_once = PTHREAD_ONCE_INIT;
+
+static void fatx_scan_select(void) {
+#ifdef FATX_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fatx_scan = &fatx_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		fatx_scan = &fatx_scan_sse2;
+	}
+#endif
+}
+
+/**
+ * Returns the kernels called name ("scalar", "sse2" or "avx2"), or NULL if
+ * they weren't built in or the CPU can't run them. For benchmarks.
+ */
+const struct fatx_scan_ops *fatx_scan_find(const char *name) {
+	if (strcmp(name, fatx_scan_scalar.name) == 0) return &fatx_scan_scalar;
+#ifdef FATX_SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, fatx_scan_sse2.name) == 0 && __builtin_cpu_supports("sse2")) return &fatx_scan_sse2;
+	if (strcmp(name, fatx_scan_avx2.name) == 0 && __builtin_cpu_supports("avx2")) return &fatx_scan_avx2;
+#endif
+	return NULL;
+}
+
+/**
+ * Picks the fastest kernels the CPU supports. Safe to call more than once,
+ * from any thread.
+ */
+void fatx_scan_init(void) {
+	pthread_once(&fatx_scan_once, fatx_scan_select);
+}
@@ -0,0 +1,778 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The metadata sidecar: a file next to the filesystem holding what
+ * mounting it would otherwise have to read again, so that a large drive
+ * can be listed as soon as it is mounted. It holds the FAT in host order,
+ * the records of every directory with the offsets of their clusters, and
+ * the extents of every file, each in an array sorted by first cluster that
+ * is searched where it is mapped. Nothing in it points anywhere, so it is
+ * used with a single read only mmap and no parsing.
+ *
+ * fatx_fs_init_opts maps the sidecar named in fatx_fs_options.sidecar and
+ * keeps it if it was written for this partition of a device of the same
+ * size and its FAT checksum matches the FAT's. Directory indexes and
+ * extent maps are then built from it instead of from the disk, and a read
+ * only filesystem whose FAT would be paged uses the sidecar's copy. A
+ * missing or stale sidecar is deleted and fatx_sidecar_build writes a new
+ * one in the background, for the next mount.
+ *
+ * The first change to the filesystem stops the sidecar from being used
+ * and deletes it, since changing a directory doesn't always change the
+ * FAT. A change made by a mount without the sidecar that leaves the FAT
+ * alone (a rename on a block device) goes unnoticed; on an image file the
+ * sidecar remembers the modification time, which catches it.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FATX_SIDECAR_MAGIC UINT64_C(0x3158444958544146) // "FATXIDX1" in little endian
+#define FATX_SIDECAR_VERSION 1
+#define FATX_SIDECAR_ALIGN 64
+#define FATX_SIDECAR_FAT_ALIGN 4096
+
+/**
+ * The start of a sidecar. Sections are given as a byte offset into the
+ * file and a number of elements. Everything is in host byte order, so a
+ * sidecar written on a host of the other byte order fails the magic.
+ */
+struct fatx_sidecar_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t file_size;
+	uint64_t device_size;
+	int64_t device_mtime; // nanoseconds, for an image file; 0 for a device
+	int64_t fat_offset; // geometry of the partition
+	int64_t root_dir;
+	int64_t end;
+	uint64_t fat_entries;
+	uint32_t width;
+	uint32_t endianness;
+	uint64_t fat_checksum;
+	uint64_t fat; // fat_entries entries of width bytes
+	uint64_t dirs, dir_count;
+	uint64_t offsets, offset_count;
+	uint64_t records, record_count;
+	uint64_t files, file_count;
+	uint64_t extents, extent_count;
+};
+
+/**
+ * A directory: count records starting at records and clusters cluster
+ * offsets starting at offsets, in their sections.
+ */
+struct fatx_sidecar_dir {
+	uint32_t cluster;
+	uint32_t corrupt;
+	uint32_t count;
+	uint32_t clusters;
+	uint64_t records;
+	uint64_t offsets;
+};
+
+struct fatx_sidecar_file {
+	uint32_t first_cluster;
+	uint32_t clusters;
+	uint64_t extents;
+	uint64_t count;
+};
+
+struct fatx_sidecar_extent {
+	uint32_t file_cluster;
+	uint32_t length;
+	int64_t disk_offset;
+};
+
+/**
+ * A 64 bit checksum fed in pieces, reading four words at a time into
+ * independent lanes. Every piece but the last must be a multiple of 32
+ * bytes long.
+ */
+struct fatx_sidecar_hash {
+	uint64_t lanes[4];
+	uint64_t length;
+};
+
+#define FATX_SIDECAR_PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define FATX_SIDECAR_PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+
+static void fatx_sidecar_hash_init(struct fatx_sidecar_hash *hash) {
+	hash->lanes[0] = FATX_SIDECAR_PRIME1;
+	hash->lanes[1] = FATX_SIDECAR_PRIME2;
+	hash->lanes[2] = 0;
+	hash->lanes[3] = ~FATX_SIDECAR_PRIME1;
+	hash->length = 0;
+}
+
+static inline uint64_t fatx_sidecar_mix(uint64_t lane, uint64_t word) {
+	lane = (lane ^ word) * FATX_SIDECAR_PRIME1;
+	return lane ^ (lane >> 31);
+}
+
+static void fatx_sidecar_hash_update(struct fatx_sidecar_hash *hash, const void *data, size_t size) {
+	const uint8_t *p = data;
+	uint64_t words[4];
+	size_t i;
+	hash->length += size;
+	for (; size >= sizeof(words); p += sizeof(words), size -= sizeof(words)) {
+		memcpy(words, p, sizeof(words));
+		for (i = 0; i < 4; i++) hash->lanes[i] = fatx_sidecar_mix(hash->lanes[i], words[i]);
+	}
+	if (size > 0) {
+		memset(words, 0, sizeof(words));
+		memcpy(words, p, size);
+		for (i = 0; i < 4; i++) hash->lanes[i] = fatx_sidecar_mix(hash->lanes[i], words[i]);
+	}
+}
+
+static uint64_t fatx_sidecar_hash_final(struct fatx_sidecar_hash *hash) {
+	uint64_t h = hash->length * FATX_SIDECAR_PRIME2;
+	size_t i;
+	for (i = 0; i < 4; i++) h = fatx_sidecar_mix(h, hash->lanes[i] + i);
+	h ^= h >> 33;
+	h *= FATX_SIDECAR_PRIME2;
+	return h ^ (h >> 29);
+}
+
+/**
+ * Checksums the FAT in host order, from memory if it is loaded and
+ * otherwise read in FATX_FLUSH_CHUNK pieces. With fd, the host order
+ * table is also written to it at offset. Returns 0 or -errno.
+ */
+static int fatx_sidecar_fat(fatx_fs_info *info, uint64_t *checksum, int fd, off_t offset) {
+	size_t bytes = info->fat_entries * info->width, done, n;
+	struct fatx_sidecar_hash hash;
+	uint8_t *buffer;
+	fatx_sidecar_hash_init(&hash);
+	if (info->fat != NULL) {
+		fatx_sidecar_hash_update(&hash, info->fat, bytes);
+		if (fd >= 0 && pwrite(fd, info->fat, bytes, offset) != (ssize_t)bytes) {
+			return errno != 0 ? -errno : -EIO;
+		}
+		*checksum = fatx_sidecar_hash_final(&hash);
+		return 0;
+	}
+	buffer = malloc(FATX_FLUSH_CHUNK);
+	if (buffer == NULL) return -ENOMEM;
+	for (done = 0; done < bytes; done += n) {
+		n = min((size_t)FATX_FLUSH_CHUNK, bytes - done);
+		if (fatx_read_at(info, buffer, n, info->fat_offset + done) < 0) {
+			free(buffer);
+			return -EIO;
+		}
+		fatx_fat_to_host(info, buffer, n / info->width);
+		fatx_sidecar_hash_update(&hash, buffer, n);
+		if (fd >= 0 && pwrite(fd, buffer, n, offset + done) != (ssize_t)n) {
+			free(buffer);
+			return errno != 0 ? -errno : -EIO;
+		}
+	}
+	free(buffer);
+	*checksum = fatx_sidecar_hash_final(&hash);
+	return 0;
+}
+
+/**
+ * The size of the device and, if it is an image file, its modification
+ * time, which a sidecar has to match.
+ */
+static int fatx_sidecar_device(fatx_fs_info *info, uint64_t *size, int64_t *mtime) {
+	struct stat st;
+	off_t end;
+	if (fstat(info->fd, &st) < 0) return -1;
+	end = lseek(info->fd, 0, SEEK_END);
+	if (end < 0) return -1;
+	*size = end;
+	*mtime = S_ISREG(st.st_mode) ? (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec : 0;
+	return 0;
+}
+
+static int fatx_sidecar_section_fits(const struct fatx_sidecar_header *header, uint64_t offset,
+		uint64_t count, size_t size) {
+	return offset <= header->file_size && count <= (header->file_size - offset) / size;
+}
+
+/**
+ * Checks that the sidecar mapped at map (size bytes) belongs to info's
+ * partition as it is now.
+ */
+static int fatx_sidecar_valid(fatx_fs_info *info, const uint8_t *map, size_t size) {
+	const struct fatx_sidecar_header *header = (const void *)map;
+	uint64_t device_size, checksum;
+	int64_t mtime;
+	if (size < sizeof(struct fatx_sidecar_header) || header->magic != FATX_SIDECAR_MAGIC ||
+			header->version != FATX_SIDECAR_VERSION ||
+			header->header_size != sizeof(struct fatx_sidecar_header) || header->file_size != size) {
+		return 0;
+	}
+	if (fatx_sidecar_device(info, &device_size, &mtime) < 0 || header->device_size != device_size ||
+			header->device_mtime != mtime) {
+		return 0;
+	}
+	if (header->fat_offset != info->fat_offset || header->root_dir != info->root_dir ||
+			header->end != info->end || header->fat_entries != info->fat_entries ||
+			header->width != info->width || header->endianness != (uint32_t)info->endianness) {
+		return 0;
+	}
+	if (!fatx_sidecar_section_fits(header, header->fat, header->fat_entries, header->width) ||
+			!fatx_sidecar_section_fits(header, header->dirs, header->dir_count, sizeof(struct fatx_sidecar_dir)) ||
+			!fatx_sidecar_section_fits(header, header->offsets, header->offset_count, sizeof(int64_t)) ||
+			!fatx_sidecar_section_fits(header, header->records, header->record_count,
+					sizeof(struct fatx_internal_file_record)) ||
+			!fatx_sidecar_section_fits(header, header->files, header->file_count, sizeof(struct fatx_sidecar_file)) ||
+			!fatx_sidecar_section_fits(header, header->extents, header->extent_count,
+					sizeof(struct fatx_sidecar_extent)) ||
+			header->fat % FATX_SIDECAR_FAT_ALIGN != 0 || header->dirs % FATX_SIDECAR_ALIGN != 0 ||
+			header->offsets % FATX_SIDECAR_ALIGN != 0 || header->records % FATX_SIDECAR_ALIGN != 0 ||
+			header->files % FATX_SIDECAR_ALIGN != 0 || header->extents % FATX_SIDECAR_ALIGN != 0) {
+		return 0;
+	}
+	if (fatx_sidecar_fat(info, &checksum, -1, 0) < 0) return 0;
+	return checksum == header->fat_checksum;
+}
+
+/**
+ * Sets up the sidecar at path for info, mapping it if it is valid and
+ * deleting it otherwise. Called from fatx_fs_init_opts once the FAT is set
+ * up; a sidecar that can't be used is never an error. Returns -1 only if
+ * out of memory.
+ */
+int fatx_sidecar_open(fatx_fs_info *info, const char *path) {
+	struct fatx_sidecar *sidecar;
+	struct stat st;
+	void *map;
+	int fd;
+	sidecar = calloc(1, sizeof(struct fatx_sidecar));
+	if (sidecar == NULL) return -1;
+	sidecar->path = strdup(path);
+	if (sidecar->path == NULL) {
+		free(sidecar);
+		return -1;
+	}
+	pthread_mutex_init(&sidecar->lock, NULL);
+	sidecar->state = FATX_SIDECAR_MISSING;
+	info->sidecar = sidecar;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct fatx_sidecar_header)) {
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+	if (!fatx_sidecar_valid(info, map, st.st_size)) {
+		fprintf(stderr, "libfatx: Sidecar %s is out of date, it will be written again\n", path);
+		munmap(map, st.st_size);
+		unlink(path);
+		return 0;
+	}
+	sidecar->map = map;
+	sidecar->map_size = st.st_size;
+	sidecar->state = FATX_SIDECAR_LOADED;
+	madvise(map, st.st_size, MADV_RANDOM);
+	return 0;
+}
+
+/**
+ * Returns the whole FAT in host order as the sidecar holds it, or NULL if
+ * no valid sidecar is mapped.
+ */
+void *fatx_sidecar_fat_table(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	if (sidecar == NULL || sidecar->map == NULL) return NULL;
+	return sidecar->map + ((const struct fatx_sidecar_header *)sidecar->map)->fat;
+}
+
+/**
+ * Whether the sidecar may be used: it was valid at mount, and nothing has
+ * been changed since.
+ */
+static inline const struct fatx_sidecar_header *fatx_sidecar_usable(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	if (sidecar == NULL || sidecar->map == NULL ||
+			__atomic_load_n(&sidecar->changes, __ATOMIC_ACQUIRE) != 0) {
+		return NULL;
+	}
+	return (const struct fatx_sidecar_header *)sidecar->map;
+}
+
+/**
+ * Fills index with the records and cluster offsets of the directory
+ * starting at cluster, as the sidecar has them. Returns 0, or -1 if the
+ * sidecar can't be used or doesn't hold the directory; index is left
+ * untouched then.
+ */
+int fatx_sidecar_dir(fatx_fs_info *info, uint32_t cluster, struct fatx_dir_index *index) {
+	const struct fatx_sidecar_header *header = fatx_sidecar_usable(info);
+	const struct fatx_sidecar_dir *dirs, *dir;
+	const uint8_t *map = (const uint8_t *)header;
+	size_t low = 0, high, mid, count, i;
+	if (header == NULL) return -1;
+	dirs = (const void *)(map + header->dirs);
+	high = header->dir_count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (dirs[mid].cluster < cluster) low = mid + 1;
+		else high = mid;
+	}
+	if (low == header->dir_count || dirs[low].cluster != cluster) return -1;
+	dir = &dirs[low];
+	count = dir->count;
+	if (dir->clusters == 0 || count > (size_t)dir->clusters * FATX_RECORDS_PER_CLUSTER ||
+			dir->records > header->record_count || count > header->record_count - dir->records ||
+			dir->offsets > header->offset_count || dir->clusters > header->offset_count - dir->offsets) {
+		return -1;
+	}
+	index->records = malloc(max(count, (size_t)1) * sizeof(struct fatx_internal_file_record));
+	index->classes = malloc(max(count, (size_t)1));
+	index->cluster_offsets = malloc(dir->clusters * sizeof(off_t));
+	if (index->records == NULL || index->classes == NULL || index->cluster_offsets == NULL) goto fail;
+	memcpy(index->records, map + header->records + dir->records * sizeof(struct fatx_internal_file_record),
+			count * sizeof(struct fatx_internal_file_record));
+	for (i = 0; i < dir->clusters; i++) {
+		index->cluster_offsets[i] = ((const int64_t *)(map + header->offsets))[dir->offsets + i];
+	}
+	if (fatx_scan->classify(index->records, count, index->classes) != count) goto fail;
+	index->count = count;
+	index->clusters = dir->clusters;
+	index->corrupt = dir->corrupt != 0;
+	return 0;
+fail:
+	free(index->records);
+	free(index->classes);
+	free(index->cluster_offsets);
+	index->records = NULL;
+	index->classes = NULL;
+	index->cluster_offsets = NULL;
+	return -1;
+}
+
+/**
+ * Returns a new extent map of the clusters long chain starting at
+ * first_cluster from the sidecar, or NULL if it doesn't hold the chain
+ * (or holds it for a file of another length).
+ */
+struct fatx_extent_map *fatx_sidecar_extents(fatx_fs_info *info, uint32_t first_cluster, uint32_t clusters) {
+	const struct fatx_sidecar_header *header = fatx_sidecar_usable(info);
+	const struct fatx_sidecar_file *files, *file;
+	const struct fatx_sidecar_extent *extents;
+	const uint8_t *map = (const uint8_t *)header;
+	struct fatx_extent_map *result;
+	size_t low = 0, high, mid, i;
+	if (header == NULL) return NULL;
+	files = (const void *)(map + header->files);
+	high = header->file_count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (files[mid].first_cluster < first_cluster) low = mid + 1;
+		else high = mid;
+	}
+	if (low == header->file_count || files[low].first_cluster != first_cluster) return NULL;
+	file = &files[low];
+	if (file->clusters != clusters || file->count == 0 || file->extents > header->extent_count ||
+			file->count > header->extent_count - file->extents) {
+		return NULL;
+	}
+	result = calloc(1, sizeof(struct fatx_extent_map));
+	if (result == NULL) return NULL;
+	result->extents = malloc(file->count * sizeof(struct fatx_extent));
+	if (result->extents == NULL) {
+		free(result);
+		return NULL;
+	}
+	extents = (const void *)(map + header->extents);
+	for (i = 0; i < file->count; i++) {
+		result->extents[i].file_cluster = extents[file->extents + i].file_cluster;
+		result->extents[i].length = extents[file->extents + i].length;
+		result->extents[i].disk_offset = extents[file->extents + i].disk_offset;
+	}
+	result->first_cluster = first_cluster;
+	result->clusters = clusters;
+	result->refs = 1;
+	result->count = result->allocated = file->count;
+	return result;
+}
+
+/**
+ * Called under write_lock before the FAT or a directory is changed. The
+ * first change stops the sidecar from being used and deletes it, under
+ * the sidecar's lock so that a sidecar being written can't be put in
+ * place afterwards.
+ */
+void fatx_sidecar_changed(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	if (sidecar == NULL || __atomic_load_n(&sidecar->changes, __ATOMIC_RELAXED) != 0) return;
+	pthread_mutex_lock(&sidecar->lock);
+	__atomic_store_n(&sidecar->changes, 1, __ATOMIC_RELEASE);
+	unlink(sidecar->path);
+	pthread_mutex_unlock(&sidecar->lock);
+}
+
+/**
+ * The sections of a sidecar being written, grown as the tree is walked.
+ */
+struct fatx_sidecar_builder {
+	fatx_fs_info *info;
+	struct fatx_sidecar_dir *dirs;
+	size_t dir_count, dirs_allocated;
+	int64_t *offsets;
+	size_t offset_count, offsets_allocated;
+	struct fatx_internal_file_record *records;
+	size_t record_count, records_allocated;
+	struct fatx_sidecar_file *files;
+	size_t file_count, files_allocated;
+	struct fatx_sidecar_extent *extents;
+	size_t extent_count, extents_allocated;
+	uint32_t *stack;
+	size_t stack_count, stack_allocated;
+	uint64_t *visited; // bit per cluster, set once a directory starting there is queued
+};
+
+/**
+ * Makes room for need more elements of size bytes in *array.
+ */
+static int fatx_sidecar_reserve(void *array, size_t *allocated, size_t count, size_t need, size_t size) {
+	size_t want = *allocated ? *allocated : 64;
+	void *p;
+	while (want < count + need) want *= 2;
+	if (want == *allocated) return 0;
+	p = realloc(*(void **)array, want * size);
+	if (p == NULL) return -1;
+	*(void **)array = p;
+	*allocated = want;
+	return 0;
+}
+
+static int fatx_sidecar_compare_dirs(const void *a, const void *b) {
+	const struct fatx_sidecar_dir *x = a, *y = b;
+	return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+static int fatx_sidecar_compare_files(const void *a, const void *b) {
+	const struct fatx_sidecar_file *x = a, *y = b;
+	return (x->first_cluster > y->first_cluster) - (x->first_cluster < y->first_cluster);
+}
+
+/**
+ * Adds the extents of a file's chain. A chain that can't be walked is
+ * left out, so that opening the file walks it and reports the error.
+ */
+static int fatx_sidecar_add_file(struct fatx_sidecar_builder *b, uint32_t first_cluster, uint32_t clusters) {
+	struct fatx_extent_map *map;
+	struct fatx_sidecar_file *file;
+	size_t i;
+	map = fatx_extent_map_build(b->info, first_cluster, clusters);
+	if (map == NULL) return 0;
+	if (map->clusters != clusters) { // cut short, which opening the file warns about
+		fatx_extent_map_put(map);
+		return 0;
+	}
+	if (fatx_sidecar_reserve(&b->files, &b->files_allocated, b->file_count, 1, sizeof(*b->files)) < 0 ||
+			fatx_sidecar_reserve(&b->extents, &b->extents_allocated, b->extent_count, map->count,
+					sizeof(*b->extents)) < 0) {
+		fatx_extent_map_put(map);
+		return -ENOMEM;
+	}
+	file = &b->files[b->file_count++];
+	file->first_cluster = first_cluster;
+	file->clusters = clusters;
+	file->extents = b->extent_count;
+	file->count = map->count;
+	for (i = 0; i < map->count; i++) {
+		b->extents[b->extent_count].file_cluster = map->extents[i].file_cluster;
+		b->extents[b->extent_count].length = map->extents[i].length;
+		b->extents[b->extent_count++].disk_offset = map->extents[i].disk_offset;
+	}
+	fatx_extent_map_put(map);
+	return 0;
+}
+
+/**
+ * Adds the directory starting at cluster, queueing its subdirectories
+ * and adding its files.
+ */
+static int fatx_sidecar_add_dir(struct fatx_sidecar_builder *b, uint32_t cluster) {
+	fatx_fs_info *info = b->info;
+	struct fatx_dir_index *index;
+	struct fatx_sidecar_dir *dir;
+	size_t i;
+	int ret = 0;
+	index = fatx_dir_index_build(info, cluster);
+	if (index == NULL) return -EIO;
+	if (fatx_sidecar_reserve(&b->dirs, &b->dirs_allocated, b->dir_count, 1, sizeof(*b->dirs)) < 0 ||
+			fatx_sidecar_reserve(&b->offsets, &b->offsets_allocated, b->offset_count, index->clusters,
+					sizeof(*b->offsets)) < 0 ||
+			fatx_sidecar_reserve(&b->records, &b->records_allocated, b->record_count, index->count,
+					sizeof(*b->records)) < 0) {
+		fatx_dir_index_put(index);
+		return -ENOMEM;
+	}
+	dir = &b->dirs[b->dir_count++];
+	dir->cluster = cluster;
+	dir->corrupt = index->corrupt;
+	dir->count = index->count;
+	dir->clusters = index->clusters;
+	dir->records = b->record_count;
+	dir->offsets = b->offset_count;
+	memcpy(b->records + b->record_count, index->records, index->count * sizeof(*b->records));
+	b->record_count += index->count;
+	for (i = 0; i < index->clusters; i++) b->offsets[b->offset_count++] = index->cluster_offsets[i];
+	for (i = 0; i < index->count && ret == 0; i++) {
+		struct fatx_internal_file_record *ifr = &index->records[i];
+		uint32_t first = fatx_to_host32(info, ifr->first_cluster);
+		uint32_t clusters = ((uint64_t)fatx_to_host32(info, ifr->size) + FATX_CLUSTER_SIZE - 1) >> 14;
+		if (index->classes[i] != FATX_RECORD_LIVE || first < 2 || first >= info->cluster_limit) continue;
+		if (ifr->attributes & 0x10) {
+			if (b->visited[first / 64] & (UINT64_C(1) << (first % 64))) continue;
+			b->visited[first / 64] |= UINT64_C(1) << (first % 64);
+			if (fatx_sidecar_reserve(&b->stack, &b->stack_allocated, b->stack_count, 1,
+					sizeof(*b->stack)) < 0) {
+				ret = -ENOMEM;
+			} else {
+				b->stack[b->stack_count++] = first;
+			}
+		} else if (clusters > 0) {
+			ret = fatx_sidecar_add_file(b, first, clusters);
+		}
+	}
+	fatx_dir_index_put(index);
+	return ret;
+}
+
+/**
+ * Writes size bytes of data as the next section of fd, aligned to align,
+ * and returns where it starts in *offset.
+ */
+static int fatx_sidecar_put(int fd, uint64_t *end, uint64_t *offset, const void *data, size_t size,
+		size_t align) {
+	*offset = (*end + align - 1) / align * align;
+	if (size > 0 && pwrite(fd, data, size, *offset) != (ssize_t)size) return errno != 0 ? -errno : -EIO;
+	*end = *offset + size;
+	return 0;
+}
+
+static void fatx_sidecar_builder_free(struct fatx_sidecar_builder *b) {
+	free(b->dirs);
+	free(b->offsets);
+	free(b->records);
+	free(b->files);
+	free(b->extents);
+	free(b->stack);
+	free(b->visited);
+}
+
+/**
+ * Writes a sidecar of info to path: the FAT, then every directory reachable
+ * from the root. The file is written under a temporary name and renamed
+ * into place, unless the filesystem changed meanwhile. With stop, the walk
+ * gives up with -ECANCELED as soon as *stop is set.
+ */
+static int fatx_sidecar_write_file(fatx_fs_info *info, const char *path, const int *stop) {
+	struct fatx_sidecar_builder b;
+	struct fatx_sidecar_header header;
+	struct fatx_sidecar *sidecar = info->sidecar;
+	size_t length = strlen(path), i, kept;
+	uint64_t end = sizeof(header);
+	char *temp;
+	int fd, ret;
+	if (sidecar != NULL && __atomic_load_n(&sidecar->changes, __ATOMIC_ACQUIRE) != 0) return -ESTALE;
+	memset(&b, 0, sizeof(b));
+	memset(&header, 0, sizeof(header));
+	b.info = info;
+	temp = malloc(length + 5);
+	b.visited = calloc((info->cluster_limit + 63) / 64, sizeof(uint64_t));
+	if (temp == NULL || b.visited == NULL) {
+		free(temp);
+		free(b.visited);
+		return -ENOMEM;
+	}
+	memcpy(temp, path, length);
+	memcpy(temp + length, ".tmp", 5);
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		free(temp);
+		free(b.visited);
+		return ret;
+	}
+	header.magic = FATX_SIDECAR_MAGIC;
+	header.version = FATX_SIDECAR_VERSION;
+	header.header_size = sizeof(header);
+	header.fat_offset = info->fat_offset;
+	header.root_dir = info->root_dir;
+	header.end = info->end;
+	header.fat_entries = info->fat_entries;
+	header.width = info->width;
+	header.endianness = info->endianness;
+	ret = fatx_sidecar_device(info, &header.device_size, &header.device_mtime) < 0 ? -errno : 0;
+	if (ret == 0) {
+		header.fat = (end + FATX_SIDECAR_FAT_ALIGN - 1) / FATX_SIDECAR_FAT_ALIGN * FATX_SIDECAR_FAT_ALIGN;
+		ret = fatx_sidecar_fat(info, &header.fat_checksum, fd, header.fat);
+		end = header.fat + info->fat_entries * info->width;
+	}
+	if (ret == 0) ret = fatx_sidecar_add_dir(&b, 1);
+	while (ret == 0 && b.stack_count > 0) {
+		if (stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED)) ret = -ECANCELED;
+		else ret = fatx_sidecar_add_dir(&b, b.stack[--b.stack_count]);
+	}
+	if (ret == 0) {
+		qsort(b.dirs, b.dir_count, sizeof(*b.dirs), fatx_sidecar_compare_dirs);
+		qsort(b.files, b.file_count, sizeof(*b.files), fatx_sidecar_compare_files);
+		// a chain two records share (a cross link) is kept once
+		for (i = 0, kept = 0; i < b.file_count; i++) {
+			if (kept > 0 && b.files[kept - 1].first_cluster == b.files[i].first_cluster) continue;
+			b.files[kept++] = b.files[i];
+		}
+		b.file_count = kept;
+		header.dir_count = b.dir_count;
+		header.offset_count = b.offset_count;
+		header.record_count = b.record_count;
+		header.file_count = b.file_count;
+		header.extent_count = b.extent_count;
+		ret = fatx_sidecar_put(fd, &end, &header.dirs, b.dirs, b.dir_count * sizeof(*b.dirs), FATX_SIDECAR_ALIGN);
+	}
+	if (ret == 0) {
+		ret = fatx_sidecar_put(fd, &end, &header.offsets, b.offsets, b.offset_count * sizeof(*b.offsets),
+				FATX_SIDECAR_ALIGN);
+	}
+	if (ret == 0) {
+		ret = fatx_sidecar_put(fd, &end, &header.records, b.records, b.record_count * sizeof(*b.records),
+				FATX_SIDECAR_ALIGN);
+	}
+	if (ret == 0) {
+		ret = fatx_sidecar_put(fd, &end, &header.files, b.files, b.file_count * sizeof(*b.files),
+				FATX_SIDECAR_ALIGN);
+	}
+	if (ret == 0) {
+		ret = fatx_sidecar_put(fd, &end, &header.extents, b.extents, b.extent_count * sizeof(*b.extents),
+				FATX_SIDECAR_ALIGN);
+	}
+	if (ret == 0) {
+		header.file_size = end;
+		if (ftruncate(fd, end) < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+				fdatasync(fd) < 0) {
+			ret = errno != 0 ? -errno : -EIO;
+		}
+	}
+	if (close(fd) < 0 && ret == 0) ret = -errno;
+	fatx_sidecar_builder_free(&b);
+	if (sidecar != NULL) pthread_mutex_lock(&sidecar->lock);
+	if (ret == 0 && sidecar != NULL && __atomic_load_n(&sidecar->changes, __ATOMIC_ACQUIRE) != 0) {
+		ret = -ESTALE;
+	}
+	if (ret == 0 && rename(temp, path) < 0) ret = -errno;
+	if (sidecar != NULL) pthread_mutex_unlock(&sidecar->lock);
+	if (ret < 0) unlink(temp);
+	free(temp);
+	return ret;
+}
+
+/**
+ * Writes a sidecar of info to path, which a later fatx_fs_init_opts can be
+ * given as fatx_fs_options.sidecar. Walks the whole tree, so it takes as
+ * long as listing everything would. Returns 0, -ESTALE if the filesystem
+ * has been changed since it was mounted (the sidecar would only be right
+ * once the changes are written out) or another -errno.
+ */
+int fatx_sidecar_write(fatx_fs_info *info, const char *path) {
+	return fatx_sidecar_write_file(info, path, NULL);
+}
+
+static void *fatx_sidecar_builder_main(void *arg) {
+	fatx_fs_info *info = arg;
+	struct fatx_sidecar *sidecar = info->sidecar;
+	int ret = fatx_sidecar_write_file(info, sidecar->path, &sidecar->stop);
+	if (ret < 0 && ret != -ECANCELED && ret != -ESTALE) {
+		fprintf(stderr, "libfatx: Error writing sidecar %s: %s\n", sidecar->path, strerror(-ret));
+	}
+	__atomic_store_n(&sidecar->state, ret == 0 ? FATX_SIDECAR_BUILT : FATX_SIDECAR_FAILED, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Starts writing the sidecar in a background thread if fatx_fs_init_opts
+ * found it missing or out of date. The thread is stopped and joined by
+ * fatx_fs_end. A program that daemonizes must call this afterwards, since
+ * the thread wouldn't survive the fork. Returns 0, or -errno if the
+ * thread couldn't be started.
+ */
+int fatx_sidecar_build(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	int ret;
+	if (sidecar == NULL || sidecar->state != FATX_SIDECAR_MISSING ||
+			__atomic_load_n(&sidecar->changes, __ATOMIC_ACQUIRE) != 0) {
+		return 0;
+	}
+	sidecar->state = FATX_SIDECAR_BUILDING;
+	ret = pthread_create(&sidecar->builder, NULL, fatx_sidecar_builder_main, info);
+	if (ret != 0) {
+		sidecar->state = FATX_SIDECAR_MISSING;
+		return -ret;
+	}
+	sidecar->started = 1;
+	return 0;
+}
+
+/**
+ * Returns the state of info's sidecar, FATX_SIDECAR_NONE if it wasn't
+ * given one.
+ */
+int fatx_sidecar_status(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	if (sidecar == NULL) return FATX_SIDECAR_NONE;
+	if (__atomic_load_n(&sidecar->changes, __ATOMIC_ACQUIRE) != 0) return FATX_SIDECAR_STALE;
+	return __atomic_load_n(&sidecar->state, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Stops and joins the thread writing the sidecar, if there is one. Called
+ * first thing by fatx_fs_end.
+ */
+void fatx_sidecar_stop(fatx_fs_info *info) {
+	struct fatx_sidecar *sidecar = info->sidecar;
+	if (sidecar == NULL || !sidecar->started) return;
+	__atomic_store_n(&sidecar->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(sidecar->builder, NULL);
+	sidecar->started = 0;
+}
+
+/**
+ * Unmaps and frees the sidecar. The FAT may point into it, so fatx_fs_end
+ * does this last.
+ */
+void fatx_sidecar_free(struct fatx_sidecar *sidecar) {
+	if (sidecar == NULL) return;
+	if (sidecar->map != NULL) munmap(sidecar->map, sidecar->map_size);
+	pthread_mutex_destroy(&sidecar->lock);
+	free(sidecar->path);
+	free(sidecar);
+}
@@ -0,0 +1,176 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Walking a tree. Directories are handed out to worker threads through
+ * the queues of fatx_work.c, the same way fatx_check does it. A directory
+ * is only queued by whoever first claims its cluster in a shared bitmap,
+ * so a damaged tree that links back to a directory above can't keep the
+ * walk going forever. Each directory is read through the directory index
+ * cache, so entries come out decoded and with their record offsets without
+ * another lookup. A directory is only queued if the depth limit and the
+ * visitor let it be, so pruned subtrees are never read.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+struct fatx_walk {
+	fatx_fs_info *info;
+	const fatx_walk_options *opts;
+	uint64_t *visited; // bit per cluster, set once a directory starting there is queued
+	struct fatx_work work;
+	int error;
+	int damaged; // a directory ended in a bad record or was reached twice, so the listing is off
+};
+
+struct fatx_walk_worker {
+	struct fatx_walk *walk;
+	unsigned int id;
+	pthread_t thread;
+};
+
+static void fatx_walk_fail(struct fatx_walk *walk, int error) {
+	int expected = 0;
+	__atomic_compare_exchange_n(&walk->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queues a directory on the worker's own queue, unless it has been queued
+ * before. path is copied.
+ */
+static int fatx_walk_push(struct fatx_walk_worker *worker, uint32_t cluster, int depth, char *path) {
+	struct fatx_walk *walk = worker->walk;
+	struct fatx_work_dir dir = { cluster, depth, 0, path };
+	uint64_t bit = UINT64_C(1) << (cluster % 64);
+	if (__atomic_fetch_or(&walk->visited[cluster / 64], bit, __ATOMIC_RELAXED) & bit) {
+		__atomic_store_n(&walk->damaged, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return fatx_work_push(&walk->work, worker->id, &dir);
+}
+
+/**
+ * Visits everything in a directory that passes the filters, and queues
+ * the subdirectories that are to be listed too.
+ */
+static int fatx_walk_dir(struct fatx_walk_worker *worker, const struct fatx_work_dir *dir) {
+	struct fatx_walk *walk = worker->walk;
+	const fatx_walk_options *opts = walk->opts;
+	struct fatx_dir_index *index;
+	fatx_dirent entry;
+	size_t length = strlen(dir->path), i;
+	char *path;
+	int descend = opts->max_depth == 0 || dir->depth < opts->max_depth;
+	int ret = 0, visit;
+	index = fatx_dir_index_get(walk->info, dir->cluster);
+	if (index == NULL) return -EIO;
+	path = malloc(length + sizeof(entry.record.name) + 1);
+	if (path == NULL) {
+		fatx_dir_index_put(index);
+		return -ENOMEM;
+	}
+	memcpy(path, dir->path, length);
+	path[length] = '/';
+	for (i = 0; i < index->count && ret >= 0; i++) {
+		if (index->classes[i] != FATX_RECORD_LIVE) continue;
+		if (fatx_dir_index_entry(walk->info, index, i, &entry) < 0) continue;
+		if (opts->dirs_only && !entry.record.isdir) continue;
+		strcpy(path + length + 1, entry.record.name);
+		visit = opts->pattern == NULL || fnmatch(opts->pattern, entry.record.name, FNM_CASEFOLD) == 0;
+		ret = visit && opts->visit != NULL ? opts->visit(path, &entry, dir->depth, opts->user) : 0;
+		if (ret < 0 || ret == FATX_WALK_PRUNE || !entry.record.isdir || !descend) continue;
+		if (entry.first_cluster < 2 || entry.first_cluster >= walk->info->cluster_limit) continue;
+		ret = fatx_walk_push(worker, entry.first_cluster, dir->depth + 1, path);
+	}
+	if (index->corrupt) __atomic_store_n(&walk->damaged, 1, __ATOMIC_RELAXED);
+	fatx_dir_index_put(index);
+	free(path);
+	return ret < 0 ? ret : 0;
+}
+
+static void *fatx_walk_worker(void *arg) {
+	struct fatx_walk_worker *worker = arg;
+	struct fatx_walk *walk = worker->walk;
+	struct fatx_work_dir dir;
+	int ret;
+	while (fatx_work_next(&walk->work, worker->id, &dir)) {
+		if (__atomic_load_n(&walk->error, __ATOMIC_RELAXED) == 0) {
+			ret = fatx_walk_dir(worker, &dir);
+			if (ret < 0) fatx_walk_fail(walk, ret);
+		}
+		fatx_work_done(&walk->work, &dir);
+	}
+	return NULL;
+}
+
+int fatx_walk(fatx_fs_info *info, const char *path, const fatx_walk_options *opts) {
+	struct fatx_walk walk;
+	struct fatx_walk_worker *workers = NULL;
+	fatx_dirent start;
+	size_t length = strlen(path), i;
+	unsigned int started = 0;
+	char *prefix;
+	int ret;
+	ret = fatx_lookup_path(info, path, &start);
+	if (ret < 0) return ret;
+	if (!start.record.isdir) return -ENOTDIR;
+	// the paths handed to visit are path and a name, without doubled slashes
+	while (length > 0 && path[length - 1] == '/') length--;
+	prefix = strndup(path, length);
+	if (prefix == NULL) return -ENOMEM;
+	memset(&walk, 0, sizeof(walk));
+	walk.info = info;
+	walk.opts = opts;
+	walk.visited = calloc((info->cluster_limit + 63) / 64, sizeof(uint64_t));
+	if (fatx_work_init(&walk.work, opts->threads) == 0) {
+		workers = calloc(walk.work.threads, sizeof(struct fatx_walk_worker));
+	}
+	if (walk.visited == NULL || workers == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < walk.work.threads; i++) {
+		workers[i].walk = &walk;
+		workers[i].id = i;
+	}
+	ret = fatx_walk_push(&workers[0], start.first_cluster, 1, prefix);
+	if (ret < 0) goto out;
+	for (started = 0; started < walk.work.threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, fatx_walk_worker, &workers[started]) != 0) break;
+	}
+	if (started == 0) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	for (i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+	ret = walk.error;
+	if (ret == 0 && walk.damaged) ret = -EIO;
+out:
+	fatx_work_destroy(&walk.work);
+	free(workers);
+	free(walk.visited);
+	free(prefix);
+	return ret;
+}
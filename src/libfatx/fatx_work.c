@@ -0,0 +1,163 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Directories handed out to a pool of threads, for the passes that visit
+ * a whole tree. Each thread has its own queue: it takes the newest
+ * directory off it and, when that is empty, steals the oldest one from
+ * another's, so a thread keeps going deeper into its own part of the tree
+ * while idle ones take whole subtrees near the top. A thread with nothing
+ * to take sleeps until a directory is queued or the last one is done.
+ */
+
+#include "fatx_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * Sets up a queue per thread, threads of them or one per CPU if 0.
+ */
+int fatx_work_init(struct fatx_work *work, unsigned int threads) {
+	long cpus;
+	unsigned int i;
+	memset(work, 0, sizeof(struct fatx_work));
+	if (threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	work->queues = calloc(threads, sizeof(struct fatx_work_queue));
+	if (work->queues == NULL) return -ENOMEM;
+	work->threads = threads;
+	for (i = 0; i < threads; i++) pthread_mutex_init(&work->queues[i].lock, NULL);
+	pthread_mutex_init(&work->lock, NULL);
+	pthread_cond_init(&work->wake, NULL);
+	return 0;
+}
+
+/**
+ * Frees the queues and whatever is left on them.
+ */
+void fatx_work_destroy(struct fatx_work *work) {
+	struct fatx_work_queue *queue;
+	unsigned int i;
+	if (work->queues == NULL) return;
+	for (i = 0; i < work->threads; i++) {
+		queue = &work->queues[i];
+		while (queue->start < queue->end) free(queue->items[queue->start++].path);
+		free(queue->items);
+		pthread_mutex_destroy(&queue->lock);
+	}
+	free(work->queues);
+	work->queues = NULL;
+	pthread_cond_destroy(&work->wake);
+	pthread_mutex_destroy(&work->lock);
+}
+
+/**
+ * Queues a directory on thread id's own queue. dir->path is copied.
+ */
+int fatx_work_push(struct fatx_work *work, unsigned int id, const struct fatx_work_dir *dir) {
+	struct fatx_work_queue *queue = &work->queues[id];
+	char *copy = strdup(dir->path);
+	if (copy == NULL) return -ENOMEM;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->end == queue->allocated) {
+		if (queue->start > 0) {
+			memmove(queue->items, queue->items + queue->start,
+					(queue->end - queue->start) * sizeof(struct fatx_work_dir));
+			queue->end -= queue->start;
+			queue->start = 0;
+		}
+		if (queue->end == queue->allocated) {
+			size_t allocated = queue->allocated ? queue->allocated * 2 : 64;
+			struct fatx_work_dir *p = realloc(queue->items, allocated * sizeof(struct fatx_work_dir));
+			if (p == NULL) {
+				pthread_mutex_unlock(&queue->lock);
+				free(copy);
+				return -ENOMEM;
+			}
+			queue->items = p;
+			queue->allocated = allocated;
+		}
+	}
+	queue->items[queue->end] = *dir;
+	queue->items[queue->end].path = copy;
+	queue->end++;
+	// counted before it can be taken, so queued never drops below zero
+	pthread_mutex_lock(&work->lock);
+	work->queued++;
+	work->pending++;
+	pthread_cond_signal(&work->wake);
+	pthread_mutex_unlock(&work->lock);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+/**
+ * Takes the newest directory off queue, or the oldest if stealing.
+ */
+static int fatx_work_take(struct fatx_work_queue *queue, int steal, struct fatx_work_dir *dir) {
+	int found = 0;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->start < queue->end) {
+		*dir = steal ? queue->items[queue->start++] : queue->items[--queue->end];
+		found = 1;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return found;
+}
+
+/**
+ * Gets thread id the next directory to work on, waiting for one if need
+ * be. Returns 1 with a directory that has to be given back to
+ * fatx_work_done, or 0 once every directory queued has been done.
+ */
+int fatx_work_next(struct fatx_work *work, unsigned int id, struct fatx_work_dir *dir) {
+	unsigned int i;
+	int found, done;
+	for (;;) {
+		found = fatx_work_take(&work->queues[id], 0, dir);
+		for (i = 1; !found && i < work->threads; i++) {
+			found = fatx_work_take(&work->queues[(id + i) % work->threads], 1, dir);
+		}
+		pthread_mutex_lock(&work->lock);
+		if (found) {
+			work->queued--;
+			pthread_mutex_unlock(&work->lock);
+			return 1;
+		}
+		// another thread may have taken what was queued since, so look again once woken
+		while (work->queued == 0 && work->pending > 0) pthread_cond_wait(&work->wake, &work->lock);
+		done = work->pending == 0;
+		pthread_mutex_unlock(&work->lock);
+		if (done) return 0;
+	}
+}
+
+/**
+ * Marks a directory from fatx_work_next as done and frees its path.
+ */
+void fatx_work_done(struct fatx_work *work, struct fatx_work_dir *dir) {
+	free(dir->path);
+	dir->path = NULL;
+	pthread_mutex_lock(&work->lock);
+	if (--work->pending == 0) pthread_cond_broadcast(&work->wake);
+	pthread_mutex_unlock(&work->lock);
+}
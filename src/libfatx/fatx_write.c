@@ -0,0 +1,1032 @@
+/*
+  libfatx: Userspace access to a FATX filesystem
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write support. Clusters are allocated from a bitmap of free clusters
+ * built from the FAT at mount, preferring runs that hold a whole write so
+ * files stay in one piece. Changes to the FAT and to directory records
+ * are kept in memory and written out together, in disk order, by
+ * fatx_sync (or fatx_fs_end); file data is written straight away.
+ */
+
+#include "fatx_internal.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static int fatx_flush(fatx_fs_info *info);
+
+static inline int fatx_free_map_test(fatx_fs_info *info, uint32_t cluster) {
+	return (info->free_map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/**
+ * Marks count clusters starting at cluster as free (free set) or used.
+ */
+static void fatx_free_map_mark(fatx_fs_info *info, uint32_t cluster, uint32_t count, int free) {
+	uint32_t end = cluster + count;
+	for (; cluster < end && cluster % 64 != 0; cluster++) {
+		if (free) info->free_map[cluster / 64] |= UINT64_C(1) << (cluster % 64);
+		else info->free_map[cluster / 64] &= ~(UINT64_C(1) << (cluster % 64));
+	}
+	for (; cluster + 64 <= end; cluster += 64) info->free_map[cluster / 64] = free ? UINT64_MAX : 0;
+	for (; cluster < end; cluster++) {
+		if (free) info->free_map[cluster / 64] |= UINT64_C(1) << (cluster % 64);
+		else info->free_map[cluster / 64] &= ~(UINT64_C(1) << (cluster % 64));
+	}
+}
+
+/**
+ * Returns the first free cluster at or after cluster and before end, or
+ * end if there is none. Skips a whole word of used clusters at a time.
+ */
+static uint32_t fatx_free_map_next(fatx_fs_info *info, uint32_t cluster, uint32_t end) {
+	while (cluster < end) {
+		uint64_t word = info->free_map[cluster / 64] >> (cluster % 64);
+		if (word != 0) {
+			cluster += __builtin_ctzll(word);
+			return min(cluster, end);
+		}
+		cluster = (cluster | 63) + 1;
+	}
+	return end;
+}
+
+/**
+ * Returns how many clusters from cluster on are free, stopping at limit.
+ */
+static uint32_t fatx_free_map_run(fatx_fs_info *info, uint32_t cluster, uint32_t limit) {
+	uint32_t run = 0;
+	while (run < limit && cluster + run < info->cluster_limit) {
+		uint32_t c = cluster + run;
+		uint64_t word = ~info->free_map[c / 64] >> (c % 64);
+		uint32_t free = word ? (uint32_t)__builtin_ctzll(word) : 64 - c % 64;
+		run += free;
+		if (word != 0) break;
+	}
+	return min(run, min(limit, info->cluster_limit - cluster));
+}
+
+/**
+ * Finds free clusters for want more clusters: the first run (searching
+ * from the allocation hint and wrapping around) that holds all of them,
+ * or failing that the longest run there is. Sets *start and returns the
+ * run's length, which is 0 if the disk is full.
+ */
+static uint32_t fatx_free_map_find(fatx_fs_info *info, uint32_t want, uint32_t *start) {
+	uint32_t hint = max(info->alloc_hint, 2), best = 0, best_start = 0, pass, cluster, end, run;
+	for (pass = 0; pass < 2; pass++) {
+		cluster = pass ? 2 : hint;
+		end = pass ? hint : info->cluster_limit;
+		while ((cluster = fatx_free_map_next(info, cluster, end)) < end) {
+			run = fatx_free_map_run(info, cluster, want);
+			if (run == want) {
+				*start = cluster;
+				return run;
+			}
+			if (run > best) {
+				best = run;
+				best_start = cluster;
+			}
+			cluster += run;
+		}
+	}
+	*start = best_start;
+	return best;
+}
+
+/**
+ * Sets up writing: the free cluster bitmap and the table of changed
+ * directory clusters. Returns 0, or -1 if info has to stay read only.
+ */
+int fatx_write_init(fatx_fs_info *info) {
+	size_t pages = (info->fat_entries * info->width + FATX_FAT_PAGE_SIZE - 1) / FATX_FAT_PAGE_SIZE;
+	info->alloc_hint = 2;
+	if (info->fat != NULL) {
+		info->fat_dirty = calloc(pages, 1);
+		if (info->fat_dirty == NULL) return -1;
+	}
+	info->dirty = calloc(1, sizeof(struct fatx_dirty_clusters));
+	info->free_map = calloc((info->cluster_limit + 63) / 64, sizeof(uint64_t));
+	if (info->dirty == NULL || info->free_map == NULL || fatx_fat_count_free(info, info->free_map) < 0) {
+		free(info->fat_dirty);
+		free(info->free_map);
+		free(info->dirty);
+		info->fat_dirty = NULL;
+		info->free_map = NULL;
+		info->dirty = NULL;
+		return -1;
+	}
+	pthread_rwlock_init(&info->dirty->lock, NULL);
+	pthread_mutex_init(&info->write_lock, NULL);
+	return 0;
+}
+
+/**
+ * Recounts the free clusters and rebuilds the bitmap from the FAT, after
+ * the FAT has been changed behind the allocator's back and written out.
+ */
+int fatx_free_map_reset(fatx_fs_info *info) {
+	int ret;
+	pthread_mutex_lock(&info->write_lock);
+	memset(info->free_map, 0, (info->cluster_limit + 63) / 64 * sizeof(uint64_t));
+	info->alloc_hint = 2;
+	ret = fatx_fat_count_free(info, info->free_map);
+	pthread_mutex_unlock(&info->write_lock);
+	return ret < 0 ? -EIO : 0;
+}
+
+/**
+ * Writes out everything still in memory and frees what fatx_write_init
+ * set up. Does nothing for a read only info.
+ */
+void fatx_write_end(fatx_fs_info *info) {
+	if (info->dirty == NULL) return;
+	fatx_sync(info);
+	pthread_rwlock_destroy(&info->dirty->lock);
+	pthread_mutex_destroy(&info->write_lock);
+	free(info->dirty->freed);
+	free(info->dirty);
+	free(info->free_map);
+	free(info->fat_dirty);
+	info->dirty = NULL;
+	info->free_map = NULL;
+	info->fat_dirty = NULL;
+}
+
+static inline off_t fatx_cluster_base(fatx_fs_info *info, off_t offset) {
+	return offset - ((offset - info->root_dir) & (FATX_CLUSTER_SIZE - 1));
+}
+
+static struct fatx_dirty_cluster **fatx_dirty_slot(struct fatx_dirty_clusters *dirty, off_t offset) {
+	struct fatx_dirty_cluster **slot = &dirty->buckets[(offset >> 14) % FATX_DIRTY_CLUSTER_LIMIT];
+	while (*slot != NULL && (*slot)->offset != offset) slot = &(*slot)->hash_next;
+	return slot;
+}
+
+/**
+ * Copies size bytes at offset out of the changed copy of their cluster.
+ * Returns 1 if there is one, or 0 if the disk is up to date.
+ */
+static int fatx_dirty_read(fatx_fs_info *info, void *buffer, size_t size, off_t offset) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	struct fatx_dirty_cluster *cluster;
+	off_t base;
+	if (dirty == NULL || __atomic_load_n(&dirty->count, __ATOMIC_ACQUIRE) == 0) return 0;
+	base = fatx_cluster_base(info, offset);
+	pthread_rwlock_rdlock(&dirty->lock);
+	cluster = *fatx_dirty_slot(dirty, base);
+	if (cluster != NULL) memcpy(buffer, cluster->data + (offset - base), size);
+	pthread_rwlock_unlock(&dirty->lock);
+	return cluster != NULL;
+}
+
+/**
+ * Reads directory records (which must not cross a cluster boundary),
+ * seeing changes that haven't been written out yet. Same return values as
+ * fatx_read_at.
+ */
+int fatx_read_meta(fatx_fs_info *info, void *buffer, size_t size, off_t offset) {
+	if (fatx_dirty_read(info, buffer, size, offset)) return 0;
+	return fatx_read_at(info, buffer, size, offset);
+}
+
+/**
+ * Fills ifr with the record at record_offset if it has been changed since
+ * it was last written out. Returns 1 if so, or 0 if what is on disk (and
+ * so anything cached from it) is current.
+ */
+int fatx_record_refresh(fatx_fs_info *info, off_t record_offset,
+		struct fatx_internal_file_record *ifr) {
+	if (record_offset == -1) return 0;
+	return fatx_dirty_read(info, ifr, sizeof(*ifr), record_offset);
+}
+
+/**
+ * Returns the in-memory copy of the directory cluster at offset, making
+ * one the first time: read from disk, or filled with end markers for a
+ * cluster that has just been allocated (fresh). Flushes first when the
+ * table is full, so no pointer returned earlier may be kept across a
+ * call. Called with write_lock held.
+ */
+static struct fatx_dirty_cluster *fatx_dirty_get(fatx_fs_info *info, off_t offset, int fresh) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	struct fatx_dirty_cluster **slot, *cluster;
+	fatx_sidecar_changed(info);
+	slot = fatx_dirty_slot(dirty, offset);
+	if (*slot != NULL) {
+		if (fresh) {
+			pthread_rwlock_wrlock(&dirty->lock);
+			memset((*slot)->data, 0xFF, FATX_CLUSTER_SIZE);
+			pthread_rwlock_unlock(&dirty->lock);
+		}
+		return *slot;
+	}
+	if (dirty->count >= FATX_DIRTY_CLUSTER_LIMIT && fatx_flush(info) < 0) return NULL;
+	cluster = malloc(sizeof(struct fatx_dirty_cluster));
+	if (cluster == NULL) return NULL;
+	cluster->offset = offset;
+	if (fresh) {
+		memset(cluster->data, 0xFF, FATX_CLUSTER_SIZE);
+	} else if (fatx_read_at(info, cluster->data, FATX_CLUSTER_SIZE, offset) < 0) {
+		free(cluster);
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&dirty->lock);
+	slot = fatx_dirty_slot(dirty, offset);
+	cluster->hash_next = NULL;
+	*slot = cluster;
+	__atomic_store_n(&dirty->count, dirty->count + 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&dirty->lock);
+	return cluster;
+}
+
+/**
+ * Drops the changed copy of the cluster at offset, which has been freed,
+ * so that flushing it can't overwrite whatever the cluster holds next.
+ */
+static void fatx_dirty_drop(fatx_fs_info *info, off_t offset) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	struct fatx_dirty_cluster **slot, *cluster;
+	if (dirty->count == 0) return;
+	pthread_rwlock_wrlock(&dirty->lock);
+	slot = fatx_dirty_slot(dirty, offset);
+	cluster = *slot;
+	if (cluster != NULL) {
+		*slot = cluster->hash_next;
+		__atomic_store_n(&dirty->count, dirty->count - 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&dirty->lock);
+	free(cluster);
+}
+
+/**
+ * Replaces the record at record_offset with ifr in memory. Called with
+ * write_lock held.
+ */
+int fatx_record_write(fatx_fs_info *info, off_t record_offset,
+		const struct fatx_internal_file_record *ifr) {
+	off_t base = fatx_cluster_base(info, record_offset);
+	struct fatx_dirty_cluster *cluster = fatx_dirty_get(info, base, 0);
+	if (cluster == NULL) return -EIO;
+	pthread_rwlock_wrlock(&info->dirty->lock);
+	memcpy(cluster->data + (record_offset - base), ifr, sizeof(*ifr));
+	pthread_rwlock_unlock(&info->dirty->lock);
+	return 0;
+}
+
+int fatx_record_read(fatx_fs_info *info, off_t record_offset,
+		struct fatx_internal_file_record *ifr) {
+	return fatx_read_meta(info, ifr, sizeof(*ifr), record_offset) < 0 ? -EIO : 0;
+}
+
+static int fatx_dirty_compare(const void *a, const void *b) {
+	off_t x = (*(struct fatx_dirty_cluster * const *)a)->offset;
+	off_t y = (*(struct fatx_dirty_cluster * const *)b)->offset;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Frees the clusters fatx_chain_free put aside, now that no record on disk
+ * points at them any more. Called with write_lock held.
+ */
+static int fatx_freed_release(fatx_fs_info *info) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	uint32_t cluster;
+	size_t i;
+	for (i = 0; i < dirty->freed_count; i++) {
+		cluster = dirty->freed[i];
+		if (fatx_free_map_test(info, cluster)) continue; // freed twice through a damaged chain
+		if (fatx_fat_set(info, cluster, 0) < 0) return -EIO;
+		fatx_free_map_mark(info, cluster, 1, 1);
+		__atomic_add_fetch(&info->free_clusters, 1, __ATOMIC_RELAXED);
+	}
+	dirty->freed_count = 0;
+	return fatx_fat_flush(info) < 0 ? -EIO : 0;
+}
+
+/**
+ * Writes out the changed FAT pages, then the changed directory clusters
+ * sorted by offset, with neighbouring clusters going out in one pwritev.
+ * Chains freed since the last flush are only freed in the FAT once the
+ * records that pointed at them are on disk, so a crash in between leaves
+ * lost clusters rather than a record pointing into free space. Called
+ * with write_lock held.
+ */
+static int fatx_flush(fatx_fs_info *info) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	struct fatx_dirty_cluster **list, *cluster, *next;
+	struct iovec iov[FATX_IOV_BATCH];
+	size_t n = 0, i, j;
+	if (fatx_fat_flush(info) < 0) return -EIO;
+	if (dirty->count == 0) return dirty->freed_count > 0 ? fatx_freed_release(info) : 0;
+	list = malloc(dirty->count * sizeof(struct fatx_dirty_cluster *));
+	if (list == NULL) return -ENOMEM;
+	for (i = 0; i < FATX_DIRTY_CLUSTER_LIMIT; i++) {
+		for (cluster = dirty->buckets[i]; cluster != NULL; cluster = cluster->hash_next) list[n++] = cluster;
+	}
+	qsort(list, n, sizeof(struct fatx_dirty_cluster *), fatx_dirty_compare);
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && j - i < FATX_IOV_BATCH &&
+				(j == i || list[j]->offset == list[j - 1]->offset + FATX_CLUSTER_SIZE); j++) {
+			iov[j - i].iov_base = list[j]->data;
+			iov[j - i].iov_len = FATX_CLUSTER_SIZE;
+		}
+		if (fatx_write_at(info, iov, j - i, list[i]->offset) < 0) {
+			fprintf(stderr, "libfatx: Error writing directory records: [%d] %s\n", errno, strerror(errno));
+			free(list);
+			return -EIO;
+		}
+	}
+	free(list);
+	// anything cached from before the changes is forgotten before the copies go
+	fatx_caches_forget(info);
+	pthread_rwlock_wrlock(&dirty->lock);
+	for (i = 0; i < FATX_DIRTY_CLUSTER_LIMIT; i++) {
+		for (cluster = dirty->buckets[i]; cluster != NULL; cluster = next) {
+			next = cluster->hash_next;
+			free(cluster);
+		}
+		dirty->buckets[i] = NULL;
+	}
+	__atomic_store_n(&dirty->count, 0, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&dirty->lock);
+	if (dirty->freed_count == 0) return 0;
+	if (fdatasync(info->fd) < 0) return -EIO;
+	return fatx_freed_release(info);
+}
+
+/**
+ * Writes every change to the FAT and to directory records out to disk
+ * and waits for it (and any file data written before) to get there.
+ * Returns 0, or -errno.
+ */
+int fatx_sync(fatx_fs_info *info) {
+	int ret;
+	if (info->read_only) return 0;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_flush(info);
+	pthread_mutex_unlock(&info->write_lock);
+	if (ret == 0 && fdatasync(info->fd) < 0) ret = -EIO;
+	return ret;
+}
+
+/**
+ * Frees the chain starting at cluster. The clusters stay in use until the
+ * next fatx_flush has written out the records, unless there is no memory
+ * to remember them. Stops at a cluster that is out of range or already
+ * free instead of trusting a damaged chain, and after as many clusters as
+ * there are, in case it goes round a loop. Called with write_lock held.
+ */
+static void fatx_chain_free(fatx_fs_info *info, uint32_t cluster) {
+	struct fatx_dirty_clusters *dirty = info->dirty;
+	uint32_t next, steps;
+	if (cluster != 0) fatx_extent_forget(info, cluster);
+	for (steps = 0; steps < info->cluster_limit; steps++) {
+		if (cluster < 2 || cluster >= info->cluster_limit || fatx_free_map_test(info, cluster)) break;
+		if (fatx_fat_entry(info, cluster, &next) < 0) break;
+		if (dirty->freed_count == dirty->freed_alloc) {
+			size_t alloc = dirty->freed_alloc ? dirty->freed_alloc * 2 : 1024;
+			uint32_t *freed = realloc(dirty->freed, alloc * sizeof(uint32_t));
+			if (freed != NULL) {
+				dirty->freed = freed;
+				dirty->freed_alloc = alloc;
+			}
+		}
+		if (dirty->freed_count < dirty->freed_alloc) {
+			dirty->freed[dirty->freed_count++] = cluster;
+		} else {
+			if (fatx_fat_set(info, cluster, 0) < 0) break;
+			fatx_free_map_mark(info, cluster, 1, 1);
+			__atomic_add_fetch(&info->free_clusters, 1, __ATOMIC_RELAXED);
+		}
+		fatx_dirty_drop(info, fatx_cluster_offset(info, cluster));
+		if (fatx_fat_is_last(info, next)) break;
+		cluster = next;
+	}
+}
+
+/**
+ * Appends the run of count clusters starting at cluster to map, growing
+ * its last extent when the run follows on from it.
+ */
+static int fatx_extent_map_append(fatx_fs_info *info, struct fatx_extent_map *map,
+		uint32_t cluster, uint32_t count) {
+	struct fatx_extent *extent;
+	off_t offset = fatx_cluster_offset(info, cluster);
+	if (map->count > 0) {
+		extent = &map->extents[map->count - 1];
+		if (extent->disk_offset + ((off_t)extent->length << 14) == offset) {
+			extent->length += count;
+			map->clusters += count;
+			return 0;
+		}
+	}
+	if (map->count == map->allocated) {
+		void *p = realloc(map->extents, map->allocated * 2 * sizeof(struct fatx_extent));
+		if (p == NULL) return -ENOMEM;
+		map->extents = p;
+		map->allocated *= 2;
+	}
+	extent = &map->extents[map->count++];
+	extent->file_cluster = map->clusters;
+	extent->length = count;
+	extent->disk_offset = offset;
+	map->clusters += count;
+	return 0;
+}
+
+static inline uint32_t fatx_extent_map_last(fatx_fs_info *info, struct fatx_extent_map *map) {
+	struct fatx_extent *extent = &map->extents[map->count - 1];
+	return fatx_offset_cluster(info, extent->disk_offset) + extent->length - 1;
+}
+
+/**
+ * Adds want clusters to the end of the chain described by map. The
+ * clusters right after its last one are taken if they are free; if not,
+ * the first free run that holds everything that is left (with room to
+ * spare for a file that is already large), and only when there is no such
+ * run, the longest ones there are. Called with write_lock held.
+ */
+static int fatx_chain_extend(fatx_fs_info *info, struct fatx_extent_map *map, uint32_t want) {
+	uint32_t tail = 0, start, run, c, next;
+	// space freed since the last flush only counts once it has been written
+	if (want > info->free_clusters && info->dirty->freed_count > 0 && fatx_flush(info) < 0) return -EIO;
+	if (want > info->free_clusters) return -ENOSPC;
+	if (map->clusters > 0) {
+		tail = fatx_extent_map_last(info, map);
+		// a chain longer than its file is cut back before it grows
+		if (fatx_fat_entry(info, tail, &next) < 0) return -EIO;
+		if (!fatx_fat_is_last(info, next)) {
+			if (fatx_fat_set(info, tail, fatx_fat_last(info)) < 0) return -EIO;
+			fatx_chain_free(info, next);
+		}
+	}
+	while (want > 0) {
+		if (tail != 0 && tail + 1 < info->cluster_limit && fatx_free_map_test(info, tail + 1)) {
+			start = tail + 1;
+			run = fatx_free_map_run(info, start, want);
+		} else {
+			// leave room after the run: a file that has got this big tends to keep growing
+			uint32_t room = want + min(map->clusters, FATX_ALLOC_LOOKAHEAD);
+			run = fatx_free_map_find(info, room, &start);
+			if (run < room && room > want) run = fatx_free_map_find(info, want, &start);
+			run = min(run, want);
+		}
+		if (run == 0) {
+			if (info->dirty->freed_count == 0) return -ENOSPC;
+			if (fatx_flush(info) < 0) return -EIO;
+			continue;
+		}
+		if (fatx_extent_map_append(info, map, start, run) < 0) return -ENOMEM;
+		fatx_free_map_mark(info, start, run, 0);
+		__atomic_sub_fetch(&info->free_clusters, run, __ATOMIC_RELAXED);
+		for (c = start; c < start + run - 1; c++) {
+			if (fatx_fat_set(info, c, c + 1) < 0) return -EIO;
+		}
+		if (fatx_fat_set(info, start + run - 1, fatx_fat_last(info)) < 0) return -EIO;
+		if (tail != 0) {
+			if (fatx_fat_set(info, tail, start) < 0) return -EIO;
+		} else {
+			map->first_cluster = start;
+		}
+		tail = start + run - 1;
+		info->alloc_hint = tail + 1;
+		want -= run;
+	}
+	return 0;
+}
+
+/**
+ * Cuts the chain described by map down to keep clusters, freeing the
+ * rest. Called with write_lock held.
+ */
+static int fatx_chain_truncate(fatx_fs_info *info, struct fatx_extent_map *map, uint32_t keep) {
+	uint32_t last, next;
+	size_t i;
+	if (keep >= map->clusters) return 0;
+	if (keep == 0) {
+		fatx_chain_free(info, map->first_cluster);
+		map->first_cluster = 0;
+		map->clusters = 0;
+		map->count = 0;
+		return 0;
+	}
+	i = fatx_extent_find(map, keep - 1);
+	last = fatx_offset_cluster(info, map->extents[i].disk_offset) + (keep - 1 - map->extents[i].file_cluster);
+	if (fatx_fat_entry(info, last, &next) < 0 || fatx_fat_set(info, last, fatx_fat_last(info)) < 0) {
+		return -EIO;
+	}
+	if (!fatx_fat_is_last(info, next)) fatx_chain_free(info, next);
+	map->extents[i].length = keep - map->extents[i].file_cluster;
+	map->count = i + 1;
+	map->clusters = keep;
+	return 0;
+}
+
+/**
+ * Makes sure node has a map that only it holds, so the map can be changed
+ * without readers of the extent cache seeing it happen. Called with the
+ * node's lock held for writing and write_lock held.
+ */
+static int fatx_node_own_map(fatx_fs_info *info, struct fatx_node *node) {
+	struct fatx_extent_map *map = node->map, *copy;
+	if (map == NULL) {
+		if (node->first_cluster != 0) { // clusters left behind by an empty file
+			fatx_chain_free(info, node->first_cluster);
+			node->first_cluster = 0;
+		}
+		node->map = fatx_extent_map_new(0);
+		return node->map == NULL ? -ENOMEM : 0;
+	}
+	fatx_extent_forget(info, map->first_cluster);
+	if (__atomic_load_n(&map->refs, __ATOMIC_ACQUIRE) == 1) return 0;
+	copy = fatx_extent_map_new(map->first_cluster);
+	if (copy == NULL) return -ENOMEM;
+	if (map->count > copy->allocated) {
+		void *p = realloc(copy->extents, map->count * sizeof(struct fatx_extent));
+		if (p == NULL) {
+			fatx_extent_map_put(copy);
+			return -ENOMEM;
+		}
+		copy->extents = p;
+		copy->allocated = map->count;
+	}
+	memcpy(copy->extents, map->extents, map->count * sizeof(struct fatx_extent));
+	copy->count = map->count;
+	copy->clusters = map->clusters;
+	node->map = copy;
+	fatx_extent_map_put(map);
+	return 0;
+}
+
+/**
+ * Stores node's size and first cluster in its record, along with the
+ * modification time when modified is set. Called with write_lock held.
+ */
+static int fatx_node_update(fatx_fs_info *info, struct fatx_node *node, int modified) {
+	struct fatx_internal_file_record ifr;
+	if (node->unlinked) return 0;
+	if (fatx_record_read(info, node->record_offset, &ifr) < 0) return -EIO;
+	ifr.first_cluster = fatx_to_disk32(info, node->first_cluster);
+	ifr.size = fatx_to_disk32(info, node->size);
+	if (modified) ifr.modified_time = fatx_to_disk32(info, fatx_time_unix2fatx(time(NULL)));
+	return fatx_record_write(info, node->record_offset, &ifr);
+}
+
+/**
+ * Grows node's chain to hold end bytes. Called with the node's lock held
+ * for writing.
+ */
+static int fatx_node_reserve(fatx_fs_info *info, struct fatx_node *node, uint64_t end) {
+	uint32_t need = (end + FATX_CLUSTER_SIZE - 1) >> 14;
+	int ret;
+	if (node->map != NULL && node->map->clusters >= need) return 0;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_node_own_map(info, node);
+	if (ret == 0) ret = fatx_chain_extend(info, node->map, need - node->map->clusters);
+	if (node->map != NULL && node->map->first_cluster != node->first_cluster) {
+		// a new chain is recorded right away so it can't be lost
+		node->first_cluster = node->map->first_cluster;
+		fatx_node_update(info, node, 0);
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	return ret;
+}
+
+/**
+ * Writes size bytes of buffer, or zeros if buffer is NULL, to the file
+ * described by map at offset, one pwritev per run of contiguous clusters.
+ */
+static int fatx_write_extents(fatx_fs_info *info, struct fatx_extent_map *map,
+		const uint8_t *buffer, size_t size, off_t offset) {
+	static const uint8_t zeros[FATX_CLUSTER_SIZE];
+	struct iovec iov[FATX_IOV_BATCH];
+	size_t done = 0, i;
+	if (size == 0) return 0;
+	i = fatx_extent_find(map, offset >> 14);
+	while (done < size) {
+		struct fatx_extent *extent = &map->extents[i++];
+		off_t within = offset + done - ((off_t)extent->file_cluster << 14);
+		size_t run = min(size - done, ((size_t)extent->length << 14) - within);
+		size_t written = 0;
+		while (written < run) {
+			size_t bytes = 0;
+			int n = 0;
+			if (buffer != NULL) {
+				iov[0].iov_base = (uint8_t *)buffer + done + written;
+				iov[0].iov_len = bytes = run - written;
+				n = 1;
+			} else {
+				for (; n < FATX_IOV_BATCH && bytes < run - written; n++) {
+					iov[n].iov_base = (void *)zeros;
+					iov[n].iov_len = min(sizeof(zeros), run - written - bytes);
+					bytes += iov[n].iov_len;
+				}
+			}
+			if (fatx_write_at(info, iov, n, extent->disk_offset + within + written) < 0) {
+				return -EIO;
+			}
+			written += bytes;
+		}
+		done += run;
+	}
+	return 0;
+}
+
+/**
+ * Writes size bytes of buffer to an open file at offset. A write ending
+ * past the end of the file grows it, zero filling any gap, with the new
+ * clusters allocated in as few runs as possible. Returns size, or -errno.
+ */
+ssize_t fatx_pwrite(fatx_file *file, const void *buffer, size_t size, off_t offset) {
+	fatx_fs_info *info = file->info;
+	struct fatx_node *node = file->node;
+	uint64_t end = (uint64_t)offset + size;
+	int ret;
+	if (info->read_only) return -EROFS;
+	if (offset < 0) return -EINVAL;
+	if (end > UINT32_MAX) return -EFBIG;
+	if (size == 0) return 0;
+	pthread_rwlock_wrlock(&node->lock);
+	ret = fatx_node_reserve(info, node, end);
+	if (ret == 0 && (size_t)offset > node->size) {
+		ret = fatx_write_extents(info, node->map, NULL, offset - node->size, node->size);
+	}
+	if (ret == 0) ret = fatx_write_extents(info, node->map, buffer, size, offset);
+	if (ret == 0) {
+		pthread_mutex_lock(&info->write_lock);
+		if (end > node->size) node->size = end;
+		ret = fatx_node_update(info, node, 1);
+		pthread_mutex_unlock(&info->write_lock);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret < 0 ? ret : (ssize_t)size;
+}
+
+/**
+ * Sets the size of an open file to length, freeing clusters it no longer
+ * needs or zero filling the part it gains. Returns 0, or -errno.
+ */
+int fatx_truncate(fatx_file *file, off_t length) {
+	fatx_fs_info *info = file->info;
+	struct fatx_node *node = file->node;
+	int ret = 0;
+	if (info->read_only) return -EROFS;
+	if (length < 0) return -EINVAL;
+	if ((uint64_t)length > UINT32_MAX) return -EFBIG;
+	pthread_rwlock_wrlock(&node->lock);
+	if ((size_t)length > node->size) {
+		ret = fatx_node_reserve(info, node, length);
+		if (ret == 0) ret = fatx_write_extents(info, node->map, NULL, length - node->size, node->size);
+	}
+	if (ret == 0) {
+		pthread_mutex_lock(&info->write_lock);
+		if ((size_t)length < node->size && node->map != NULL) {
+			ret = fatx_node_own_map(info, node);
+			if (ret == 0) ret = fatx_chain_truncate(info, node->map, (length + FATX_CLUSTER_SIZE - 1) >> 14);
+			if (node->map->clusters == 0) {
+				fatx_extent_map_put(node->map);
+				node->map = NULL;
+				node->first_cluster = 0;
+			}
+		}
+		if (ret == 0) {
+			node->size = length;
+			ret = fatx_node_update(info, node, 1);
+		}
+		pthread_mutex_unlock(&info->write_lock);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+/**
+ * Frees the clusters of a file that was unlinked while it was open, once
+ * its last handle has been closed.
+ */
+void fatx_node_release(fatx_fs_info *info, struct fatx_node *node) {
+	pthread_mutex_lock(&info->write_lock);
+	fatx_chain_free(info, node->first_cluster);
+	pthread_mutex_unlock(&info->write_lock);
+}
+
+/**
+ * Checks that name can be stored in a record: 1 to 42 characters, none of
+ * them control characters or ones FATX doesn't allow.
+ */
+static int fatx_name_check(const char *name) {
+	size_t i, length = strlen(name);
+	if (length == 0 || !strcmp(name, ".") || !strcmp(name, "..")) return -EINVAL;
+	if (length > 42) return -ENAMETOOLONG;
+	for (i = 0; i < length; i++) {
+		unsigned char c = name[i];
+		if (c < 0x20 || c >= 0x7F || strchr("\"*+,/:;<=>?\\|", c) != NULL) return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * Writes an end marker over the record at record_offset.
+ */
+static int fatx_record_end(fatx_fs_info *info, off_t record_offset) {
+	struct fatx_internal_file_record ifr;
+	memset(&ifr, 0xFF, sizeof(ifr));
+	return fatx_record_write(info, record_offset, &ifr);
+}
+
+/**
+ * Stores ifr as a new record in the directory starting at dir. It goes in
+ * the first deleted record not held by a file that is still open after
+ * being unlinked, or else where the end marker is, moving the marker
+ * along; a full directory grows by a cluster, except for the root, which
+ * can't. Called with write_lock held. Returns the record's offset, or
+ * -errno.
+ */
+static off_t fatx_dir_add_record(fatx_fs_info *info, uint32_t dir,
+		const struct fatx_internal_file_record *ifr) {
+	struct fatx_dir_index *index;
+	struct fatx_extent_map *map;
+	off_t offset = -1, end = -1;
+	size_t i;
+	int ret = 0;
+	index = fatx_dir_index_get(info, dir);
+	if (index == NULL) return -EIO;
+	if (index->corrupt) {
+		fatx_dir_index_put(index);
+		return -EIO;
+	}
+	for (i = 0; i < index->count; i++) {
+		if (index->classes[i] != FATX_RECORD_DELETED) continue;
+		offset = fatx_dir_index_record_offset(index, i);
+		if (!fatx_node_busy(info, offset)) break;
+		offset = -1;
+	}
+	if (offset < 0 && index->count < index->clusters * FATX_RECORDS_PER_CLUSTER) {
+		offset = fatx_dir_index_record_offset(index, index->count);
+		if (index->count + 1 < index->clusters * FATX_RECORDS_PER_CLUSTER) {
+			end = fatx_dir_index_record_offset(index, index->count + 1);
+		}
+	} else if (offset < 0) {
+		if (dir == 1) {
+			ret = -ENOSPC;
+		} else {
+			// the directory's last cluster stands in for its whole chain
+			map = fatx_extent_map_new(dir);
+			if (map == NULL) ret = -ENOMEM;
+			else ret = fatx_extent_map_append(info, map,
+					fatx_offset_cluster(info, index->cluster_offsets[index->clusters - 1]), 1);
+			if (ret == 0) ret = fatx_chain_extend(info, map, 1);
+			if (ret == 0) {
+				offset = fatx_cluster_offset(info, fatx_extent_map_last(info, map));
+				if (fatx_dirty_get(info, offset, 1) == NULL) ret = -EIO;
+			}
+			fatx_extent_map_put(map);
+		}
+	}
+	fatx_dir_index_put(index);
+	if (ret == 0) ret = fatx_record_write(info, offset, ifr);
+	if (ret == 0 && end >= 0) ret = fatx_record_end(info, end);
+	return ret < 0 ? ret : offset;
+}
+
+/**
+ * Checks that the directory starting at cluster has no live entries.
+ */
+static int fatx_dir_check_empty(fatx_fs_info *info, uint32_t cluster) {
+	struct fatx_dir_index *index;
+	size_t i;
+	int ret = 0;
+	index = fatx_dir_index_get(info, cluster);
+	if (index == NULL) return -EIO;
+	for (i = 0; i < index->count && ret == 0; i++) {
+		if (index->classes[i] == FATX_RECORD_LIVE) ret = -ENOTEMPTY;
+	}
+	fatx_dir_index_put(index);
+	return ret;
+}
+
+/**
+ * Marks entry's record in the directory starting at dir as deleted and
+ * frees its clusters, or leaves them to fatx_close if the file is still
+ * open. Called with write_lock held.
+ */
+static int fatx_remove_entry(fatx_fs_info *info, uint32_t dir, const struct fatx_dirent *entry) {
+	struct fatx_internal_file_record ifr;
+	if (fatx_record_read(info, entry->record_offset, &ifr) < 0) return -EIO;
+	ifr.name_length = 0xE5;
+	if (fatx_record_write(info, entry->record_offset, &ifr) < 0) return -EIO;
+	if (entry->attributes & 0x10) {
+		fatx_chain_free(info, entry->first_cluster);
+		fatx_dir_index_forget(info, entry->first_cluster);
+		fatx_dentry_forget_parent(info, entry->first_cluster);
+	} else if (!fatx_node_unlink(info, entry->record_offset)) {
+		fatx_chain_free(info, entry->first_cluster);
+	}
+	fatx_dir_index_forget(info, dir);
+	return 0;
+}
+
+static void fatx_record_name(struct fatx_internal_file_record *ifr, const char *name) {
+	int length;
+	fatx_name_ansi2fatx(ifr->name, name, &length);
+	ifr->name_length = length;
+}
+
+/**
+ * Creates an empty file, or a directory if isdir is set, called name in
+ * the directory dir and fills entry with it. Returns 0, -EEXIST if the
+ * name is taken (names are compared without regard to case), or -errno.
+ */
+int fatx_create(fatx_fs_info *info, const fatx_dirent *dir, const char *name, int isdir,
+		fatx_dirent *entry) {
+	struct fatx_internal_file_record ifr;
+	struct fatx_extent_map *map = NULL;
+	uint32_t now;
+	off_t offset = 0;
+	int ret;
+	if (info->read_only) return -EROFS;
+	if (!(dir->attributes & 0x10)) return -ENOTDIR;
+	ret = fatx_name_check(name);
+	if (ret < 0) return ret;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_dir_lookup(info, dir->first_cluster, name, entry);
+	if (ret == 0) ret = -EEXIST;
+	else if (ret == -ENOENT) ret = 0;
+	else ret = -EIO;
+	if (ret == 0) {
+		memset(&ifr, 0, sizeof(ifr));
+		fatx_record_name(&ifr, name);
+		ifr.attributes = isdir ? 0x10 : 0;
+		now = fatx_to_disk32(info, fatx_time_unix2fatx(time(NULL)));
+		ifr.modified_time = ifr.created_time = ifr.accessed_time = now;
+	}
+	if (ret == 0 && isdir) { // a new directory is one cluster of end markers
+		map = fatx_extent_map_new(0);
+		if (map == NULL) ret = -ENOMEM;
+		else ret = fatx_chain_extend(info, map, 1);
+		if (ret == 0 && fatx_dirty_get(info, fatx_cluster_offset(info, map->first_cluster), 1) == NULL) {
+			ret = -EIO;
+		}
+		if (ret == 0) ifr.first_cluster = fatx_to_disk32(info, map->first_cluster);
+	}
+	if (ret == 0) {
+		offset = fatx_dir_add_record(info, dir->first_cluster, &ifr);
+		if (offset < 0) ret = offset;
+	}
+	if (ret < 0 && map != NULL && map->first_cluster != 0) fatx_chain_free(info, map->first_cluster);
+	if (ret == 0) {
+		fatx_dir_index_forget(info, dir->first_cluster);
+		fatx_dentry_forget(info, dir->first_cluster, name);
+		entry->record_offset = offset;
+		entry->first_cluster = fatx_to_host32(info, ifr.first_cluster);
+		entry->attributes = ifr.attributes;
+		fatx_decode_record(info, &ifr, &entry->record);
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	fatx_extent_map_put(map);
+	return ret;
+}
+
+/**
+ * Removes name from the directory dir; isdir says whether it must be an
+ * (empty) directory or must be a file.
+ */
+static int fatx_remove(fatx_fs_info *info, const fatx_dirent *dir, const char *name, int isdir) {
+	struct fatx_dirent entry;
+	int ret;
+	if (info->read_only) return -EROFS;
+	if (!(dir->attributes & 0x10)) return -ENOTDIR;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_dir_lookup(info, dir->first_cluster, name, &entry);
+	if (ret == -1) ret = -EIO;
+	if (ret == 0) {
+		if (isdir && !(entry.attributes & 0x10)) ret = -ENOTDIR;
+		else if (!isdir && (entry.attributes & 0x10)) ret = -EISDIR;
+		else if (isdir) ret = fatx_dir_check_empty(info, entry.first_cluster);
+	}
+	if (ret == 0) ret = fatx_remove_entry(info, dir->first_cluster, &entry);
+	if (ret == 0) fatx_dentry_forget(info, dir->first_cluster, name);
+	pthread_mutex_unlock(&info->write_lock);
+	return ret;
+}
+
+/**
+ * Removes the file name from the directory dir. A file that is still open
+ * keeps its data until its last handle is closed.
+ */
+int fatx_unlink(fatx_fs_info *info, const fatx_dirent *dir, const char *name) {
+	return fatx_remove(info, dir, name, 0);
+}
+
+/**
+ * Removes the empty directory name from the directory dir.
+ */
+int fatx_rmdir(fatx_fs_info *info, const fatx_dirent *dir, const char *name) {
+	return fatx_remove(info, dir, name, 1);
+}
+
+/**
+ * Moves name in dir to newname in newdir, replacing what is there unless
+ * that is a directory with entries in it. Within one directory the record
+ * is renamed where it is; a move to another directory writes a new record,
+ * so the entry gets a new record_offset. Fills entry with the result. The
+ * caller has to make sure a directory isn't moved into itself.
+ */
+int fatx_rename(fatx_fs_info *info, const fatx_dirent *dir, const char *name,
+		const fatx_dirent *newdir, const char *newname, fatx_dirent *entry) {
+	struct fatx_internal_file_record ifr;
+	struct fatx_dirent source, target;
+	off_t offset = 0;
+	int ret;
+	if (info->read_only) return -EROFS;
+	if (!(dir->attributes & 0x10) || !(newdir->attributes & 0x10)) return -ENOTDIR;
+	ret = fatx_name_check(newname);
+	if (ret < 0) return ret;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_dir_lookup(info, dir->first_cluster, name, &source);
+	if (ret == -1) ret = -EIO;
+	if (ret == 0) {
+		ret = fatx_dir_lookup(info, newdir->first_cluster, newname, &target);
+		if (ret == 0 && target.record_offset != source.record_offset) {
+			if ((source.attributes & 0x10) && !(target.attributes & 0x10)) ret = -ENOTDIR;
+			else if (!(source.attributes & 0x10) && (target.attributes & 0x10)) ret = -EISDIR;
+			else if (target.attributes & 0x10) ret = fatx_dir_check_empty(info, target.first_cluster);
+			if (ret == 0) ret = fatx_remove_entry(info, newdir->first_cluster, &target);
+		} else if (ret == -ENOENT) {
+			ret = 0;
+		} else if (ret == -1) {
+			ret = -EIO;
+		}
+	}
+	if (ret == 0) ret = fatx_record_read(info, source.record_offset, &ifr);
+	if (ret == 0) {
+		fatx_record_name(&ifr, newname);
+		if (dir->first_cluster == newdir->first_cluster) {
+			offset = source.record_offset;
+			ret = fatx_record_write(info, offset, &ifr);
+		} else {
+			offset = fatx_dir_add_record(info, newdir->first_cluster, &ifr);
+			if (offset < 0) {
+				ret = offset;
+			} else {
+				struct fatx_internal_file_record deleted = ifr;
+				deleted.name_length = 0xE5;
+				ret = fatx_record_write(info, source.record_offset, &deleted);
+				fatx_node_move(info, source.record_offset, offset);
+			}
+		}
+	}
+	if (ret == 0) {
+		fatx_dir_index_forget(info, dir->first_cluster);
+		fatx_dir_index_forget(info, newdir->first_cluster);
+		fatx_dentry_forget(info, dir->first_cluster, name);
+		fatx_dentry_forget(info, newdir->first_cluster, newname);
+		entry->record_offset = offset;
+		entry->first_cluster = fatx_to_host32(info, ifr.first_cluster);
+		entry->attributes = ifr.attributes;
+		fatx_decode_record(info, &ifr, &entry->record);
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	return ret;
+}
+
+/**
+ * Sets the access and modification times of entry. The root directory
+ * has no record to keep them in, so nothing happens for it.
+ */
+int fatx_set_times(fatx_fs_info *info, const fatx_dirent *entry, time_t accessed, time_t modified) {
+	struct fatx_internal_file_record ifr;
+	int ret;
+	if (info->read_only) return -EROFS;
+	if (entry->record_offset == -1) return 0;
+	pthread_mutex_lock(&info->write_lock);
+	ret = fatx_record_read(info, entry->record_offset, &ifr);
+	if (ret == 0 && (ifr.name_length == 0 || ifr.name_length > 42)) ret = -ENOENT;
+	if (ret == 0) {
+		ifr.accessed_time = fatx_to_disk32(info, fatx_time_unix2fatx(accessed));
+		ifr.modified_time = fatx_to_disk32(info, fatx_time_unix2fatx(modified));
+		ret = fatx_record_write(info, entry->record_offset, &ifr);
+	}
+	pthread_mutex_unlock(&info->write_lock);
+	return ret;
+}
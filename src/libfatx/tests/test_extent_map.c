@@ -0,0 +1,123 @@
+/*
+  test-extent-map: files whose first cluster is outside the FAT
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes a 16 MiB little endian image by hand: a FAT16 at 0x1000, the
+ * root directory at 0x2000 and one good file in cluster 2, next to files
+ * whose first cluster is 0, 1 or past the end of the FAT. Each file is
+ * read with the whole FAT in memory and with it paged, and only the good
+ * one may give any data.
+ */
+
+#include <fatx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+
+#define IMAGE_SIZE (16 << 20)
+#define FAT_OFFSET 0x1000
+#define ROOT_OFFSET 0x2000 // cluster 1
+#define CLUSTER_SIZE 0x4000
+
+struct test_file {
+	const char *name;
+	uint32_t first_cluster;
+	int good;
+};
+
+static const struct test_file files[] = {
+	{ "good", 2, 1 },
+	{ "zero", 0, 0 },
+	{ "one", 1, 0 },
+	{ "past", 5000, 0 },
+	{ "limit", 1024, 0 }, // one past the last entry of this FAT
+};
+
+#define FILE_COUNT (sizeof(files) / sizeof(files[0]))
+
+static int write_image(int fd) {
+	uint8_t block[CLUSTER_SIZE];
+	uint16_t fat[3] = { htole16(0xFFF8), htole16(0xFFFF), htole16(0xFFFF) };
+	size_t i;
+	if (ftruncate(fd, IMAGE_SIZE) < 0) return -1;
+	if (pwrite(fd, "FATX", 4, 0) != 4) return -1;
+	if (pwrite(fd, fat, sizeof(fat), FAT_OFFSET) != sizeof(fat)) return -1;
+	memset(block, 0xFF, sizeof(block));
+	for (i = 0; i < FILE_COUNT; i++) {
+		uint8_t *record = block + i * 64;
+		uint32_t first_cluster = htole32(files[i].first_cluster), size = htole32(5), time = 0;
+		memset(record, 0, 64);
+		record[0] = strlen(files[i].name);
+		memcpy(record + 2, files[i].name, record[0]);
+		memcpy(record + 44, &first_cluster, 4);
+		memcpy(record + 48, &size, 4);
+		memcpy(record + 52, &time, 4);
+	}
+	if (pwrite(fd, block, sizeof(block), ROOT_OFFSET) != sizeof(block)) return -1;
+	if (pwrite(fd, "hello", 5, ROOT_OFFSET + CLUSTER_SIZE) != 5) return -1;
+	return 0;
+}
+
+static int check_files(const char *image, size_t fat_memory_limit) {
+	fatx_fs_options opts;
+	fatx_fs_info *info;
+	char path[16], data[5];
+	size_t i;
+	int failed = 0;
+	fatx_fs_options_init(&opts);
+	opts.fat_memory_limit = fat_memory_limit;
+	info = fatx_fs_init_opts(image, &opts);
+	if (info == NULL) {
+		printf("FAIL: mounting the image with fat_memory_limit %zu\n", fat_memory_limit);
+		return 1;
+	}
+	for (i = 0; i < FILE_COUNT; i++) {
+		fatx_file *file;
+		ssize_t got = -1;
+		snprintf(path, sizeof(path), "/%s", files[i].name);
+		file = fatx_open(info, path);
+		if (file != NULL) {
+			got = fatx_pread(file, data, sizeof(data), 0);
+			fatx_close(file);
+		}
+		if (files[i].good ? got != 5 || memcmp(data, "hello", 5) != 0 : got >= 0) {
+			printf("FAIL: %s with fat_memory_limit %zu read %zd bytes\n", path, fat_memory_limit, got);
+			failed = 1;
+		}
+	}
+	fatx_fs_end(info);
+	return failed;
+}
+
+int main(void) {
+	char image[] = "test-extent-map.XXXXXX";
+	int fd = mkstemp(image), failed;
+	if (fd < 0 || write_image(fd) < 0) {
+		perror("test-extent-map: writing the image");
+		if (fd >= 0) unlink(image);
+		return 1;
+	}
+	close(fd);
+	failed = check_files(image, 0);
+	failed |= check_files(image, 1); // less than a page, so the FAT is paged
+	unlink(image);
+	return failed;
+}
@@ -0,0 +1,156 @@
+/*
+  test-geometry: runs the layout kernels over hand-built FATs
+  Copyright (C) 2010  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each layout gets the same FAT written out byte by byte as it would be
+ * on disk, so the expected chains don't depend on anything libfatx or
+ * bench-mkimage writes: 2 -> 3 -> 4 -> 7 -> end, 8 -> 9 -> end (with an
+ * end marker other than all ones), 5 free and 6 ending on its own.
+ */
+
+#include "fatx_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define ENTRIES 10
+
+static const uint8_t fat_le16[ENTRIES * 2] = {
+	0xF8, 0xFF, 0xFF, 0xFF, 0x03, 0x00, 0x04, 0x00, 0x07, 0x00,
+	0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x09, 0x00, 0xF8, 0xFF,
+};
+
+static const uint8_t fat_be16[ENTRIES * 2] = {
+	0xFF, 0xF8, 0xFF, 0xFF, 0x00, 0x03, 0x00, 0x04, 0x00, 0x07,
+	0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x09, 0xFF, 0xF8,
+};
+
+static const uint8_t fat_le32[ENTRIES * 4] = {
+	0xF8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+	0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x09, 0x00, 0x00, 0x00, 0xF8, 0xFF, 0xFF, 0x0F,
+};
+
+static const uint8_t fat_be32[ENTRIES * 4] = {
+	0xFF, 0xFF, 0xFF, 0xF8, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04,
+	0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x00, 0x00, 0x09, 0x0F, 0xFF, 0xFF, 0xF8,
+};
+
+struct layout {
+	const char *name;
+	int endianness;
+	size_t width;
+	const uint8_t *fat;
+	uint8_t record_size[4]; // 0x01020304 as the layout stores it
+};
+
+static const struct layout layouts[] = {
+	{ "le16", LITTLE_ENDIAN, 2, fat_le16, { 0x04, 0x03, 0x02, 0x01 } },
+	{ "be16", BIG_ENDIAN, 2, fat_be16, { 0x01, 0x02, 0x03, 0x04 } },
+	{ "le32", LITTLE_ENDIAN, 4, fat_le32, { 0x04, 0x03, 0x02, 0x01 } },
+	{ "be32", BIG_ENDIAN, 4, fat_be32, { 0x01, 0x02, 0x03, 0x04 } },
+};
+
+static int failed;
+
+static void expect(const struct layout *layout, const char *what, uint32_t got, uint32_t want) {
+	if (got == want) return;
+	printf("FAIL: %s: %s is %#x, expected %#x\n", layout->name, what, got, want);
+	failed = 1;
+}
+
+static int is_last(const struct fatx_geometry_ops *geometry, uint32_t entry) {
+	return (entry & geometry->entry_mask) > geometry->last_above;
+}
+
+/**
+ * Follows the chain from cluster a run at a time, writing the clusters
+ * into chain. Returns how many there were.
+ */
+static size_t follow(const struct fatx_geometry_ops *geometry, const void *fat, uint32_t cluster,
+		uint32_t *chain, size_t max) {
+	uint32_t run, next, i;
+	size_t count = 0;
+	while (count < max) {
+		run = geometry->chain_run(fat, ENTRIES, cluster, max - count, &next);
+		for (i = 0; i < run; i++) chain[count++] = cluster + i;
+		if (count == max || is_last(geometry, next) || next < 2 || next >= ENTRIES) break;
+		cluster = next;
+	}
+	return count;
+}
+
+static void check_layout(const struct layout *layout) {
+	static const uint32_t long_chain[] = { 2, 3, 4, 7 }, short_chain[] = { 8, 9 };
+	const struct fatx_geometry_ops *geometry = fatx_geometry_find(layout->endianness, layout->width);
+	uint8_t fat[ENTRIES * 4];
+	uint32_t chain[ENTRIES], next, value;
+	size_t count, i;
+	if (geometry == NULL || strcmp(geometry->name, layout->name) != 0) {
+		printf("FAIL: %s: no kernels, or the wrong ones\n", layout->name);
+		failed = 1;
+		return;
+	}
+	memcpy(fat, layout->fat, ENTRIES * layout->width);
+	geometry->fat_to_host(fat, ENTRIES);
+	expect(layout, "entry 2", geometry->load(fat, 2), 3);
+	expect(layout, "entry 4", geometry->load(fat, 4), 7);
+	expect(layout, "entry 5", geometry->load(fat, 5), 0);
+	expect(layout, "entry 6 ends a chain", is_last(geometry, geometry->load(fat, 6)), 1);
+	expect(layout, "entry 9 ends a chain", is_last(geometry, geometry->load(fat, 9)), 1);
+	expect(layout, "entry 8 ends a chain", is_last(geometry, geometry->load(fat, 8)), 0);
+	expect(layout, "the end marker ends a chain", is_last(geometry, geometry->last), 1);
+
+	expect(layout, "run from 2", geometry->chain_run(fat, ENTRIES, 2, ENTRIES, &next), 3);
+	expect(layout, "next after the run from 2", next, 7);
+	expect(layout, "run from 2 of at most 2", geometry->chain_run(fat, ENTRIES, 2, 2, &next), 2);
+	expect(layout, "next after 2 clusters", next, 4);
+	expect(layout, "run from 2 below 4", geometry->chain_run(fat, 4, 2, ENTRIES, &next), 2);
+	expect(layout, "next below 4", next, 4);
+	expect(layout, "run from 7", geometry->chain_run(fat, ENTRIES, 7, ENTRIES, &next), 1);
+	expect(layout, "next after 7 ends the chain", is_last(geometry, next), 1);
+
+	count = follow(geometry, fat, 2, chain, ENTRIES);
+	expect(layout, "length of the chain from 2", count, 4);
+	for (i = 0; i < count && i < 4; i++) expect(layout, "cluster of the chain from 2", chain[i], long_chain[i]);
+	count = follow(geometry, fat, 8, chain, ENTRIES);
+	expect(layout, "length of the chain from 8", count, 2);
+	for (i = 0; i < count && i < 2; i++) expect(layout, "cluster of the chain from 8", chain[i], short_chain[i]);
+
+	geometry->store(fat, 5, 6);
+	expect(layout, "entry 5 once stored", geometry->load(fat, 5), 6);
+	expect(layout, "entry 4 after storing 5", geometry->load(fat, 4), 7);
+	geometry->store(fat, 5, 0);
+	geometry->fat_to_host(fat, ENTRIES); // back to disk order
+	if (memcmp(fat, layout->fat, ENTRIES * layout->width) != 0) {
+		printf("FAIL: %s: the FAT doesn't convert back to what was on disk\n", layout->name);
+		failed = 1;
+	}
+
+	memcpy(&value, layout->record_size, 4);
+	expect(layout, "a record field", geometry->to_host32(value), 0x01020304);
+}
+
+int main(void) {
+	size_t i;
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) check_layout(&layouts[i]);
+	return failed;
+}
@@ -18,103 +18,880 @@
 
 #define FUSE_USE_VERSION 26
 
-#include "fatx.h"
+#include "xfd.h"
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 
 static fatx_fs_info *info;
 
-static struct readdir_user {
+struct readdir_user {
 	fuse_fill_dir_t filler;
 	void *buf;
 };
 
-static int xfd_getattr(const char *path, struct stat *stbuf)
+/**
+ * Fills stbuf with what a stat of the file described by record returns.
+ * Both frontends report the same attributes.
+ */
+void xfd_fill_stat(const fatx_file_record *record, struct stat *stbuf)
 {
-    int res = 0;
-    fatx_file_record record;
-
     memset(stbuf, 0, sizeof(struct stat));
 
-    res = fatx_read_file_record(&record, info, path);
-    if (res < 0) return res;
-
-    if (record.isdir) {
+    if (record->isdir) {
     	stbuf->st_mode = S_IFDIR|0755;
     	stbuf->st_nlink = 2;
     } else {
     	stbuf->st_mode = S_IFREG|0644;
     	stbuf->st_nlink = 1;
-    	stbuf->st_size = record.size;
+    	stbuf->st_size = record->size;
     }
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
-    stbuf->st_ctim.tv_sec = record.created;
-    stbuf->st_mtim.tv_sec = record.modified;
-    stbuf->st_atim.tv_sec = record.accessed;
+    stbuf->st_ctim.tv_sec = record->created;
+    stbuf->st_mtim.tv_sec = record->modified;
+    stbuf->st_atim.tv_sec = record->accessed;
+}
+
+/**
+ * Returns the format of the statistics file at path, or 0 if path isn't
+ * one of them.
+ */
+static int xfd_stats_path(const char *path)
+{
+    return path[0] == '/' ? xfd_stats_format(path + 1) : 0;
+}
+
+static int xfd_getattr(const char *path, struct stat *stbuf)
+{
+    int res = 0;
+    fatx_file_record record;
+
+    if (xfd_stats_path(path)) {
+    	xfd_stats_fill_stat(stbuf);
+    	return 0;
+    }
+    memset(stbuf, 0, sizeof(struct stat));
 
+    res = fatx_read_file_record(&record, info, path);
+    if (res < 0) return res;
+
+    xfd_fill_stat(&record, stbuf);
     return res;
 }
 
-static void readdir_callback(const char *path, struct readdir_user *user) {
-	user->filler(user->buf, path, NULL, 0);
+/**
+ * Adds an entry with its attributes, so listing a directory doesn't need
+ * a getattr (and a path lookup) per entry. Offsets 1 and 2 resume after
+ * "." and ".."; after that an offset is the directory's cookie plus 2.
+ */
+static int readdir_callback(const fatx_file_record *record, off_t next, void *data)
+{
+	struct readdir_user *user = data;
+	struct stat stbuf;
+
+	xfd_fill_stat(record, &stbuf);
+	return user->filler(user->buf, record->name, &stbuf, next + 2);
 }
 
 static int xfd_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi)
 {
-    (void) offset;
     (void) fi;
+    int ret;
 
     struct readdir_user user = {
     		.filler = filler,
     		.buf = buf
     };
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (offset < 1 && filler(buf, ".", NULL, 1)) return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2)) return 0;
+
+    ret = fatx_list_dir(info, path, offset > 2 ? offset - 2 : 0, readdir_callback, &user);
+    if (ret == -1) return -EIO;
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Opens a statistics file, taking the snapshot that reads of it return.
+ */
+static int xfd_stats_open(int format, struct fuse_file_info *fi)
+{
+    size_t length;
+    char *data;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    data = xfd_stats_snapshot(format, &length);
+    if (data == NULL) return -ENOMEM;
+    fi->fh = (uint64_t)(uintptr_t)data;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int xfd_open(const char *path, struct fuse_file_info *fi)
+{
+    struct xfd_handle *handle;
+    fatx_file *file;
+    int format = xfd_stats_path(path);
+
+    if (format) return xfd_stats_open(format, fi);
+
+    file = fatx_open(info, path);
+    if (file == NULL) return -errno;
+    handle = xfd_handle_open(file);
+    if (handle == NULL) {
+    	fatx_close(file);
+    	return -ENOMEM;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)handle;
+    return 0;
+}
+
+static int xfd_map(fatx_file *file, fatx_package *package, int index, off_t offset, size_t size,
+		fatx_io_extent *extents, int max)
+{
+    if (file != NULL) return fatx_map_file(file, offset, size, extents, max);
+    return fatx_package_map(package, index, offset, size, extents, max);
+}
+
+/**
+ * Reads size bytes into a single buffer allocated along with the
+ * fuse_bufvec, for when the data can't be handed to fuse as parts of the
+ * device: the block cache has to see every read.
+ */
+static struct fuse_bufvec *xfd_bufvec_copy(fatx_file *file, fatx_package *package, int index,
+		size_t size, off_t offset)
+{
+    struct fuse_bufvec *bufv;
+    ssize_t ret;
+
+    bufv = malloc(sizeof(struct fuse_bufvec) + size);
+    if (bufv == NULL) {
+    	errno = ENOMEM;
+    	return NULL;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->buf[0].mem = bufv + 1;
+    if (file != NULL) ret = fatx_pread(file, bufv->buf[0].mem, size, offset);
+    else ret = fatx_package_pread(package, index, bufv->buf[0].mem, size, offset);
+    if (ret < 0) {
+    	free(bufv);
+    	errno = -ret;
+    	return NULL;
+    }
+    bufv->buf[0].size = ret;
+    return bufv;
+}
+
+static struct fuse_bufvec *xfd_bufvec(fatx_file *file, fatx_package *package, int index,
+		size_t size, off_t offset)
+{
+    fatx_io_extent local[XFD_READ_EXTENTS], *extents = local, *more;
+    struct fuse_bufvec *bufv;
+    int allocated = XFD_READ_EXTENTS, count, i;
+
+    count = xfd_map(file, package, index, offset, size, extents, allocated);
+    if (count == -EOPNOTSUPP) return xfd_bufvec_copy(file, package, index, size, offset);
+    while (count > allocated) { // the file may have grown more runs since, so map again until they fit
+    	more = realloc(extents != local ? extents : NULL, count * sizeof(fatx_io_extent));
+    	if (more == NULL) {
+    		if (extents != local) free(extents);
+    		errno = ENOMEM;
+    		return NULL;
+    	}
+    	extents = more;
+    	allocated = count;
+    	count = xfd_map(file, package, index, offset, size, extents, allocated);
+    }
+    if (count < 0) {
+    	if (extents != local) free(extents);
+    	errno = -count;
+    	return NULL;
+    }
+    bufv = malloc(sizeof(struct fuse_bufvec) + (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+    if (bufv != NULL) {
+    	*bufv = FUSE_BUFVEC_INIT(0); // stays a single empty buffer at the end of the file
+    	if (count > 0) bufv->count = count;
+    	for (i = 0; i < count; i++) {
+    		bufv->buf[i].size = extents[i].length;
+    		if (extents[i].mem != NULL) { // the image is mapped, let fuse copy from there
+    			bufv->buf[i].flags = 0;
+    			bufv->buf[i].mem = (void *)extents[i].mem;
+    		} else {
+    			bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    			bufv->buf[i].mem = NULL;
+    		}
+    		bufv->buf[i].fd = extents[i].fd;
+    		bufv->buf[i].pos = extents[i].offset;
+    	}
+    } else {
+    	errno = ENOMEM;
+    }
+    if (extents != local) free(extents);
+    return bufv;
+}
+
+/**
+ * Describes size bytes of file at offset as a fuse_bufvec of segments of
+ * the device, one per contiguous cluster run, so fuse can splice the data
+ * to the kernel without copying it through our memory. With the mmap
+ * backend the segments point into the mapping instead, and with the block
+ * cache the data is read into memory of our own. Returns NULL and
+ * sets errno on failure; the result is freed with free().
+ */
+struct fuse_bufvec *xfd_read_bufvec(fatx_file *file, size_t size, off_t offset)
+{
+    return xfd_bufvec(file, NULL, 0, size, offset);
+}
+
+/**
+ * Like xfd_read_bufvec, for the file at index inside a package.
+ */
+struct fuse_bufvec *xfd_package_bufvec(fatx_package *package, int index, size_t size, off_t offset)
+{
+    return xfd_bufvec(NULL, package, index, size, offset);
+}
+
+/**
+ * Asks the kernel to accept replies spliced from the device.
+ */
+void xfd_want_splice(struct fuse_conn_info *conn)
+{
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void *xfd_init(struct fuse_conn_info *conn)
+{
+    xfd_want_splice(conn);
+    xfd_stats_watch();
+    xfd_build_sidecars();
+    return NULL;
+}
 
-    fatx_list_dir(info, path, readdir_callback, &user);
+/**
+ * Reads a statistics file into a buffer of its own, which fuse frees.
+ */
+static int xfd_stats_read(const char *data, struct fuse_bufvec **bufp, size_t size, off_t offset)
+{
+    size_t length = strlen(data);
+    struct fuse_bufvec *bufv;
 
+    if ((size_t)offset >= length) size = 0;
+    else if (size > length - offset) size = length - offset;
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL) return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(size);
+    if (size > 0) {
+    	bufv->buf[0].mem = malloc(size);
+    	if (bufv->buf[0].mem == NULL) {
+    		free(bufv);
+    		return -ENOMEM;
+    	}
+    	memcpy(bufv->buf[0].mem, data + offset, size);
+    }
+    *bufp = bufv;
     return 0;
 }
 
-static int xfd_read(const char *path, char *buf, size_t size, off_t offset,
+/**
+ * The high-level API frees the memory of each buffer of a read reply along
+ * with the fuse_bufvec, so buffers pointing into the mapped image (or into
+ * the fuse_bufvec itself) are given copies of their own.
+ */
+static int xfd_own_buffers(struct fuse_bufvec *bufv)
+{
+    size_t i;
+    void *mem;
+
+    for (i = 0; i < bufv->count; i++) {
+    	if ((bufv->buf[i].flags & FUSE_BUF_IS_FD) || bufv->buf[i].size == 0) continue;
+    	mem = malloc(bufv->buf[i].size);
+    	if (mem == NULL) {
+    		while (i-- > 0) {
+    			if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) free(bufv->buf[i].mem);
+    		}
+    		return -ENOMEM;
+    	}
+    	memcpy(mem, bufv->buf[i].mem, bufv->buf[i].size);
+    	bufv->buf[i].mem = mem;
+    }
+    return 0;
+}
+
+static int xfd_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                      off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+
+    if (xfd_stats_path(path)) return xfd_stats_read((const char *)(uintptr_t)fi->fh, bufp, size, offset);
+    *bufp = xfd_handle_read((struct xfd_handle *)(uintptr_t)fi->fh, size, offset);
+    if (*bufp == NULL) return -errno;
+    res = xfd_own_buffers(*bufp);
+    if (res < 0) {
+    	free(*bufp);
+    	*bufp = NULL;
+    }
+    return res;
+}
+
+static int xfd_release(const char *path, struct fuse_file_info *fi)
+{
+    if (xfd_stats_path(path)) free((void *)(uintptr_t)fi->fh);
+    else xfd_handle_close((struct xfd_handle *)(uintptr_t)fi->fh);
+    return 0;
+}
+
+/**
+ * Looks up the directory that holds path and points *name at the last
+ * component of path, which has to be a copy that can be cut in two.
+ */
+static int xfd_parent(char *path, fatx_dirent *dir, char **name)
+{
+    char *slash = strrchr(path, '/');
+    int res;
+
+    *name = slash + 1;
+    if (slash == path) {
+    	// the statistics files can't be created, removed or renamed
+    	if (xfd_stats_format(*name)) return -EACCES;
+    	fatx_dirent_root(info, dir);
+    	return 0;
+    }
+    *slash = '\0';
+    res = fatx_lookup_path(info, path, dir);
+    return res == -1 ? -EIO : res;
+}
+
+static int xfd_make(const char *path, int isdir, fatx_dirent *entry)
+{
+    fatx_dirent dir;
+    char *name;
+    int res;
+
+    res = xfd_parent(strdupa(path), &dir, &name);
+    if (res == 0) res = fatx_create(info, &dir, name, isdir, entry);
+    return res;
+}
+
+static int xfd_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct xfd_handle *handle;
+    fatx_dirent entry;
+    fatx_file *file;
+    int res;
+    (void) mode;
+
+    res = xfd_make(path, 0, &entry);
+    if (res < 0) return res;
+    file = fatx_open_dirent(info, &entry);
+    if (file == NULL) return -errno;
+    handle = xfd_handle_open(file);
+    if (handle == NULL) {
+    	fatx_close(file);
+    	return -ENOMEM;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)handle;
+    return 0;
+}
+
+static int xfd_mkdir(const char *path, mode_t mode)
+{
+    fatx_dirent entry;
+    (void) mode;
+
+    return xfd_make(path, 1, &entry);
+}
+
+static int xfd_unlink(const char *path)
+{
+    fatx_dirent dir;
+    char *name;
+    int res;
+
+    res = xfd_parent(strdupa(path), &dir, &name);
+    if (res == 0) res = fatx_unlink(info, &dir, name);
+    return res;
+}
+
+static int xfd_rmdir(const char *path)
+{
+    fatx_dirent dir;
+    char *name;
+    int res;
+
+    res = xfd_parent(strdupa(path), &dir, &name);
+    if (res == 0) res = fatx_rmdir(info, &dir, name);
+    return res;
+}
+
+static int xfd_rename(const char *from, const char *to)
+{
+    fatx_dirent dir, newdir, entry;
+    char *name, *newname;
+    int res;
+
+    res = xfd_parent(strdupa(from), &dir, &name);
+    if (res == 0) res = xfd_parent(strdupa(to), &newdir, &newname);
+    if (res == 0) res = fatx_rename(info, &dir, name, &newdir, newname, &entry);
+    return res;
+}
+
+static int xfd_write(const char *path, const char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi)
 {
-    size_t len;
+    int res;
+
+    if (xfd_stats_path(path)) return -EBADF;
+    res = fatx_pwrite(xfd_handle_file((struct xfd_handle *)(uintptr_t)fi->fh), buf, size, offset);
+    xfd_readahead_invalidate();
+    return res;
+}
 
-    len = fatx_read_file(info, path, buf, size, offset);
+static int xfd_truncate(const char *path, off_t size)
+{
+    fatx_file *file;
+    int res;
 
-    return len;
+    if (xfd_stats_path(path)) return -EACCES;
+    file = fatx_open(info, path);
+    if (file == NULL) return -errno;
+    res = fatx_truncate(file, size);
+    fatx_close(file);
+    xfd_readahead_invalidate();
+    return res;
 }
 
+static int xfd_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    int res;
+
+    if (xfd_stats_path(path)) return -EACCES;
+    res = fatx_truncate(xfd_handle_file((struct xfd_handle *)(uintptr_t)fi->fh), size);
+    xfd_readahead_invalidate();
+    return res;
+}
+
+static int xfd_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) path;
+    (void) datasync;
+    (void) fi;
+
+    return fatx_sync(info);
+}
+
+static int xfd_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+
+    return fatx_statfs(info, stbuf);
+}
+
+static time_t xfd_time(const struct timespec *ts, time_t current)
+{
+    if (ts->tv_nsec == UTIME_NOW) return time(NULL);
+    if (ts->tv_nsec == UTIME_OMIT) return current;
+    return ts->tv_sec;
+}
+
+static int xfd_utimens(const char *path, const struct timespec tv[2])
+{
+    fatx_dirent entry;
+    int res;
+
+    if (xfd_stats_path(path)) return -EACCES;
+    res = fatx_lookup_path(info, path, &entry);
+    if (res == -1) return -EIO;
+    if (res < 0) return res;
+    return fatx_set_times(info, &entry, xfd_time(&tv[0], entry.record.accessed),
+    		xfd_time(&tv[1], entry.record.modified));
+}
+
+/*
+ * Each operation is timed by a wrapper around it, see xfd_stats.c.
+ */
+#define XFD_TIMED(name, op, params, args) \
+static int xfd_timed_##name params \
+{ \
+    uint64_t start = xfd_stats_clock(); \
+    int res = xfd_##name args; \
+    xfd_stats_record(op, start); \
+    return res; \
+}
+
+XFD_TIMED(getattr, XFD_OP_GETATTR, (const char *path, struct stat *stbuf), (path, stbuf))
+XFD_TIMED(readdir, XFD_OP_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+XFD_TIMED(open, XFD_OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+XFD_TIMED(read_buf, XFD_OP_READ, (const char *path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+XFD_TIMED(release, XFD_OP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+XFD_TIMED(create, XFD_OP_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+		(path, mode, fi))
+XFD_TIMED(mkdir, XFD_OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+XFD_TIMED(unlink, XFD_OP_UNLINK, (const char *path), (path))
+XFD_TIMED(rmdir, XFD_OP_RMDIR, (const char *path), (path))
+XFD_TIMED(rename, XFD_OP_RENAME, (const char *from, const char *to), (from, to))
+XFD_TIMED(write, XFD_OP_WRITE, (const char *path, const char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi), (path, buf, size, offset, fi))
+XFD_TIMED(truncate, XFD_OP_SETATTR, (const char *path, off_t size), (path, size))
+XFD_TIMED(ftruncate, XFD_OP_SETATTR, (const char *path, off_t size, struct fuse_file_info *fi),
+		(path, size, fi))
+XFD_TIMED(fsync, XFD_OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+		(path, datasync, fi))
+XFD_TIMED(statfs, XFD_OP_STATFS, (const char *path, struct statvfs *stbuf), (path, stbuf))
+XFD_TIMED(utimens, XFD_OP_SETATTR, (const char *path, const struct timespec tv[2]), (path, tv))
+
 static struct fuse_operations xfd_oper = {
-    .getattr	= xfd_getattr,
-    .readdir	= xfd_readdir,
-    .read	= xfd_read
+    .init	= xfd_init,
+    .getattr	= xfd_timed_getattr,
+    .readdir	= xfd_timed_readdir,
+    .open	= xfd_timed_open,
+    .read_buf	= xfd_timed_read_buf,
+    .release	= xfd_timed_release,
+    .create	= xfd_timed_create,
+    .mkdir	= xfd_timed_mkdir,
+    .unlink	= xfd_timed_unlink,
+    .rmdir	= xfd_timed_rmdir,
+    .rename	= xfd_timed_rename,
+    .write	= xfd_timed_write,
+    .truncate	= xfd_timed_truncate,
+    .ftruncate	= xfd_timed_ftruncate,
+    .fsync	= xfd_timed_fsync,
+    .statfs	= xfd_timed_statfs,
+    .utimens	= xfd_timed_utimens,
+    .flag_utime_omit_ok = 1
 };
 
+struct xfd_loop {
+	struct fuse_session *se;
+	sem_t finished;
+};
+
+/**
+ * Serves requests until the filesystem is unmounted or the session is
+ * told to exit. Several of these run at once, one per thread.
+ */
+static void *xfd_worker(void *arg)
+{
+	struct xfd_loop *loop = arg;
+	struct fuse_chan *ch = fuse_session_next_chan(loop->se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *buf = malloc(bufsize);
+
+	if (buf == NULL) {
+		fprintf(stderr, "xfd: Out of memory\n");
+		fuse_session_exit(loop->se);
+	}
+	while (buf != NULL && !fuse_session_exited(loop->se)) {
+		struct fuse_chan *tmpch = ch;
+		struct fuse_buf fbuf = {
+				.mem = buf,
+				.size = bufsize
+		};
+		int res = fuse_session_receive_buf(loop->se, &fbuf, &tmpch);
+		if (res == -EINTR) continue;
+		if (res <= 0) break;
+		// don't get cancelled halfway through a request
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		fuse_session_process_buf(loop->se, &fbuf, tmpch);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	free(buf);
+	sem_post(&loop->finished);
+	return NULL;
+}
+
+/**
+ * Like fuse_loop_mt, but with a fixed number of worker threads.
+ * The calling thread only waits for signals and the end of the session.
+ */
+int xfd_loop_threads(struct fuse_session *se, int threads)
+{
+	struct xfd_loop loop;
+	pthread_t *workers;
+	sigset_t block, old;
+	int i, started;
+
+	loop.se = se;
+	sem_init(&loop.finished, 0, 0);
+	workers = calloc(threads, sizeof(pthread_t));
+	if (workers == NULL) return -1;
+
+	// let the signal handlers installed by fuse_setup run on this thread
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, xfd_worker, &loop) != 0) break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (started > 0) {
+		while (!fuse_session_exited(loop.se)) {
+			if (sem_wait(&loop.finished) == 0) break;
+		}
+	}
+	for (i = 0; i < started; i++) pthread_cancel(workers[i]);
+	for (i = 0; i < started; i++) pthread_join(workers[i], NULL);
+	free(workers);
+	sem_destroy(&loop.finished);
+	fuse_session_reset(loop.se);
+	return started > 0 ? 0 : -1;
+}
+
+/**
+ * Serves info through the path-based high-level API, which resolves the
+ * full path of a file on every operation.
+ */
+static int xfd_path_main(int argc, char *argv[], int threads)
+{
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded, ret;
+	if (threads <= 0) { // let fuse pick how many threads to run
+		return fuse_main(argc, argv, &xfd_oper, NULL);
+	}
+	fuse = fuse_setup(argc, argv, &xfd_oper, sizeof(xfd_oper), &mountpoint,
+			&multithreaded, NULL);
+	if (fuse == NULL) return 1;
+	ret = xfd_loop_threads(fuse_get_session(fuse), threads);
+	fuse_teardown(fuse, mountpoint);
+	return ret == 0 ? 0 : 1;
+}
+
+/**
+ * Returns the part of budget (bytes of memory or cache entries) that a
+ * partition of length bytes gets out of total. 0, for no limit or no
+ * cache, stays 0.
+ */
+static size_t xfd_share(size_t budget, off_t length, off_t total)
+{
+	size_t share;
+	if (budget == 0) return 0;
+	share = (size_t)((long double)budget * length / total);
+	return share > 0 ? share : 1;
+}
+
+static const struct xfd_partition *xfd_partitions;
+static size_t xfd_partition_count;
+
+/**
+ * Starts writing the sidecar of each partition that was given -I and
+ * found it missing or out of date. This happens when the filesystem
+ * starts, since daemonizing leaves only the thread that forked.
+ */
+void xfd_build_sidecars(void)
+{
+	size_t i;
+	int ret;
+	for (i = 0; i < xfd_partition_count; i++) {
+		ret = fatx_sidecar_build(xfd_partitions[i].info);
+		if (ret < 0) {
+			fprintf(stderr, "xfd: Could not start writing the sidecar of %s: %s\n",
+					xfd_partitions[i].partition.name, strerror(-ret));
+		}
+	}
+}
+
+/**
+ * Returns the sidecar file of partition name for the -I prefix: the
+ * prefix, made absolute as the daemon leaves the working directory, with
+ * the partition's name added. Returns NULL if out of memory.
+ */
+static char *xfd_sidecar_path(const char *prefix, const char *name)
+{
+	char cwd[PATH_MAX], *path;
+	int ret;
+	if (prefix[0] == '/') ret = asprintf(&path, "%s.%s", prefix, name);
+	else if (getcwd(cwd, sizeof(cwd)) != NULL) ret = asprintf(&path, "%s/%s.%s", cwd, prefix, name);
+	else ret = asprintf(&path, "%s.%s", prefix, name);
+	return ret < 0 ? NULL : path;
+}
+
+/**
+ * Prints how well the block cache of a partition did, if it has one.
+ */
+static void xfd_print_cache_stats(struct xfd_partition *part)
+{
+	fatx_block_cache_stats stats;
+	if (fatx_get_block_cache_stats(part->info, &stats) < 0) return;
+	fprintf(stderr, "xfd: %s block cache%s: metadata %" PRIu64 " hits, %" PRIu64 " misses "
+			"(%zu blocks); data %" PRIu64 " hits, %" PRIu64 " misses (%zu blocks)\n",
+			part->partition.name, stats.direct ? "" : " (buffered)",
+			stats.metadata_hits, stats.metadata_misses, stats.metadata_blocks,
+			stats.data_hits, stats.data_misses, stats.data_blocks);
+}
+
 int main(int argc, char *argv[])
 {
-	int debug, fargc, c;
+	int debug, fargc, c, path_api, ret, count, i, n;
+	fatx_fs_options opts, part_opts;
+	fatx_partition found[FATX_MAX_PARTITIONS];
+	struct xfd_partition parts[FATX_MAX_PARTITIONS];
+	const char *only = NULL, *stats_file = NULL, *sidecar = NULL;
+	char *sidecars[FATX_MAX_PARTITIONS] = {NULL};
+	off_t total = 0;
+	size_t readahead_window = XFD_READAHEAD_WINDOW, readahead_pool = XFD_READAHEAD_POOL;
+	int stats_fd = -1;
+	struct xfd_ll_options ll_opts = {
+			.entry_timeout = 60,
+			.attr_timeout = 60,
+			.threads = 0,
+			.packages = 0,
+			.verify_packages = 0
+	};
 	debug = 0;
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	path_api = 0;
+	fatx_fs_options_init(&opts);
+	while ((c = getopt(argc, argv, "dM:c:b:t:pe:a:umPrkVx:S:I:A:R:")) != -1) {
 		switch (c) {
 		case 'd':
 			debug = 1;
 			break;
+		case 'M':
+			opts.fat_memory_limit = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'c':
+			opts.dentry_cache_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts.block_cache_size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 't':
+			ll_opts.threads = atoi(optarg);
+			break;
+		case 'p':
+			path_api = 1;
+			break;
+		case 'u':
+			opts.io_engine = FATX_IO_URING;
+			break;
+		case 'm':
+			opts.io_engine = FATX_IO_MMAP;
+			break;
+		case 'P':
+			opts.mmap_populate = 1;
+			break;
+		case 'r':
+			opts.read_only = 1;
+			break;
+		case 'e':
+			ll_opts.entry_timeout = strtod(optarg, NULL);
+			break;
+		case 'a':
+			ll_opts.attr_timeout = strtod(optarg, NULL);
+			break;
+		case 'k':
+			ll_opts.packages = 1;
+			break;
+		case 'V':
+			ll_opts.verify_packages = 1;
+			break;
+		case 'x':
+			only = optarg;
+			break;
+		case 'S':
+			stats_file = optarg;
+			break;
+		case 'I':
+			sidecar = optarg;
+			break;
+		case 'A':
+			readahead_window = strtoul(optarg, NULL, 10) << 10;
+			break;
+		case 'R':
+			readahead_pool = strtoul(optarg, NULL, 10) << 20;
+			break;
+		}
+	}
+	count = fatx_find_partitions(argv[optind], found, FATX_MAX_PARTITIONS);
+	if (count < 0) {
+		fprintf(stderr, "xfd: Error opening %s: %s\n", argv[optind], strerror(errno));
+		return -1;
+	}
+	for (i = 0, n = 0; i < count; i++) {
+		if (only != NULL && strcasecmp(found[i].name, only) != 0) continue;
+		parts[n++].partition = found[i];
+		total += found[i].length;
+	}
+	if (n == 0) {
+		if (only != NULL) fprintf(stderr, "xfd: %s has no partition named %s\n", argv[optind], only);
+		else fprintf(stderr, "xfd: %s has no FATX partitions\n", argv[optind]);
+		return -1;
+	}
+	if (path_api && n > 1) {
+		fputs("xfd: -p serves a single partition; pick one with -x\n", stderr);
+		return -1;
+	}
+	// the partitions share the device, and the caches are split between them
+	for (i = 0; i < n; i++) {
+		part_opts = opts;
+		part_opts.offset = parts[i].partition.offset;
+		part_opts.length = parts[i].partition.length;
+		part_opts.share = i > 0 ? parts[0].info : NULL;
+		part_opts.fat_memory_limit = xfd_share(opts.fat_memory_limit, part_opts.length, total);
+		part_opts.extent_cache_size = xfd_share(opts.extent_cache_size, part_opts.length, total);
+		part_opts.dentry_cache_size = xfd_share(opts.dentry_cache_size, part_opts.length, total);
+		part_opts.dir_index_cache_size = xfd_share(opts.dir_index_cache_size, part_opts.length, total);
+		part_opts.block_cache_size = xfd_share(opts.block_cache_size, part_opts.length, total);
+		if (sidecar != NULL) {
+			sidecars[i] = xfd_sidecar_path(sidecar, parts[i].partition.name);
+			part_opts.sidecar = sidecars[i];
 		}
+		parts[i].info = fatx_fs_init_opts(argv[optind], &part_opts);
+		if (parts[i].info == NULL) {
+			while (i-- > 0) fatx_fs_end(parts[i].info);
+			for (i = 0; i < n; i++) free(sidecars[i]);
+			return -1;
+		}
+	}
+	info = parts[0].info;
+	xfd_partitions = parts;
+	xfd_partition_count = n;
+	if (stats_file != NULL) {
+		// opened now, as the daemon leaves the working directory
+		stats_fd = open(stats_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (stats_fd < 0) fprintf(stderr, "xfd: Error opening %s: %s\n", stats_file, strerror(errno));
+	}
+	xfd_stats_init(parts, n, stats_fd);
+	xfd_readahead_init(readahead_window, readahead_pool);
+	char *fargv[6] = {argv[0], argv[optind + 1], "-obig_writes"};
+	fargc = 3;
+	if (fatx_fs_read_only(info)) fargv[fargc++] = "-oro";
+	if (debug) fargv[fargc++] = "-d";
+	fargv[fargc] = NULL;
+	if (path_api) {
+		ret = xfd_path_main(fargc, fargv, ll_opts.threads);
+	} else {
+		struct fuse_args args = FUSE_ARGS_INIT(fargc, fargv);
+		ret = xfd_ll_main(&args, parts, n, &ll_opts);
+		fuse_opt_free_args(&args);
 	}
-	fargc = debug ? 3 : 2;
-	char *fargv[4] = {argv[0], argv[optind + 1], debug ? "-d" : NULL, NULL};
-	info = fatx_fs_init(argv[optind]);
-	if (info == NULL) return -1;
-    int ret = fuse_main(fargc, fargv, &xfd_oper, NULL);
-    fatx_fs_end(info);
-    return ret;
+	xfd_readahead_end();
+	for (i = 0; debug && i < n; i++) xfd_print_cache_stats(&parts[i]);
+	for (i = n - 1; i >= 0; i--) fatx_fs_end(parts[i].info);
+	for (i = 0; i < n; i++) free(sidecars[i]);
+	if (stats_fd >= 0) close(stats_fd);
+	return ret;
 }
@@ -0,0 +1,122 @@
+/*
+  xfd: FATX filesystem driver
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XFD_H_
+#define XFD_H_
+
+#include "fatx.h"
+#include <sys/stat.h>
+
+struct fuse_args;
+struct fuse_session;
+struct fuse_bufvec;
+struct fuse_conn_info;
+struct xfd_handle;
+
+/* device segments that fit in a read reply without allocating */
+#define XFD_READ_EXTENTS 16
+
+/* the files at the root of a mount that show its statistics, see xfd_stats.c */
+#define XFD_STATS_NAME ".xfd-stats"
+#define XFD_STATS_JSON_NAME ".xfd-stats.json"
+#define XFD_STATS_TEXT 1
+#define XFD_STATS_JSON 2
+#define XFD_STATS_BUCKETS 24 // latency histogram buckets, the last from 2^22 us up
+
+/* the kinds of operation timed by xfd_stats_record */
+#define XFD_OP_LOOKUP 0
+#define XFD_OP_FORGET 1
+#define XFD_OP_GETATTR 2
+#define XFD_OP_SETATTR 3 // and truncate, ftruncate and utimens
+#define XFD_OP_CREATE 4 // and mknod
+#define XFD_OP_MKDIR 5
+#define XFD_OP_UNLINK 6
+#define XFD_OP_RMDIR 7
+#define XFD_OP_RENAME 8
+#define XFD_OP_OPENDIR 9
+#define XFD_OP_READDIR 10
+#define XFD_OP_OPEN 11
+#define XFD_OP_READ 12
+#define XFD_OP_WRITE 13
+#define XFD_OP_FSYNC 14
+#define XFD_OP_STATFS 15
+#define XFD_OP_RELEASE 16
+#define XFD_OPS 17
+
+/* readahead limits, see xfd_readahead.c */
+#define XFD_READAHEAD_WINDOW (4 << 20) // the most a stream reads ahead
+#define XFD_READAHEAD_POOL (64 << 20) // the most all streams hold at once
+
+/* the counters kept by xfd_readahead.c */
+#define XFD_RA_STAT_STREAMS 0 // files whose reads started to look sequential
+#define XFD_RA_STAT_COLLAPSES 1 // streams ended by a read elsewhere
+#define XFD_RA_STAT_READS 2
+#define XFD_RA_STAT_HITS 3 // reads served whole from data read ahead
+#define XFD_RA_STAT_WAITS 4 // hits that waited for the data to arrive
+#define XFD_RA_STAT_PREFETCHED_BYTES 5
+#define XFD_RA_STAT_HIT_BYTES 6
+#define XFD_RA_STAT_WASTED_BYTES 7 // read ahead and dropped without being read
+#define XFD_RA_STAT_POOL_BYTES 8 // held for readahead right now
+#define XFD_RA_STATS 9
+
+struct xfd_ll_options {
+	double entry_timeout; // seconds the kernel may cache a name lookup
+	double attr_timeout; // seconds the kernel may cache attributes
+	int threads; // fixed worker threads, 0 to let fuse decide
+	int packages; // show each package as a directory next to it
+	int verify_packages; // check a package's hashes before showing its files
+};
+
+/**
+ * A partition served by xfd, and where it lies on the drive.
+ */
+struct xfd_partition {
+	fatx_partition partition;
+	fatx_fs_info *info;
+};
+
+void xfd_fill_stat(const fatx_file_record *record, struct stat *stbuf);
+struct fuse_bufvec *xfd_read_bufvec(fatx_file *file, size_t size, off_t offset);
+struct fuse_bufvec *xfd_package_bufvec(fatx_package *package, int index, size_t size, off_t offset);
+void xfd_want_splice(struct fuse_conn_info *conn);
+void xfd_build_sidecars(void);
+int xfd_loop_threads(struct fuse_session *se, int threads);
+int xfd_ll_main(struct fuse_args *args, const struct xfd_partition *partitions, size_t count,
+		const struct xfd_ll_options *opts);
+
+/* xfd_stats.c */
+void xfd_stats_init(const struct xfd_partition *partitions, size_t count, int dump_fd);
+void xfd_stats_watch(void);
+uint64_t xfd_stats_clock(void);
+void xfd_stats_record(int op, uint64_t start);
+int xfd_stats_format(const char *name);
+void xfd_stats_fill_stat(struct stat *stbuf);
+char *xfd_stats_snapshot(int format, size_t *length);
+
+/* xfd_readahead.c */
+void xfd_readahead_init(size_t window, size_t pool);
+void xfd_readahead_invalidate(void);
+void xfd_readahead_end(void);
+void xfd_readahead_stats(uint64_t *values);
+const char *xfd_readahead_stat_name(int stat);
+struct xfd_handle *xfd_handle_open(fatx_file *file);
+fatx_file *xfd_handle_file(struct xfd_handle *h);
+struct fuse_bufvec *xfd_handle_read(struct xfd_handle *h, size_t size, off_t offset);
+void xfd_handle_close(struct xfd_handle *h);
+
+#endif /* XFD_H_ */
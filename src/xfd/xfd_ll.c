@@ -0,0 +1,1369 @@
+/*
+  xfd: FATX filesystem driver
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Low-level FUSE frontend. The kernel names files by inode number, and an
+ * inode number is the offset of the file's directory record divided by 64
+ * (the root directory, which has no record, is FUSE_ROOT_ID). Every
+ * operation goes straight to its entry without parsing a path.
+ *
+ * Moving a file to another directory moves its record, but the kernel
+ * keeps using the old number, so the node for it follows the record. If a
+ * new file takes over the old record while that node is still around, it
+ * is given the number with XFD_LL_ALIAS set instead.
+ *
+ * With packages shown (-k), a package NAME also appears as the directory
+ * NAME.pkg. Everything inside it has XFD_LL_PACKAGE set in its number,
+ * with the package file's number above XFD_LL_PACKAGE_BITS and the index
+ * of the entry in the package's file table, plus one, below; the index
+ * of the package's top directory is FATX_PACKAGE_ROOT, -1. These numbers
+ * say all there is to know about the entry, so they need no node.
+ *
+ * Record offsets count from the start of the drive, so the numbers of
+ * different partitions never meet. When a drive has several partitions,
+ * FUSE_ROOT_ID is a read only directory holding one directory per
+ * partition, whose number is the partition's offset divided by 64: that
+ * falls in the partition's header, where no record can be.
+ *
+ * The statistics files (see xfd_stats.c) at the root of the mount are
+ * XFD_LL_STATS_TEXT and XFD_LL_STATS_JSON, which would be records in the
+ * boot sector of a drive's first partition.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include "xfd.h"
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define XFD_LL_ALIAS ((fuse_ino_t)1 << (sizeof(fuse_ino_t) * 8 - 2))
+#define XFD_LL_PACKAGE ((fuse_ino_t)1 << (sizeof(fuse_ino_t) * 8 - 3))
+#define XFD_LL_PACKAGE_BITS 22 // a file table holds at most 0xFFFF * 64 entries
+#define XFD_LL_PACKAGE_SUFFIX ".pkg"
+#define XFD_LL_PACKAGES 64 // packages kept open while nothing uses them
+#define XFD_LL_STATS_TEXT 2
+#define XFD_LL_STATS_JSON 3
+
+/**
+ * An inode the kernel holds a lookup reference to.
+ */
+struct xfd_node {
+	fuse_ino_t ino;
+	unsigned long nlookup;
+	fatx_dirent entry;
+	struct xfd_node *next;
+};
+
+/**
+ * A package opened to show it as a directory. The list in struct xfd_ll
+ * holds one reference, and each request or open file using it another.
+ */
+struct xfd_package {
+	fatx_dirent entry; // the package file, as it was when opened
+	fatx_package *package;
+	unsigned int refs;
+	struct xfd_package *next;
+};
+
+struct xfd_package_file {
+	struct xfd_package *package;
+	int index;
+};
+
+struct xfd_ll {
+	const struct xfd_partition *partitions;
+	size_t partition_count;
+	struct xfd_ll_options opts;
+	pthread_mutex_t lock;
+	struct xfd_node **buckets;
+	size_t bucket_count;
+	size_t count;
+	struct xfd_package *packages; // most recently opened first
+	size_t package_count;
+};
+
+static inline fuse_ino_t xfd_ll_ino(const fatx_dirent *entry)
+{
+	return entry->record_offset == -1 ? FUSE_ROOT_ID : (fuse_ino_t)(entry->record_offset / 64);
+}
+
+/**
+ * Returns the format of the statistics file ino is, or 0 if it isn't one.
+ */
+static inline int xfd_ll_stats(fuse_ino_t ino)
+{
+	if (ino == XFD_LL_STATS_TEXT) return XFD_STATS_TEXT;
+	if (ino == XFD_LL_STATS_JSON) return XFD_STATS_JSON;
+	return 0;
+}
+
+/**
+ * Whether name in parent is one of the statistics files, which can't be
+ * created, removed or renamed.
+ */
+static inline int xfd_ll_reserved(fuse_ino_t parent, const char *name)
+{
+	return parent == FUSE_ROOT_ID && xfd_stats_format(name) != 0;
+}
+
+static inline int xfd_ll_errno(int ret)
+{
+	return ret == -1 ? EIO : -ret;
+}
+
+static struct xfd_node **xfd_ll_slot(struct xfd_ll *fs, fuse_ino_t ino)
+{
+	struct xfd_node **slot = &fs->buckets[ino & (fs->bucket_count - 1)];
+	while (*slot != NULL && (*slot)->ino != ino) slot = &(*slot)->next;
+	return slot;
+}
+
+static void xfd_ll_grow(struct xfd_ll *fs)
+{
+	size_t count = fs->bucket_count * 2, i;
+	struct xfd_node **buckets = calloc(count, sizeof(struct xfd_node *));
+	if (buckets == NULL) return;
+	for (i = 0; i < fs->bucket_count; i++) {
+		struct xfd_node *node = fs->buckets[i], *next;
+		for (; node != NULL; node = next) {
+			next = node->next;
+			node->next = buckets[node->ino & (count - 1)];
+			buckets[node->ino & (count - 1)] = node;
+		}
+	}
+	free(fs->buckets);
+	fs->buckets = buckets;
+	fs->bucket_count = count;
+}
+
+/**
+ * Takes one lookup reference to entry's inode for the kernel and sets
+ * *ino to its number.
+ */
+static int xfd_ll_ref(struct xfd_ll *fs, const fatx_dirent *entry, fuse_ino_t *ino)
+{
+	struct xfd_node **slot;
+	*ino = xfd_ll_ino(entry);
+	if (*ino == FUSE_ROOT_ID) return 0;
+	pthread_mutex_lock(&fs->lock);
+	slot = xfd_ll_slot(fs, *ino);
+	if (*slot != NULL && (*slot)->entry.record_offset != entry->record_offset) {
+		// the number belongs to a file that has moved out of this record
+		*ino |= XFD_LL_ALIAS;
+		slot = xfd_ll_slot(fs, *ino);
+		if (*slot != NULL && (*slot)->entry.record_offset != entry->record_offset) {
+			pthread_mutex_unlock(&fs->lock);
+			return -EBUSY;
+		}
+	}
+	if (*slot == NULL) {
+		struct xfd_node *node = malloc(sizeof(struct xfd_node));
+		if (node == NULL) {
+			pthread_mutex_unlock(&fs->lock);
+			return -ENOMEM;
+		}
+		node->ino = *ino;
+		node->nlookup = 0;
+		node->next = NULL;
+		*slot = node;
+		if (++fs->count > fs->bucket_count) xfd_ll_grow(fs);
+		slot = xfd_ll_slot(fs, *ino);
+	}
+	(*slot)->entry = *entry;
+	(*slot)->nlookup++;
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+static void xfd_ll_unref(struct xfd_ll *fs, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct xfd_node **slot, *node;
+	if (ino == FUSE_ROOT_ID) return;
+	pthread_mutex_lock(&fs->lock);
+	slot = xfd_ll_slot(fs, ino);
+	node = *slot;
+	if (node != NULL && (node->nlookup <= nlookup || (node->nlookup -= nlookup) == 0)) {
+		*slot = node->next;
+		fs->count--;
+		free(node);
+	}
+	pthread_mutex_unlock(&fs->lock);
+}
+
+static inline fuse_ino_t xfd_ll_package_ino(off_t record_offset, int index)
+{
+	return XFD_LL_PACKAGE | ((fuse_ino_t)(record_offset / 64) << XFD_LL_PACKAGE_BITS) |
+			(fuse_ino_t)(index + 1);
+}
+
+static inline off_t xfd_ll_package_record(fuse_ino_t ino)
+{
+	return (off_t)((ino & ~XFD_LL_PACKAGE) >> XFD_LL_PACKAGE_BITS) * 64;
+}
+
+static inline int xfd_ll_package_index(fuse_ino_t ino)
+{
+	return (int)(ino & (((fuse_ino_t)1 << XFD_LL_PACKAGE_BITS) - 1)) - 1;
+}
+
+/**
+ * Returns 1 if ino is the directory holding the partitions of a drive
+ * that has more than one.
+ */
+static inline int xfd_ll_top(struct xfd_ll *fs, fuse_ino_t ino)
+{
+	return fs->partition_count > 1 && ino == FUSE_ROOT_ID;
+}
+
+static inline fuse_ino_t xfd_ll_partition_ino(struct xfd_ll *fs, const struct xfd_partition *part)
+{
+	return fs->partition_count > 1 ? (fuse_ino_t)(part->partition.offset / 64) : FUSE_ROOT_ID;
+}
+
+/**
+ * Finds the partition ino is in, or returns NULL if there is none.
+ */
+static const struct xfd_partition *xfd_ll_partition(struct xfd_ll *fs, fuse_ino_t ino)
+{
+	off_t offset;
+	size_t i;
+	if (fs->partition_count == 1) return &fs->partitions[0];
+	if (ino & XFD_LL_PACKAGE) offset = xfd_ll_package_record(ino);
+	else offset = (off_t)(ino & ~XFD_LL_ALIAS) * 64;
+	for (i = 0; i < fs->partition_count; i++) {
+		const fatx_partition *p = &fs->partitions[i].partition;
+		if (offset >= p->offset && offset - p->offset < p->length) return &fs->partitions[i];
+	}
+	return NULL;
+}
+
+/**
+ * Finds the entry for ino, and the partition it is in. A directory the
+ * kernel has looked up comes from the node table; a file's record is
+ * read again, since writes change its size.
+ */
+static int xfd_ll_get(struct xfd_ll *fs, fuse_ino_t ino, fatx_dirent *entry, fatx_fs_info **info)
+{
+	const struct xfd_partition *part;
+	struct xfd_node *node;
+	off_t record_offset = (off_t)(ino & ~XFD_LL_ALIAS) * 64;
+	// callers that accept a package's entries or the top directory check for them first
+	if ((ino & XFD_LL_PACKAGE) || xfd_ll_top(fs, ino)) return -EROFS;
+	if (xfd_ll_stats(ino)) return -ENOTDIR;
+	part = xfd_ll_partition(fs, ino);
+	if (part == NULL) return -ENOENT;
+	*info = part->info;
+	if (ino == xfd_ll_partition_ino(fs, part)) {
+		fatx_dirent_root(part->info, entry);
+		return 0;
+	}
+	pthread_mutex_lock(&fs->lock);
+	node = *xfd_ll_slot(fs, ino);
+	if (node != NULL) {
+		*entry = node->entry;
+		record_offset = node->entry.record_offset;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	if (node != NULL && entry->record.isdir) return 0;
+	return fatx_read_dirent(part->info, record_offset, entry);
+}
+
+/**
+ * Points the node of a file that moved from the record at from to its new
+ * entry, so the inode number the kernel has for it keeps working.
+ */
+static void xfd_ll_moved(struct xfd_ll *fs, off_t from, const fatx_dirent *entry)
+{
+	fuse_ino_t ino = from / 64;
+	struct xfd_node *node;
+	pthread_mutex_lock(&fs->lock);
+	node = *xfd_ll_slot(fs, ino);
+	if (node == NULL || node->entry.record_offset != from) node = *xfd_ll_slot(fs, ino | XFD_LL_ALIAS);
+	if (node != NULL && node->entry.record_offset == from) node->entry = *entry;
+	pthread_mutex_unlock(&fs->lock);
+}
+
+static void xfd_ll_stat(const fatx_dirent *entry, fuse_ino_t ino, struct stat *stbuf)
+{
+	xfd_fill_stat(&entry->record, stbuf);
+	stbuf->st_ino = ino;
+}
+
+static void xfd_ll_package_free(struct xfd_package *p)
+{
+	if (p == NULL) return;
+	fatx_package_close(p->package);
+	free(p);
+}
+
+static void xfd_ll_package_put(struct xfd_ll *fs, struct xfd_package *p)
+{
+	int last;
+	pthread_mutex_lock(&fs->lock);
+	last = --p->refs == 0;
+	pthread_mutex_unlock(&fs->lock);
+	if (last) xfd_ll_package_free(p);
+}
+
+static int xfd_ll_same_file(const fatx_dirent *a, const fatx_dirent *b)
+{
+	return a->first_cluster == b->first_cluster && a->record.size == b->record.size &&
+			a->record.modified == b->record.modified;
+}
+
+/**
+ * Finds the open package whose file has its record at record_offset and
+ * takes a reference to it. A package that isn't open yet (or whose file
+ * has changed since it was) is opened, and with -V verified, first.
+ */
+static int xfd_ll_package_get(struct xfd_ll *fs, fatx_fs_info *info, off_t record_offset,
+		struct xfd_package **out)
+{
+	struct xfd_package **slot, *p, *stale = NULL;
+	fatx_dirent entry;
+	uint64_t bad;
+	int ret;
+
+	ret = fatx_read_dirent(info, record_offset, &entry);
+	if (ret < 0) return ret;
+	if (entry.record.isdir) return -ENOENT;
+	pthread_mutex_lock(&fs->lock);
+	for (slot = &fs->packages; *slot != NULL; slot = &(*slot)->next) {
+		if ((*slot)->entry.record_offset != record_offset) continue;
+		p = *slot;
+		if (xfd_ll_same_file(&p->entry, &entry)) {
+			p->refs++;
+			pthread_mutex_unlock(&fs->lock);
+			*out = p;
+			return 0;
+		}
+		// the file has changed; whoever still reads the old package keeps it
+		*slot = p->next;
+		fs->package_count--;
+		if (--p->refs == 0) stale = p;
+		break;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	xfd_ll_package_free(stale);
+	stale = NULL;
+
+	p = calloc(1, sizeof(struct xfd_package));
+	if (p == NULL) return -ENOMEM;
+	p->package = fatx_package_open(info, &entry);
+	if (p->package == NULL) {
+		ret = errno == EINVAL ? -ENOENT : -errno;
+		free(p);
+		return ret;
+	}
+	if (fs->opts.verify_packages) {
+		ret = fatx_package_verify(p->package, 0, &bad);
+		if (ret == 0 && bad > 0) {
+			fprintf(stderr, "xfd: %s: %llu blocks don't match their hashes\n", entry.record.name,
+					(unsigned long long)bad);
+			ret = -EIO;
+		}
+		if (ret < 0) {
+			xfd_ll_package_free(p);
+			return ret;
+		}
+	}
+	p->entry = entry;
+	p->refs = 2; // the list's and the caller's
+	pthread_mutex_lock(&fs->lock);
+	p->next = fs->packages;
+	fs->packages = p;
+	if (++fs->package_count > XFD_LL_PACKAGES) {
+		// close the least recently opened package nothing is using
+		struct xfd_package **idle = NULL;
+		for (slot = &fs->packages; *slot != NULL; slot = &(*slot)->next) {
+			if ((*slot)->refs == 1) idle = slot;
+		}
+		if (idle != NULL) {
+			stale = *idle;
+			*idle = stale->next;
+			fs->package_count--;
+		}
+	}
+	pthread_mutex_unlock(&fs->lock);
+	xfd_ll_package_free(stale);
+	*out = p;
+	return 0;
+}
+
+/**
+ * Opens the package holding ino's entry, and takes a reference to it.
+ */
+static int xfd_ll_package_of(struct xfd_ll *fs, fuse_ino_t ino, struct xfd_package **p)
+{
+	const struct xfd_partition *part = xfd_ll_partition(fs, ino);
+	if (part == NULL) return -ENOENT;
+	return xfd_ll_package_get(fs, part->info, xfd_ll_package_record(ino), p);
+}
+
+/**
+ * Finds the package entry ino stands for, leaving a reference to its
+ * package in *p on success.
+ */
+static int xfd_ll_package_entry(struct xfd_ll *fs, fuse_ino_t ino, struct xfd_package **p,
+		fatx_package_entry *entry)
+{
+	int ret = xfd_ll_package_of(fs, ino, p);
+	if (ret < 0) return ret;
+	ret = fatx_package_entry_get((*p)->package, xfd_ll_package_index(ino), entry);
+	if (ret < 0) xfd_ll_package_put(fs, *p);
+	return ret;
+}
+
+static void xfd_ll_package_stat(const fatx_package_entry *entry, fuse_ino_t ino, struct stat *stbuf)
+{
+	xfd_fill_stat(&entry->record, stbuf);
+	stbuf->st_mode &= ~0222; // packages are read only
+	stbuf->st_ino = ino;
+}
+
+static void xfd_ll_reply_package(fuse_req_t req, fuse_ino_t ino, const fatx_package_entry *entry)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = ino;
+	e.attr_timeout = fs->opts.attr_timeout;
+	e.entry_timeout = fs->opts.entry_timeout;
+	xfd_ll_package_stat(entry, ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+/**
+ * Looks up NAME.pkg in dir: the directory showing the package file NAME.
+ */
+static int xfd_ll_lookup_package(struct xfd_ll *fs, fatx_fs_info *info, const fatx_dirent *dir,
+		const char *name, fuse_ino_t *ino, fatx_package_entry *root)
+{
+	size_t length = strlen(name), suffix = strlen(XFD_LL_PACKAGE_SUFFIX);
+	struct xfd_package *p;
+	fatx_dirent file;
+	char base[43];
+	int ret;
+
+	if (length <= suffix || length - suffix >= sizeof(base) ||
+			strcasecmp(name + length - suffix, XFD_LL_PACKAGE_SUFFIX) != 0) {
+		return -ENOENT;
+	}
+	memcpy(base, name, length - suffix);
+	base[length - suffix] = '\0';
+	ret = fatx_lookup(info, dir, base, &file);
+	if (ret == 0 && fatx_package_probe(info, &file) != 1) ret = -ENOENT;
+	if (ret == 0) ret = xfd_ll_package_get(fs, info, file.record_offset, &p);
+	if (ret < 0) return ret;
+	fatx_package_entry_get(p->package, FATX_PACKAGE_ROOT, root);
+	xfd_ll_package_put(fs, p);
+	*ino = xfd_ll_package_ino(file.record_offset, FATX_PACKAGE_ROOT);
+	return 0;
+}
+
+static void xfd_ll_package_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct xfd_package *p;
+	fatx_package_entry entry;
+	int ret;
+
+	ret = xfd_ll_package_of(fs, parent, &p);
+	if (ret == 0) {
+		ret = fatx_package_lookup(p->package, xfd_ll_package_index(parent), name, &entry);
+		xfd_ll_package_put(fs, p);
+	}
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	xfd_ll_reply_package(req, xfd_ll_package_ino(xfd_ll_package_record(parent), entry.index), &entry);
+}
+
+/**
+ * Answers a request that made or found entry with a new lookup reference.
+ * With fi, the entry has just been created and opened.
+ */
+static void xfd_ll_reply_entry(fuse_req_t req, const fatx_dirent *entry, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	ret = xfd_ll_ref(fs, entry, &e.ino);
+	if (ret < 0) {
+		if (fi != NULL) xfd_handle_close((struct xfd_handle *)(uintptr_t)fi->fh);
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	e.attr_timeout = fs->opts.attr_timeout;
+	e.entry_timeout = fs->opts.entry_timeout;
+	xfd_ll_stat(entry, e.ino, &e.attr);
+	if (fi == NULL) {
+		fuse_reply_entry(req, &e);
+	} else if (fuse_reply_create(req, &e, fi) != 0) {
+		xfd_handle_close((struct xfd_handle *)(uintptr_t)fi->fh);
+	}
+}
+
+static void xfd_ll_top_stat(struct stat *stbuf)
+{
+	fatx_file_record record;
+
+	memset(&record, 0, sizeof(record));
+	record.isdir = 1;
+	xfd_fill_stat(&record, stbuf);
+	stbuf->st_mode &= ~0222;
+	stbuf->st_ino = FUSE_ROOT_ID;
+}
+
+static void xfd_ll_stats_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	xfd_stats_fill_stat(stbuf);
+	stbuf->st_ino = ino;
+}
+
+/**
+ * Answers a lookup of a statistics file. Its contents change all the
+ * time, so the kernel isn't allowed to cache its attributes.
+ */
+static void xfd_ll_stats_lookup(fuse_req_t req, int format)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = format == XFD_STATS_JSON ? XFD_LL_STATS_JSON : XFD_LL_STATS_TEXT;
+	e.entry_timeout = fs->opts.entry_timeout;
+	xfd_ll_stats_stat(e.ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void xfd_ll_top_lookup(fuse_req_t req, const char *name)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	fatx_dirent root;
+	size_t i;
+
+	for (i = 0; i < fs->partition_count; i++) {
+		if (strcmp(fs->partitions[i].partition.name, name) == 0) break;
+	}
+	memset(&e, 0, sizeof(e));
+	if (i == fs->partition_count) {
+		if (fs->opts.entry_timeout > 0) {
+			e.entry_timeout = fs->opts.entry_timeout;
+			fuse_reply_entry(req, &e);
+		} else {
+			fuse_reply_err(req, ENOENT);
+		}
+		return;
+	}
+	e.ino = xfd_ll_partition_ino(fs, &fs->partitions[i]);
+	e.attr_timeout = fs->opts.attr_timeout;
+	e.entry_timeout = fs->opts.entry_timeout;
+	fatx_dirent_root(fs->partitions[i].info, &root);
+	xfd_ll_stat(&root, e.ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void xfd_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	fatx_dirent dir, entry;
+	fatx_package_entry root;
+	fatx_fs_info *info;
+	fuse_ino_t ino;
+	int ret;
+
+	if (xfd_ll_reserved(parent, name)) {
+		xfd_ll_stats_lookup(req, xfd_stats_format(name));
+		return;
+	}
+	if (parent & XFD_LL_PACKAGE) {
+		xfd_ll_package_lookup(req, parent, name);
+		return;
+	}
+	if (xfd_ll_top(fs, parent)) {
+		xfd_ll_top_lookup(req, name);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	ret = xfd_ll_get(fs, parent, &dir, &info);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	ret = fatx_lookup(info, &dir, name, &entry);
+	if (ret == -ENOENT && fs->opts.packages) {
+		ret = xfd_ll_lookup_package(fs, info, &dir, name, &ino, &root);
+		if (ret == 0) {
+			xfd_ll_reply_package(req, ino, &root);
+			return;
+		}
+	}
+	if (ret == -ENOENT && fs->opts.entry_timeout > 0) {
+		// a zero inode tells the kernel to remember that the name is missing
+		e.entry_timeout = fs->opts.entry_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	xfd_ll_reply_entry(req, &entry, NULL);
+}
+
+static void xfd_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	xfd_ll_unref(fuse_req_userdata(req), ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void xfd_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		xfd_ll_unref(fuse_req_userdata(req), forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void xfd_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct stat stbuf;
+	fatx_dirent entry;
+	fatx_package_entry package_entry;
+	struct xfd_package *p;
+	fatx_fs_info *info;
+	int ret;
+	(void) fi;
+
+	if (xfd_ll_top(fs, ino)) {
+		xfd_ll_top_stat(&stbuf);
+		fuse_reply_attr(req, &stbuf, fs->opts.attr_timeout);
+		return;
+	}
+	if (xfd_ll_stats(ino)) {
+		xfd_ll_stats_stat(ino, &stbuf);
+		fuse_reply_attr(req, &stbuf, 0);
+		return;
+	}
+	if (ino & XFD_LL_PACKAGE) {
+		ret = xfd_ll_package_entry(fs, ino, &p, &package_entry);
+		if (ret < 0) {
+			fuse_reply_err(req, xfd_ll_errno(ret));
+			return;
+		}
+		xfd_ll_package_put(fs, p);
+		xfd_ll_package_stat(&package_entry, ino, &stbuf);
+		fuse_reply_attr(req, &stbuf, fs->opts.attr_timeout);
+		return;
+	}
+	ret = xfd_ll_get(fs, ino, &entry, &info);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	xfd_ll_stat(&entry, ino, &stbuf);
+	fuse_reply_attr(req, &stbuf, fs->opts.attr_timeout);
+}
+
+static void xfd_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct stat stbuf;
+	fatx_dirent entry;
+	fatx_file *file;
+	fatx_fs_info *info;
+	time_t accessed, modified;
+	int ret;
+
+	if (xfd_ll_stats(ino)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	ret = xfd_ll_get(fs, ino, &entry, &info);
+	if (ret == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if (fi != NULL) {
+			ret = fatx_truncate(xfd_handle_file((struct xfd_handle *)(uintptr_t)fi->fh), attr->st_size);
+		} else if ((file = fatx_open_dirent(info, &entry)) == NULL) {
+			ret = -errno;
+		} else {
+			ret = fatx_truncate(file, attr->st_size);
+			fatx_close(file);
+		}
+		xfd_readahead_invalidate();
+	}
+	if (ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		accessed = entry.record.accessed;
+		modified = entry.record.modified;
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) accessed = time(NULL);
+		else if (to_set & FUSE_SET_ATTR_ATIME) accessed = attr->st_atime;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) modified = time(NULL);
+		else if (to_set & FUSE_SET_ATTR_MTIME) modified = attr->st_mtime;
+		ret = fatx_set_times(info, &entry, accessed, modified);
+	}
+	// FATX has no owners or permissions, so changes to those are ignored
+	if (ret == 0) ret = xfd_ll_get(fs, ino, &entry, &info);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	xfd_ll_stat(&entry, ino, &stbuf);
+	fuse_reply_attr(req, &stbuf, fs->opts.attr_timeout);
+}
+
+/**
+ * Creates name in parent, as a directory if isdir is set. With fi, the
+ * new file is opened too.
+ */
+static void xfd_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, int isdir,
+		struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct xfd_handle *handle;
+	fatx_dirent dir, entry;
+	fatx_fs_info *info;
+	fatx_file *file;
+	int ret;
+
+	ret = xfd_ll_reserved(parent, name) ? -EEXIST : xfd_ll_get(fs, parent, &dir, &info);
+	if (ret == 0) ret = fatx_create(info, &dir, name, isdir, &entry);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	if (fi != NULL) {
+		file = fatx_open_dirent(info, &entry);
+		if (file == NULL) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+		handle = xfd_handle_open(file);
+		if (handle == NULL) {
+			fatx_close(file);
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		fi->fh = (uint64_t)(uintptr_t)handle;
+	}
+	xfd_ll_reply_entry(req, &entry, fi);
+}
+
+static void xfd_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		struct fuse_file_info *fi)
+{
+	(void) mode;
+
+	xfd_ll_make(req, parent, name, 0, fi);
+}
+
+static void xfd_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		dev_t rdev)
+{
+	(void) rdev;
+
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	xfd_ll_make(req, parent, name, 0, NULL);
+}
+
+static void xfd_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void) mode;
+
+	xfd_ll_make(req, parent, name, 1, NULL);
+}
+
+static void xfd_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int isdir)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	fatx_dirent dir;
+	fatx_fs_info *info;
+	int ret;
+
+	ret = xfd_ll_reserved(parent, name) ? -EACCES : xfd_ll_get(fs, parent, &dir, &info);
+	if (ret == 0) ret = isdir ? fatx_rmdir(info, &dir, name) : fatx_unlink(info, &dir, name);
+	fuse_reply_err(req, ret < 0 ? xfd_ll_errno(ret) : 0);
+}
+
+static void xfd_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	xfd_ll_remove(req, parent, name, 0);
+}
+
+static void xfd_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	xfd_ll_remove(req, parent, name, 1);
+}
+
+static void xfd_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	fatx_dirent dir, newdir, source, entry;
+	fatx_fs_info *info, *newinfo;
+	int ret;
+
+	if (xfd_ll_reserved(parent, name) || xfd_ll_reserved(newparent, newname)) ret = -EACCES;
+	else ret = xfd_ll_get(fs, parent, &dir, &info);
+	if (ret == 0) ret = xfd_ll_get(fs, newparent, &newdir, &newinfo);
+	if (ret == 0 && info != newinfo) ret = -EXDEV;
+	if (ret == 0) ret = fatx_lookup(info, &dir, name, &source);
+	if (ret == 0) ret = fatx_rename(info, &dir, name, &newdir, newname, &entry);
+	if (ret == 0 && entry.record_offset != source.record_offset) {
+		xfd_ll_moved(fs, source.record_offset, &entry);
+	}
+	fuse_reply_err(req, ret < 0 ? xfd_ll_errno(ret) : 0);
+}
+
+static void xfd_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	fatx_dirent entry;
+	fatx_package_entry package_entry;
+	struct xfd_package *p;
+	fatx_fs_info *info;
+	int ret;
+
+	if (xfd_ll_top(fs, ino)) {
+		ret = 0;
+		entry.record.isdir = 1;
+	} else if (ino & XFD_LL_PACKAGE) {
+		ret = xfd_ll_package_entry(fs, ino, &p, &package_entry);
+		if (ret == 0) {
+			xfd_ll_package_put(fs, p);
+			entry.record = package_entry.record;
+		}
+	} else {
+		ret = xfd_ll_get(fs, ino, &entry, &info);
+	}
+	if (ret == 0 && !entry.record.isdir) ret = -ENOTDIR;
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+struct xfd_ll_readdir {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+	struct xfd_ll *fs;
+	fatx_fs_info *info; // of the directory being listed
+	off_t package_record; // of the package being listed
+	off_t skip; // with -k, the cookie after a file already listed
+};
+
+static int xfd_ll_add(struct xfd_ll_readdir *rd, const char *name, fuse_ino_t ino, int isdir, off_t next)
+{
+	struct stat stbuf;
+	size_t len;
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = isdir ? S_IFDIR : S_IFREG;
+	len = fuse_add_direntry(rd->req, rd->buf + rd->used, rd->size - rd->used, name, &stbuf, next);
+	if (len > rd->size - rd->used) return 1;
+	rd->used += len;
+	return 0;
+}
+
+/**
+ * Lists a file and, if it is a package, the directory showing it. The two
+ * are added together or not at all. Offsets are doubled to leave room for
+ * the directory: a file's is odd when a package directory follows it.
+ */
+static int xfd_ll_add_with_package(struct xfd_ll_readdir *rd, const fatx_dirent *entry, off_t next)
+{
+	char name[43 + sizeof(XFD_LL_PACKAGE_SUFFIX)];
+	int listed = rd->skip == next, package;
+	size_t need = 0;
+
+	package = !entry->record.isdir && fatx_package_probe(rd->info, entry) == 1;
+	if (package) {
+		snprintf(name, sizeof(name), "%s" XFD_LL_PACKAGE_SUFFIX, entry->record.name);
+		need += fuse_add_direntry(rd->req, NULL, 0, name, NULL, 0);
+	}
+	if (!listed) need += fuse_add_direntry(rd->req, NULL, 0, entry->record.name, NULL, 0);
+	// without room for both, a reply that has nothing else in it gets the file alone
+	if (need > rd->size - rd->used && rd->used > 0) return 1;
+	if (!listed && xfd_ll_add(rd, entry->record.name, xfd_ll_ino(entry), entry->record.isdir,
+			2 * next + (package ? 1 : 2))) {
+		return 1;
+	}
+	if (package) {
+		return xfd_ll_add(rd, name, xfd_ll_package_ino(entry->record_offset, FATX_PACKAGE_ROOT), 1,
+				2 * next + 2);
+	}
+	return 0;
+}
+
+static int xfd_ll_readdir_callback(const fatx_dirent *entry, off_t next, void *user)
+{
+	struct xfd_ll_readdir *rd = user;
+	if (rd->fs->opts.packages) return xfd_ll_add_with_package(rd, entry, next);
+	// the first two offsets are taken by "." and ".."
+	return xfd_ll_add(rd, entry->record.name, xfd_ll_ino(entry), entry->record.isdir, next + 2);
+}
+
+static int xfd_ll_package_readdir_callback(const fatx_package_entry *entry, off_t next, void *user)
+{
+	struct xfd_ll_readdir *rd = user;
+	return xfd_ll_add(rd, entry->record.name, xfd_ll_package_ino(rd->package_record, entry->index),
+			entry->record.isdir, next + 2);
+}
+
+static int xfd_ll_package_readdir(struct xfd_ll_readdir *rd, fuse_ino_t ino, off_t cookie)
+{
+	struct xfd_package *p;
+	int ret;
+
+	ret = xfd_ll_package_of(rd->fs, ino, &p);
+	if (ret < 0) return ret;
+	rd->package_record = xfd_ll_package_record(ino);
+	ret = fatx_package_read_dir(p->package, xfd_ll_package_index(ino), cookie,
+			xfd_ll_package_readdir_callback, rd);
+	xfd_ll_package_put(rd->fs, p);
+	return ret;
+}
+
+static void xfd_ll_top_readdir(struct xfd_ll_readdir *rd, off_t cookie)
+{
+	struct xfd_ll *fs = rd->fs;
+	size_t i;
+
+	for (i = cookie; i < fs->partition_count; i++) {
+		if (xfd_ll_add(rd, fs->partitions[i].partition.name,
+				xfd_ll_partition_ino(fs, &fs->partitions[i]), 1, i + 3)) {
+			break;
+		}
+	}
+}
+
+static void xfd_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct xfd_ll_readdir rd = { req, NULL, size, 0, fs, NULL, 0, -1 };
+	fatx_dirent dir;
+	off_t cookie = off < 2 ? 0 : off - 2;
+	int ret = 0;
+	(void) fi;
+
+	if (!(ino & XFD_LL_PACKAGE) && !xfd_ll_top(fs, ino)) ret = xfd_ll_get(fs, ino, &dir, &rd.info);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	rd.buf = malloc(size);
+	if (rd.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (off < 1 && xfd_ll_add(&rd, ".", ino, 1, 1)) goto out;
+	if (off < 2 && xfd_ll_add(&rd, "..", FUSE_ROOT_ID, 1, 2)) goto out;
+	if (xfd_ll_top(fs, ino)) {
+		xfd_ll_top_readdir(&rd, cookie);
+	} else if (ino & XFD_LL_PACKAGE) {
+		ret = xfd_ll_package_readdir(&rd, ino, cookie);
+	} else {
+		if (fs->opts.packages && off > 2) {
+			// an odd offset falls between a file and its package directory
+			cookie = off % 2 ? (off - 1) / 2 - 1 : (off - 2) / 2;
+			if (off % 2) rd.skip = cookie + 1;
+		}
+		ret = fatx_read_dir(rd.info, &dir, cookie, xfd_ll_readdir_callback, &rd);
+	}
+	if (ret < 0 && rd.used == 0) {
+		free(rd.buf);
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+out:
+	fuse_reply_buf(req, rd.buf, rd.used);
+	free(rd.buf);
+}
+
+static void xfd_ll_package_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct xfd_package_file *file;
+	fatx_package_entry entry;
+	struct xfd_package *p;
+	int ret;
+
+	ret = xfd_ll_package_entry(fs, ino, &p, &entry);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	if (entry.record.isdir) ret = -EISDIR;
+	else if ((fi->flags & O_ACCMODE) != O_RDONLY) ret = -EROFS;
+	else if ((file = malloc(sizeof(struct xfd_package_file))) == NULL) ret = -ENOMEM;
+	if (ret < 0) {
+		xfd_ll_package_put(fs, p);
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	file->package = p;
+	file->index = entry.index;
+	fi->fh = (uint64_t)(uintptr_t)file;
+	fi->keep_cache = 1;
+	if (fuse_reply_open(req, fi) != 0) {
+		xfd_ll_package_put(fs, p);
+		free(file);
+	}
+}
+
+/**
+ * Opens a statistics file, taking the snapshot that reads of it return.
+ */
+static void xfd_ll_stats_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	size_t length;
+	char *data;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	data = xfd_stats_snapshot(xfd_ll_stats(ino), &length);
+	if (data == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t)(uintptr_t)data;
+	fi->direct_io = 1;
+	if (fuse_reply_open(req, fi) != 0) free(data);
+}
+
+static void xfd_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	struct xfd_handle *handle;
+	fatx_dirent entry;
+	fatx_fs_info *info;
+	fatx_file *file;
+	int ret;
+
+	if (ino & XFD_LL_PACKAGE) {
+		xfd_ll_package_open(req, ino, fi);
+		return;
+	}
+	if (xfd_ll_stats(ino)) {
+		xfd_ll_stats_open(req, ino, fi);
+		return;
+	}
+	ret = xfd_ll_get(fs, ino, &entry, &info);
+	if (ret < 0) {
+		fuse_reply_err(req, xfd_ll_errno(ret));
+		return;
+	}
+	file = fatx_open_dirent(info, &entry);
+	if (file == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	handle = xfd_handle_open(file);
+	if (handle == NULL) {
+		fatx_close(file);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t)(uintptr_t)handle;
+	fi->keep_cache = 1;
+	if (fuse_reply_open(req, fi) != 0) xfd_handle_close(handle);
+}
+
+static void xfd_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *bufv;
+
+	if (xfd_ll_stats(ino)) {
+		const char *data = (const char *)(uintptr_t)fi->fh;
+		size_t length = strlen(data);
+		if ((size_t)off >= length) fuse_reply_buf(req, NULL, 0);
+		else fuse_reply_buf(req, data + off, size < length - off ? size : length - off);
+		return;
+	}
+	if (ino & XFD_LL_PACKAGE) {
+		struct xfd_package_file *file = (struct xfd_package_file *)(uintptr_t)fi->fh;
+		bufv = xfd_package_bufvec(file->package->package, file->index, size, off);
+	} else {
+		bufv = xfd_handle_read((struct xfd_handle *)(uintptr_t)fi->fh, size, off);
+	}
+	if (bufv == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	free(bufv);
+}
+
+static void xfd_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	ssize_t ret;
+	(void) ino;
+
+	ret = fatx_pwrite(xfd_handle_file((struct xfd_handle *)(uintptr_t)fi->fh), buf, size, off);
+	xfd_readahead_invalidate();
+	if (ret < 0) fuse_reply_err(req, -ret);
+	else fuse_reply_write(req, ret);
+}
+
+static void xfd_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	const struct xfd_partition *part = xfd_ll_partition(fs, ino);
+	int ret = 0;
+	size_t i;
+	(void) datasync;
+	(void) fi;
+
+	if (part != NULL) {
+		ret = fatx_sync(part->info);
+	} else {
+		for (i = 0; i < fs->partition_count && ret == 0; i++) ret = fatx_sync(fs->partitions[i].info);
+	}
+	fuse_reply_err(req, ret < 0 ? -ret : 0);
+}
+
+static void xfd_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct xfd_ll *fs = fuse_req_userdata(req);
+	const struct xfd_partition *part = xfd_ll_partition(fs, ino);
+	struct statvfs st, sum;
+	size_t i;
+
+	if (part != NULL) {
+		fatx_statfs(part->info, &st);
+	} else {
+		// the top directory reports the whole drive
+		for (i = 0; i < fs->partition_count; i++) {
+			fatx_statfs(fs->partitions[i].info, i == 0 ? &st : &sum);
+			if (i == 0) continue;
+			st.f_blocks += sum.f_blocks;
+			st.f_bfree += sum.f_bfree;
+			st.f_bavail += sum.f_bavail;
+			st.f_files += sum.f_files;
+			st.f_ffree += sum.f_ffree;
+			st.f_favail += sum.f_favail;
+		}
+	}
+	fuse_reply_statfs(req, &st);
+}
+
+static void xfd_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (xfd_ll_stats(ino)) {
+		free((void *)(uintptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	if (ino & XFD_LL_PACKAGE) {
+		struct xfd_package_file *file = (struct xfd_package_file *)(uintptr_t)fi->fh;
+		xfd_ll_package_put(fuse_req_userdata(req), file->package);
+		free(file);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	xfd_handle_close((struct xfd_handle *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void xfd_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	xfd_want_splice(conn);
+	xfd_stats_watch();
+	xfd_build_sidecars();
+}
+
+/*
+ * Each operation is timed by a wrapper around it. Operations reply before
+ * they return, so the time is what the request spent in xfd.
+ */
+#define XFD_LL_TIMED(name, op, params, args) \
+static void xfd_ll_timed_##name params \
+{ \
+	uint64_t start = xfd_stats_clock(); \
+	xfd_ll_##name args; \
+	xfd_stats_record(op, start); \
+}
+
+XFD_LL_TIMED(lookup, XFD_OP_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+XFD_LL_TIMED(forget, XFD_OP_FORGET, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup),
+		(req, ino, nlookup))
+XFD_LL_TIMED(forget_multi, XFD_OP_FORGET, (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+		(req, count, forgets))
+XFD_LL_TIMED(getattr, XFD_OP_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+XFD_LL_TIMED(setattr, XFD_OP_SETATTR, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+XFD_LL_TIMED(mknod, XFD_OP_CREATE, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		dev_t rdev), (req, parent, name, mode, rdev))
+XFD_LL_TIMED(mkdir, XFD_OP_MKDIR, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+		(req, parent, name, mode))
+XFD_LL_TIMED(unlink, XFD_OP_UNLINK, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+XFD_LL_TIMED(rmdir, XFD_OP_RMDIR, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+XFD_LL_TIMED(rename, XFD_OP_RENAME, (fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname), (req, parent, name, newparent, newname))
+XFD_LL_TIMED(opendir, XFD_OP_OPENDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+XFD_LL_TIMED(readdir, XFD_OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi), (req, ino, size, off, fi))
+XFD_LL_TIMED(create, XFD_OP_CREATE, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		struct fuse_file_info *fi), (req, parent, name, mode, fi))
+XFD_LL_TIMED(open, XFD_OP_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+XFD_LL_TIMED(read, XFD_OP_READ, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi), (req, ino, size, off, fi))
+XFD_LL_TIMED(write, XFD_OP_WRITE, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		off_t off, struct fuse_file_info *fi), (req, ino, buf, size, off, fi))
+XFD_LL_TIMED(fsync, XFD_OP_FSYNC, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+		(req, ino, datasync, fi))
+XFD_LL_TIMED(statfs, XFD_OP_STATFS, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+XFD_LL_TIMED(release, XFD_OP_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+
+static struct fuse_lowlevel_ops xfd_ll_oper = {
+	.init		= xfd_ll_init,
+	.lookup		= xfd_ll_timed_lookup,
+	.forget		= xfd_ll_timed_forget,
+	.forget_multi	= xfd_ll_timed_forget_multi,
+	.getattr	= xfd_ll_timed_getattr,
+	.setattr	= xfd_ll_timed_setattr,
+	.mknod		= xfd_ll_timed_mknod,
+	.mkdir		= xfd_ll_timed_mkdir,
+	.unlink		= xfd_ll_timed_unlink,
+	.rmdir		= xfd_ll_timed_rmdir,
+	.rename		= xfd_ll_timed_rename,
+	.opendir	= xfd_ll_timed_opendir,
+	.readdir	= xfd_ll_timed_readdir,
+	.create		= xfd_ll_timed_create,
+	.open		= xfd_ll_timed_open,
+	.read		= xfd_ll_timed_read,
+	.write		= xfd_ll_timed_write,
+	.fsync		= xfd_ll_timed_fsync,
+	.statfs		= xfd_ll_timed_statfs,
+	.release	= xfd_ll_timed_release
+};
+
+/**
+ * Mounts the count partitions with the low-level frontend and serves
+ * requests until the filesystem is unmounted. With one partition, it is
+ * the root of the mount. args is parsed like fuse_main's arguments.
+ */
+int xfd_ll_main(struct fuse_args *args, const struct xfd_partition *partitions, size_t count,
+		const struct xfd_ll_options *opts)
+{
+	struct xfd_ll fs;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	char *mountpoint;
+	int multithreaded, foreground, ret = -1;
+	struct xfd_node *node, *next;
+	struct xfd_package *p, *p_next;
+	fuse_ino_t limit;
+	size_t i;
+
+	if (opts->packages && sizeof(fuse_ino_t) < 8) {
+		fprintf(stderr, "xfd: Showing packages needs 64 bit inode numbers\n");
+		return 1;
+	}
+	// Inode numbers are record offsets / 64 and have to stay clear of the flag bits.
+	limit = opts->packages ? XFD_LL_PACKAGE >> XFD_LL_PACKAGE_BITS : XFD_LL_PACKAGE;
+	for (i = 0; i < count; i++) {
+		if ((uintmax_t)(partitions[i].partition.offset + partitions[i].partition.length) / 64 >= limit) {
+			fprintf(stderr, "xfd: %s is too large for %d bit inode numbers\n",
+					partitions[i].partition.name, (int)sizeof(fuse_ino_t) * 8);
+			return 1;
+		}
+	}
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+	memset(&fs, 0, sizeof(fs));
+	fs.partitions = partitions;
+	fs.partition_count = count;
+	fs.opts = *opts;
+	pthread_mutex_init(&fs.lock, NULL);
+	fs.bucket_count = 1024;
+	fs.buckets = calloc(fs.bucket_count, sizeof(struct xfd_node *));
+	if (fs.buckets == NULL) {
+		free(mountpoint);
+		return 1;
+	}
+
+	ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		se = fuse_lowlevel_new(args, &xfd_ll_oper, sizeof(xfd_ll_oper), &fs);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1) {
+					if (opts->threads > 0) ret = xfd_loop_threads(se, opts->threads);
+					else if (multithreaded) ret = fuse_session_loop_mt(se);
+					else ret = fuse_session_loop(se);
+				}
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+
+	for (i = 0; i < fs.bucket_count; i++) {
+		for (node = fs.buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(fs.buckets);
+	for (p = fs.packages; p != NULL; p = p_next) {
+		p_next = p->next;
+		xfd_ll_package_free(p);
+	}
+	pthread_mutex_destroy(&fs.lock);
+	return ret == 0 ? 0 : 1;
+}
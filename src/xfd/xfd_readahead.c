@@ -0,0 +1,448 @@
+/*
+  xfd: FATX filesystem driver
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Readahead for files read front to back. Each open file on a partition
+ * is an xfd_handle, which both frontends keep in fi->fh. Once a handle
+ * has seen XFD_RA_TRIGGER reads in a row that each start about where the
+ * last ended, it gets a window: a thread of its own reads the window's
+ * worth of the file past the last read, in chunks of XFD_RA_CHUNK, with
+ * fatx_pread along the file's chain. A read that finds all its bytes in
+ * chunks (or in chunks being read, which it waits for) is copied out of
+ * them, and doubles the window up to the -A limit; any other read is
+ * spliced from the device as usual. A read far from the last one drops
+ * the chunks and closes the window until the file looks sequential
+ * again. Chunks come out of a pool of -R bytes shared by all files, so a
+ * stream that finds the pool empty reads ahead less.
+ *
+ * Chunks are only good while nothing has written to the partitions:
+ * every write and truncate through xfd bumps a generation, and chunks
+ * read ahead under an older one are dropped unused.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include "xfd.h"
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define XFD_RA_CHUNK (128 * 1024)
+#define XFD_RA_MIN_WINDOW (2 * XFD_RA_CHUNK)
+#define XFD_RA_TRIGGER 2 // reads in a row, near each other, that make a stream
+#define XFD_RA_SLACK (4 * XFD_RA_CHUNK) // how far out of order a read of a stream may come
+
+#define XFD_RA_QUEUED 0
+#define XFD_RA_READING 1
+#define XFD_RA_READY 2
+#define XFD_RA_FAILED 3
+
+struct xfd_ra_chunk {
+	struct xfd_ra_chunk *next;
+	off_t offset;
+	size_t length; // bytes read, less than XFD_RA_CHUNK at the end of the file
+	size_t used; // bytes copied out to reads
+	uint64_t generation;
+	int state;
+	int stale; // dropped while being read, the worker frees it
+	char *data;
+};
+
+struct xfd_handle {
+	fatx_file *file;
+	pthread_mutex_t lock;
+	pthread_cond_t work; // chunks were queued, or the worker is to stop
+	pthread_cond_t done; // a chunk was read
+	struct xfd_ra_chunk *chunks; // in order of offset, apart from stale ones
+	off_t next; // where the furthest read so far ended
+	off_t prefetch_end; // where the last queued chunk ends
+	off_t eof; // the end of the file as a short chunk found it, or -1
+	size_t window; // bytes to read ahead of next, 0 if not a stream
+	uint64_t generation;
+	int streak;
+	int started; // 1 while the worker runs, -1 if it couldn't be started
+	int stop;
+	pthread_t thread;
+	struct xfd_handle *prev_running, *next_running;
+};
+
+static const char *xfd_ra_stat_names[XFD_RA_STATS] = {
+	"streams", "collapses", "reads", "hits", "waits", "prefetched_bytes", "hit_bytes",
+	"wasted_bytes", "pool_bytes"
+};
+
+static size_t xfd_ra_window_limit = XFD_READAHEAD_WINDOW;
+static size_t xfd_ra_pool_limit = XFD_READAHEAD_POOL;
+static uint64_t xfd_ra_stats[XFD_RA_STATS];
+static uint64_t xfd_ra_generation;
+static pthread_mutex_t xfd_ra_running_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xfd_handle *xfd_ra_running; // handles whose worker runs
+
+static void xfd_ra_count(int stat, uint64_t n)
+{
+	__atomic_add_fetch(&xfd_ra_stats[stat], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sets the largest window of a stream and the bytes all of them may hold
+ * at once. A window of 0 turns readahead off.
+ */
+void xfd_readahead_init(size_t window, size_t pool)
+{
+	xfd_ra_window_limit = window;
+	xfd_ra_pool_limit = pool;
+}
+
+/**
+ * Copies the readahead counters, XFD_RA_STATS of them, into values.
+ */
+void xfd_readahead_stats(uint64_t *values)
+{
+	int i;
+
+	for (i = 0; i < XFD_RA_STATS; i++) values[i] = __atomic_load_n(&xfd_ra_stats[i], __ATOMIC_RELAXED);
+}
+
+const char *xfd_readahead_stat_name(int stat)
+{
+	return stat >= 0 && stat < XFD_RA_STATS ? xfd_ra_stat_names[stat] : NULL;
+}
+
+/**
+ * Makes every chunk read ahead so far unusable. Called once data of a
+ * file has changed.
+ */
+void xfd_readahead_invalidate(void)
+{
+	__atomic_add_fetch(&xfd_ra_generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wraps an open file in a handle for fi->fh. Returns NULL if out of
+ * memory; file is left open.
+ */
+struct xfd_handle *xfd_handle_open(fatx_file *file)
+{
+	struct xfd_handle *h = calloc(1, sizeof(struct xfd_handle));
+
+	if (h == NULL) return NULL;
+	h->file = file;
+	h->eof = -1;
+	h->generation = __atomic_load_n(&xfd_ra_generation, __ATOMIC_ACQUIRE);
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->work, NULL);
+	pthread_cond_init(&h->done, NULL);
+	return h;
+}
+
+fatx_file *xfd_handle_file(struct xfd_handle *h)
+{
+	return h->file;
+}
+
+static void xfd_ra_free(struct xfd_ra_chunk *c)
+{
+	size_t used = c->used < c->length ? c->used : c->length;
+
+	if (c->state == XFD_RA_READY) xfd_ra_count(XFD_RA_STAT_WASTED_BYTES, c->length - used);
+	__atomic_sub_fetch(&xfd_ra_stats[XFD_RA_STAT_POOL_BYTES], XFD_RA_CHUNK, __ATOMIC_RELAXED);
+	free(c->data);
+	free(c);
+}
+
+/**
+ * Frees the chunks before behind, or all of them. A chunk the worker is
+ * reading is only marked stale, and freed by the worker.
+ */
+static void xfd_ra_drop(struct xfd_handle *h, off_t behind, int all)
+{
+	struct xfd_ra_chunk **p = &h->chunks, *c;
+
+	while ((c = *p) != NULL) {
+		if (!all && (c->stale || c->offset + XFD_RA_CHUNK > behind)) {
+			p = &c->next;
+		} else if (c->state == XFD_RA_READING) {
+			c->stale = 1;
+			p = &c->next;
+		} else {
+			*p = c->next;
+			xfd_ra_free(c);
+		}
+	}
+	if (all) h->prefetch_end = 0;
+}
+
+static void *xfd_ra_worker(void *arg)
+{
+	struct xfd_handle *h = arg;
+	struct xfd_ra_chunk *c, **p;
+	ssize_t ret;
+
+	pthread_mutex_lock(&h->lock);
+	while (!h->stop) {
+		for (c = h->chunks; c != NULL && c->state != XFD_RA_QUEUED; c = c->next);
+		if (c == NULL) {
+			pthread_cond_wait(&h->work, &h->lock);
+			continue;
+		}
+		c->state = XFD_RA_READING;
+		pthread_mutex_unlock(&h->lock);
+		ret = fatx_pread(h->file, c->data, XFD_RA_CHUNK, c->offset);
+		pthread_mutex_lock(&h->lock);
+		c->state = ret < 0 ? XFD_RA_FAILED : XFD_RA_READY;
+		c->length = ret < 0 ? 0 : ret;
+		xfd_ra_count(XFD_RA_STAT_PREFETCHED_BYTES, c->length);
+		if (c->stale) {
+			for (p = &h->chunks; *p != c; p = &(*p)->next);
+			*p = c->next;
+			xfd_ra_free(c);
+		} else if (ret >= 0 && c->length < XFD_RA_CHUNK) {
+			if (h->eof < 0 || c->offset + (off_t)c->length < h->eof) h->eof = c->offset + c->length;
+		}
+		pthread_cond_broadcast(&h->done);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/**
+ * Starts the handle's worker the first time it has chunks to read.
+ */
+static int xfd_ra_start(struct xfd_handle *h)
+{
+	if (h->started != 0) return h->started > 0 ? 0 : -1;
+	if (pthread_create(&h->thread, NULL, xfd_ra_worker, h) != 0) {
+		fputs("xfd: Could not start a readahead thread\n", stderr);
+		h->started = -1;
+		return -1;
+	}
+	h->started = 1;
+	pthread_mutex_lock(&xfd_ra_running_lock);
+	h->next_running = xfd_ra_running;
+	if (xfd_ra_running != NULL) xfd_ra_running->prev_running = h;
+	xfd_ra_running = h;
+	pthread_mutex_unlock(&xfd_ra_running_lock);
+	return 0;
+}
+
+/**
+ * Tells the worker to stop and waits for it. h->lock must not be held.
+ */
+static void xfd_ra_stop(struct xfd_handle *h)
+{
+	pthread_mutex_lock(&h->lock);
+	h->stop = 1;
+	pthread_cond_signal(&h->work);
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->thread, NULL);
+	h->started = -1;
+}
+
+/**
+ * Decides whether a read of size bytes at offset carries on a stream,
+ * and opens or closes the window accordingly.
+ */
+static void xfd_ra_track(struct xfd_handle *h, size_t size, off_t offset)
+{
+	off_t ahead = h->prefetch_end > h->next ? h->prefetch_end : h->next;
+	int near = offset + XFD_RA_SLACK >= h->next && offset <= ahead + XFD_RA_SLACK;
+
+	if (!near) {
+		if (h->window > 0) {
+			xfd_ra_drop(h, 0, 1);
+			h->window = 0;
+			xfd_ra_count(XFD_RA_STAT_COLLAPSES, 1);
+		}
+		h->streak = 1;
+		h->next = offset + size;
+		return;
+	}
+	if (offset + (off_t)size > h->next) h->next = offset + size;
+	if (++h->streak >= XFD_RA_TRIGGER && h->window == 0 && h->started >= 0) {
+		h->window = XFD_RA_MIN_WINDOW < xfd_ra_window_limit ? XFD_RA_MIN_WINDOW : xfd_ra_window_limit;
+		xfd_ra_count(XFD_RA_STAT_STREAMS, 1);
+	}
+}
+
+/**
+ * Copies size bytes at offset out of the chunks, waiting for those still
+ * being read. Returns NULL if any of the bytes aren't in a chunk.
+ */
+static struct fuse_bufvec *xfd_ra_serve(struct xfd_handle *h, size_t size, off_t offset)
+{
+	uint64_t generation = h->generation;
+	struct fuse_bufvec *bufv;
+	struct xfd_ra_chunk *c;
+	off_t pos, end, from, to;
+	int waited = 0;
+
+again:
+	pos = offset;
+	end = offset + size;
+	if (h->eof >= 0 && end > h->eof) end = h->eof > offset ? h->eof : offset;
+	for (c = h->chunks; c != NULL && pos < end; c = c->next) {
+		if (c->stale || c->offset + XFD_RA_CHUNK <= pos) continue;
+		if (c->offset > pos) break;
+		if (c->state == XFD_RA_QUEUED || c->state == XFD_RA_READING) {
+			pthread_cond_wait(&h->done, &h->lock);
+			waited = 1;
+			goto again;
+		}
+		if (c->state == XFD_RA_FAILED || c->generation != generation) break;
+		pos = c->offset + c->length;
+		if (c->length < XFD_RA_CHUNK) {
+			if (pos < end) end = pos > offset ? pos : offset;
+			break;
+		}
+	}
+	if (pos < end) return NULL;
+	bufv = malloc(sizeof(struct fuse_bufvec) + (end - offset));
+	if (bufv == NULL) return NULL;
+	*bufv = FUSE_BUFVEC_INIT(end - offset);
+	bufv->buf[0].mem = bufv + 1;
+	for (c = h->chunks; c != NULL; c = c->next) {
+		if (c->stale || c->state != XFD_RA_READY) continue;
+		from = c->offset > offset ? c->offset : offset;
+		to = c->offset + (off_t)c->length < end ? c->offset + (off_t)c->length : end;
+		if (from >= to) continue;
+		memcpy((char *)(bufv + 1) + (from - offset), c->data + (from - c->offset), to - from);
+		c->used += to - from;
+	}
+	xfd_ra_count(XFD_RA_STAT_HITS, 1);
+	xfd_ra_count(XFD_RA_STAT_HIT_BYTES, end - offset);
+	if (waited) xfd_ra_count(XFD_RA_STAT_WAITS, 1);
+	return bufv;
+}
+
+/**
+ * Queues chunks up to the end of the window, as far as the pool allows,
+ * and wakes the worker.
+ */
+static void xfd_ra_schedule(struct xfd_handle *h)
+{
+	off_t from = h->prefetch_end > h->next ? h->prefetch_end : h->next;
+	off_t limit = h->next + h->window;
+	struct xfd_ra_chunk *c, **tail;
+	int queued = 0;
+
+	if (h->eof >= 0 && limit > h->eof) limit = h->eof;
+	for (tail = &h->chunks; *tail != NULL; tail = &(*tail)->next);
+	while (from < limit) {
+		if (__atomic_add_fetch(&xfd_ra_stats[XFD_RA_STAT_POOL_BYTES], XFD_RA_CHUNK, __ATOMIC_RELAXED) >
+				xfd_ra_pool_limit) {
+			__atomic_sub_fetch(&xfd_ra_stats[XFD_RA_STAT_POOL_BYTES], XFD_RA_CHUNK, __ATOMIC_RELAXED);
+			break;
+		}
+		c = calloc(1, sizeof(struct xfd_ra_chunk));
+		if (c != NULL) c->data = malloc(XFD_RA_CHUNK);
+		if (c == NULL || c->data == NULL) {
+			free(c);
+			__atomic_sub_fetch(&xfd_ra_stats[XFD_RA_STAT_POOL_BYTES], XFD_RA_CHUNK, __ATOMIC_RELAXED);
+			break;
+		}
+		c->offset = from;
+		c->generation = h->generation;
+		*tail = c;
+		tail = &c->next;
+		from += XFD_RA_CHUNK;
+		queued++;
+	}
+	if (from > h->prefetch_end) h->prefetch_end = from;
+	if (queued == 0) return;
+	if (xfd_ra_start(h) < 0) {
+		xfd_ra_drop(h, 0, 1);
+		h->window = 0;
+		return;
+	}
+	pthread_cond_signal(&h->work);
+}
+
+/**
+ * Reads size bytes of the handle's file at offset, from the chunks read
+ * ahead if they hold all of it, and queues more. Returns what
+ * xfd_read_bufvec does.
+ */
+struct fuse_bufvec *xfd_handle_read(struct xfd_handle *h, size_t size, off_t offset)
+{
+	struct fuse_bufvec *bufv = NULL;
+	uint64_t generation;
+
+	if (xfd_ra_window_limit == 0) return xfd_read_bufvec(h->file, size, offset);
+	xfd_ra_count(XFD_RA_STAT_READS, 1);
+	pthread_mutex_lock(&h->lock);
+	generation = __atomic_load_n(&xfd_ra_generation, __ATOMIC_ACQUIRE);
+	if (generation != h->generation) {
+		// the file may have grown or changed under the chunks
+		xfd_ra_drop(h, 0, 1);
+		h->generation = generation;
+		h->eof = -1;
+	}
+	xfd_ra_track(h, size, offset);
+	if (h->window > 0) {
+		bufv = xfd_ra_serve(h, size, offset);
+		if (bufv != NULL && h->window < xfd_ra_window_limit) {
+			h->window = h->window * 2 < xfd_ra_window_limit ? h->window * 2 : xfd_ra_window_limit;
+		}
+		xfd_ra_drop(h, offset - XFD_RA_SLACK, 0);
+		xfd_ra_schedule(h);
+	}
+	pthread_mutex_unlock(&h->lock);
+	if (bufv == NULL) bufv = xfd_read_bufvec(h->file, size, offset);
+	return bufv;
+}
+
+/**
+ * Stops the handle's worker, frees its chunks and closes its file.
+ */
+void xfd_handle_close(struct xfd_handle *h)
+{
+	if (h->started > 0) {
+		pthread_mutex_lock(&xfd_ra_running_lock);
+		if (h->prev_running != NULL) h->prev_running->next_running = h->next_running;
+		else xfd_ra_running = h->next_running;
+		if (h->next_running != NULL) h->next_running->prev_running = h->prev_running;
+		pthread_mutex_unlock(&xfd_ra_running_lock);
+		xfd_ra_stop(h);
+	}
+	xfd_ra_drop(h, 0, 1);
+	fatx_close(h->file);
+	pthread_cond_destroy(&h->done);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+/**
+ * Stops the workers of files still open when the filesystem is
+ * unmounted, before the partitions are closed under them.
+ */
+void xfd_readahead_end(void)
+{
+	struct xfd_handle *h;
+
+	pthread_mutex_lock(&xfd_ra_running_lock);
+	while ((h = xfd_ra_running) != NULL) {
+		xfd_ra_running = h->next_running;
+		xfd_ra_stop(h);
+	}
+	pthread_mutex_unlock(&xfd_ra_running_lock);
+}
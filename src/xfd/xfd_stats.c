@@ -0,0 +1,286 @@
+/*
+  xfd: FATX filesystem driver
+  Copyright (C) 2010-2011  Isaac Tepper <Isaac356@live.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Statistics of a mount: the counters libfatx keeps for each partition,
+ * how well readahead did, and how long each kind of FUSE operation took,
+ * as a histogram with power of two buckets of microseconds. Both frontends
+ * time every operation, so recording one has to be cheap: each thread adds
+ * to a shard of the histograms it picks the first time, and the shards are
+ * only added up when the statistics are read.
+ *
+ * The statistics can be read at any time from two files at the root of
+ * the mount that readdir doesn't list, XFD_STATS_NAME as text and
+ * XFD_STATS_JSON_NAME as JSON, and are written to a file on SIGUSR1 with
+ * -S.
+ */
+
+#include "xfd.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define XFD_STATS_SHARDS 16
+
+struct xfd_stats_shard {
+	uint64_t count[XFD_OPS];
+	uint64_t total_ns[XFD_OPS];
+	uint64_t buckets[XFD_OPS][XFD_STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+static const char *xfd_op_names[XFD_OPS] = {
+	"lookup", "forget", "getattr", "setattr", "create", "mkdir", "unlink", "rmdir", "rename",
+	"opendir", "readdir", "open", "read", "write", "fsync", "statfs", "release"
+};
+
+static struct xfd_stats_shard xfd_stats_shards[XFD_STATS_SHARDS];
+static __thread unsigned int xfd_stats_shard; // shard + 1, 0 until the thread first records
+static unsigned int xfd_stats_next;
+static const struct xfd_partition *xfd_stats_partitions;
+static size_t xfd_stats_partition_count;
+static int xfd_stats_dump_fd = -1;
+
+/**
+ * Returns a time in nanoseconds to pass to xfd_stats_record.
+ */
+uint64_t xfd_stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Records an operation of kind op (an XFD_OP_* id) that started at start,
+ * as returned by xfd_stats_clock.
+ */
+void xfd_stats_record(int op, uint64_t start)
+{
+	uint64_t ns = xfd_stats_clock() - start, us = ns / 1000;
+	unsigned int shard = xfd_stats_shard;
+	struct xfd_stats_shard *s;
+	int bucket;
+
+	if (shard == 0) {
+		shard = __atomic_fetch_add(&xfd_stats_next, 1, __ATOMIC_RELAXED) % XFD_STATS_SHARDS + 1;
+		xfd_stats_shard = shard;
+	}
+	s = &xfd_stats_shards[shard - 1];
+	bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= XFD_STATS_BUCKETS) bucket = XFD_STATS_BUCKETS - 1;
+	__atomic_add_fetch(&s->count[op], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->total_ns[op], ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->buckets[op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns XFD_STATS_TEXT or XFD_STATS_JSON if name is one of the files
+ * at the root of the mount that show the statistics, or 0.
+ */
+int xfd_stats_format(const char *name)
+{
+	if (strcmp(name, XFD_STATS_NAME) == 0) return XFD_STATS_TEXT;
+	if (strcmp(name, XFD_STATS_JSON_NAME) == 0) return XFD_STATS_JSON;
+	return 0;
+}
+
+/**
+ * Fills stbuf with the attributes of a statistics file: read only, and
+ * empty, as its size isn't known until it is opened. Readers have to
+ * ignore the size, which FUSE makes them do for a file opened with
+ * direct_io.
+ */
+void xfd_stats_fill_stat(struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG|0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mtim.tv_sec = time(NULL);
+	stbuf->st_ctim = stbuf->st_atim = stbuf->st_mtim;
+}
+
+/**
+ * The label of a histogram bucket: every bucket holds the operations
+ * that took less than its power of two microseconds (and at least the
+ * previous bucket's), except the last, which holds everything slower.
+ */
+static void xfd_stats_bucket_label(int bucket, char *label, size_t size)
+{
+	if (bucket < XFD_STATS_BUCKETS - 1) snprintf(label, size, "lt_%" PRIu64 "us", (uint64_t)1 << bucket);
+	else snprintf(label, size, "ge_%" PRIu64 "us", (uint64_t)1 << (bucket - 1));
+}
+
+static void xfd_stats_write(FILE *out, int format)
+{
+	uint64_t values[FATX_STATS], readahead[XFD_RA_STATS], count[XFD_OPS], total[XFD_OPS], buckets[XFD_STATS_BUCKETS];
+	const char *sep = "";
+	char label[32];
+	size_t i;
+	int op, b, j;
+
+	for (op = 0; op < XFD_OPS; op++) {
+		count[op] = total[op] = 0;
+		for (j = 0; j < XFD_STATS_SHARDS; j++) {
+			count[op] += __atomic_load_n(&xfd_stats_shards[j].count[op], __ATOMIC_RELAXED);
+			total[op] += __atomic_load_n(&xfd_stats_shards[j].total_ns[op], __ATOMIC_RELAXED);
+		}
+	}
+	if (format == XFD_STATS_JSON) fputs("{\"partitions\":{", out);
+	for (i = 0; i < xfd_stats_partition_count; i++) {
+		const struct xfd_partition *part = &xfd_stats_partitions[i];
+		fatx_get_stats(part->info, values);
+		if (format == XFD_STATS_JSON) fprintf(out, "%s\"%s\":{", i > 0 ? "," : "", part->partition.name);
+		for (j = 0; j < FATX_STATS; j++) {
+			if (format == XFD_STATS_JSON) {
+				fprintf(out, "%s\"%s\":%" PRIu64, j > 0 ? "," : "", fatx_stat_name(j), values[j]);
+			} else {
+				fprintf(out, "%s.%s %" PRIu64 "\n", part->partition.name, fatx_stat_name(j), values[j]);
+			}
+		}
+		if (format == XFD_STATS_JSON) fputc('}', out);
+	}
+	if (format == XFD_STATS_JSON) fputs("},\"readahead\":{", out);
+	xfd_readahead_stats(readahead);
+	for (j = 0; j < XFD_RA_STATS; j++) {
+		if (format == XFD_STATS_JSON) {
+			fprintf(out, "%s\"%s\":%" PRIu64, j > 0 ? "," : "", xfd_readahead_stat_name(j), readahead[j]);
+		} else {
+			fprintf(out, "readahead.%s %" PRIu64 "\n", xfd_readahead_stat_name(j), readahead[j]);
+		}
+	}
+	if (format == XFD_STATS_JSON) fputs("},\"ops\":{", out);
+	for (op = 0; op < XFD_OPS; op++) {
+		if (count[op] == 0) continue;
+		for (b = 0; b < XFD_STATS_BUCKETS; b++) {
+			buckets[b] = 0;
+			for (j = 0; j < XFD_STATS_SHARDS; j++) {
+				buckets[b] += __atomic_load_n(&xfd_stats_shards[j].buckets[op][b], __ATOMIC_RELAXED);
+			}
+		}
+		if (format == XFD_STATS_JSON) {
+			fprintf(out, "%s\"%s\":{\"count\":%" PRIu64 ",\"total_us\":%" PRIu64 ",\"histogram\":{",
+					sep, xfd_op_names[op], count[op], total[op] / 1000);
+			sep = ",";
+		} else {
+			fprintf(out, "op.%s.count %" PRIu64 "\nop.%s.total_us %" PRIu64 "\n",
+					xfd_op_names[op], count[op], xfd_op_names[op], total[op] / 1000);
+		}
+		for (b = 0, j = 0; b < XFD_STATS_BUCKETS; b++) {
+			if (buckets[b] == 0) continue;
+			xfd_stats_bucket_label(b, label, sizeof(label));
+			if (format == XFD_STATS_JSON) {
+				fprintf(out, "%s\"%s\":%" PRIu64, j++ > 0 ? "," : "", label, buckets[b]);
+			} else {
+				fprintf(out, "op.%s.%s %" PRIu64 "\n", xfd_op_names[op], label, buckets[b]);
+			}
+		}
+		if (format == XFD_STATS_JSON) fputs("}}", out);
+	}
+	if (format == XFD_STATS_JSON) fputs("}}\n", out);
+}
+
+/**
+ * Returns the statistics as they are now, in the given format, as a
+ * string of *length bytes to be freed with free(). Returns NULL if out
+ * of memory.
+ */
+char *xfd_stats_snapshot(int format, size_t *length)
+{
+	char *data = NULL;
+	FILE *out;
+
+	out = open_memstream(&data, length);
+	if (out == NULL) return NULL;
+	xfd_stats_write(out, format);
+	if (fclose(out) != 0) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/**
+ * Writes the statistics to the file given with -S each time the process
+ * gets SIGUSR1, which every other thread has blocked.
+ */
+static void *xfd_stats_watcher(void *arg)
+{
+	sigset_t set;
+	size_t length;
+	char *data;
+	int sig;
+	(void) arg;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (sigwait(&set, &sig) == 0) {
+		data = xfd_stats_snapshot(XFD_STATS_TEXT, &length);
+		if (data == NULL) continue;
+		if (ftruncate(xfd_stats_dump_fd, 0) < 0 ||
+				pwrite(xfd_stats_dump_fd, data, length, 0) != (ssize_t)length) {
+			fprintf(stderr, "xfd: Error writing statistics: %s\n", strerror(errno));
+		}
+		free(data);
+	}
+	return NULL;
+}
+
+/**
+ * Tells the statistics which partitions are mounted. With dump_fd, an
+ * open file, the statistics are written to it on SIGUSR1; the signal is
+ * blocked here, so that the threads started from now on inherit that.
+ */
+void xfd_stats_init(const struct xfd_partition *partitions, size_t count, int dump_fd)
+{
+	sigset_t set;
+
+	xfd_stats_partitions = partitions;
+	xfd_stats_partition_count = count;
+	xfd_stats_dump_fd = dump_fd;
+	if (dump_fd < 0) return;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/**
+ * Starts waiting for SIGUSR1, if xfd_stats_init was given a file. This
+ * happens when the filesystem starts, since daemonizing leaves only the
+ * thread that forked.
+ */
+void xfd_stats_watch(void)
+{
+	static int started;
+	pthread_t thread;
+
+	if (xfd_stats_dump_fd < 0 || __atomic_exchange_n(&started, 1, __ATOMIC_RELAXED)) return;
+	if (pthread_create(&thread, NULL, xfd_stats_watcher, NULL) != 0) {
+		fputs("xfd: Could not start waiting for SIGUSR1\n", stderr);
+		return;
+	}
+	pthread_detach(thread);
+}